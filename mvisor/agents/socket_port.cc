@@ -0,0 +1,260 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "object.h"
+#include "utilities.h"
+#include "logger.h"
+#include "device.h"
+#include "device_manager.h"
+#include "device_interface.h"
+
+/* A virtio console port connected to a Unix socket, e.g. for the QEMU guest agent
+ * or log shipping. Data moves with readv / writev between the socket and the guest
+ * buffers. With listen enabled (default), the port accepts one client at a time,
+ * otherwise it connects to the socket and retries every second.
+ */
+class SocketPort : public Object, public SerialPortInterface {
+ private:
+  IoThread*   io_ = nullptr;
+  std::string path_;
+  bool        listen_ = true;
+  int         listen_fd_ = -1;
+  int         fd_ = -1;
+  bool        can_read_ = false;
+  bool        can_write_ = false;
+  IoTimer*    reconnect_timer_ = nullptr;
+  bool        destroying_ = false;
+
+ public:
+  SocketPort() {
+    port_name_[0] = 0;
+  }
+
+  virtual ~SocketPort() {
+    /* Closing the client must not schedule a reconnect to this object */
+    destroying_ = true;
+    CloseClient();
+    if (reconnect_timer_) {
+      io_->RemoveTimer(reconnect_timer_);
+      reconnect_timer_ = nullptr;
+    }
+    if (listen_fd_ >= 0) {
+      io_->StopPolling(listen_fd_);
+      safe_close(&listen_fd_);
+      unlink(path_.c_str());
+    }
+  }
+
+  void Initialize(SerialDeviceInterface* device, uint32_t id) {
+    SerialPortInterface::Initialize(device, id);
+
+    auto pci_device = dynamic_cast<Device*>(device);
+    MV_ASSERT(pci_device);
+    io_ = pci_device->manager()->io();
+
+    if (!has_key("port_name") || !has_key("socket")) {
+      MV_PANIC("%s requires port_name and socket", name_);
+    }
+    std::string port_name = std::get<std::string>(key_values_["port_name"]);
+    MV_ASSERT(port_name.size() < sizeof(port_name_));
+    strcpy(port_name_, port_name.c_str());
+    path_ = std::get<std::string>(key_values_["socket"]);
+    MV_ASSERT(path_.size() < sizeof(sockaddr_un::sun_path));
+    if (has_key("listen")) {
+      listen_ = std::get<bool>(key_values_["listen"]);
+    }
+
+    if (listen_) {
+      StartListening();
+    } else {
+      Connect();
+    }
+  }
+
+  void SetReady(bool ready) {
+    ready_ = ready;
+    if (ready_) {
+      ReadSocket();
+    }
+  }
+
+  /* The guest added receive buffers */
+  void OnWritable() {
+    writable_ = true;
+    ReadSocket();
+  }
+
+  void OnMessage(uint8_t* data, size_t size) {
+    iovec iov = { .iov_base = data, .iov_len = size };
+    OnMessageVector(&iov, 1);
+  }
+
+  /* Guest output is dropped without a client, so the guest never blocks on it */
+  size_t OnMessageVector(const iovec* iov, int iovcnt) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      size += iov[i].iov_len;
+    }
+    if (fd_ < 0) {
+      return size;
+    }
+    if (!can_write_) {
+      return 0;
+    }
+
+    ssize_t ret = writev(fd_, iov, iovcnt);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        can_write_ = false;
+        return 0;
+      }
+      CloseClient();
+      return size;
+    }
+    if ((size_t)ret < size) {
+      /* Wait for EPOLLOUT */
+      can_write_ = false;
+    }
+    return ret;
+  }
+
+ private:
+  sockaddr_un GetAddress() {
+    sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+  }
+
+  void StartListening() {
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    MV_ASSERT(listen_fd_ >= 0);
+
+    unlink(path_.c_str());
+    auto addr = GetAddress();
+    if (bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 1) < 0) {
+      MV_PANIC("failed to listen on %s", path_.c_str());
+    }
+
+    io_->StartPolling(listen_fd_, EPOLLIN, [this](auto events) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        return;
+      }
+      /* The new client replaces the old one */
+      CloseClient();
+      SetClient(fd);
+    });
+  }
+
+  void Connect() {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    MV_ASSERT(fd >= 0);
+    auto addr = GetAddress();
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+      safe_close(&fd);
+      ScheduleReconnect();
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    SetClient(fd);
+  }
+
+  void ScheduleReconnect() {
+    if (listen_ || reconnect_timer_ || destroying_) {
+      return;
+    }
+    reconnect_timer_ = io_->AddTimer(1000, false, [this]() {
+      reconnect_timer_ = nullptr;
+      Connect();
+    });
+  }
+
+  void SetClient(int fd) {
+    fd_ = fd;
+    can_read_ = can_write_ = false;
+    if (debug_) {
+      MV_LOG("%s connected to %s", port_name_, path_.c_str());
+    }
+
+    io_->StartPolling(fd_, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, [this](auto events) {
+      if (events & EPOLLOUT) {
+        can_write_ = true;
+        device_->ResumeGuestOutput(this);
+      }
+      if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        can_read_ = true;
+        ReadSocket();
+      }
+    });
+  }
+
+  void CloseClient() {
+    if (fd_ < 0) {
+      return;
+    }
+    if (debug_) {
+      MV_LOG("%s disconnected from %s", port_name_, path_.c_str());
+    }
+    io_->StopPolling(fd_);
+    safe_close(&fd_);
+    can_read_ = can_write_ = false;
+    ScheduleReconnect();
+  }
+
+  /* Read until the socket is drained or the guest has no more buffers. The socket
+   * is edge triggered, so reading is resumed by OnWritable() in the latter case.
+   */
+  void ReadSocket() {
+    if (fd_ < 0 || !can_read_ || !ready_) {
+      return;
+    }
+
+    bool closed = false;
+    while (can_read_) {
+      size_t filled = device_->FillGuestBuffers(this, [this, &closed](const iovec* iov, int iovcnt) -> ssize_t {
+        ssize_t ret = readv(fd_, iov, iovcnt);
+        if (ret == 0) {
+          closed = true;
+        } else if (ret < 0) {
+          if (errno == EAGAIN) {
+            can_read_ = false;
+          } else if (errno != EINTR) {
+            closed = true;
+          }
+        }
+        return ret;
+      });
+      if (closed) {
+        CloseClient();
+        return;
+      }
+      if (filled == 0) {
+        /* No guest buffers, or the socket is drained */
+        break;
+      }
+    }
+  }
+};
+
+DECLARE_AGENT(SocketPort);
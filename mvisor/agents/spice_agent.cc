@@ -23,6 +23,11 @@
 #include <cstring>
 #include <chrono>
 #include <cstdlib>
+#include <mutex>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "object.h"
 #include "utilities.h"
 #include "logger.h"
@@ -35,6 +40,45 @@ using namespace std::chrono;
 /* Limit send mouse frequency */
 const auto kSendMouseInterval = milliseconds(20);
 
+/* Messages are sent in chunks of this size at most, so a transfer of any size only
+ * holds one chunk in memory, and mouse events are sent between the chunks.
+ */
+#define AGENT_CHUNK_SIZE            VD_AGENT_MAX_DATA_SIZE
+/* Incoming messages except the clipboard data are assembled before handling */
+#define AGENT_MAX_BUFFERED_SIZE     (64 * 1024)
+/* File data is sent in messages of this size, one message at a time */
+#define AGENT_FILE_XFER_DATA_SIZE   (64 * 1024)
+/* Mouse events are dropped if the guest does not take them */
+#define AGENT_MAX_SERVER_MESSAGES   64
+
+struct AgentOutput {
+  uint32_t              port;
+  uint32_t              type;
+  size_t                size;
+  size_t                sent = 0;
+  bool                  header_sent = false;
+  /* Message data, or the message header followed by the reader data */
+  std::vector<uint8_t>  data;
+  AgentDataReader       reader;
+  /* Called with the output lock held after the last chunk is taken */
+  std::function<void()> done;
+};
+
+struct AgentInput {
+  VDAgentMessage        header;
+  size_t                header_filled = 0;
+  size_t                received = 0;
+  bool                  streamed = false;
+  bool                  discard = false;
+  std::vector<uint8_t>  buffer;
+};
+
+struct AgentFileTransfer {
+  int                   fd;
+  uint64_t              size;
+  uint64_t              offset;
+};
+
 class SpiceAgent : public Object, public SerialPortInterface,
   public SpiceAgentInterface, public PointerInputInterface
 {
@@ -44,6 +88,22 @@ class SpiceAgent : public Object, public SerialPortInterface,
   steady_clock::time_point  last_send_mouse_time_;
   uint32_t                  width_, height_;
   int                       num_monitors_;
+  ClipboardListener         clipboard_listener_;
+
+  /* Guest output is parsed on the IO thread */
+  VDIChunkHeader            chunk_header_;
+  size_t                    chunk_header_filled_ = 0;
+  size_t                    chunk_remaining_ = 0;
+  AgentInput                inputs_[VDP_END_PORT];
+
+  /* Host output may come from any thread */
+  std::mutex                mutex_;
+  std::deque<AgentOutput>   server_messages_;
+  std::deque<AgentOutput>   client_messages_;
+  std::vector<uint8_t>      chunk_;
+  size_t                    chunk_offset_ = 0;
+  std::map<uint32_t, AgentFileTransfer> file_transfers_;
+  uint32_t                  next_file_xfer_id_ = 1;
 
  public:
   SpiceAgent() {
@@ -53,22 +113,49 @@ class SpiceAgent : public Object, public SerialPortInterface,
     num_monitors_ = 2;
   }
 
+  virtual ~SpiceAgent() {
+    ResetOutput();
+  }
+
+  /* The agent restarted, messages in flight are lost */
+  void SetReady(bool ready) {
+    ready_ = ready;
+    ResetInput();
+    ResetOutput();
+  }
+
+  /* Guest output may be split anywhere, chunks and messages are parsed as a stream */
   void OnMessage(uint8_t* data, size_t size) {
-    if (size < sizeof(VDIChunkHeader) + sizeof(VDAgentMessage)) {
-      MV_PANIC("Chunk too small, size=0x%lx", size);
-      return;
-    }
-    VDIChunkHeader* chunk_header = (VDIChunkHeader*)data;
-    if (chunk_header->size + sizeof(VDIChunkHeader) != size) {
-      MV_PANIC("Invalid chunk size=0x%lx", size);
-      return;
+    while (size > 0) {
+      if (chunk_header_filled_ < sizeof(chunk_header_)) {
+        size_t bytes = std::min(size, sizeof(chunk_header_) - chunk_header_filled_);
+        memcpy((uint8_t*)&chunk_header_ + chunk_header_filled_, data, bytes);
+        chunk_header_filled_ += bytes;
+        data += bytes;
+        size -= bytes;
+        if (chunk_header_filled_ == sizeof(chunk_header_)) {
+          if (chunk_header_.port >= VDP_END_PORT) {
+            MV_PANIC("invalid chunk port=%u size=0x%x", chunk_header_.port, chunk_header_.size);
+          }
+          chunk_remaining_ = chunk_header_.size;
+        }
+      } else {
+        size_t bytes = std::min(size, chunk_remaining_);
+        ParseMessage(inputs_[chunk_header_.port], data, bytes);
+        chunk_remaining_ -= bytes;
+        data += bytes;
+        size -= bytes;
+      }
+      if (chunk_header_filled_ == sizeof(chunk_header_) && chunk_remaining_ == 0) {
+        chunk_header_filled_ = 0;
+      }
     }
-    VDAgentMessage* message = (VDAgentMessage*)(data + sizeof(VDIChunkHeader));
-    HandleAgentMessage(message);
   }
 
+  /* The guest added buffers, continue sending */
   void OnWritable() {
     writable_ = true;
+    FlushOutput();
   }
 
   void SendMonitorConfig() {
@@ -87,10 +174,27 @@ class SpiceAgent : public Object, public SerialPortInterface,
     SendAgentMessage(VDP_CLIENT_PORT, VD_AGENT_MONITORS_CONFIG, buffer, buffer_size);
   }
 
+  void SendCapabilities() {
+    uint8_t buffer[sizeof(VDAgentAnnounceCapabilities) + VD_AGENT_CAPS_BYTES] = { 0 };
+    auto announce = (VDAgentAnnounceCapabilities*)buffer;
+    VD_AGENT_SET_CAPABILITY(announce->caps, VD_AGENT_CAP_MOUSE_STATE);
+    VD_AGENT_SET_CAPABILITY(announce->caps, VD_AGENT_CAP_MONITORS_CONFIG);
+    VD_AGENT_SET_CAPABILITY(announce->caps, VD_AGENT_CAP_REPLY);
+    VD_AGENT_SET_CAPABILITY(announce->caps, VD_AGENT_CAP_DISPLAY_CONFIG);
+    VD_AGENT_SET_CAPABILITY(announce->caps, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
+    VD_AGENT_SET_CAPABILITY(announce->caps, VD_AGENT_CAP_MAX_CLIPBOARD);
+    SendAgentMessage(VDP_CLIENT_PORT, VD_AGENT_ANNOUNCE_CAPABILITIES, buffer, sizeof(buffer));
+  }
+
   void HandleAgentMessage(VDAgentMessage* message) {
     switch (message->type)
     {
     case VD_AGENT_ANNOUNCE_CAPABILITIES: {
+      auto announce = (VDAgentAnnounceCapabilities*)message->data;
+      if (message->size >= sizeof(*announce) && announce->request) {
+        SendCapabilities();
+      }
+
       /* control the initial resolution when OS started */
       // SendMonitorConfig();
 
@@ -114,6 +218,52 @@ class SpiceAgent : public Object, public SerialPortInterface,
       }
       break;
     }
+    case VD_AGENT_CLIPBOARD_GRAB: {
+      ClipboardEvent event = { .event = kClipboardGrab };
+      event.types = (const uint32_t*)message->data;
+      event.ntypes = message->size / sizeof(uint32_t);
+      NotifyClipboard(event);
+      break;
+    }
+    case VD_AGENT_CLIPBOARD_RELEASE: {
+      ClipboardEvent event = { .event = kClipboardRelease };
+      NotifyClipboard(event);
+      break;
+    }
+    case VD_AGENT_CLIPBOARD_REQUEST: {
+      auto request = (VDAgentClipboardRequest*)message->data;
+      if (message->size < sizeof(*request)) {
+        break;
+      }
+      if (!clipboard_listener_) {
+        /* Nothing to paste, or the guest waits for the data */
+        SendClipboard(VD_AGENT_CLIPBOARD_NONE, 0, nullptr);
+        break;
+      }
+      ClipboardEvent event = { .event = kClipboardRequest };
+      event.type = request->type;
+      NotifyClipboard(event);
+      break;
+    }
+    case VD_AGENT_FILE_XFER_STATUS: {
+      auto status = (VDAgentFileXferStatusMessage*)message->data;
+      if (message->size >= sizeof(*status)) {
+        HandleFileTransferStatus(status->id, status->result);
+      }
+      break;
+    }
+    case VD_AGENT_FILE_XFER_START: {
+      /* Copying files from the guest is not supported */
+      auto start = (VDAgentFileXferStartMessage*)message->data;
+      VDAgentFileXferStatusMessage status = {
+        .id = start->id,
+        .result = VD_AGENT_FILE_XFER_STATUS_CANCELLED
+      };
+      SendAgentMessage(VDP_CLIENT_PORT, VD_AGENT_FILE_XFER_STATUS, &status, sizeof(status));
+      break;
+    }
+    case VD_AGENT_FILE_XFER_DATA:
+      break;
     default:
       MV_LOG("Unhandled agent message type=0x%x", message->type);
       DumpHex(message, sizeof(*message) + message->size);
@@ -122,19 +272,13 @@ class SpiceAgent : public Object, public SerialPortInterface,
   }
 
   void SendAgentMessage(int port, int type, void* data, size_t length) {
-    size_t buffer_size = sizeof(VDIChunkHeader) + sizeof(VDAgentMessage) + length;
-    uint8_t* buffer = new uint8_t[buffer_size];
-    VDIChunkHeader* chunk_header = (VDIChunkHeader*)buffer;
-    chunk_header->port = port;
-    chunk_header->size = sizeof(VDAgentMessage) + length;
-    VDAgentMessage* agent_message = (VDAgentMessage*)(buffer + sizeof(VDIChunkHeader));
-    agent_message->type = type;
-    agent_message->protocol = 1;
-    agent_message->opaque = 0UL;
-    agent_message->size = length;
-    memcpy(agent_message->data, data, length);
-    device_->SendMessage(this, buffer, buffer_size);
-    delete buffer;
+    AgentOutput output = {
+      .port = (uint32_t)port,
+      .type = (uint32_t)type,
+      .size = length
+    };
+    output.data.assign((uint8_t*)data, (uint8_t*)data + length);
+    QueueOutput(std::move(output));
   }
 
   void QueueEvent(uint buttons, int x, int y) {
@@ -187,6 +331,339 @@ class SpiceAgent : public Object, public SerialPortInterface,
     SendAgentMessage(VDP_CLIENT_PORT, VD_AGENT_MONITORS_CONFIG, config, config_size);
     free(config);
   }
+
+  virtual void RegisterClipboardListener(ClipboardListener listener) {
+    clipboard_listener_ = listener;
+  }
+
+  virtual void GrabClipboard(const std::vector<uint32_t>& types) {
+    SendAgentMessage(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD_GRAB, (void*)types.data(),
+      types.size() * sizeof(uint32_t));
+  }
+
+  virtual void ReleaseClipboard() {
+    SendAgentMessage(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD_RELEASE, nullptr, 0);
+  }
+
+  virtual void RequestClipboard(uint32_t type) {
+    VDAgentClipboardRequest request = { .type = type };
+    SendAgentMessage(VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD_REQUEST, &request, sizeof(request));
+  }
+
+  virtual void SendClipboard(uint32_t type, size_t size, AgentDataReader reader) {
+    VDAgentClipboard clipboard = { .type = type };
+    AgentOutput output = {
+      .port = VDP_CLIENT_PORT,
+      .type = VD_AGENT_CLIPBOARD,
+      .size = sizeof(clipboard) + size
+    };
+    output.data.assign((uint8_t*)&clipboard, (uint8_t*)&clipboard + sizeof(clipboard));
+    output.reader = reader;
+    QueueOutput(std::move(output));
+  }
+
+  /* The guest agent saves the file to its download directory */
+  virtual bool SendFile(const std::string& path) {
+    if (!ready_) {
+      return false;
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      MV_ERROR("failed to open %s", path.c_str());
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+      MV_ERROR("%s is not a regular file", path.c_str());
+      safe_close(&fd);
+      return false;
+    }
+
+    uint32_t id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = next_file_xfer_id_++;
+      file_transfers_[id] = AgentFileTransfer { .fd = fd, .size = (uint64_t)st.st_size, .offset = 0 };
+    }
+
+    auto name = path.substr(path.find_last_of('/') + 1);
+    auto info = "[vdagent-file-xfer]\nname=" + name + "\nsize=" + std::to_string(st.st_size) + "\n";
+    std::vector<uint8_t> buffer(sizeof(VDAgentFileXferStartMessage) + info.size() + 1);
+    auto start = (VDAgentFileXferStartMessage*)buffer.data();
+    start->id = id;
+    memcpy(start->data, info.c_str(), info.size() + 1);
+    SendAgentMessage(VDP_CLIENT_PORT, VD_AGENT_FILE_XFER_START, buffer.data(), buffer.size());
+    if (debug_) {
+      MV_LOG("file transfer id=%u %s size=%lu", id, path.c_str(), st.st_size);
+    }
+    return true;
+  }
+
+ private:
+  void NotifyClipboard(const ClipboardEvent& event) {
+    if (clipboard_listener_) {
+      clipboard_listener_(event);
+    }
+  }
+
+  void ResetInput() {
+    chunk_header_filled_ = 0;
+    chunk_remaining_ = 0;
+    for (auto &input : inputs_) {
+      input = AgentInput();
+    }
+  }
+
+  void ResetOutput() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    server_messages_.clear();
+    client_messages_.clear();
+    chunk_.clear();
+    chunk_offset_ = 0;
+    for (auto &it : file_transfers_) {
+      safe_close(&it.second.fd);
+    }
+    file_transfers_.clear();
+  }
+
+  /* Messages larger than the chunk size are split, only the clipboard data is passed
+   * on in pieces, other messages are small and handled as a whole.
+   */
+  void ParseMessage(AgentInput& input, uint8_t* data, size_t size) {
+    while (size > 0) {
+      if (input.header_filled < sizeof(input.header)) {
+        size_t bytes = std::min(size, sizeof(input.header) - input.header_filled);
+        memcpy((uint8_t*)&input.header + input.header_filled, data, bytes);
+        input.header_filled += bytes;
+        data += bytes;
+        size -= bytes;
+        if (input.header_filled == sizeof(input.header)) {
+          BeginMessage(input);
+        }
+        continue;
+      }
+
+      size_t bytes = std::min(size, input.header.size - input.received);
+      if (input.streamed && input.received >= sizeof(VDAgentClipboard)) {
+        input.received += bytes;
+        ClipboardEvent event = { .event = kClipboardData };
+        event.type = ((VDAgentClipboard*)input.buffer.data())->type;
+        event.data = data;
+        event.size = bytes;
+        event.last = input.received == input.header.size;
+        NotifyClipboard(event);
+      } else {
+        if (input.streamed) {
+          /* Only the clipboard type is kept */
+          bytes = std::min(bytes, sizeof(VDAgentClipboard) - input.received);
+        }
+        if (!input.discard) {
+          input.buffer.insert(input.buffer.end(), data, data + bytes);
+        }
+        input.received += bytes;
+      }
+      data += bytes;
+      size -= bytes;
+
+      if (input.received == input.header.size) {
+        EndMessage(input);
+      }
+    }
+  }
+
+  void BeginMessage(AgentInput& input) {
+    input.received = 0;
+    input.buffer.clear();
+    input.streamed = input.header.type == VD_AGENT_CLIPBOARD &&
+      input.header.size >= sizeof(VDAgentClipboard);
+    input.discard = !input.streamed && input.header.size > AGENT_MAX_BUFFERED_SIZE;
+    if (input.discard) {
+      MV_ERROR("discard agent message type=0x%x size=0x%x", input.header.type, input.header.size);
+    }
+    if (!input.streamed && !input.discard) {
+      input.buffer.reserve(sizeof(input.header) + input.header.size);
+      input.buffer.insert(input.buffer.end(), (uint8_t*)&input.header,
+        (uint8_t*)&input.header + sizeof(input.header));
+    }
+    if (input.header.size == 0) {
+      EndMessage(input);
+    }
+  }
+
+  void EndMessage(AgentInput& input) {
+    if (input.streamed && input.header.size == sizeof(VDAgentClipboard)) {
+      /* Empty clipboard */
+      ClipboardEvent event = { .event = kClipboardData };
+      event.type = ((VDAgentClipboard*)input.buffer.data())->type;
+      event.last = true;
+      NotifyClipboard(event);
+    } else if (!input.streamed && !input.discard) {
+      HandleAgentMessage((VDAgentMessage*)input.buffer.data());
+    }
+    input.header_filled = 0;
+    input.received = 0;
+    input.buffer.clear();
+  }
+
+  void HandleFileTransferStatus(uint32_t id, uint32_t result) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = file_transfers_.find(id);
+    if (it == file_transfers_.end()) {
+      return;
+    }
+    if (result == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA) {
+      QueueFileData(id);
+      lock.unlock();
+      FlushOutput();
+      return;
+    }
+
+    if (result != VD_AGENT_FILE_XFER_STATUS_SUCCESS) {
+      MV_ERROR("file transfer id=%u failed, result=%u", id, result);
+    } else if (debug_) {
+      MV_LOG("file transfer id=%u done", id);
+    }
+    safe_close(&it->second.fd);
+    file_transfers_.erase(it);
+  }
+
+  /* Send the next data message with the lock held. Only one is queued at a time,
+   * so the file is read as fast as the guest takes it.
+   */
+  void QueueFileData(uint32_t id) {
+    auto &transfer = file_transfers_[id];
+    size_t length = std::min(transfer.size - transfer.offset, (uint64_t)AGENT_FILE_XFER_DATA_SIZE);
+    VDAgentFileXferDataMessage header = { .id = id, .size = length };
+
+    AgentOutput output = {
+      .port = VDP_CLIENT_PORT,
+      .type = VD_AGENT_FILE_XFER_DATA,
+      .size = sizeof(header) + length
+    };
+    output.data.assign((uint8_t*)&header, (uint8_t*)&header + sizeof(header));
+    output.reader = [this, id](uint8_t* buffer, size_t size) -> size_t {
+      auto it = file_transfers_.find(id);
+      if (it == file_transfers_.end()) {
+        return 0;
+      }
+      ssize_t ret = pread(it->second.fd, buffer, size, it->second.offset);
+      if (ret <= 0) {
+        return 0;
+      }
+      it->second.offset += ret;
+      return ret;
+    };
+    output.done = [this, id]() {
+      auto it = file_transfers_.find(id);
+      if (it != file_transfers_.end() && it->second.offset < it->second.size) {
+        QueueFileData(id);
+      }
+    };
+    client_messages_.push_back(std::move(output));
+  }
+
+  void QueueOutput(AgentOutput&& output) {
+    if (!ready_) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (output.port == VDP_SERVER_PORT) {
+        if (server_messages_.size() >= AGENT_MAX_SERVER_MESSAGES) {
+          return;
+        }
+        server_messages_.push_back(std::move(output));
+      } else {
+        client_messages_.push_back(std::move(output));
+      }
+    }
+    FlushOutput();
+  }
+
+  /* The serial device lock is taken before the output lock */
+  void FlushOutput() {
+    if (!ready_) {
+      return;
+    }
+    device_->FillGuestBuffers(this, [this](const iovec* iov, int iovcnt) -> ssize_t {
+      return CopyOutput(iov, iovcnt);
+    });
+  }
+
+  ssize_t CopyOutput(const iovec* iov, int iovcnt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      size_t offset = 0;
+      while (offset < iov[i].iov_len) {
+        if (chunk_offset_ == chunk_.size() && !PrepareChunk()) {
+          return total;
+        }
+        size_t bytes = std::min(iov[i].iov_len - offset, chunk_.size() - chunk_offset_);
+        memcpy((uint8_t*)iov[i].iov_base + offset, chunk_.data() + chunk_offset_, bytes);
+        chunk_offset_ += bytes;
+        offset += bytes;
+        total += bytes;
+      }
+    }
+    return total;
+  }
+
+  /* Build the next chunk, the server port goes first so the mouse is not delayed
+   * by a large transfer.
+   */
+  bool PrepareChunk() {
+    auto &queue = server_messages_.empty() ? client_messages_ : server_messages_;
+    if (queue.empty()) {
+      return false;
+    }
+    auto &output = queue.front();
+
+    chunk_.resize(AGENT_CHUNK_SIZE + sizeof(VDIChunkHeader));
+    chunk_offset_ = 0;
+    auto chunk_header = (VDIChunkHeader*)chunk_.data();
+    chunk_header->port = output.port;
+    size_t position = sizeof(VDIChunkHeader);
+    if (!output.header_sent) {
+      auto message = (VDAgentMessage*)(chunk_.data() + position);
+      message->protocol = VD_AGENT_PROTOCOL;
+      message->type = output.type;
+      message->opaque = 0UL;
+      message->size = output.size;
+      position += sizeof(VDAgentMessage);
+      output.header_sent = true;
+    }
+
+    size_t end = std::min(chunk_.size(), position + output.size - output.sent);
+    if (output.sent < output.data.size()) {
+      size_t bytes = std::min(end - position, output.data.size() - output.sent);
+      memcpy(chunk_.data() + position, output.data.data() + output.sent, bytes);
+      position += bytes;
+      output.sent += bytes;
+    }
+    while (position < end) {
+      size_t ret = output.reader ? output.reader(chunk_.data() + position, end - position) : 0;
+      if (ret == 0) {
+        /* The source ended early, pad the message to keep the stream in sync */
+        bzero(chunk_.data() + position, end - position);
+        ret = end - position;
+      }
+      position += ret;
+      output.sent += ret;
+    }
+
+    chunk_header->size = position - sizeof(VDIChunkHeader);
+    chunk_.resize(position);
+
+    if (output.sent == output.size) {
+      auto done = std::move(output.done);
+      queue.pop_front();
+      if (done) {
+        done();
+      }
+    }
+    return true;
+  }
 };
 
 DECLARE_AGENT(SpiceAgent);
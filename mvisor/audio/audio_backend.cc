@@ -0,0 +1,213 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio_backend.h"
+#include <cstring>
+#include <chrono>
+#include "logger.h"
+#include "device_manager.h"
+
+/* The capacity is rounded up to power of 2 so indexes can wrap freely */
+void AudioRingBuffer::Initialize(size_t frames, uint32_t nchannels) {
+  capacity_ = 1;
+  while (capacity_ < frames) {
+    capacity_ <<= 1;
+  }
+  nchannels_ = nchannels;
+  samples_.resize(capacity_ * nchannels_);
+  Clear();
+}
+
+void AudioRingBuffer::Clear() {
+  write_index_.store(0, std::memory_order_release);
+  read_index_.store(0, std::memory_order_release);
+}
+
+size_t AudioRingBuffer::Write(const int16_t* frames, size_t count) {
+  size_t write_index = write_index_.load(std::memory_order_relaxed);
+  size_t read_index = read_index_.load(std::memory_order_acquire);
+  count = std::min(count, capacity_ - (write_index - read_index));
+
+  size_t offset = write_index & (capacity_ - 1);
+  size_t first = std::min(count, capacity_ - offset);
+  memcpy(&samples_[offset * nchannels_], frames, first * nchannels_ * sizeof(int16_t));
+  if (count > first) {
+    memcpy(&samples_[0], frames + first * nchannels_, (count - first) * nchannels_ * sizeof(int16_t));
+  }
+  write_index_.store(write_index + count, std::memory_order_release);
+  return count;
+}
+
+size_t AudioRingBuffer::Read(int16_t* frames, size_t count) {
+  size_t read_index = read_index_.load(std::memory_order_relaxed);
+  size_t write_index = write_index_.load(std::memory_order_acquire);
+  count = std::min(count, write_index - read_index);
+
+  size_t offset = read_index & (capacity_ - 1);
+  size_t first = std::min(count, capacity_ - offset);
+  memcpy(frames, &samples_[offset * nchannels_], first * nchannels_ * sizeof(int16_t));
+  if (count > first) {
+    memcpy(frames + first * nchannels_, &samples_[0], (count - first) * nchannels_ * sizeof(int16_t));
+  }
+  read_index_.store(read_index + count, std::memory_order_release);
+  return count;
+}
+
+
+AudioBackend::AudioBackend() {
+}
+
+AudioBackend::~AudioBackend() {
+  MV_ASSERT(!clock_thread_.joinable());
+}
+
+AudioBackend* AudioBackend::Create(Device* device, const std::string& class_name, const std::string& path,
+  const AudioFormat& format, uint32_t period_ms) {
+  auto backend = dynamic_cast<AudioBackend*>(Object::Create(class_name.c_str()));
+  MV_ASSERT(backend);
+  MV_ASSERT(format.nchannels > 0 && format.nchannels <= AUDIO_MAX_CHANNELS);
+  MV_ASSERT(period_ms > 0);
+
+  backend->device_ = device;
+  backend->io_ = device->manager()->io();
+  backend->format_ = format;
+  backend->period_ms_ = period_ms;
+  backend->period_frames_ = format.frequency * period_ms / 1000;
+  /* Leave enough room for a few periods and the largest DMA transfer */
+  backend->ring_.Initialize(backend->period_frames_ * 8, format.nchannels);
+  backend->capture_ring_.Initialize(backend->period_frames_ * 8, format.nchannels);
+  backend->Initialize(path);
+  return backend;
+}
+
+void AudioBackend::StartPlayback(AudioPeriodCallback callback) {
+  std::unique_lock<std::mutex> lock(clock_mutex_);
+  if (playback_) {
+    return;
+  }
+  ring_.Clear();
+  callback_ = callback;
+  playback_ = true;
+  UpdateClock(lock);
+
+  /* Let the device fill the ring before the first period */
+  io_->Schedule(callback);
+}
+
+void AudioBackend::StopPlayback() {
+  std::unique_lock<std::mutex> lock(clock_mutex_);
+  if (!playback_) {
+    return;
+  }
+  playback_ = false;
+  UpdateClock(lock);
+}
+
+void AudioBackend::StartCapture() {
+  std::unique_lock<std::mutex> lock(clock_mutex_);
+  if (capture_ || !capture_supported()) {
+    return;
+  }
+  capture_ring_.Clear();
+  capture_ = true;
+  UpdateClock(lock);
+}
+
+void AudioBackend::StopCapture() {
+  std::unique_lock<std::mutex> lock(clock_mutex_);
+  if (!capture_) {
+    return;
+  }
+  capture_ = false;
+  UpdateClock(lock);
+}
+
+/* Sinks must stop the clock in their destructors before releasing resources */
+void AudioBackend::StopClock() {
+  std::unique_lock<std::mutex> lock(clock_mutex_);
+  playback_ = capture_ = false;
+  UpdateClock(lock);
+}
+
+/* The clock thread runs while either direction is active */
+void AudioBackend::UpdateClock(std::unique_lock<std::mutex>& lock) {
+  bool running = playback_ || capture_;
+  if (running == clock_thread_.joinable()) {
+    return;
+  }
+  if (running) {
+    clock_thread_ = std::thread(&AudioBackend::ClockProcess, this);
+  } else {
+    lock.unlock();
+    clock_cv_.notify_all();
+    clock_thread_.join();
+    Flush();
+  }
+}
+
+size_t AudioBackend::ReadPeriod(int16_t* frames, size_t count) {
+  return 0;
+}
+
+/* The sink has no hardware clock, so the period is paced by absolute deadlines on
+ * the monotonic clock. The device only wakes up once per period to refill the ring.
+ */
+void AudioBackend::ClockProcess() {
+  SetThreadName("mvisor-audio");
+
+  auto period = std::chrono::microseconds(period_ms_ * 1000);
+  std::vector<int16_t> frames(period_frames_ * format_.nchannels);
+  auto next_timepoint = std::chrono::steady_clock::now();
+
+  std::unique_lock<std::mutex> lock(clock_mutex_);
+  while (playback_ || capture_) {
+    next_timepoint += period;
+    if (clock_cv_.wait_until(lock, next_timepoint, [this]() { return !playback_ && !capture_; })) {
+      break;
+    }
+    bool playback = playback_, capture = capture_;
+    auto callback = callback_;
+    lock.unlock();
+
+    if (playback) {
+      size_t count = ring_.Read(frames.data(), period_frames_);
+      if (count < period_frames_) {
+        if (debug_) {
+          MV_LOG("audio underrun, %lu of %lu frames", count, period_frames_);
+        }
+        bzero(&frames[count * format_.nchannels], (period_frames_ - count) * format_.nchannels * sizeof(int16_t));
+      }
+      WritePeriod(frames.data(), period_frames_);
+      io_->Schedule(callback);
+    }
+
+    if (capture) {
+      size_t count = ReadPeriod(frames.data(), period_frames_);
+      if (capture_ring_.Write(frames.data(), count) < count && debug_) {
+        MV_LOG("audio capture overrun");
+      }
+    }
+
+    /* Do not burst to catch up if the sink was blocked for a long time */
+    auto now = std::chrono::steady_clock::now();
+    if (now - next_timepoint > period * 4) {
+      next_timepoint = now;
+    }
+    lock.lock();
+  }
+}
@@ -0,0 +1,350 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio_backend.h"
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <opus/opus.h>
+#include "device.h"
+#include "logger.h"
+
+#define OPUS_MAX_PACKET_SIZE    4000
+#define OPUS_MAX_FRAME_MS       120
+#define OPUS_MAX_BUFFERED_MS    200
+
+/* Every packet is preceded by this header in both directions. The timestamp counts
+ * frames at the sink rate and keeps running while the stream is stopped, so the
+ * peer's jitter buffer can tell a gap from a late packet.
+ */
+struct OpusPacketHeader {
+  uint32_t  size;
+  uint32_t  sequence;
+  uint64_t  timestamp;
+} __attribute__((packed));
+
+/* Encodes the playback with Opus on the audio clock thread.
+ * path is a file, or unix:/path/to/socket to stream to a local peer. With a
+ * socket, Opus packets sent by the peer are decoded as microphone input.
+ * Options are read from the device: bitrate (bps, default 64000) and frame_ms
+ * (5, 10, 20, 40 or 60, default 20).
+ */
+class OpusSink : public AudioBackend {
+ private:
+  OpusEncoder*  encoder_ = nullptr;
+  OpusDecoder*  decoder_ = nullptr;
+  FILE*         fp_ = nullptr;
+  std::string   socket_path_;
+  int           fd_ = -1;
+  size_t        retry_periods_ = 0;
+  size_t        frame_frames_ = 0;
+  std::vector<int16_t>  pending_;
+  uint32_t      sequence_ = 0;
+  uint64_t      timestamp_ = 0;
+  IoTimePoint   start_time_;
+
+  /* Microphone */
+  std::vector<uint8_t>  receive_buffer_;
+  std::vector<int16_t>  decoded_;
+  bool          received_any_ = false;
+  uint32_t      next_sequence_ = 0;
+
+  void Initialize(const std::string& path) {
+    uint32_t frequency = format_.frequency;
+    if (frequency != 8000 && frequency != 12000 && frequency != 16000 &&
+        frequency != 24000 && frequency != 48000) {
+      MV_PANIC("Opus does not support sample rate %u", frequency);
+    }
+    if (format_.nchannels > 2) {
+      MV_PANIC("Opus sink supports mono or stereo only");
+    }
+
+    uint64_t bitrate = 64000, frame_ms = 20;
+    if (device_->has_key("bitrate")) {
+      bitrate = std::get<uint64_t>((*device_)["bitrate"]);
+    }
+    if (device_->has_key("frame_ms")) {
+      frame_ms = std::get<uint64_t>((*device_)["frame_ms"]);
+    }
+    if (frame_ms != 5 && frame_ms != 10 && frame_ms != 20 && frame_ms != 40 && frame_ms != 60) {
+      MV_PANIC("invalid Opus frame size %lu ms", frame_ms);
+    }
+    frame_frames_ = frequency * frame_ms / 1000;
+    pending_.reserve(frame_frames_ * format_.nchannels);
+
+    int error;
+    encoder_ = opus_encoder_create(frequency, format_.nchannels, OPUS_APPLICATION_AUDIO, &error);
+    if (error != OPUS_OK) {
+      MV_PANIC("failed to create Opus encoder, error=%d", error);
+    }
+    opus_encoder_ctl(encoder_, OPUS_SET_BITRATE(bitrate));
+    opus_encoder_ctl(encoder_, OPUS_SET_INBAND_FEC(1));
+
+    if (path.find("unix:") == 0) {
+      socket_path_ = path.substr(5);
+      if (socket_path_.size() >= sizeof(sockaddr_un::sun_path)) {
+        MV_PANIC("socket path is too long: %s", socket_path_.c_str());
+      }
+      decoder_ = opus_decoder_create(frequency, format_.nchannels, &error);
+      if (error != OPUS_OK) {
+        MV_PANIC("failed to create Opus decoder, error=%d", error);
+      }
+    } else {
+      fp_ = fopen(path.c_str(), "wb");
+      if (fp_ == nullptr) {
+        MV_PANIC("failed to open %s", path.c_str());
+      }
+    }
+    start_time_ = std::chrono::steady_clock::now();
+  }
+
+  bool capture_supported() {
+    return decoder_ != nullptr;
+  }
+
+  bool TryConnect() {
+    if (retry_periods_ > 0) {
+      --retry_periods_;
+      return false;
+    }
+    retry_periods_ = 1000 / period_ms_;
+
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    MV_ASSERT(fd_ >= 0);
+
+    sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+      safe_close(&fd_);
+      return false;
+    }
+
+    timeval timeout = { .tv_sec = 0, .tv_usec = (suseconds_t)period_ms_ * 1000 };
+    setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    receive_buffer_.clear();
+    received_any_ = false;
+    if (debug_) {
+      MV_LOG("connected to %s", socket_path_.c_str());
+    }
+    return true;
+  }
+
+  void Disconnect() {
+    if (debug_) {
+      MV_LOG("disconnected from %s, errno=%d", socket_path_.c_str(), errno);
+    }
+    safe_close(&fd_);
+  }
+
+  void SendPacket(const uint8_t* data, size_t size) {
+    OpusPacketHeader header = {
+      .size = (uint32_t)size,
+      .sequence = sequence_++,
+      .timestamp = timestamp_
+    };
+
+    if (fp_) {
+      fwrite(&header, sizeof(header), 1, fp_);
+      fwrite(data, size, 1, fp_);
+      return;
+    }
+    if (fd_ < 0) {
+      return;
+    }
+
+    iovec iov[2] = {
+      { .iov_base = &header, .iov_len = sizeof(header) },
+      { .iov_base = (void*)data, .iov_len = size }
+    };
+    msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    size_t remain = sizeof(header) + size;
+    while (remain > 0) {
+      ssize_t ret = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        /* A partial packet would break the framing, reconnect instead */
+        Disconnect();
+        return;
+      }
+      remain -= ret;
+      while (ret > 0 && msg.msg_iovlen > 0) {
+        size_t n = std::min((size_t)ret, msg.msg_iov->iov_len);
+        msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + n;
+        msg.msg_iov->iov_len -= n;
+        ret -= n;
+        if (msg.msg_iov->iov_len == 0) {
+          msg.msg_iov++;
+          msg.msg_iovlen--;
+        }
+      }
+    }
+  }
+
+  void EncodeFrame() {
+    uint8_t packet[OPUS_MAX_PACKET_SIZE];
+    int size = opus_encode(encoder_, pending_.data(), frame_frames_, packet, sizeof(packet));
+    if (size < 0) {
+      MV_ERROR("failed to encode Opus frame, error=%d", size);
+    } else {
+      SendPacket(packet, size);
+    }
+    pending_.clear();
+    timestamp_ += frame_frames_;
+  }
+
+  void WritePeriod(const int16_t* frames, size_t count) {
+    if (fd_ < 0 && fp_ == nullptr) {
+      TryConnect();
+    }
+
+    /* Restart the timestamps from the wall clock after the stream was stopped */
+    if (pending_.empty()) {
+      auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_time_).count();
+      timestamp_ = std::max(timestamp_, (uint64_t)elapsed_us * format_.frequency / 1000000);
+    }
+
+    size_t nchannels = format_.nchannels;
+    while (count > 0) {
+      size_t n = std::min(count, frame_frames_ - pending_.size() / nchannels);
+      pending_.insert(pending_.end(), frames, frames + n * nchannels);
+      frames += n * nchannels;
+      count -= n;
+      if (pending_.size() == frame_frames_ * nchannels) {
+        EncodeFrame();
+      }
+    }
+  }
+
+  /* Encode the last partial frame padded with silence */
+  void Flush() {
+    if (!pending_.empty()) {
+      pending_.resize(frame_frames_ * format_.nchannels, 0);
+      EncodeFrame();
+    }
+    if (fp_) {
+      fflush(fp_);
+    }
+  }
+
+  void DecodePacket(const OpusPacketHeader* header, const uint8_t* data) {
+    size_t nchannels = format_.nchannels;
+    size_t max_frames = format_.frequency * OPUS_MAX_FRAME_MS / 1000;
+
+    /* Sequence numbers wrap, a packet behind the expected one is late or duplicated */
+    int32_t gap = received_any_ ? (int32_t)(header->sequence - next_sequence_) : 0;
+    if (gap < 0) {
+      return;
+    }
+
+    /* Conceal lost packets, or use the FEC data of this packet for the last one.
+     * PLC and FEC decode exactly the duration of the missing frames.
+     */
+    int lost = std::min<int32_t>(gap, 4);
+    for (int i = 0; i < lost; i++) {
+      size_t offset = decoded_.size();
+      decoded_.resize(offset + frame_frames_ * nchannels);
+      bool last = i == lost - 1;
+      int ret = opus_decode(decoder_, last ? data : nullptr, last ? header->size : 0,
+        &decoded_[offset], frame_frames_, last ? 1 : 0);
+      decoded_.resize(offset + std::max(ret, 0) * nchannels);
+    }
+    received_any_ = true;
+    next_sequence_ = header->sequence + 1;
+
+    size_t offset = decoded_.size();
+    decoded_.resize(offset + max_frames * nchannels);
+    int ret = opus_decode(decoder_, data, header->size, &decoded_[offset], max_frames, 0);
+    if (ret < 0) {
+      MV_ERROR("failed to decode Opus packet, error=%d", ret);
+      ret = 0;
+    }
+    decoded_.resize(offset + ret * nchannels);
+  }
+
+  size_t ReadPeriod(int16_t* frames, size_t count) {
+    if (fd_ < 0 && !TryConnect()) {
+      return 0;
+    }
+
+    uint8_t buffer[OPUS_MAX_PACKET_SIZE];
+    while (true) {
+      ssize_t ret = recv(fd_, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+        Disconnect();
+        return 0;
+      } else if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      receive_buffer_.insert(receive_buffer_.end(), buffer, buffer + ret);
+    }
+
+    size_t offset = 0;
+    while (receive_buffer_.size() - offset >= sizeof(OpusPacketHeader)) {
+      auto header = (OpusPacketHeader*)&receive_buffer_[offset];
+      if (header->size > OPUS_MAX_PACKET_SIZE) {
+        MV_ERROR("invalid Opus packet size %u", header->size);
+        Disconnect();
+        return 0;
+      }
+      if (receive_buffer_.size() - offset < sizeof(*header) + header->size) {
+        break;
+      }
+      DecodePacket(header, (uint8_t*)(header + 1));
+      offset += sizeof(*header) + header->size;
+    }
+    receive_buffer_.erase(receive_buffer_.begin(), receive_buffer_.begin() + offset);
+
+    /* Drop the oldest frames if the peer sends faster than the clock */
+    size_t nchannels = format_.nchannels;
+    size_t max_samples = format_.frequency * OPUS_MAX_BUFFERED_MS / 1000 * nchannels;
+    if (decoded_.size() > max_samples) {
+      decoded_.erase(decoded_.begin(), decoded_.end() - max_samples);
+    }
+
+    count = std::min(count, decoded_.size() / nchannels);
+    memcpy(frames, decoded_.data(), count * nchannels * sizeof(int16_t));
+    decoded_.erase(decoded_.begin(), decoded_.begin() + count * nchannels);
+    return count;
+  }
+
+ public:
+  virtual ~OpusSink() {
+    StopClock();
+    safe_close(&fd_);
+    if (fp_) {
+      fclose(fp_);
+    }
+    if (encoder_) {
+      opus_encoder_destroy(encoder_);
+    }
+    if (decoder_) {
+      opus_decoder_destroy(decoder_);
+    }
+  }
+};
+
+DECLARE_AUDIO_BACKEND(OpusSink);
@@ -0,0 +1,75 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio_backend.h"
+#include <cstring>
+#include "logger.h"
+
+void AudioResampler::Initialize(const AudioFormat& input, const AudioFormat& output) {
+  MV_ASSERT(input.nchannels > 0 && input.nchannels <= AUDIO_MAX_CHANNELS);
+  MV_ASSERT(output.nchannels > 0 && output.nchannels <= AUDIO_MAX_CHANNELS);
+  input_ = input;
+  output_ = output;
+  step_ = ((uint64_t)input.frequency << 32) / output.frequency;
+  position_ = 1ULL << 32;
+  bzero(last_frame_, sizeof(last_frame_));
+
+  /* Mono is duplicated to all channels, extra channels are dropped */
+  for (uint32_t i = 0; i < output.nchannels; i++) {
+    channel_map_[i] = std::min(i, input.nchannels - 1);
+  }
+}
+
+size_t AudioResampler::MaxOutputFrames(size_t input_frames) {
+  return input_frames * output_.frequency / input_.frequency + 2;
+}
+
+size_t AudioResampler::Process(const int16_t* input, size_t input_frames, int16_t* output) {
+  if (input_frames == 0) {
+    return 0;
+  }
+
+  /* Same format needs no conversion */
+  if (input_.frequency == output_.frequency && input_.nchannels == output_.nchannels) {
+    memcpy(output, input, input_frames * input_.nchannels * sizeof(int16_t));
+    return input_frames;
+  }
+
+  const uint32_t in_channels = input_.nchannels;
+  const uint32_t out_channels = output_.nchannels;
+  const uint64_t end = (uint64_t)input_frames << 32;
+  size_t count = 0;
+
+  while (position_ < end) {
+    size_t index = position_ >> 32;
+    int32_t fraction = (position_ & 0xFFFFFFFF) >> 17; /* 15 bits to avoid overflow */
+    const int16_t* a = index == 0 ? last_frame_ : &input[(index - 1) * in_channels];
+    const int16_t* b = &input[index * in_channels];
+    for (uint32_t c = 0; c < out_channels; c++) {
+      int32_t sa = a[channel_map_[c]];
+      int32_t sb = b[channel_map_[c]];
+      *output++ = sa + (((sb - sa) * fraction) >> 15);
+    }
+    position_ += step_;
+    count++;
+  }
+
+  position_ -= end;
+  memcpy(last_frame_, &input[(input_frames - 1) * in_channels], in_channels * sizeof(int16_t));
+  return count;
+}
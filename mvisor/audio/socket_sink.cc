@@ -0,0 +1,102 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio_backend.h"
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "logger.h"
+
+/* Sends raw PCM to a local stream socket, e.g. a player started with
+ * socat UNIX-LISTEN:/tmp/audio.sock - | aplay -f S16_LE -r 48000 -c 2
+ * Periods are dropped while nobody is listening, and the connection is retried
+ * every second.
+ */
+class SocketSink : public AudioBackend {
+ private:
+  std::string path_;
+  int         fd_ = -1;
+  size_t      retry_periods_ = 0;
+
+  void Initialize(const std::string& path) {
+    path_ = path;
+    if (path_.size() >= sizeof(sockaddr_un::sun_path)) {
+      MV_PANIC("socket path is too long: %s", path_.c_str());
+    }
+  }
+
+  bool TryConnect() {
+    if (retry_periods_ > 0) {
+      --retry_periods_;
+      return false;
+    }
+    retry_periods_ = 1000 / period_ms_;
+
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    MV_ASSERT(fd_ >= 0);
+
+    sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+      safe_close(&fd_);
+      return false;
+    }
+
+    /* A stalled reader should not block the clock for more than a period */
+    timeval timeout = { .tv_sec = 0, .tv_usec = (suseconds_t)period_ms_ * 1000 };
+    setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (debug_) {
+      MV_LOG("connected to %s", path_.c_str());
+    }
+    return true;
+  }
+
+  void WritePeriod(const int16_t* frames, size_t count) {
+    if (fd_ < 0 && !TryConnect()) {
+      return;
+    }
+
+    auto data = (const uint8_t*)frames;
+    size_t length = count * format_.nchannels * sizeof(int16_t);
+    while (length > 0) {
+      ssize_t ret = send(fd_, data, length, MSG_NOSIGNAL);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        /* A partial period would break the frame alignment, reconnect instead */
+        if (debug_) {
+          MV_LOG("disconnected from %s, errno=%d", path_.c_str(), errno);
+        }
+        safe_close(&fd_);
+        return;
+      }
+      data += ret;
+      length -= ret;
+    }
+  }
+
+ public:
+  virtual ~SocketSink() {
+    StopClock();
+    safe_close(&fd_);
+  }
+};
+
+DECLARE_AUDIO_BACKEND(SocketSink);
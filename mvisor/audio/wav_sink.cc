@@ -0,0 +1,87 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio_backend.h"
+#include <cstdio>
+#include "logger.h"
+
+struct WavHeader {
+  char      riff[4];
+  uint32_t  riff_size;
+  char      wave[4];
+  char      fmt[4];
+  uint32_t  fmt_size;
+  uint16_t  audio_format;
+  uint16_t  nchannels;
+  uint32_t  sample_rate;
+  uint32_t  byte_rate;
+  uint16_t  block_align;
+  uint16_t  bits_per_sample;
+  char      data[4];
+  uint32_t  data_size;
+} __attribute__((packed));
+
+/* Records the playback to a WAV file, the sizes are updated when closed */
+class WavSink : public AudioBackend {
+ private:
+  FILE*     fp_ = nullptr;
+  WavHeader header_;
+
+  void Initialize(const std::string& path) {
+    fp_ = fopen(path.c_str(), "wb");
+    if (fp_ == nullptr) {
+      MV_PANIC("failed to open %s", path.c_str());
+    }
+
+    header_ = WavHeader {
+      .riff = { 'R', 'I', 'F', 'F' },
+      .riff_size = sizeof(WavHeader) - 8,
+      .wave = { 'W', 'A', 'V', 'E' },
+      .fmt = { 'f', 'm', 't', ' ' },
+      .fmt_size = 16,
+      .audio_format = 1,
+      .nchannels = (uint16_t)format_.nchannels,
+      .sample_rate = format_.frequency,
+      .byte_rate = format_.frequency * format_.nchannels * 2,
+      .block_align = (uint16_t)(format_.nchannels * 2),
+      .bits_per_sample = 16,
+      .data = { 'd', 'a', 't', 'a' },
+      .data_size = 0
+    };
+    fwrite(&header_, sizeof(header_), 1, fp_);
+  }
+
+  void WritePeriod(const int16_t* frames, size_t count) {
+    size_t length = count * header_.block_align;
+    fwrite(frames, length, 1, fp_);
+    header_.data_size += length;
+    header_.riff_size += length;
+  }
+
+ public:
+  virtual ~WavSink() {
+    StopClock();
+    if (fp_) {
+      fseek(fp_, 0, SEEK_SET);
+      fwrite(&header_, sizeof(header_), 1, fp_);
+      fclose(fp_);
+    }
+  }
+};
+
+DECLARE_AUDIO_BACKEND(WavSink);
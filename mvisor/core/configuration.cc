@@ -22,6 +22,7 @@
 #include <cstring>
 #include "machine.h"
 #include "logger.h"
+#include "utilities.h"
 
 using namespace std;
 
@@ -88,22 +89,170 @@ bool Configuration::LoadFile(std::string path) {
   return true;
 }
 
+/* Memory sizes are written as 512M or 8G */
+static uint64_t ParseMemorySize(string memory) {
+  uint64_t value = atol(memory.substr(0, memory.length() - 1).c_str());
+  if (memory.back() == 'G') {
+    return value << 30;
+  } else if (memory.back() == 'M') {
+    return value << 20;
+  }
+  MV_PANIC("invalid memory size %s", memory.c_str());
+  return 0;
+}
+
 /* Extract machine configs */
 void Configuration::LoadMachine(YAML::Node node) {
   if (node["memory"]) {
-    string memory = node["memory"].as<string>();
-    MV_ASSERT(memory.back() == 'G');
-    machine_->ram_size_ = (1UL << 30) * atol(memory.substr(0, memory.length() - 1).c_str());
+    machine_->ram_size_ = ParseMemorySize(node["memory"].as<string>());
+  }
+  if (node["shared_memory"]) {
+    machine_->shared_memory_ = node["shared_memory"].as<bool>();
   }
   if (node["vcpu"]) {
     machine_->num_vcpus_ = node["vcpu"].as<uint64_t>();
   }
+  if (node["topology"]) {
+    auto topology = node["topology"];
+    machine_->topology_.sockets = topology["sockets"] ? topology["sockets"].as<int>() : 1;
+    machine_->topology_.cores = topology["cores"] ? topology["cores"].as<int>() : 1;
+    machine_->topology_.threads = topology["threads"] ? topology["threads"].as<int>() : 1;
+  }
+  if (node["numa"]) {
+    LoadNumaNodes(node["numa"]);
+  }
+  if (node["affinity"]) {
+    LoadAffinity(node["affinity"]);
+  }
+  if (node["halt_poll"]) {
+    auto halt_poll = node["halt_poll"];
+    machine_->halt_poll_.max_ns = halt_poll["max_ns"] ? halt_poll["max_ns"].as<int64_t>() : -1;
+    machine_->halt_poll_.adaptive = halt_poll["adaptive"] ? halt_poll["adaptive"].as<bool>() : false;
+    machine_->halt_poll_.disable_hlt_exits = halt_poll["disable_hlt_exits"] ?
+      halt_poll["disable_hlt_exits"].as<bool>() : false;
+  }
   if (node["bios"]) {
     machine_->bios_path_ = FindPath(node["bios"].as<string>());
   }
+  if (node["kernel"]) {
+    LoadKernelBoot(node["kernel"]);
+  }
   if (node["debug"]) {
     machine_->debug_ = node["debug"].as<bool>();
   }
+  if (node["paravirt"]) {
+    LoadParavirtFeatures(node["paravirt"]);
+  }
+  if (node["irqchip"]) {
+    auto irqchip = node["irqchip"].as<string>();
+    if (irqchip != "kernel" && irqchip != "split") {
+      MV_PANIC("invalid irqchip %s, should be kernel or split", irqchip.c_str());
+    }
+    machine_->split_irqchip_ = irqchip == "split";
+  }
+}
+
+/* Paravirt features are listed by name, KVM features and Hyper-V enlightenments */
+void Configuration::LoadParavirtFeatures(YAML::Node node) {
+  static const std::map<string, uint32_t> features = {
+    { "kvmclock", kParavirtKvmClock },
+    { "pv-eoi", kParavirtPvEoi },
+    { "pv-tlb-flush", kParavirtPvTlbFlush },
+    { "pv-spinlock", kParavirtPvSpinlock },
+    { "hv-relaxed", kParavirtHvRelaxed },
+    { "hv-vapic", kParavirtHvVapic },
+    { "hv-time", kParavirtHvTime },
+    { "hv-synic", kParavirtHvSynic },
+    { "hv-stimer", kParavirtHvStimer }
+  };
+
+  machine_->paravirt_features_ = 0;
+  for (auto it = node.begin(); it != node.end(); it++) {
+    auto name = it->as<string>();
+    auto feature = features.find(name);
+    if (feature == features.end()) {
+      MV_PANIC("unknown paravirt feature %s", name.c_str());
+    }
+    machine_->paravirt_features_ |= feature->second;
+  }
+}
+
+/* Each NUMA node lists its vCPUs, memory size, host node and optional SLIT distances */
+void Configuration::LoadNumaNodes(YAML::Node node) {
+  machine_->numa_nodes_.clear();
+  for (auto it = node.begin(); it != node.end(); it++) {
+    auto numa_node = *it;
+    NumaNode numa;
+    numa.memory = ParseMemorySize(numa_node["memory"].as<string>());
+    numa.host_node = numa_node["host_node"] ? numa_node["host_node"].as<int>() : -1;
+    if (numa_node["vcpus"]) {
+      for (auto vcpu : numa_node["vcpus"]) {
+        numa.vcpus.push_back(vcpu.as<int>());
+      }
+    }
+    if (numa_node["distances"]) {
+      for (auto distance : numa_node["distances"]) {
+        numa.distances.push_back(distance.as<int>());
+      }
+    }
+    machine_->numa_nodes_.emplace_back(std::move(numa));
+  }
+}
+
+/* vCPU and IO thread host CPU lists, vcpu is a list with one CPU list per vCPU,
+ * or a single CPU list shared by all vCPUs. vCPUs are unpinned without vcpu.
+ */
+void Configuration::LoadAffinity(YAML::Node node) {
+  int vcpu_priority = node["vcpu_priority"] ? node["vcpu_priority"].as<int>() : 0;
+  machine_->vcpu_placements_.clear();
+  if (!node["vcpu"]) {
+    /* Real-time vCPUs floating over the host CPUs could starve the host */
+    if (vcpu_priority > 0) {
+      MV_PANIC("affinity vcpu_priority requires vcpu");
+    }
+  } else if (node["vcpu"].IsSequence()) {
+    for (auto cpus : node["vcpu"]) {
+      machine_->vcpu_placements_.emplace_back(ThreadPlacement {
+        .cpus = parse_cpu_list(cpus.as<string>()),
+        .priority = vcpu_priority
+      });
+    }
+  } else {
+    machine_->vcpu_placements_.emplace_back(ThreadPlacement {
+      .cpus = parse_cpu_list(node["vcpu"].as<string>()),
+      .priority = vcpu_priority
+    });
+  }
+
+  auto &io_thread = machine_->io_thread_placement_;
+  if (node["iothread"]) {
+    io_thread.cpus = parse_cpu_list(node["iothread"].as<string>());
+  }
+  if (node["iothread_priority"]) {
+    io_thread.priority = node["iothread_priority"].as<int>();
+  }
+}
+
+/* Direct kernel boot, the option ROM is linuxboot_dma.bin from QEMU (pc-bios/ in
+ * the QEMU tree or /usr/share/qemu), which jumps to the kernel loaded by the fw_cfg
+ * DMA interface. It is not shipped with mvisor.
+ */
+void Configuration::LoadKernelBoot(YAML::Node node) {
+  auto &boot = machine_->kernel_boot_;
+  if (!node["path"]) {
+    MV_PANIC("kernel path is not specified");
+  }
+  boot.kernel = FindPath(node["path"].as<string>());
+  if (node["initrd"]) {
+    boot.initrd = FindPath(node["initrd"].as<string>());
+  }
+  if (node["cmdline"]) {
+    boot.cmdline = node["cmdline"].as<string>();
+  }
+  if (!node["option_rom"]) {
+    MV_PANIC("kernel option_rom is not specified, e.g. /usr/share/qemu/linuxboot_dma.bin");
+  }
+  boot.option_rom = FindPath(node["option_rom"].as<string>());
 }
 
 void Configuration::LoadObjects(YAML::Node objects_node) {
@@ -43,18 +43,19 @@ inline IoThread* DeviceManager::io() {
 }
 
 DeviceManager::DeviceManager(Machine* machine, Device* root) :
-  machine_(machine), root_(root)
+  machine_(machine), root_(root), gsi_routing_table_(machine->vm_fd_)
 {
   root_->manager_ = this;
   
   /* Initialize GSI routing table */
-  SetupGsiRoutingTable();
+  gsi_routing_table_.Setup(machine_->split_irqchip());
 
   /* Call Connect() on all devices and do the initialization
    * 1. reset device status
    * 2. register IO handlers
    */
   root_->Connect();
+  SetupInterruptControllers();
 
   /* Call Reset() on all devices after Connect() */
   ResetDevices();
@@ -173,7 +174,7 @@ void DeviceManager::UnregisterIoHandler(Device* device, const IoResource* resour
   }
 }
 
-IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch) {
+IoEvent* DeviceManager::CreateIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch) {
   IoEvent* event = new IoEvent {
     .type = kIoEventFd,
     .device = device,
@@ -181,7 +182,8 @@ IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uin
     .length = length,
     .datamatch = datamatch,
     .flags = length ? KVM_IOEVENTFD_FLAG_DATAMATCH : 0U,
-    .fd = eventfd(0, 0)
+    .fd = eventfd(0, 0),
+    .polled = false
   };
   if (type == kIoResourceTypePio) {
     event->flags |= KVM_IOEVENTFD_FLAG_PIO;
@@ -201,6 +203,14 @@ IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uin
     MV_PANIC("failed to register io event, ret=%d", ret);
   }
 
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  ioevents_.insert(event);
+  return event;
+}
+
+IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch) {
+  IoEvent* event = CreateIoEvent(device, type, address, length, datamatch);
+  event->polled = true;
   io()->StartPolling(event->fd, EPOLLIN, [event, this](int events) {
     uint64_t tmp;
     read(event->fd, &tmp, sizeof(tmp));
@@ -210,18 +220,22 @@ IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uin
       HandleIo(event->address, (uint8_t*)&event->datamatch, event->length, true, 1, true);
     }
   });
-
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
-  ioevents_.insert(event);
   return event;
 }
 
+/* The caller waits on the returned fd itself, e.g. a virtqueue poller thread */
+IoEvent* DeviceManager::RegisterIoEventFd(Device* device, IoResourceType type, uint64_t address) {
+  return CreateIoEvent(device, type, address, 0, 0);
+}
+
 IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uint64_t address) {
   return RegisterIoEvent(device, type, address, 0, 0);
 }
 
 void DeviceManager::UnregisterIoEvent(IoEvent* event) {
-  io()->StopPolling(event->fd);
+  if (event->polled) {
+    io()->StopPolling(event->fd);
+  }
 
   std::lock_guard<std::recursive_mutex> lock(mutex_);
 
@@ -369,8 +383,35 @@ void* DeviceManager::TranslateGuestMemory(uint64_t gpa) {
   return host;
 }
 
+/* With split irqchip, the IOAPIC, PIC and PIT devices must be configured */
+void DeviceManager::SetupInterruptControllers() {
+  if (!machine_->split_irqchip()) {
+    return;
+  }
+  for (auto device : registered_devices_) {
+    auto controller = dynamic_cast<InterruptControllerInterface*>(device);
+    if (controller) {
+      interrupt_controllers_.push_back(controller);
+    }
+    auto external_interrupt = dynamic_cast<ExternalInterruptInterface*>(device);
+    if (external_interrupt) {
+      external_interrupt_ = external_interrupt;
+    }
+  }
+  if (interrupt_controllers_.empty() || !external_interrupt_) {
+    MV_PANIC("split irqchip requires ioapic and i8259-pic devices");
+  }
+}
+
 /* Maybe we should have an IRQ manager or just let KVM do this? */
 void DeviceManager::SetIrq(uint32_t irq, uint32_t level) {
+  if (!interrupt_controllers_.empty()) {
+    for (auto controller : interrupt_controllers_) {
+      controller->SetIrqLevel(irq, level);
+    }
+    return;
+  }
+
   /* Send an IRQ to the guest */
   struct kvm_irq_level irq_level = {
     .irq = irq,
@@ -394,120 +435,50 @@ void DeviceManager::SignalMsi(uint64_t address, uint32_t data) {
   }
 }
 
-/* Since we cannot read routing table from KVM, we keep a copy and update to KVM if changed */
-void DeviceManager::UpdateGsiRoutingTable() {
-  uint8_t buffer[sizeof(kvm_irq_routing) + sizeof(kvm_irq_routing_entry) * gsi_routing_table_.size()];
-  auto table = (kvm_irq_routing*)buffer;
-
-  mutex_.lock();
-  table->nr = gsi_routing_table_.size();
-  table->flags = 0;
-  std::copy(gsi_routing_table_.begin(), gsi_routing_table_.end(), table->entries);
-  mutex_.unlock();
-
-  auto ret = ioctl(machine_->vm_fd_, KVM_SET_GSI_ROUTING, table);
-  if (ret) {
-    MV_PANIC("KVM_SET_GSI_ROUTING ret=%d", ret);
-  }
+void DeviceManager::BeginGsiRoutingUpdate() {
+  gsi_routing_table_.BeginUpdate();
 }
 
-/* Although KVM has initialized GSI routing table, we still need to do it again */
-void DeviceManager::SetupGsiRoutingTable() {
-  auto add_irq_routing = [this](uint gsi, uint chip, uint pin) {
-    kvm_irq_routing_entry entry = {
-      .gsi = gsi,
-      .type = KVM_IRQ_ROUTING_IRQCHIP,
-      .u = { .irqchip = { .irqchip = chip, .pin = pin } }
-    };
-    gsi_routing_table_.push_back(entry);
-  };
-
-  /* 8259A Master */
-  for (uint i = 0; i < 8; i++) {
-    if (i != 2) {
-      add_irq_routing(i, 0, i);
-    }
-  }
+void DeviceManager::EndGsiRoutingUpdate() {
+  gsi_routing_table_.EndUpdate();
+}
 
-  /* 8259A Slave */
-  for (uint i = 0; i < 8; i++) {
-    add_irq_routing(8 + i, 1, i);
-  }
+int DeviceManager::AddMsiRoute(uint64_t address, uint32_t data, int trigger_fd) {
+  return gsi_routing_table_.AddMsiRoute(address, data, trigger_fd);
+}
 
-  /* IOAPIC */
-  for (uint i = 0; i < 24; i++) {
-    if (i == 0) {
-      add_irq_routing(i, 2, 2);
-    } else if (i != 2) {
-      add_irq_routing(i, 2, i);
-    }
-  }
+void DeviceManager::UpdateMsiRoute(int gsi, uint64_t address, uint32_t data, int trigger_fd) {
+  gsi_routing_table_.UpdateMsiRoute(gsi, address, data, trigger_fd);
+}
 
-  next_gsi_ = 24;
-  UpdateGsiRoutingTable();
+void DeviceManager::AssignIrqfd(int gsi, int trigger_fd, int resample_fd) {
+  gsi_routing_table_.AssignIrqfd(gsi, trigger_fd, resample_fd);
 }
 
-/* This GSI is currently used with IRQ fd */
-int DeviceManager::AddMsiRoute(uint64_t address, uint32_t data, int trigger_fd) {
-  auto gsi = next_gsi_++;
-
-  kvm_irq_routing_entry entry = {
-    .gsi = (uint)gsi,
-    .type = KVM_IRQ_ROUTING_MSI,
-    .u = { .msi = {
-      .address_lo = (uint32_t)address,
-      .address_hi = (uint32_t)(address >> 32),
-      .data = data
-    } }
-  };
+void DeviceManager::DeassignIrqfd(int gsi, int trigger_fd) {
+  gsi_routing_table_.DeassignIrqfd(gsi, trigger_fd);
+}
 
-  mutex_.lock();
-  gsi_routing_table_.push_back(entry);
-  mutex_.unlock();
+void DeviceManager::SetIoapicRoute(uint pin, uint64_t address, uint32_t data) {
+  gsi_routing_table_.SetIoapicRoute(pin, address, data);
+}
 
-  UpdateGsiRoutingTable();
-  if (trigger_fd != -1) {
-    kvm_irqfd irqfd = { .fd = (uint)trigger_fd, .gsi = (uint)gsi };
-    if (ioctl(machine_->vm_fd_, KVM_IRQFD, &irqfd) < 0) {
-      MV_PANIC("failed to assign irqfd=%d to gsi=%d", trigger_fd, gsi);
-    }
+/* KVM_EXIT_IOAPIC_EOI, the guest acknowledged a level-triggered interrupt */
+void DeviceManager::EndOfInterrupt(uint vector) {
+  for (auto controller : interrupt_controllers_) {
+    controller->EndOfInterrupt(vector);
   }
-  return gsi;
 }
 
-/* Setting the address to 0 to remove a MSI route */
-void DeviceManager::UpdateMsiRoute(int gsi, uint64_t address, uint32_t data, int trigger_fd) {
-  mutex_.lock();
-  auto it = std::find_if(gsi_routing_table_.begin(), gsi_routing_table_.end(), [gsi](auto &entry) {
-    return entry.gsi == (uint)gsi;
-  });
+/* The PIC output is connected to LINT0 of the BSP */
+void DeviceManager::NotifyExternalInterrupt() {
+  machine_->vcpus_[0]->Kick();
+}
 
-  if (it == gsi_routing_table_.end()) {
-    MV_PANIC("not found gsi=%d", gsi);
-  } else if (address == 0) {
-    /* deassign the irqfd and remove from table */
-    if (trigger_fd != -1) {
-      kvm_irqfd irqfd = { .fd = (uint)trigger_fd, .gsi = (uint)gsi, .flags = KVM_IRQFD_FLAG_DEASSIGN };
-      if (ioctl(machine_->vm_fd_, KVM_IRQFD, &irqfd) < 0) {
-        MV_PANIC("failed to assign irqfd=%d to gsi=%d", trigger_fd, gsi);
-      }
-    }
-    gsi_routing_table_.erase(it);
-  } else {
-    /* update entry and irqfd */
-    it->u.msi = (kvm_irq_routing_msi) {
-      .address_lo = (uint32_t)address,
-      .address_hi = (uint32_t)(address >> 32),
-      .data = data
-    };
-    if (trigger_fd != -1) {
-      kvm_irqfd irqfd = { .fd = (uint)trigger_fd, .gsi = (uint)gsi };
-      if (ioctl(machine_->vm_fd_, KVM_IRQFD, &irqfd) < 0) {
-        MV_PANIC("failed to assign irqfd=%d to gsi=%d", trigger_fd, gsi);
-      }
-    }
-  }
-  mutex_.unlock();
-  
-  UpdateGsiRoutingTable();
+bool DeviceManager::HasExternalInterrupt() {
+  return external_interrupt_ && external_interrupt_->HasExternalInterrupt();
+}
+
+int DeviceManager::AcknowledgeExternalInterrupt() {
+  return external_interrupt_->AcknowledgeExternalInterrupt();
 }
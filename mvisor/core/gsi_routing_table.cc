@@ -0,0 +1,235 @@
+/* 
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "gsi_routing_table.h"
+#include <algorithm>
+#include <sys/ioctl.h>
+#include "logger.h"
+
+GsiRoutingTable::GsiRoutingTable(int vm_fd) : vm_fd_(vm_fd) {
+}
+
+/* Since we cannot read routing table from KVM, we keep a copy and update to KVM if changed.
+ * Inside a batch the table is only marked dirty and loaded at the end.
+ */
+void GsiRoutingTable::Update() {
+  mutex_.lock();
+  if (depth_ > 0) {
+    dirty_ = true;
+    mutex_.unlock();
+    return;
+  }
+  dirty_ = false;
+
+  uint8_t buffer[sizeof(kvm_irq_routing) + sizeof(kvm_irq_routing_entry) * entries_.size()];
+  auto table = (kvm_irq_routing*)buffer;
+  table->nr = entries_.size();
+  table->flags = 0;
+  std::copy(entries_.begin(), entries_.end(), table->entries);
+  mutex_.unlock();
+
+  auto ret = ioctl(vm_fd_, KVM_SET_GSI_ROUTING, table);
+  if (ret) {
+    MV_PANIC("KVM_SET_GSI_ROUTING ret=%d", ret);
+  }
+}
+
+/* Although KVM has initialized GSI routing table, we still need to do it again */
+void GsiRoutingTable::Setup(bool split_irqchip) {
+  /* With split irqchip, GSIs below IOAPIC_NUM_PINS are MSI routes set by the userspace
+   * IOAPIC, KVM scans them to find level-triggered vectors which need EOI exits
+   */
+  if (split_irqchip) {
+    next_gsi_ = IOAPIC_NUM_PINS;
+    Update();
+    return;
+  }
+
+  auto add_irq_routing = [this](uint gsi, uint chip, uint pin) {
+    kvm_irq_routing_entry entry = {
+      .gsi = gsi,
+      .type = KVM_IRQ_ROUTING_IRQCHIP,
+      .u = { .irqchip = { .irqchip = chip, .pin = pin } }
+    };
+    entries_.push_back(entry);
+  };
+
+  /* 8259A Master */
+  for (uint i = 0; i < 8; i++) {
+    if (i != 2) {
+      add_irq_routing(i, 0, i);
+    }
+  }
+
+  /* 8259A Slave */
+  for (uint i = 0; i < 8; i++) {
+    add_irq_routing(8 + i, 1, i);
+  }
+
+  /* IOAPIC */
+  for (uint i = 0; i < 24; i++) {
+    if (i == 0) {
+      add_irq_routing(i, 2, 2);
+    } else if (i != 2) {
+      add_irq_routing(i, 2, i);
+    }
+  }
+
+  next_gsi_ = IOAPIC_NUM_PINS;
+  Update();
+}
+
+void GsiRoutingTable::BeginUpdate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++depth_;
+}
+
+void GsiRoutingTable::EndUpdate() {
+  mutex_.lock();
+  MV_ASSERT(depth_ > 0);
+  bool update = --depth_ == 0 && dirty_;
+  mutex_.unlock();
+  if (update) {
+    Update();
+  }
+}
+
+/* This GSI is currently used with IRQ fd, GSIs of removed routes are reused */
+int GsiRoutingTable::AddMsiRoute(uint64_t address, uint32_t data, int trigger_fd) {
+  kvm_irq_routing_entry entry = {
+    .type = KVM_IRQ_ROUTING_MSI,
+    .u = { .msi = {
+      .address_lo = (uint32_t)address,
+      .address_hi = (uint32_t)(address >> 32),
+      .data = data
+    } }
+  };
+
+  mutex_.lock();
+  int gsi;
+  if (free_gsis_.empty()) {
+    gsi = next_gsi_++;
+  } else {
+    gsi = free_gsis_.back();
+    free_gsis_.pop_back();
+  }
+  entry.gsi = (uint)gsi;
+  entries_.push_back(entry);
+  mutex_.unlock();
+
+  Update();
+  if (trigger_fd != -1) {
+    AssignIrqfd(gsi, trigger_fd);
+  }
+  return gsi;
+}
+
+/* Setting the address to 0 to remove a MSI route, the table is not reloaded if
+ * the message is unchanged
+ */
+void GsiRoutingTable::UpdateMsiRoute(int gsi, uint64_t address, uint32_t data, int trigger_fd) {
+  mutex_.lock();
+  auto it = std::find_if(entries_.begin(), entries_.end(), [gsi](auto &entry) {
+    return entry.gsi == (uint)gsi;
+  });
+
+  bool changed = true;
+  if (it == entries_.end() || (int)it->gsi < IOAPIC_NUM_PINS) {
+    MV_PANIC("not found gsi=%d", gsi);
+  } else if (address == 0) {
+    /* deassign the irqfd and remove from table */
+    if (trigger_fd != -1) {
+      DeassignIrqfd(gsi, trigger_fd);
+    }
+    entries_.erase(it);
+    free_gsis_.push_back(gsi);
+  } else {
+    /* update entry and irqfd */
+    changed = it->u.msi.address_lo != (uint32_t)address ||
+      it->u.msi.address_hi != (uint32_t)(address >> 32) || it->u.msi.data != data;
+    it->u.msi = (kvm_irq_routing_msi) {
+      .address_lo = (uint32_t)address,
+      .address_hi = (uint32_t)(address >> 32),
+      .data = data
+    };
+    if (trigger_fd != -1) {
+      AssignIrqfd(gsi, trigger_fd);
+    }
+  }
+  mutex_.unlock();
+
+  if (changed) {
+    Update();
+  }
+}
+
+/* Setting the address to 0 to remove the route of a masked IOAPIC pin */
+void GsiRoutingTable::SetIoapicRoute(uint pin, uint64_t address, uint32_t data) {
+  MV_ASSERT(pin < IOAPIC_NUM_PINS);
+  mutex_.lock();
+  auto it = std::find_if(entries_.begin(), entries_.end(), [pin](auto &entry) {
+    return entry.gsi == pin;
+  });
+  if (it != entries_.end()) {
+    if (address && it->u.msi.address_lo == (uint32_t)address &&
+        it->u.msi.address_hi == (uint32_t)(address >> 32) && it->u.msi.data == data) {
+      /* Unchanged */
+      mutex_.unlock();
+      return;
+    }
+    entries_.erase(it);
+  } else if (!address) {
+    mutex_.unlock();
+    return;
+  }
+  if (address) {
+    kvm_irq_routing_entry entry = {
+      .gsi = pin,
+      .type = KVM_IRQ_ROUTING_MSI,
+      .u = { .msi = {
+        .address_lo = (uint32_t)address,
+        .address_hi = (uint32_t)(address >> 32),
+        .data = data
+      } }
+    };
+    entries_.push_back(entry);
+  }
+  mutex_.unlock();
+
+  Update();
+}
+
+/* Writing to the trigger fd injects the GSI without a VM ioctl. A level-triggered
+ * GSI stays asserted until the guest EOI, then the resample fd is signaled.
+ */
+void GsiRoutingTable::AssignIrqfd(int gsi, int trigger_fd, int resample_fd) {
+  kvm_irqfd irqfd = { .fd = (uint)trigger_fd, .gsi = (uint)gsi };
+  if (resample_fd != -1) {
+    irqfd.flags = KVM_IRQFD_FLAG_RESAMPLE;
+    irqfd.resamplefd = (uint)resample_fd;
+  }
+  if (ioctl(vm_fd_, KVM_IRQFD, &irqfd) < 0) {
+    MV_PANIC("failed to assign irqfd=%d to gsi=%d", trigger_fd, gsi);
+  }
+}
+
+void GsiRoutingTable::DeassignIrqfd(int gsi, int trigger_fd) {
+  kvm_irqfd irqfd = { .fd = (uint)trigger_fd, .gsi = (uint)gsi, .flags = KVM_IRQFD_FLAG_DEASSIGN };
+  if (ioctl(vm_fd_, KVM_IRQFD, &irqfd) < 0) {
+    MV_PANIC("failed to deassign irqfd=%d from gsi=%d", trigger_fd, gsi);
+  }
+}
@@ -51,6 +51,7 @@ IoThread::~IoThread() {
 void IoThread::Start() {
 
   thread_ = std::thread(&IoThread::RunLoop, this);
+  machine_->PlaceThread(thread_, machine_->io_thread_placement());
 
   StartPolling(event_fd_, EPOLLIN, [this](auto ret) {
     uint64_t tmp;
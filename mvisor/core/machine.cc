@@ -23,13 +23,21 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <cstring>
+#include <fstream>
+#include <set>
 #include "disk_image.h"
 #include "device_interface.h"
+#include "utilities.h"
 #include "logger.h"
 
 #define X86_EPT_IDENTITY_BASE 0xfeffc000
 
+#define HALT_POLL_ADJUST_INTERVAL_MS  1000
+#define HALT_POLL_MIN_NS              10000
+
 /* The Machine class handles all the VM initialization and common operations
  * such as interrupts, start, quit, pause, resume
  * KVM API reference: https://www.kernel.org/doc/html/latest/virt/kvm/api.html
@@ -42,6 +50,9 @@ Machine::Machine(std::string config_path) {
   }
 
   InitializeKvm();
+  CheckParavirtFeatures();
+  CheckTopology();
+  SetupHaltPolling();
 
   memory_manager_ = new MemoryManager(this);
 
@@ -107,6 +118,317 @@ void Machine::InitializeKvm() {
   MV_ASSERT(vm_fd_ > 0);
 }
 
+/* Drop the paravirt features which the host KVM could not provide */
+void Machine::CheckParavirtFeatures() {
+  struct {
+    uint32_t    feature;
+    int         capability;
+    const char* name;
+  } requirements[] = {
+    { kParavirtHvRelaxed, KVM_CAP_HYPERV, "hv-relaxed" },
+    { kParavirtHvVapic, KVM_CAP_HYPERV_VAPIC, "hv-vapic" },
+    { kParavirtHvTime, KVM_CAP_HYPERV_TIME, "hv-time" },
+    { kParavirtHvSynic, KVM_CAP_HYPERV_SYNIC2, "hv-synic" },
+    { kParavirtHvStimer, KVM_CAP_HYPERV_SYNIC2, "hv-stimer" }
+  };
+
+  for (auto &requirement : requirements) {
+    if ((paravirt_features_ & requirement.feature) &&
+        ioctl(kvm_fd_, KVM_CHECK_EXTENSION, requirement.capability) <= 0) {
+      MV_ERROR("paravirt feature %s is not supported by KVM", requirement.name);
+      paravirt_features_ &= ~requirement.feature;
+    }
+  }
+
+  /* Synthetic timers are delivered as SynIC messages and count reference time */
+  if ((paravirt_features_ & kParavirtHvStimer) &&
+      (~paravirt_features_ & (kParavirtHvSynic | kParavirtHvTime))) {
+    MV_ERROR("hv-stimer requires hv-synic and hv-time");
+    paravirt_features_ &= ~kParavirtHvStimer;
+  }
+}
+
+/* HLT exits must be disabled before any vCPU is created. A guest halting in
+ * VMX non-root mode never yields the host CPU, so it only suits dedicated cores.
+ * Otherwise the halt-polling ceiling of this VM overrides the module parameter.
+ */
+void Machine::SetupHaltPolling() {
+  if (halt_poll_.disable_hlt_exits) {
+    int exits = ioctl(kvm_fd_, KVM_CHECK_EXTENSION, KVM_CAP_X86_DISABLE_EXITS);
+    if (exits & KVM_X86_DISABLE_EXITS_HLT) {
+      struct kvm_enable_cap cap = { .cap = KVM_CAP_X86_DISABLE_EXITS };
+      cap.args[0] = KVM_X86_DISABLE_EXITS_HLT;
+      if (ioctl(vm_fd_, KVM_ENABLE_CAP, &cap) < 0) {
+        MV_PANIC("failed to disable HLT exits");
+      }
+      if (vcpu_placements_.empty()) {
+        MV_ERROR("HLT exits are disabled but vCPUs are not pinned to dedicated cores");
+      }
+      /* Nothing to poll if the guest never exits on HLT */
+      halt_poll_.adaptive = false;
+      return;
+    }
+    MV_ERROR("KVM does not support disabling HLT exits");
+  }
+
+  if (halt_poll_.max_ns < 0) {
+    halt_poll_.adaptive = false;
+    return;
+  }
+  if (ioctl(kvm_fd_, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) <= 0) {
+    MV_ERROR("KVM does not support per-VM halt polling");
+    halt_poll_.adaptive = false;
+    return;
+  }
+  SetHaltPollNs(halt_poll_.max_ns);
+}
+
+void Machine::SetHaltPollNs(uint64_t ns) {
+  struct kvm_enable_cap cap = { .cap = KVM_CAP_HALT_POLL };
+  cap.args[0] = ns;
+  if (ioctl(vm_fd_, KVM_ENABLE_CAP, &cap) < 0) {
+    MV_PANIC("failed to set halt poll ns=%lu", ns);
+  }
+  halt_poll_ns_ = ns;
+}
+
+/* KVM grows and shrinks the polling window of each vCPU within the VM ceiling.
+ * The ceiling is raised when the vCPUs are woken up shortly after they sleep,
+ * and lowered when most of the polling time is wasted without a wakeup.
+ */
+void Machine::AdjustHaltPolling() {
+  VcpuHaltStats total = { 0 };
+  for (auto vcpu : vcpus_) {
+    VcpuHaltStats stats;
+    if (!vcpu->GetHaltStats(&stats)) {
+      MV_ERROR("halt stats are not available, adaptive halt polling is disabled");
+      io_thread_->RemoveTimer(halt_poll_timer_);
+      halt_poll_timer_ = nullptr;
+      return;
+    }
+    total.successful_poll += stats.successful_poll;
+    total.wakeup += stats.wakeup;
+    total.poll_success_ns += stats.poll_success_ns;
+    total.poll_fail_ns += stats.poll_fail_ns;
+    total.wait_ns += stats.wait_ns;
+  }
+
+  uint64_t successful_poll = total.successful_poll - last_halt_stats_.successful_poll;
+  uint64_t sleeps = total.wakeup - last_halt_stats_.wakeup;
+  uint64_t poll_success_ns = total.poll_success_ns - last_halt_stats_.poll_success_ns;
+  uint64_t poll_fail_ns = total.poll_fail_ns - last_halt_stats_.poll_fail_ns;
+  uint64_t wait_ns = total.wait_ns - last_halt_stats_.wait_ns;
+  last_halt_stats_ = total;
+
+  uint64_t halts = successful_poll + sleeps;
+  if (halts == 0) {
+    return;
+  }
+  uint64_t average_wait_ns = sleeps ? wait_ns / sleeps : 0;
+
+  uint64_t ns = halt_poll_ns_;
+  if (sleeps && average_wait_ns < (uint64_t)halt_poll_.max_ns) {
+    /* Wakeup latency is within reach, polling a little longer saves the sleep */
+    ns = std::max<uint64_t>(ns * 2, HALT_POLL_MIN_NS);
+    ns = std::min<uint64_t>(std::max(ns, average_wait_ns * 2), halt_poll_.max_ns);
+  } else if (poll_fail_ns > poll_success_ns * 2) {
+    /* Most polling ends up sleeping anyway */
+    ns /= 2;
+    if (ns < HALT_POLL_MIN_NS) {
+      ns = 0;
+    }
+  }
+
+  if (ns != halt_poll_ns_) {
+    if (debug_) {
+      MV_LOG("halt poll ns %lu -> %lu, halts=%lu polled=%lu avg_wait=%luns",
+        halt_poll_ns_, ns, halts, successful_poll, average_wait_ns);
+    }
+    SetHaltPollNs(ns);
+  }
+}
+
+/* Default to a single socket with one thread per core, and validate the NUMA layout */
+void Machine::CheckTopology() {
+  if (topology_.sockets == 0) {
+    topology_ = { .sockets = 1, .cores = num_vcpus_, .threads = 1 };
+  }
+  if (topology_.sockets * topology_.cores * topology_.threads != num_vcpus_) {
+    MV_PANIC("topology sockets=%d cores=%d threads=%d mismatches vcpu=%d",
+      topology_.sockets, topology_.cores, topology_.threads, num_vcpus_);
+  }
+
+  if (numa_nodes_.empty()) {
+    return;
+  }
+  uint64_t total_memory = 0;
+  std::vector<bool> assigned(num_vcpus_, false);
+  for (size_t i = 0; i < numa_nodes_.size(); i++) {
+    auto &node = numa_nodes_[i];
+    total_memory += node.memory;
+    for (auto vcpu : node.vcpus) {
+      if (vcpu < 0 || vcpu >= num_vcpus_ || assigned[vcpu]) {
+        MV_PANIC("invalid or duplicated vcpu %d in NUMA node %lu", vcpu, i);
+      }
+      assigned[vcpu] = true;
+    }
+    if (node.distances.empty()) {
+      for (size_t j = 0; j < numa_nodes_.size(); j++) {
+        node.distances.push_back(i == j ? 10 : 20);
+      }
+    } else if (node.distances.size() != numa_nodes_.size()) {
+      MV_PANIC("NUMA node %lu should have %lu distances", i, numa_nodes_.size());
+    }
+  }
+  if (total_memory != ram_size_) {
+    MV_PANIC("NUMA nodes memory 0x%lx mismatches machine memory 0x%lx", total_memory, ram_size_);
+  }
+  for (int i = 0; i < num_vcpus_; i++) {
+    if (!assigned[i]) {
+      MV_PANIC("vcpu %d is not assigned to any NUMA node", i);
+    }
+  }
+}
+
+/* The APIC ID is composed of package, core and thread fields, each rounded up to
+ * power of 2 bits, the same as the physical CPU does
+ */
+void Machine::GetApicIdShifts(int* core_shift, int* package_shift) {
+  auto bits_of = [](int count) {
+    int bits = 0;
+    while ((1 << bits) < count) {
+      bits++;
+    }
+    return bits;
+  };
+  *core_shift = bits_of(topology_.threads);
+  *package_shift = *core_shift + bits_of(topology_.cores);
+}
+
+uint32_t Machine::GetApicId(int vcpu_id) {
+  int core_shift, package_shift;
+  GetApicIdShifts(&core_shift, &package_shift);
+  int thread = vcpu_id % topology_.threads;
+  int core = (vcpu_id / topology_.threads) % topology_.cores;
+  int package = vcpu_id / (topology_.threads * topology_.cores);
+  return (package << package_shift) | (core << core_shift) | thread;
+}
+
+/* The firmware enumerates APIC IDs below this value */
+uint32_t Machine::GetApicIdLimit() {
+  return GetApicId(num_vcpus_ - 1) + 1;
+}
+
+/* Use a single placement for all vCPUs if only one is configured */
+const ThreadPlacement& Machine::GetVcpuPlacement(int vcpu_id) {
+  static const ThreadPlacement unpinned = { .priority = 0 };
+  if (vcpu_placements_.empty()) {
+    return unpinned;
+  }
+  if (vcpu_placements_.size() == 1) {
+    return vcpu_placements_[0];
+  }
+  if (vcpu_id >= (int)vcpu_placements_.size()) {
+    MV_PANIC("affinity of vcpu %d is not configured", vcpu_id);
+  }
+  return vcpu_placements_[vcpu_id];
+}
+
+/* Bind the thread to host CPUs and optionally run it with SCHED_FIFO,
+ * real-time priority requires CAP_SYS_NICE, so failure is not fatal
+ */
+void Machine::PlaceThread(std::thread& thread, const ThreadPlacement& placement) {
+  auto handle = thread.native_handle();
+  if (!placement.cpus.empty()) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (auto cpu : placement.cpus) {
+      CPU_SET(cpu, &cpuset);
+    }
+    int ret = pthread_setaffinity_np(handle, sizeof(cpuset), &cpuset);
+    if (ret) {
+      MV_PANIC("failed to set affinity %s, ret=%d", format_cpu_list(placement.cpus).c_str(), ret);
+    }
+  }
+  if (placement.priority > 0) {
+    struct sched_param param = { .sched_priority = placement.priority };
+    int ret = pthread_setschedparam(handle, SCHED_FIFO, &param);
+    if (ret) {
+      MV_ERROR("failed to set SCHED_FIFO priority %d, ret=%d", placement.priority, ret);
+    }
+  }
+}
+
+/* Print where the vCPU and IO threads actually run, and warn about placements
+ * that hurt latency, e.g. real-time vCPUs sharing a host CPU or running on CPUs
+ * not isolated from the host scheduler (isolcpus= and nohz_full= kernel options)
+ */
+void Machine::PrintThreadPlacement() {
+  auto read_host_cpus = [](const char* path) {
+    std::set<int> cpus;
+    std::ifstream file(path);
+    std::string list;
+    if (file && std::getline(file, list) && !list.empty()) {
+      for (auto cpu : parse_cpu_list(list)) {
+        cpus.insert(cpu);
+      }
+    }
+    return cpus;
+  };
+  auto isolated = read_host_cpus("/sys/devices/system/cpu/isolated");
+  auto nohz_full = read_host_cpus("/sys/devices/system/cpu/nohz_full");
+
+  std::map<int, int> fifo_vcpus_per_cpu;
+  auto report = [&](const char* name, std::thread& thread, bool is_vcpu) {
+    cpu_set_t cpuset;
+    std::vector<int> cpus;
+    if (pthread_getaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpuset)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    int policy;
+    struct sched_param param = { 0 };
+    pthread_getschedparam(thread.native_handle(), &policy, &param);
+
+    bool all_isolated = !cpus.empty();
+    bool all_nohz_full = !cpus.empty();
+    for (auto cpu : cpus) {
+      all_isolated = all_isolated && isolated.count(cpu);
+      all_nohz_full = all_nohz_full && nohz_full.count(cpu);
+    }
+    MV_LOG("%s host cpus=%s policy=%s priority=%d%s%s", name, format_cpu_list(cpus).c_str(),
+      policy == SCHED_FIFO ? "fifo" : "other", param.sched_priority,
+      all_isolated ? " isolated" : "", all_nohz_full ? " nohz_full" : "");
+
+    if (policy == SCHED_FIFO && !all_isolated) {
+      MV_ERROR("%s runs SCHED_FIFO on CPUs not isolated, host tasks may starve", name);
+    }
+    if (is_vcpu && policy == SCHED_FIFO) {
+      for (auto cpu : cpus) {
+        fifo_vcpus_per_cpu[cpu]++;
+      }
+    }
+  };
+
+  if (!debug_ && vcpu_placements_.empty() && io_thread_placement_.cpus.empty()) {
+    return;
+  }
+  for (auto vcpu : vcpus_) {
+    report(vcpu->name(), vcpu->thread(), true);
+  }
+  report("mvisor-iothread", io_thread_->thread(), false);
+
+  for (auto &item : fifo_vcpus_per_cpu) {
+    if (item.second > 1) {
+      MV_ERROR("%d SCHED_FIFO vCPUs share host cpu %d, they may deadlock on spinlocks",
+        item.second, item.first);
+    }
+  }
+}
+
 /* SeaBIOS is loaded into the end of 1MB and the end of 4GB */
 void Machine::LoadBiosFile() {
   // Read BIOS data from path to bios_data
@@ -153,15 +475,35 @@ void Machine::CreateArchRelated() {
   /* Map these addresses as reserved so the guest never touch it */
   memory_manager_->Map(X86_EPT_IDENTITY_BASE, 4 * PAGE_SIZE, nullptr, kMemoryTypeReserved, "EPT+TSS");
 
-  // Use Kvm in-kernel IRQChip
-  if (ioctl(vm_fd_, KVM_CREATE_IRQCHIP) < 0) {
-    MV_PANIC("failed to create irqchip");
+  if (split_irqchip_) {
+    /* Only LAPICs are in kernel, the IOAPIC, PIC and PIT are emulated by devices.
+     * The in-kernel PIT requires the in-kernel PIC, so it is not created.
+     */
+    struct kvm_enable_cap cap = { .cap = KVM_CAP_SPLIT_IRQCHIP };
+    cap.args[0] = IOAPIC_NUM_PINS;
+    if (ioctl(vm_fd_, KVM_ENABLE_CAP, &cap) < 0) {
+      MV_PANIC("failed to create split irqchip");
+    }
+  } else {
+    // Use Kvm in-kernel IRQChip
+    if (ioctl(vm_fd_, KVM_CREATE_IRQCHIP) < 0) {
+      MV_PANIC("failed to create irqchip");
+    }
+
+    // Use Kvm in-kernel PITClock
+    struct kvm_pit_config pit_config = { 0 };
+    if (ioctl(vm_fd_, KVM_CREATE_PIT2, &pit_config) < 0) {
+      MV_PANIC("failed to create pit");
+    }
   }
 
-  // Use Kvm in-kernel PITClock
-  struct kvm_pit_config pit_config = { 0 };
-  if (ioctl(vm_fd_, KVM_CREATE_PIT2, &pit_config) < 0) {
-    MV_PANIC("failed to create pit");
+  /* x2APIC IDs above 255 are passed in the high 32 bits of MSI addresses */
+  if (GetApicIdLimit() > 255) {
+    struct kvm_enable_cap cap = { .cap = KVM_CAP_X2APIC_API };
+    cap.args[0] = KVM_X2APIC_API_USE_32BIT_IDS | KVM_X2APIC_API_DISABLE_BROADCAST_QUIRK;
+    if (ioctl(vm_fd_, KVM_ENABLE_CAP, &cap) < 0) {
+      MV_PANIC("failed to enable x2APIC API");
+    }
   }
 }
 
@@ -179,6 +521,13 @@ int Machine::Run() {
     vcpu->Start();
   }
   io_thread_->Start();
+  PrintThreadPlacement();
+
+  if (halt_poll_.adaptive) {
+    halt_poll_timer_ = io_thread_->AddTimer(HALT_POLL_ADJUST_INTERVAL_MS, true, [this]() {
+      AdjustHaltPolling();
+    });
+  }
   return 0;
 }
 
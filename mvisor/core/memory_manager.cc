@@ -20,12 +20,19 @@
 #include "memory_manager.h"
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 #include <cstring>
+#include <algorithm>
 #include <linux/kvm.h>
 #include <unordered_set>
 #include "machine.h"
 #include "logger.h"
 
+/* Huge page mappings of 1GB are possible for the IOMMU */
+#define RAM_HOST_ALIGNMENT    (1ULL << 30)
+
 static uint32_t _new_slot_id = 0;
 static inline uint32_t get_new_slot_id() {
   return _new_slot_id++;
@@ -54,6 +61,7 @@ MemoryManager::MemoryManager(const Machine* machine)
 
 MemoryManager::~MemoryManager() {
   munmap(ram_host_, machine_->ram_size_);
+  safe_close(&ram_fd_);
 }
 
 
@@ -62,21 +70,75 @@ void MemoryManager::InitializeSystemRam() {
   if (machine_->debug_)
     MV_LOG("RAM size: %lu MB", machine_->ram_size_ >> 20);
 
-  ram_host_ = mmap(nullptr, machine_->ram_size_, PROT_READ | PROT_WRITE,
-    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  /* Align the host address so that guest and host addresses are congruent modulo
+   * the huge page size, then KVM and the IOMMU can use huge page mappings
+   */
+  size_t reserved_size = machine_->ram_size_ + RAM_HOST_ALIGNMENT;
+  void* reserved = mmap(nullptr, reserved_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  MV_ASSERT(reserved != MAP_FAILED);
+  uint64_t start = ((uint64_t)reserved + RAM_HOST_ALIGNMENT - 1) & ~(RAM_HOST_ALIGNMENT - 1);
+  if (machine_->shared_memory_) {
+    /* Backed by a memfd, so vhost-user backends can map the guest RAM */
+    ram_fd_ = memfd_create("mvisor-ram", MFD_CLOEXEC);
+    MV_ASSERT(ram_fd_ >= 0);
+    if (ftruncate(ram_fd_, machine_->ram_size_) < 0) {
+      MV_PANIC("failed to allocate shared memory size=0x%lx", machine_->ram_size_);
+    }
+    ram_host_ = mmap((void*)start, machine_->ram_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_FIXED, ram_fd_, 0);
+  } else {
+    ram_host_ = mmap((void*)start, machine_->ram_size_, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  }
   MV_ASSERT(ram_host_ != MAP_FAILED);
 
+  /* Release the unused reservation */
+  if (start > (uint64_t)reserved) {
+    munmap(reserved, start - (uint64_t)reserved);
+  }
+  uint64_t end = start + machine_->ram_size_;
+  if ((uint64_t)reserved + reserved_size > end) {
+    munmap((void*)end, (uint64_t)reserved + reserved_size - end);
+  }
+  madvise(ram_host_, machine_->ram_size_, MADV_HUGEPAGE);
+
+  /* Bind before the guest touches any page */
+  BindNumaNodes();
+
   /* Don't map MMIO region */
-  const uint64_t low_ram_upper_bound = 2 * (1LL << 30);
-  const uint64_t high_ram_lower_bound = 1LL << 32;
-  if (machine_->ram_size_ <= low_ram_upper_bound) {
+  if (machine_->ram_size_ <= LOW_RAM_UPPER_BOUND) {
     Map(0, machine_->ram_size_, ram_host_, kMemoryTypeRam, "Free");
   } else {
     // Split the ram to two segments leaving a hole in the GPA
-    Map(0, low_ram_upper_bound, ram_host_, kMemoryTypeRam, "Free");
+    Map(0, LOW_RAM_UPPER_BOUND, ram_host_, kMemoryTypeRam, "Free");
     // Skip the hole and map the rest
-    Map(high_ram_lower_bound, machine_->ram_size_ - low_ram_upper_bound,
-      (uint8_t*)ram_host_ + low_ram_upper_bound, kMemoryTypeRam, "Free");
+    Map(HIGH_RAM_LOWER_BOUND, machine_->ram_size_ - LOW_RAM_UPPER_BOUND,
+      (uint8_t*)ram_host_ + LOW_RAM_UPPER_BOUND, kMemoryTypeRam, "Free");
+  }
+}
+
+/* Guest RAM is split into virtual NUMA nodes in order, each part is bound to
+ * the corresponding host node if specified
+ */
+void MemoryManager::BindNumaNodes() {
+  uint64_t offset = 0;
+  for (auto &node : machine_->numa_nodes_) {
+    if (node.host_node >= 0) {
+      unsigned long node_mask[16] = { 0 };
+      const unsigned long max_node = sizeof(node_mask) * 8;
+      MV_ASSERT(node.host_node < (int)max_node);
+      node_mask[node.host_node / 64] |= 1UL << (node.host_node % 64);
+      if (syscall(SYS_mbind, (uint8_t*)ram_host_ + offset, node.memory, MPOL_BIND,
+          node_mask, max_node, MPOL_MF_STRICT | MPOL_MF_MOVE) < 0) {
+        MV_PANIC("failed to bind guest memory offset=0x%lx size=0x%lx to host node %d",
+          offset, node.memory, node.host_node);
+      }
+      if (machine_->debug_) {
+        MV_LOG("bind guest memory offset=0x%lx size=0x%lx to host node %d",
+          offset, node.memory, node.host_node);
+      }
+    }
+    offset += node.memory;
   }
 }
 
@@ -168,6 +230,8 @@ void MemoryManager::AddMemoryRegion(MemoryRegion* region) {
       listener->callback(slot, false);
     }
   }
+
+  UpdateRamView();
 }
 
 /* Mapping a memory region in the guest address space */
@@ -229,6 +293,7 @@ void MemoryManager::Unmap(const MemoryRegion** pregion) {
     }
     delete slot;
   }
+  UpdateRamView();
 }
 
 /* Since slots is a flat view without overlaps,
@@ -293,3 +358,138 @@ void MemoryManager::UnregisterMemoryListener(const MemoryListener** plistener) {
     *plistener = nullptr;
   }
 }
+
+/* Offset of a host range in the memfd of shared guest RAM, fails if the range is
+ * not shared, e.g. the BIOS
+ */
+bool MemoryManager::GetRamFileOffset(uint64_t hva, uint64_t size, uint64_t* offset) {
+  uint64_t base = (uint64_t)ram_host_;
+  if (ram_fd_ < 0 || hva < base || hva + size > base + machine_->ram_size_) {
+    return false;
+  }
+  *offset = hva - base;
+  return true;
+}
+
+std::vector<MemoryExtent> MemoryManager::GetRamFlatView() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<MemoryExtent> extents;
+  for (auto &it : ram_view_) {
+    extents.push_back(it.second);
+  }
+  return extents;
+}
+
+const RamViewListener* MemoryManager::RegisterRamViewListener(RamViewListenerCallback callback) {
+  auto listener = new RamViewListener {
+    .callback = callback
+  };
+  ram_view_listeners_.insert(listener);
+  return listener;
+}
+
+void MemoryManager::UnregisterRamViewListener(const RamViewListener** plistener) {
+  if (ram_view_listeners_.erase(*plistener)) {
+    delete *plistener;
+    *plistener = nullptr;
+  }
+}
+
+void MemoryManager::BeginUpdate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++update_depth_;
+}
+
+void MemoryManager::EndUpdate() {
+  mutex_.lock();
+  MV_ASSERT(update_depth_ > 0);
+  --update_depth_;
+  mutex_.unlock();
+  UpdateRamView();
+}
+
+/* Append the ranges of the view from which are not mapped to the same host address
+ * in the view to. Adjacent ranges are merged if the host memory is contiguous.
+ */
+static void DiffRamView(const std::map<uint64_t, MemoryExtent>& from,
+  const std::map<uint64_t, MemoryExtent>& to, std::vector<MemoryExtent>& changes) {
+  auto add_change = [&changes](uint64_t begin, uint64_t end, uint64_t hva) {
+    if (!changes.empty()) {
+      auto &last = changes.back();
+      if (last.end == begin && last.hva + (last.end - last.begin) == hva) {
+        last.end = end;
+        return;
+      }
+    }
+    changes.push_back(MemoryExtent { .begin = begin, .end = end, .hva = hva });
+  };
+
+  for (auto &item : from) {
+    auto &extent = item.second;
+    uint64_t position = extent.begin;
+    /* The first extent of the view to which ends after the position */
+    auto it = to.upper_bound(position);
+    if (it != to.begin() && std::prev(it)->second.end > position) {
+      --it;
+    }
+    while (position < extent.end) {
+      if (it == to.end() || it->second.begin >= extent.end) {
+        add_change(position, extent.end, extent.hva + (position - extent.begin));
+        break;
+      }
+      auto &other = it->second;
+      if (other.begin > position) {
+        add_change(position, other.begin, extent.hva + (position - extent.begin));
+        position = other.begin;
+      }
+      uint64_t end = std::min(extent.end, other.end);
+      uint64_t hva = extent.hva + (position - extent.begin);
+      if (other.hva + (position - other.begin) != hva) {
+        add_change(position, end, hva);
+      }
+      position = end;
+      ++it;
+    }
+  }
+}
+
+/* Rebuild the RAM view from the slots and publish the ranges changed. Splitting an
+ * extent only reports the part which is unmapped or remapped, and moving a device
+ * region in the MMIO hole does not change the RAM view at all.
+ */
+void MemoryManager::UpdateRamView() {
+  std::vector<MemoryExtent> removed, added;
+
+  mutex_.lock();
+  if (update_depth_ > 0) {
+    mutex_.unlock();
+    return;
+  }
+
+  std::map<uint64_t, MemoryExtent> view;
+  MemoryExtent* last = nullptr;
+  for (auto &it : kvm_slots_) {
+    auto slot = it.second;
+    if (slot->type != kMemoryTypeRam) {
+      continue;
+    }
+    if (last && last->end == slot->begin && last->hva + (last->end - last->begin) == slot->hva) {
+      last->end = slot->end;
+      continue;
+    }
+    last = &view[slot->begin];
+    *last = MemoryExtent { .begin = slot->begin, .end = slot->end, .hva = slot->hva };
+  }
+
+  DiffRamView(ram_view_, view, removed);
+  DiffRamView(view, ram_view_, added);
+  ram_view_.swap(view);
+  mutex_.unlock();
+
+  if (removed.empty() && added.empty()) {
+    return;
+  }
+  for (auto listener : ram_view_listeners_) {
+    listener->callback(removed, added);
+  }
+}
@@ -21,6 +21,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include "logger.h"
 #include "machine.h"
 
@@ -32,6 +33,10 @@ PciDevice::PciDevice() {
   bzero(&pci_bars_, sizeof(pci_bars_));
   bzero(&pci_rom_, sizeof(pci_rom_));
   bzero(&msi_config_, sizeof(msi_config_));
+  for (auto &route : msi_routes_) {
+    route.gsi = route.trigger_fd = -1;
+  }
+  intx_route_ = { .gsi = -1, .trigger_fd = -1, .resample_fd = -1, .level = 0 };
 
   next_capability_offset_ = 0x40;
 }
@@ -48,6 +53,7 @@ void PciDevice::Disconnect() {
       DeactivatePciBar(i);
     }
   }
+  ReleaseIrqfds();
   Device::Disconnect();
 }
 
@@ -111,21 +117,111 @@ void PciDevice::AddMsiXCapability(uint8_t bar, uint16_t table_size, uint64_t spa
     (uint8_t*)&cap.control, msi_config_.length - 2);
 }
 
+/* The GSI route of a vector is registered on first use, and updated only if the
+ * guest has changed the message, then injecting an MSI is an eventfd write
+ */
 void PciDevice::SignalMsi(int vector) {
+  uint64_t address;
+  uint32_t data;
   if (msi_config_.is_msix) {
     MV_ASSERT(vector < msi_config_.msix_table_size);
     auto &msix = msi_config_.msix_table[vector];
     if (msix.control & 1) {
       return; /* Masked */
     }
-    uint64_t address = ((uint64_t)msix.message.address_hi << 32) | msix.message.address_lo;
-    manager_->SignalMsi(address, msix.message.data);
+    address = ((uint64_t)msix.message.address_hi << 32) | msix.message.address_lo;
+    data = msix.message.data;
   } else if (msi_config_.is_64bit) {
     MV_ASSERT(vector == 0);
-    uint64_t address = ((uint64_t)msi_config_.msi64->address1 << 32) | msi_config_.msi64->address0;
-    manager_->SignalMsi(address, msi_config_.msi64->data);
+    address = ((uint64_t)msi_config_.msi64->address1 << 32) | msi_config_.msi64->address0;
+    data = msi_config_.msi64->data;
   } else {
     MV_PANIC("not implemented 32bit msi");
+    return;
+  }
+
+  auto &route = msi_routes_[vector];
+  if (route.gsi < 0 || route.address != address || route.data != data) {
+    std::lock_guard<std::mutex> lock(irqfd_mutex_);
+    if (route.gsi < 0) {
+      route.trigger_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      MV_ASSERT(route.trigger_fd >= 0);
+      route.gsi = manager_->AddMsiRoute(address, data, route.trigger_fd);
+    } else if (route.address != address || route.data != data) {
+      manager_->UpdateMsiRoute(route.gsi, address, data);
+    }
+    route.address = address;
+    route.data = data;
+  }
+
+  uint64_t value = 1;
+  if (write(route.trigger_fd, &value, sizeof(value)) != sizeof(value)) {
+    MV_PANIC("failed to signal msi vector=%d", vector);
+  }
+}
+
+/* Legacy INTx of the device. With the in-kernel irqchip, the line is asserted by
+ * an irqfd and reasserted after the guest EOI if the device still holds it.
+ * The userspace IOAPIC of split irqchip is signaled directly.
+ */
+void PciDevice::SetPciIrqLevel(int level) {
+  auto irq = pci_header_.irq_line;
+  if (!irq) {
+    return;
+  }
+  if (manager_->machine()->split_irqchip()) {
+    manager_->SetIrq(irq, level);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(irqfd_mutex_);
+  if (intx_route_.gsi != irq) {
+    if (intx_route_.gsi >= 0) {
+      manager_->DeassignIrqfd(intx_route_.gsi, intx_route_.trigger_fd);
+    } else {
+      intx_route_.trigger_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      intx_route_.resample_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      MV_ASSERT(intx_route_.trigger_fd >= 0 && intx_route_.resample_fd >= 0);
+      /* The route is changed by the vCPU threads, read it with the same lock */
+      manager_->io()->StartPolling(intx_route_.resample_fd, EPOLLIN, [this](auto events) {
+        std::lock_guard<std::mutex> lock(irqfd_mutex_);
+        if (intx_route_.resample_fd < 0) {
+          return;
+        }
+        uint64_t value;
+        read(intx_route_.resample_fd, &value, sizeof(value));
+        if (intx_route_.level) {
+          value = 1;
+          write(intx_route_.trigger_fd, &value, sizeof(value));
+        }
+      });
+    }
+    intx_route_.gsi = irq;
+    manager_->AssignIrqfd(intx_route_.gsi, intx_route_.trigger_fd, intx_route_.resample_fd);
+  }
+
+  if (level && !intx_route_.level) {
+    uint64_t value = 1;
+    write(intx_route_.trigger_fd, &value, sizeof(value));
+  }
+  intx_route_.level = level;
+}
+
+void PciDevice::ReleaseIrqfds() {
+  std::lock_guard<std::mutex> lock(irqfd_mutex_);
+  for (auto &route : msi_routes_) {
+    if (route.gsi >= 0) {
+      manager_->UpdateMsiRoute(route.gsi, 0, 0, route.trigger_fd);
+      safe_close(&route.trigger_fd);
+      route.gsi = -1;
+    }
+  }
+  if (intx_route_.gsi >= 0) {
+    manager_->DeassignIrqfd(intx_route_.gsi, intx_route_.trigger_fd);
+    manager_->io()->StopPolling(intx_route_.resample_fd);
+    safe_close(&intx_route_.trigger_fd);
+    safe_close(&intx_route_.resample_fd);
+    intx_route_.gsi = -1;
   }
 }
 
@@ -210,11 +306,15 @@ void PciDevice::UpdateRomMapAddress(uint32_t address) {
       /* unchanged */
       return;
     }
+    mm->BeginUpdate();
     mm->Unmap(&pci_rom_.mapped_region);
+  } else {
+    mm->BeginUpdate();
   }
 
   pci_rom_.mapped_region = mm->Map(address, pci_rom_.size, pci_rom_.data,
     kMemoryTypeRam, "PCI ROM");
+  mm->EndUpdate();
 }
 
 /* Handle IO, MMIO ON or OFF */
@@ -222,6 +322,9 @@ void PciDevice::WritePciCommand(uint16_t new_command) {
   int toggle_io = (pci_header_.command ^ new_command) & PCI_COMMAND_IO;
   int toggle_mem = (pci_header_.command ^ new_command) & PCI_COMMAND_MEMORY;
 
+  /* Publish the memory changes of all BARs at once */
+  auto mm = manager_->machine()->memory_manager();
+  mm->BeginUpdate();
   for (int i = 0; i < PCI_BAR_NUMS; i++) {
     if (!pci_header_.bars[i])
       continue;
@@ -241,6 +344,7 @@ void PciDevice::WritePciCommand(uint16_t new_command) {
         DeactivatePciBar(i);
     }
   }
+  mm->EndUpdate();
   pci_header_.command = new_command;
 }
 
@@ -349,9 +453,14 @@ void PciDevice::WritePciBar(uint8_t index, uint32_t value) {
     return;
   }
 
+  /* Moving a BAR is published as one memory update */
+  auto mm = manager_->machine()->memory_manager();
+  mm->BeginUpdate();
   if (bar.active) {
-    if (!DeactivatePciBar(index))
+    if (!DeactivatePciBar(index)) {
+      mm->EndUpdate();
       return;
+    }
   }
 
   bar.address = new_address;
@@ -360,4 +469,5 @@ void PciDevice::WritePciBar(uint8_t index, uint32_t value) {
   if (bar.address && !bar.active) {
     ActivatePciBar(index);
   }
+  mm->EndUpdate();
 }
@@ -22,10 +22,16 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <cstring>
+#include <vector>
+#include <linux/kvm_para.h>
+#include "linuz/hyperv.h"
 #include "machine.h"
 #include "logger.h"
 
-#define MAX_KVM_CPUID_ENTRIES 100
+#define MAX_KVM_CPUID_ENTRIES     100
+#define MAX_HYPERV_CPUID_ENTRIES  8
+/* KVM_GET_SUPPORTED_HV_CPUID fails with E2BIG if less than what KVM reports */
+#define MAX_KVM_HV_CPUID_ENTRIES  32
 
 /* Use Vcpu::current_vcpu() */
 __thread Vcpu* Vcpu::current_vcpu_ = nullptr;
@@ -34,7 +40,9 @@ __thread Vcpu* Vcpu::current_vcpu_ = nullptr;
 Vcpu::Vcpu(Machine* machine, int vcpu_id)
     : machine_(machine), vcpu_id_(vcpu_id) {
 
-  fd_ = ioctl(machine_->vm_fd_, KVM_CREATE_VCPU, vcpu_id_);
+  /* KVM uses the vCPU ID as its initial APIC ID */
+  apic_id_ = machine_->GetApicId(vcpu_id_);
+  fd_ = ioctl(machine_->vm_fd_, KVM_CREATE_VCPU, apic_id_);
   MV_ASSERT(fd_ > 0);
 
   /* A one page size memory region stored some information of current vcpu */
@@ -53,12 +61,15 @@ Vcpu::Vcpu(Machine* machine, int vcpu_id)
   ioctl(fd_, KVM_GET_SREGS, &default_registers_.sregs);
   
   SetupCpuid();
+  SetupHaltStats();
 }
 
 Vcpu::~Vcpu() {
   if (thread_.joinable()) {
     thread_.join();
   }
+  if (stats_fd_ > 0)
+    close(stats_fd_);
   if (fd_ > 0)
     close(fd_);
   if (kvm_run_)
@@ -68,6 +79,7 @@ Vcpu::~Vcpu() {
 /* Starting a vcpu is as simple as starting a thread on the host */
 void Vcpu::Start() {
   thread_ = std::thread(&Vcpu::Process, this);
+  machine_->PlaceThread(thread_, machine_->GetVcpuPlacement(vcpu_id_));
 }
 
 
@@ -76,62 +88,125 @@ void Vcpu::Reset() {
     MV_PANIC("KVM_SET_REGS failed");
   if (ioctl(fd_, KVM_SET_SREGS, &default_registers_.sregs) < 0)
     MV_PANIC("KVM_SET_SREGS failed");
+  ResetParavirtMsrs();
 }
 
 /* 
  * Intel CPUID Instruction Reference
  * https://www.intel.com/content/dam/develop/external/us/en/documents/ \
  * architecture-instruction-set-extensions-programming-reference.pdf
- * TODO: Hyper-V
  */
 void Vcpu::SetupCpuid() {
   static const char cpu_model[48] = "Intel Xeon Processor (Cascadelake)";
-  struct kvm_cpuid2 *cpuid = (struct kvm_cpuid2*)malloc(
-    sizeof(*cpuid) + MAX_KVM_CPUID_ENTRIES * sizeof(cpuid->entries[0]));
+  struct kvm_cpuid2 *cpuid = (struct kvm_cpuid2*)malloc(sizeof(*cpuid) +
+    (MAX_KVM_CPUID_ENTRIES + MAX_HYPERV_CPUID_ENTRIES) * sizeof(cpuid->entries[0]));
   
   cpuid->nent = MAX_KVM_CPUID_ENTRIES;
   if (ioctl(machine_->kvm_fd_, KVM_GET_SUPPORTED_CPUID, cpuid) < 0)
     MV_PANIC("KVM_GET_SUPPORTED_CPUID failed");
+
+  /* Hyper-V owns the leaves at 0x40000000 if enabled, KVM leaves are moved to 0x40000100 */
+  uint32_t paravirt = machine_->paravirt_features_;
+  uint32_t kvm_cpuid_base = (paravirt & PARAVIRT_HYPERV_MASK) ? 0x100 : 0;
+
+  /* Topology is reflected consistently in leaf 0x1, 0x4, 0xB and 0x1F */
+  auto &topology = machine_->topology_;
+  int core_shift, package_shift;
+  machine_->GetApicIdShifts(&core_shift, &package_shift);
   
+  uint32_t nent = 0;
   for (uint32_t i = 0; i < cpuid->nent; i++) {
     auto entry = &cpuid->entries[i];
     switch (entry->function)
     {
-    case 0x1: // ACPI ID & Features
-      entry->ecx &= ~(1 << 31); // disable hypervisor mode now
-      entry->ebx = (vcpu_id_ << 24) | (machine_->num_vcpus_ << 16) | (entry->ebx & 0xFFFF);
+    case 0x1: { // ACPI ID & Features
+      if (!paravirt) {
+        entry->ecx &= ~(1 << 31); // no hypervisor leaves to publish
+      }
+      uint32_t logical_count = topology.cores * topology.threads;
+      entry->ebx = (apic_id_ << 24) | (logical_count << 16) | (entry->ebx & 0xFFFF);
+      if (logical_count > 1) {
+        entry->edx |= (1 << 28); // HTT
+      } else {
+        entry->edx &= ~(1 << 28);
+      }
+      /* xAPIC logical flat mode addresses at most 8 CPUs, and x2APIC is required
+       * for APIC IDs above 255. KVM emulates x2APIC with MSR accesses.
+       */
+      if (machine_->num_vcpus_ > 8) {
+        entry->ecx |= (1 << 21); // x2APIC
+      }
       machine_->cpuid_version_ = entry->eax;
       machine_->cpuid_features_ = entry->edx;
       break;
+    }
+    case 0x4: { // Deterministic Cache Parameters
+      uint32_t cache_level = (entry->eax >> 5) & 7;
+      if (cache_level == 0) {
+        break;
+      }
+      /* L1 and L2 are shared by threads of a core, L3 is shared by the package */
+      uint32_t sharing = cache_level < 3 ? (1 << core_shift) : (1 << package_shift);
+      entry->eax &= 0x3FFF;
+      entry->eax |= (((1 << (package_shift - core_shift)) - 1) << 26) | ((sharing - 1) << 14);
+      break;
+    }
     case 0x6: // Thermal and Power Management Leaf
       entry->ecx = entry->ecx & ~(1 << 3); // disable peformance energy bias
       break;
-    case 0xB: // CPU topology (cores = num_vcpus / 2, threads per core = 2)
-      if (machine_->num_vcpus_ % 2 == 0) {
-        switch (entry->index)
-        {
-        case 0:
-          entry->ebx = machine_->num_vcpus_;
-          break;
-        default:
-          entry->ebx = 0;
-          break;
-        }
-      } else {
-        switch (entry->index)
-        {
-        case 0:
-          entry->ebx = 2;
-          break;
-        case 1:
-          entry->ebx = machine_->num_vcpus_ / 2;
-        default:
-          entry->ebx = 0;
-          break;
-        }
+    case 0xB: // Extended Topology Enumeration
+    case 0x1F: // V2 Extended Topology Enumeration
+      switch (entry->index)
+      {
+      case 0: // SMT level
+        entry->eax = core_shift;
+        entry->ebx = topology.threads;
+        entry->ecx = (1 << 8) | entry->index;
+        break;
+      case 1: // Core level
+        entry->eax = package_shift;
+        entry->ebx = topology.cores * topology.threads;
+        entry->ecx = (2 << 8) | entry->index;
+        break;
+      default: // Invalid level
+        entry->eax = 0;
+        entry->ebx = 0;
+        entry->ecx = entry->index;
+        break;
       }
-      entry->edx = vcpu_id_;
+      entry->edx = apic_id_;
       break;
+    case KVM_CPUID_SIGNATURE: // "KVMKVMKVM"
+      if (!(paravirt & PARAVIRT_KVM_MASK)) {
+        continue;
+      }
+      entry->function += kvm_cpuid_base;
+      entry->eax = KVM_CPUID_FEATURES + kvm_cpuid_base;
+      break;
+    case KVM_CPUID_FEATURES: { // KVM para-virtualization features
+      if (!(paravirt & PARAVIRT_KVM_MASK)) {
+        continue;
+      }
+      uint32_t features = (1 << KVM_FEATURE_NOP_IO_DELAY);
+      if (paravirt & kParavirtKvmClock) {
+        features |= (1 << KVM_FEATURE_CLOCKSOURCE) | (1 << KVM_FEATURE_CLOCKSOURCE2) |
+          (1 << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT);
+      }
+      if (paravirt & kParavirtPvEoi) {
+        features |= (1 << KVM_FEATURE_PV_EOI);
+      }
+      if (paravirt & kParavirtPvTlbFlush) {
+        /* Linux guests only flush remote TLBs lazily if steal time is present */
+        features |= (1 << KVM_FEATURE_PV_TLB_FLUSH) | (1 << KVM_FEATURE_STEAL_TIME);
+      }
+      if (paravirt & kParavirtPvSpinlock) {
+        features |= (1 << KVM_FEATURE_PV_UNHALT);
+      }
+      entry->function += kvm_cpuid_base;
+      entry->eax &= features;
+      entry->edx = 0; // no KVM_HINTS_REALTIME
+      break;
+    }
     case 0x80000002 ... 0x80000004: { // Setup CPU model string
       uint32_t offset = (entry->function - 0x80000002) * 16;
       memcpy(&entry->eax, cpu_model + offset, 16);
@@ -140,6 +215,12 @@ void Vcpu::SetupCpuid() {
     default:
       break;
     }
+    cpuid->entries[nent++] = *entry;
+  }
+  cpuid->nent = nent;
+
+  if (paravirt & PARAVIRT_HYPERV_MASK) {
+    SetupHyperV(cpuid);
   }
 
   if (ioctl(fd_, KVM_SET_CPUID2, cpuid) < 0)
@@ -148,6 +229,147 @@ void Vcpu::SetupCpuid() {
   free(cpuid);
 }
 
+/* 
+ * Hyper-V Top Level Functional Specification
+ * https://docs.microsoft.com/en-us/virtualization/hyper-v-on-windows/reference/tlfs
+ * The MSRs and shared pages (hypercall page, reference TSC page, SynIC pages) are
+ * emulated by KVM once the leaves are published, the guest chooses their addresses.
+ */
+void Vcpu::SetupHyperV(struct kvm_cpuid2* cpuid) {
+  uint32_t paravirt = machine_->paravirt_features_;
+  auto add_entry = [cpuid](uint32_t function, uint32_t eax, uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    auto entry = &cpuid->entries[cpuid->nent++];
+    bzero(entry, sizeof(*entry));
+    entry->function = function;
+    entry->eax = eax;
+    entry->ebx = ebx;
+    entry->ecx = ecx;
+    entry->edx = edx;
+  };
+
+  /* Leaf values follow docs/qemu_cpuid_hv, QEMU with hv-relaxed, hv-vapic and hv-time */
+  uint32_t features = HV_MSR_HYPERCALL_AVAILABLE;
+  uint32_t features_edx = HV_X64_CPU_DYNAMIC_PARTITIONING_AVAILABLE;
+  uint32_t recommendations = 0;
+  if (paravirt & kParavirtHvRelaxed) {
+    recommendations |= HV_X64_RELAXED_TIMING_RECOMMENDED;
+  }
+  if (paravirt & kParavirtHvVapic) {
+    features |= HV_MSR_APIC_ACCESS_AVAILABLE;
+    recommendations |= HV_X64_APIC_ACCESS_RECOMMENDED;
+  }
+  if (paravirt & kParavirtHvTime) {
+    features |= HV_MSR_TIME_REF_COUNT_AVAILABLE | HV_MSR_REFERENCE_TSC_AVAILABLE;
+  }
+  if (paravirt & kParavirtHvSynic) {
+    /* SynIC messages are targeted by VP index */
+    features |= HV_MSR_SYNIC_AVAILABLE | HV_MSR_VP_INDEX_AVAILABLE;
+    struct kvm_enable_cap cap = { .cap = KVM_CAP_HYPERV_SYNIC2 };
+    if (ioctl(fd_, KVM_ENABLE_CAP, &cap) < 0)
+      MV_PANIC("failed to enable SynIC");
+  }
+  if (paravirt & kParavirtHvStimer) {
+    features |= HV_MSR_SYNTIMER_AVAILABLE;
+    if (GetSupportedHyperVFeaturesEdx() & HV_STIMER_DIRECT_MODE_AVAILABLE) {
+      features_edx |= HV_STIMER_DIRECT_MODE_AVAILABLE;
+    }
+  }
+
+  /* "Microsoft Hv" */
+  add_entry(HYPERV_CPUID_VENDOR_AND_MAX_FUNCTIONS, HYPERV_CPUID_IMPLEMENT_LIMITS,
+    0x7263694D, 0x666F736F, 0x76482074);
+  add_entry(HYPERV_CPUID_INTERFACE, HYPERV_CPUID_SIGNATURE_EAX, 0, 0, 0);
+  /* Same version as QEMU, Windows Server 2008 R2 build 7100 */
+  add_entry(HYPERV_CPUID_VERSION, 0x00001BBC, 0x00060001, 0, 0);
+  add_entry(HYPERV_CPUID_FEATURES, features, 0, 0, features_edx);
+  /* Notify the hypervisor after 8191 spinlock retries, the QEMU default */
+  add_entry(HYPERV_CPUID_ENLIGHTMENT_INFO, recommendations, 0x1FFF, 0, 0);
+  /* No limit of virtual processors, 64 logical processors */
+  add_entry(HYPERV_CPUID_IMPLEMENT_LIMITS, 0xFFFFFFFF, 0x40, 0, 0);
+}
+
+/* Hyper-V features of leaf 0x40000003 EDX which the host KVM implements, e.g.
+ * direct mode synthetic timers since Linux 5.0
+ */
+uint32_t Vcpu::GetSupportedHyperVFeaturesEdx() {
+  if (ioctl(machine_->kvm_fd_, KVM_CHECK_EXTENSION, KVM_CAP_HYPERV_CPUID) <= 0) {
+    return 0;
+  }
+
+  auto cpuid = (struct kvm_cpuid2*)malloc(sizeof(struct kvm_cpuid2) +
+    MAX_KVM_HV_CPUID_ENTRIES * sizeof(struct kvm_cpuid_entry2));
+  cpuid->nent = MAX_KVM_HV_CPUID_ENTRIES;
+  uint32_t edx = 0;
+  if (ioctl(fd_, KVM_GET_SUPPORTED_HV_CPUID, cpuid) == 0) {
+    for (uint32_t i = 0; i < cpuid->nent; i++) {
+      if (cpuid->entries[i].function == HYPERV_CPUID_FEATURES) {
+        edx = cpuid->entries[i].edx;
+      }
+    }
+  }
+  free(cpuid);
+  return edx;
+}
+
+/* Guest enabled MSRs must be cleared on system reset, so shared pages are not
+ * updated by KVM after the guest memory is reused by the next boot
+ */
+void Vcpu::ResetParavirtMsrs() {
+  uint32_t paravirt = machine_->paravirt_features_;
+  std::vector<kvm_msr_entry> entries;
+  auto add_msr = [&entries](uint32_t index, uint64_t data) {
+    entries.emplace_back(kvm_msr_entry { .index = index, .data = data });
+  };
+
+  if (paravirt & kParavirtKvmClock) {
+    add_msr(MSR_KVM_SYSTEM_TIME_NEW, 0);
+    add_msr(MSR_KVM_WALL_CLOCK_NEW, 0);
+  }
+  if (paravirt & kParavirtPvEoi) {
+    add_msr(MSR_KVM_PV_EOI_EN, 0);
+  }
+  if (paravirt & kParavirtPvTlbFlush) {
+    add_msr(MSR_KVM_STEAL_TIME, 0);
+  }
+  if (paravirt & PARAVIRT_HYPERV_MASK) {
+    add_msr(HV_X64_MSR_GUEST_OS_ID, 0);
+    add_msr(HV_X64_MSR_HYPERCALL, 0);
+  }
+  if (paravirt & kParavirtHvVapic) {
+    add_msr(HV_X64_MSR_VP_ASSIST_PAGE, 0);
+  }
+  if (paravirt & kParavirtHvTime) {
+    add_msr(HV_X64_MSR_REFERENCE_TSC, 0);
+  }
+  if (paravirt & kParavirtHvSynic) {
+    add_msr(HV_X64_MSR_SCONTROL, 0);
+    add_msr(HV_X64_MSR_SIEFP, 0);
+    add_msr(HV_X64_MSR_SIMP, 0);
+    for (uint32_t index = HV_X64_MSR_SINT0; index <= HV_X64_MSR_SINT15; index++) {
+      add_msr(index, HV_SYNIC_SINT_MASKED);
+    }
+  }
+  if (paravirt & kParavirtHvStimer) {
+    for (uint32_t index = HV_X64_MSR_STIMER0_CONFIG; index <= HV_X64_MSR_STIMER3_COUNT; index++) {
+      add_msr(index, 0);
+    }
+  }
+
+  if (entries.empty()) {
+    return;
+  }
+  uint8_t buffer[sizeof(kvm_msrs) + sizeof(kvm_msr_entry) * entries.size()];
+  auto msrs = (kvm_msrs*)buffer;
+  msrs->nmsrs = entries.size();
+  msrs->pad = 0;
+  std::copy(entries.begin(), entries.end(), msrs->entries);
+  
+  int ret = ioctl(fd_, KVM_SET_MSRS, msrs);
+  if (ret != (int)entries.size()) {
+    MV_PANIC("KVM_SET_MSRS failed ret=%d expected=%lu", ret, entries.size());
+  }
+}
+
 /* Used for debugging sometimes */
 void Vcpu::EnableSingleStep() {
   struct kvm_guest_debug debug = {
@@ -183,6 +405,84 @@ void Vcpu::ProcessIo() {
   machine_->device_manager()->HandleIo(io->port, data, io->size, io->direction, io->count);
 }
 
+/* The binary stats fd lists descriptors by name, find the data offsets of the
+ * halt counters once, then they could be read with pread() without parsing
+ */
+void Vcpu::SetupHaltStats() {
+  if (ioctl(machine_->kvm_fd_, KVM_CHECK_EXTENSION, KVM_CAP_BINARY_STATS_FD) <= 0) {
+    return;
+  }
+  stats_fd_ = ioctl(fd_, KVM_GET_STATS_FD, 0);
+  if (stats_fd_ < 0) {
+    return;
+  }
+
+  struct kvm_stats_header header;
+  MV_ASSERT(pread(stats_fd_, &header, sizeof(header), 0) == sizeof(header));
+
+  /* The order must match VcpuHaltStats */
+  static const char* names[] = {
+    "halt_successful_poll", "halt_wakeup", "halt_poll_success_ns",
+    "halt_poll_fail_ns", "halt_wait_ns"
+  };
+  halt_stats_offsets_.assign(sizeof(names) / sizeof(names[0]), -1);
+
+  size_t desc_size = sizeof(struct kvm_stats_desc) + header.name_size;
+  std::vector<uint8_t> descriptors(desc_size * header.num_desc);
+  MV_ASSERT(pread(stats_fd_, descriptors.data(), descriptors.size(), header.desc_offset) ==
+    (ssize_t)descriptors.size());
+  for (uint32_t i = 0; i < header.num_desc; i++) {
+    auto desc = (struct kvm_stats_desc*)&descriptors[i * desc_size];
+    for (size_t j = 0; j < halt_stats_offsets_.size(); j++) {
+      if (strcmp(desc->name, names[j]) == 0 && desc->size == 1) {
+        halt_stats_offsets_[j] = header.data_offset + desc->offset;
+      }
+    }
+  }
+
+  for (auto offset : halt_stats_offsets_) {
+    if (offset < 0) {
+      close(stats_fd_);
+      stats_fd_ = -1;
+      break;
+    }
+  }
+}
+
+bool Vcpu::GetHaltStats(VcpuHaltStats* stats) {
+  if (stats_fd_ < 0) {
+    return false;
+  }
+  uint64_t* values = (uint64_t*)stats;
+  for (size_t i = 0; i < halt_stats_offsets_.size(); i++) {
+    if (pread(stats_fd_, &values[i], sizeof(uint64_t), halt_stats_offsets_[i]) != sizeof(uint64_t)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* With split irqchip, the userspace PIC output goes to LINT0 of the BSP. The vector
+ * could be injected only if the guest is ready, otherwise ask KVM to exit once the
+ * interrupt window is open.
+ */
+void Vcpu::InjectExternalInterrupt() {
+  auto device_manager = machine_->device_manager();
+  if (!device_manager->HasExternalInterrupt()) {
+    kvm_run_->request_interrupt_window = 0;
+    return;
+  }
+  if (kvm_run_->ready_for_interrupt_injection) {
+    struct kvm_interrupt interrupt = { .irq = (uint32_t)device_manager->AcknowledgeExternalInterrupt() };
+    if (ioctl(fd_, KVM_INTERRUPT, &interrupt) < 0) {
+      MV_PANIC("failed to inject interrupt vector=0x%x", interrupt.irq);
+    }
+    kvm_run_->request_interrupt_window = 0;
+  } else {
+    kvm_run_->request_interrupt_window = 1;
+  }
+}
+
 /* To wake up a vcpu thread, the easist way is to send a signal */
 void Vcpu::SignalHandler(int signum) {
   // Do nothing now ...
@@ -208,6 +508,10 @@ void Vcpu::Process() {
   if (machine_->debug()) MV_LOG("%s started", name_);
 
   for (; machine_->valid_;) {
+    if (vcpu_id_ == 0 && machine_->split_irqchip_) {
+      InjectExternalInterrupt();
+    }
+
     int ret = ioctl(fd_, KVM_RUN, 0);
     if (ret < 0 && errno != EINTR) {
       if (errno == EAGAIN) {
@@ -234,8 +538,16 @@ void Vcpu::Process() {
       MV_LOG("KVM_EXIT_SHUTDOWN vcpu=%d", vcpu_id_);
       goto quit;
     case KVM_EXIT_HLT:
-      MV_LOG("KVM_EXIT_HLT vcpu=%d", vcpu_id_);
-      goto quit;
+      /* With the in-kernel LAPIC, KVM_RUN blocks (and polls) in kernel until
+       * an interrupt arrives, so a halted vCPU only needs to re-enter
+       */
+      break;
+    case KVM_EXIT_IOAPIC_EOI:
+      machine_->device_manager()->EndOfInterrupt(kvm_run_->eoi.vector);
+      break;
+    case KVM_EXIT_IRQ_WINDOW_OPEN:
+      /* The pending PIC interrupt is injected before next KVM_RUN */
+      break;
     case KVM_EXIT_DEBUG:
       PrintRegisters();
       getchar();
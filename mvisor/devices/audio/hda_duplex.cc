@@ -28,26 +28,31 @@
 #include "device.h"
 #include "hda_internal.h"
 #include "device_manager.h"
+#include "audio_backend.h"
 #include "logger.h"
 
-#define HDA_TIMER_INTERVAL_MS (10) // 10ms
+#define HDA_PERIOD_MS (10) // 10ms
+#define HDA_PREFILL_PERIODS 2
 #define HDA_STREAM_BUFFER_SIZE 8192
 
 struct HdaStream {
-  uint32_t id;
-  uint32_t channel;
-  uint32_t format;
-  uint32_t gain_left, gain_right;
-  bool mute_left, mute_right;
-  bool output;
-  bool running;
-  size_t position;
-  uint32_t nchannels;
-  uint32_t frequency;
-  size_t bytes_per_second;
-  IoTimer* timer;
+  uint32_t id = 0;
+  uint32_t channel = 0;
+  uint32_t format = 0;
+  uint32_t gain_left = 0, gain_right = 0;
+  bool mute_left = false, mute_right = false;
+  bool output = false;
+  bool running = false;
+  size_t position = 0;
+  uint32_t nchannels = 0;
+  uint32_t frequency = 0;
+  size_t bytes_per_second = 0;
+  IoTimer* timer = nullptr;
   IoTimePoint start_time;
   TransferCallback transfer_callback;
+  AudioResampler resampler;
+  std::vector<int16_t> resample_buffer;
+  size_t capture_filled = 0;
   uint8_t buffer[HDA_STREAM_BUFFER_SIZE];
 };
 
@@ -68,20 +73,36 @@ class HdaDuplex : public Device, public HdaCodecInterface {
   uint32_t pcm_formats_;
   std::vector<HdaNode> nodes_;
   std::array<HdaStream, 2> streams_;
-  FILE* fp_output_ = nullptr;
+  AudioBackend* backend_ = nullptr;
+  uint32_t period_ms_ = HDA_PERIOD_MS;
 
  public:
   void Connect() {
     Device::Connect();
-    if (debug_) {
-      fp_output_ = fopen("/tmp/sound.dat", "wb");
-      MV_ASSERT(fp_output_);
+
+    if (has_key("period_ms")) {
+      period_ms_ = std::get<uint64_t>(key_values_["period_ms"]);
+      MV_ASSERT(period_ms_ > 0);
+    }
+    /* Playback is sent to the backend sink, or dropped if not configured */
+    if (has_key("backend")) {
+      std::string backend = std::get<std::string>(key_values_["backend"]);
+      std::string path = has_key("path") ? std::get<std::string>(key_values_["path"]) : "";
+      AudioFormat format = { .frequency = 48000, .nchannels = 2 };
+      if (has_key("rate")) {
+        format.frequency = std::get<uint64_t>(key_values_["rate"]);
+      }
+      backend_ = AudioBackend::Create(this, backend, path, format, period_ms_);
     }
   }
 
   virtual void Disconnect() {
-    if (fp_output_) {
-      fclose(fp_output_);
+    for (auto& stream : streams_) {
+      SetStreamRunning(&stream, false);
+    }
+    if (backend_) {
+      delete backend_;
+      backend_ = nullptr;
     }
     Device::Disconnect();
   }
@@ -91,10 +112,15 @@ class HdaDuplex : public Device, public HdaCodecInterface {
   }
 
   void InitializeCodec() {
-    bzero(streams_.data(), streams_.size() * sizeof(HdaStream));
+    for (auto& stream : streams_) {
+      SetStreamRunning(&stream, false);
+      stream.transfer_callback = nullptr;
+      stream.id = stream.channel = stream.format = 0;
+      stream.mute_left = stream.mute_right = false;
+    }
     nodes_.clear();
     subsystem_id_ = (0x1AF4 << 16) | 0x21;  // duplex, no mixer
-    pcm_formats_ = AC_SUPPCM_BITS_16 | (1 << 6); // 48000 Hz
+    pcm_formats_ = AC_SUPPCM_BITS_16 | (1 << 5) | (1 << 6); // 44100 Hz, 48000 Hz
     
     // root node
     HdaNode root = { .id = AC_NODE_ROOT, .name = "root" };
@@ -130,6 +156,7 @@ class HdaDuplex : public Device, public HdaCodecInterface {
     dac.stream->output = true;
     dac.stream->gain_left = dac.stream->gain_right = 0x4A;
     dac.stream->format = AC_FMT_TYPE_PCM | AC_FMT_BITS_16 | (1 << AC_FMT_CHAN_SHIFT);
+    SetupStream(dac.stream);
     dac.parameters[AC_PAR_AUDIO_WIDGET_CAP] = ((AC_WID_AUD_OUT << AC_WCAP_TYPE_SHIFT) |
       AC_WCAP_FORMAT_OVRD | AC_WCAP_AMP_OVRD | AC_WCAP_STEREO);
     dac.parameters[AC_PAR_PCM] = pcm_formats_;
@@ -156,6 +183,7 @@ class HdaDuplex : public Device, public HdaCodecInterface {
     adc.stream = &streams_[1];
     adc.stream->output = false;
     adc.stream->format = AC_FMT_TYPE_PCM | AC_FMT_BITS_16 | (1 << AC_FMT_CHAN_SHIFT);
+    SetupStream(adc.stream);
     adc.connection.push_back(5);
     adc.parameters[AC_PAR_AUDIO_WIDGET_CAP] = (AC_WID_AUD_IN << AC_WCAP_TYPE_SHIFT) |
       AC_WCAP_CONN_LIST | AC_WCAP_FORMAT_OVRD | AC_WCAP_AMP_OVRD | AC_WCAP_STEREO;
@@ -306,23 +334,79 @@ class HdaDuplex : public Device, public HdaCodecInterface {
     stream->bytes_per_second = 2LL * stream->nchannels * stream->frequency;
   }
 
-  void OnStreamTimer(HdaStream* stream) {
-    size_t transferred = stream->transfer_callback(stream->buffer, HDA_STREAM_BUFFER_SIZE);
-    stream->position += transferred;
-    if (stream->output && fp_output_) {
-      fwrite(stream->buffer, transferred, 1, fp_output_);
+  /* Called by the sink clock after each period, keep a few periods queued in the
+   * ring and the guest DMA runs at the pace of the sink.
+   */
+  void OnStreamPeriod(HdaStream* stream) {
+    if (!stream->running) {
+      return;
     }
 
-    auto written_ms = stream->position * 1000 / stream->bytes_per_second;
-    auto started_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-      std::chrono::steady_clock::now() - stream->start_time).count();
-    int next_interval = written_ms - started_ms;
-    if (next_interval < 0) {
-      next_interval = 1;
+    auto& ring = backend_->ring();
+    size_t frame_size = stream->nchannels * sizeof(int16_t);
+    size_t target_frames = backend_->period_frames() * HDA_PREFILL_PERIODS;
+    size_t max_frames = stream->resampler.MaxOutputFrames(HDA_STREAM_BUFFER_SIZE / frame_size);
+
+    while (ring.readable() < target_frames && ring.writable() >= max_frames) {
+      size_t transferred = stream->transfer_callback(stream->buffer, HDA_STREAM_BUFFER_SIZE);
+      if (transferred == 0) {
+        break;
+      }
+      stream->position += transferred;
+      size_t frames = stream->resampler.Process((int16_t*)stream->buffer, transferred / frame_size,
+        stream->resample_buffer.data());
+      ring.Write(stream->resample_buffer.data(), frames);
     }
+  }
 
-    if (stream->timer->interval_ms != next_interval) {
-      manager_->io()->ModifyTimer(stream->timer, next_interval);
+  /* Move captured frames to the stream buffer and pad the rest with silence. Frames
+   * not taken by the DMA transfer are kept for the next one.
+   */
+  void FillCaptureBuffer(HdaStream* stream) {
+    size_t frame_size = stream->nchannels * sizeof(int16_t);
+    size_t free_frames = (HDA_STREAM_BUFFER_SIZE - stream->capture_filled) / frame_size;
+    if (free_frames > 2) {
+      size_t input_frames = (free_frames - 2) * backend_->format().frequency / stream->frequency;
+      input_frames = std::min(input_frames, stream->resample_buffer.size() / backend_->format().nchannels);
+      input_frames = backend_->capture_ring().Read(stream->resample_buffer.data(), input_frames);
+      size_t frames = stream->resampler.Process(stream->resample_buffer.data(), input_frames,
+        (int16_t*)&stream->buffer[stream->capture_filled]);
+      stream->capture_filled += frames * frame_size;
+    }
+    bzero(&stream->buffer[stream->capture_filled], HDA_STREAM_BUFFER_SIZE - stream->capture_filled);
+  }
+
+  void ConsumeCaptureBuffer(HdaStream* stream, size_t transferred) {
+    if (stream->capture_filled > transferred) {
+      stream->capture_filled -= transferred;
+      memmove(stream->buffer, &stream->buffer[transferred], stream->capture_filled);
+    } else {
+      stream->capture_filled = 0;
+    }
+  }
+
+  /* Without a sink, DMA is paced by a period timer and catches up with the time
+   * elapsed since the stream started. Capture streams are filled from the backend
+   * if it supports capture, otherwise with silence.
+   */
+  void OnStreamTimer(HdaStream* stream) {
+    auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - stream->start_time).count() + period_ms_ * 1000;
+    size_t expected = elapsed_us * stream->bytes_per_second / 1000000;
+    bool capture = !stream->output && backend_ && backend_->capture_supported();
+
+    while (stream->position < expected) {
+      if (capture) {
+        FillCaptureBuffer(stream);
+      }
+      size_t transferred = stream->transfer_callback(stream->buffer, HDA_STREAM_BUFFER_SIZE);
+      if (transferred == 0) {
+        break;
+      }
+      stream->position += transferred;
+      if (capture) {
+        ConsumeCaptureBuffer(stream, transferred);
+      }
     }
   }
 
@@ -338,14 +422,43 @@ class HdaDuplex : public Device, public HdaCodecInterface {
     if (running) {
       stream->position = 0;
       stream->start_time = std::chrono::steady_clock::now();
-      MV_ASSERT(stream->timer == nullptr);
-      stream->timer = manager_->io()->AddTimer(1, true, [this, stream]() {
-        OnStreamTimer(stream);
-      });
+      AudioFormat format = { .frequency = stream->frequency, .nchannels = stream->nchannels };
+      size_t stream_frames = HDA_STREAM_BUFFER_SIZE / (stream->nchannels * sizeof(int16_t));
+      if (stream->output && backend_) {
+        stream->resampler.Initialize(format, backend_->format());
+        size_t max_frames = stream->resampler.MaxOutputFrames(stream_frames);
+        stream->resample_buffer.resize(max_frames * backend_->format().nchannels);
+        backend_->StartPlayback([this, stream]() {
+          OnStreamPeriod(stream);
+        });
+      } else {
+        if (!stream->output) {
+          bzero(stream->buffer, sizeof(stream->buffer));
+          stream->capture_filled = 0;
+          if (backend_ && backend_->capture_supported()) {
+            stream->resampler.Initialize(backend_->format(), format);
+            size_t max_frames = stream_frames * backend_->format().frequency / stream->frequency + 1;
+            stream->resample_buffer.resize(max_frames * backend_->format().nchannels);
+            backend_->StartCapture();
+          }
+        }
+        MV_ASSERT(stream->timer == nullptr);
+        stream->timer = manager_->io()->AddTimer(period_ms_, true, [this, stream]() {
+          OnStreamTimer(stream);
+        });
+      }
     } else {
-      MV_ASSERT(stream->timer);
-      manager_->io()->RemoveTimer(stream->timer);
-      stream->timer = nullptr;
+      if (stream->timer) {
+        manager_->io()->RemoveTimer(stream->timer);
+        stream->timer = nullptr;
+      }
+      if (backend_) {
+        if (stream->output) {
+          backend_->StopPlayback();
+        } else {
+          backend_->StopCapture();
+        }
+      }
     }
   }
 
@@ -19,6 +19,7 @@
 #include "ich9_hda.h"
 #include <cstring>
 #include <vector>
+#include <chrono>
 #include "logger.h"
 #include "pci_device.h"
 #include "device_manager.h"
@@ -29,6 +30,8 @@ class Ich9Hda : public PciDevice {
  private:
   Ich9HdaRegisters regs_;
   uint32_t rirb_counter_;
+  uint32_t* dma_positions_ = nullptr;
+  IoTimePoint wall_clock_start_;
   std::vector<HdaCodecInterface*> codecs_;
 
   struct Ich9HdaStreamState {
@@ -82,6 +85,8 @@ class Ich9Hda : public PciDevice {
     MV_ASSERT(sizeof(regs_) == 0x180);
     rirb_counter_ = 0;
     bzero(&regs_, sizeof(regs_));
+    dma_positions_ = nullptr;
+    wall_clock_start_ = std::chrono::steady_clock::now();
     regs_.global_capabilities = 0x4401; // 4 input, 4 output, 64bit supported
     regs_.major_version = 1;
     regs_.minor_version = 0;
@@ -145,8 +150,9 @@ class Ich9Hda : public PciDevice {
     }
     MV_ASSERT(offset + size <= sizeof(regs_));
 
-    if (offset == offsetof(Ich9HdaRegisters, wall_clock_counter)) {
-      MV_PANIC("not implemented: should update clock");
+    if (offset < offsetof(Ich9HdaRegisters, wall_clock_counter) + sizeof(regs_.wall_clock_counter) &&
+        offset + size > offsetof(Ich9HdaRegisters, wall_clock_counter)) {
+      UpdateWallClock();
     }
     memcpy(data, (uint8_t*)&regs_ + offset, size);
     // MV_LOG("read %s at 0x%lx size=%x ret=0x%x", name_, offset, size, *(uint32_t*)data);
@@ -207,6 +213,12 @@ class Ich9Hda : public PciDevice {
       memcpy((uint8_t*)&regs_ + offset, data, size);
       PopCorbEntries();
       break;
+    case offsetof(Ich9HdaRegisters, dma_position_base0):
+    case offsetof(Ich9HdaRegisters, dma_position_base1):
+      memcpy((uint8_t*)&regs_ + offset, data, size);
+      regs_.dma_position_base0 &= ~0x7EU;
+      UpdateDmaPositionBuffer();
+      break;
     case offsetof(Ich9HdaRegisters, rirb_write_pointer):
       memcpy((uint8_t*)&regs_ + offset, data, size);
       if (regs_.rirb_write_pointer & ICH6_RIRBWP_RST) { // reset bit
@@ -219,6 +231,36 @@ class Ich9Hda : public PciDevice {
     }
   }
 
+  /* The wall clock counter runs at 24 MHz since controller reset */
+  void UpdateWallClock() {
+    auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - wall_clock_start_).count();
+    regs_.wall_clock_counter = (uint64_t)elapsed_ns * 3 / 125;
+  }
+
+  /* The DMA engine writes the link positions of all streams to guest memory, so
+   * the guest driver does not need to read the registers to track the streams.
+   */
+  void UpdateDmaPositionBuffer() {
+    if (regs_.dma_position_base0 & 1) {
+      uint64_t addr = ((uint64_t)regs_.dma_position_base1 << 32) + (regs_.dma_position_base0 & ~0x7FU);
+      dma_positions_ = (uint32_t*)manager_->TranslateGuestMemory(addr);
+      for (int i = 0; i < 8; i++) {
+        WriteDmaPosition(i);
+      }
+    } else {
+      dma_positions_ = nullptr;
+    }
+  }
+
+  void WriteDmaPosition(uint64_t index) {
+    if (dma_positions_) {
+      /* Each stream takes 8 bytes, the upper 4 bytes are reserved */
+      __atomic_store_n(&dma_positions_[index * 2], regs_.streams[index].link_position_in_buffer,
+        __ATOMIC_RELEASE);
+    }
+  }
+
   void ParseBufferDescriptorList(uint64_t index) {
     auto &stream = regs_.streams[index];
     auto &stream_state = stream_states_[index];
@@ -259,6 +301,7 @@ class Ich9Hda : public PciDevice {
       stream.link_position_in_buffer = 0;
       stream_state.buffers_index = 0;
     }
+    WriteDmaPosition(index);
     if (entry.interrupt_on_completion) {
       stream.status |= 1 << 2;
       CheckIrqLevel();
@@ -275,6 +318,8 @@ class Ich9Hda : public PciDevice {
         MV_LOG("streams[%d] reset", index);
       }
       stream.status = 0x20; // FIFO ready
+      stream.link_position_in_buffer = 0;
+      WriteDmaPosition(index);
     }
 
     if ((stream.control & 0x02) != (old_control & 0x02)) {
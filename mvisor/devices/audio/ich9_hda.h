@@ -82,7 +82,11 @@ struct Ich9HdaRegisters {
   uint8_t   rirb_status;
   uint8_t   rirb_size;
   uint8_t   pad5[0x1];
-  uint8_t   pad6[0x20];
+  uint8_t   pad6[0x10];
+  /* 0x70-0x80 dma position buffer */
+  uint32_t  dma_position_base0;       // bit 0 enables the buffer, 128 bytes aligned
+  uint32_t  dma_position_base1;
+  uint8_t   pad7[0x8];
   /* 0x80-0x180 streams */
   Ich9HdaStream streams[8];
 } __attribute__((packed));
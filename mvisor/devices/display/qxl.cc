@@ -286,9 +286,7 @@ class Qxl : public Vga {
 
   void UpdateIrqLevel() {
     int level = !!(qxl_ram_->int_pending & qxl_ram_->int_mask);
-    if (pci_header_.irq_line) {
-      manager_->SetIrq(pci_header_.irq_line, level);
-    }
+    SetPciIrqLevel(level);
   }
 
   void* GetMemSlotAddress(uint64_t data) {
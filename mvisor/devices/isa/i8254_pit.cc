@@ -0,0 +1,337 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "i8254_pit.h"
+#include "logger.h"
+
+#define PIT_BASE_ADDRESS  0x40
+#define PIT_FREQUENCY     1193182
+
+#define RW_STATE_LSB      1
+#define RW_STATE_MSB      2
+#define RW_STATE_WORD0    3
+#define RW_STATE_WORD1    4
+
+/* https://wiki.osdev.org/Programmable_Interval_Timer */
+I8254Pit::I8254Pit() {
+  AddIoResource(kIoResourceTypePio, PIT_BASE_ADDRESS, 4, "PIT");
+}
+
+void I8254Pit::Disconnect() {
+  if (irq_timer_) {
+    manager_->io()->RemoveTimer(irq_timer_);
+    irq_timer_ = nullptr;
+  }
+  Device::Disconnect();
+}
+
+void I8254Pit::Reset() {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  for (int i = 0; i < 3; i++) {
+    auto channel = &channels_[i];
+    *channel = PitChannel();
+    channel->mode = 3;
+    channel->gate = (i != 2);
+    LoadCount(i, 0);
+  }
+}
+
+/* A low gate suspends counting, except in modes 1 and 5 where the gate is a trigger */
+int64_t I8254Pit::GetElapsedTicks(PitChannel* channel) {
+  auto now = std::chrono::steady_clock::now();
+  if (!channel->gate && channel->mode != 1 && channel->mode != 5) {
+    now = channel->gate_low_time;
+  }
+  auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    now - channel->count_load_time).count();
+  return (__int128)elapsed_ns * PIT_FREQUENCY / 1000000000;
+}
+
+uint16_t I8254Pit::GetCount(PitChannel* channel) {
+  int64_t ticks = GetElapsedTicks(channel);
+  switch (channel->mode)
+  {
+  case 0:
+  case 1:
+  case 4:
+  case 5:
+    return (channel->count - ticks) & 0xFFFF;
+  case 3: {
+    /* The count decrements by two and is reloaded at each half period. For odd
+     * counts N, N - 1 is loaded, and OUT is high for (N + 1) / 2 clocks and low
+     * for (N - 1) / 2 clocks.
+     */
+    int64_t period = ticks % channel->count;
+    int64_t high_ticks = (channel->count + 1) >> 1;
+    if (period >= high_ticks) {
+      period -= high_ticks;
+    }
+    return ((channel->count & ~1) - 2 * period) & 0xFFFF;
+  }
+  default:
+    return channel->count - (ticks % channel->count);
+  }
+}
+
+int I8254Pit::GetOutput(PitChannel* channel) {
+  int64_t ticks = GetElapsedTicks(channel);
+  switch (channel->mode)
+  {
+  case 0:
+    return ticks >= channel->count;
+  case 1:
+    return ticks < channel->count;
+  case 2:
+    return !channel->gate || ((ticks % channel->count) == 0 && ticks != 0);
+  case 3:
+    /* A low gate forces OUT high */
+    return !channel->gate || (ticks % channel->count) < ((channel->count + 1) >> 1);
+  default:
+    return ticks == channel->count;
+  }
+}
+
+void I8254Pit::LatchCount(PitChannel* channel) {
+  if (!channel->count_latched) {
+    channel->latched_count = GetCount(channel);
+    channel->count_latched = channel->rw_mode;
+  }
+}
+
+void I8254Pit::LoadCount(int index, uint32_t value) {
+  auto channel = &channels_[index];
+  channel->count = value ? value : 0x10000;
+  channel->count_load_time = std::chrono::steady_clock::now();
+  channel->gate_low_time = channel->count_load_time;
+  if (index == 0) {
+    UpdateIrqTimer();
+  }
+}
+
+/* Channel 0 is connected to IRQ 0. The periodic modes are emulated by an IO thread
+ * timer with millisecond resolution, which is enough before the guest switches to
+ * the LAPIC timer. A timer removed may still fire once, the generation tells.
+ */
+void I8254Pit::UpdateIrqTimer() {
+  if (irq_timer_) {
+    manager_->io()->RemoveTimer(irq_timer_);
+    irq_timer_ = nullptr;
+  }
+  uint generation = ++irq_timer_generation_;
+
+  auto channel = &channels_[0];
+  if (!channel->gate) {
+    return;
+  }
+  int64_t ticks = channel->count;
+  if (channel->mode == 0 || channel->mode == 4) {
+    /* Counting may have been suspended by the gate */
+    ticks -= GetElapsedTicks(channel);
+    if (ticks <= 0) {
+      return;
+    }
+  }
+  int interval_ms = (ticks * 1000 + PIT_FREQUENCY - 1) / PIT_FREQUENCY;
+  switch (channel->mode)
+  {
+  case 0:
+  case 4:
+    irq_timer_ = manager_->io()->AddTimer(interval_ms, false, [this, generation]() {
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      if (generation != irq_timer_generation_) {
+        return;
+      }
+      irq_timer_ = nullptr;
+      manager_->SetIrq(0, 1);
+      manager_->SetIrq(0, 0);
+    });
+    break;
+  case 2:
+  case 3:
+    irq_timer_ = manager_->io()->AddTimer(interval_ms, true, [this, generation]() {
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      if (generation != irq_timer_generation_) {
+        return;
+      }
+      manager_->SetIrq(0, 1);
+      manager_->SetIrq(0, 0);
+    });
+    break;
+  }
+}
+
+void I8254Pit::SetGate(int index, int gate) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto channel = &channels_[index];
+  if (bool(gate) == bool(channel->gate)) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  switch (channel->mode)
+  {
+  case 1:
+  case 2:
+  case 3:
+  case 5:
+    /* Reload the count and restart counting on rising edge */
+    if (gate) {
+      channel->count_load_time = now;
+    }
+    break;
+  default:
+    /* Modes 0 and 4 resume counting from where the gate stopped it */
+    if (gate) {
+      channel->count_load_time += now - channel->gate_low_time;
+    }
+    break;
+  }
+  if (!gate) {
+    channel->gate_low_time = now;
+  }
+  channel->gate = gate;
+  if (index == 0) {
+    UpdateIrqTimer();
+  }
+}
+
+int I8254Pit::GetGate(int index) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  return channels_[index].gate;
+}
+
+int I8254Pit::GetOutput(int index) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  return GetOutput(&channels_[index]);
+}
+
+void I8254Pit::Read(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (offset == 3) {
+    /* Mode/Command register is write only */
+    data[0] = 0;
+    return;
+  }
+
+  auto channel = &channels_[offset];
+  if (channel->status_latched) {
+    channel->status_latched = 0;
+    data[0] = channel->status;
+  } else if (channel->count_latched) {
+    switch (channel->count_latched)
+    {
+    case RW_STATE_LSB:
+      data[0] = channel->latched_count & 0xFF;
+      channel->count_latched = 0;
+      break;
+    case RW_STATE_MSB:
+      data[0] = channel->latched_count >> 8;
+      channel->count_latched = 0;
+      break;
+    default:
+      data[0] = channel->latched_count & 0xFF;
+      channel->count_latched = RW_STATE_MSB;
+      break;
+    }
+  } else {
+    uint16_t count = GetCount(channel);
+    switch (channel->read_state)
+    {
+    case RW_STATE_LSB:
+      data[0] = count & 0xFF;
+      break;
+    case RW_STATE_MSB:
+      data[0] = count >> 8;
+      break;
+    case RW_STATE_WORD0:
+      data[0] = count & 0xFF;
+      channel->read_state = RW_STATE_WORD1;
+      break;
+    default:
+      data[0] = count >> 8;
+      channel->read_state = RW_STATE_WORD0;
+      break;
+    }
+  }
+}
+
+void I8254Pit::Write(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  uint8_t value = data[0];
+  if (offset == 3) {
+    int index = value >> 6;
+    if (index == 3) {
+      /* Read-back command */
+      for (int i = 0; i < 3; i++) {
+        auto channel = &channels_[i];
+        if (!(value & (2 << i))) {
+          continue;
+        }
+        if (!(value & 0x20)) {
+          LatchCount(channel);
+        }
+        if (!(value & 0x10) && !channel->status_latched) {
+          channel->status = (GetOutput(channel) << 7) | (channel->rw_mode << 4) |
+            (channel->mode << 1) | channel->bcd;
+          channel->status_latched = 1;
+        }
+      }
+      return;
+    }
+
+    auto channel = &channels_[index];
+    int access = (value >> 4) & 3;
+    if (access == 0) {
+      LatchCount(channel);
+    } else {
+      channel->rw_mode = access;
+      channel->read_state = access;
+      channel->write_state = access;
+      channel->mode = (value >> 1) & 7;
+      if (channel->mode > 5) {
+        channel->mode -= 4; /* 6 and 7 are aliases of 2 and 3 */
+      }
+      channel->bcd = value & 1;
+      if (channel->bcd) {
+        MV_ERROR("PIT BCD mode is not supported");
+      }
+    }
+    return;
+  }
+
+  auto channel = &channels_[offset];
+  switch (channel->write_state)
+  {
+  case RW_STATE_LSB:
+    LoadCount(offset, value);
+    break;
+  case RW_STATE_MSB:
+    LoadCount(offset, value << 8);
+    break;
+  case RW_STATE_WORD0:
+    channel->write_latch = value;
+    channel->write_state = RW_STATE_WORD1;
+    break;
+  default:
+    LoadCount(offset, channel->write_latch | (value << 8));
+    channel->write_state = RW_STATE_WORD0;
+    break;
+  }
+}
+
+DECLARE_DEVICE(I8254Pit);
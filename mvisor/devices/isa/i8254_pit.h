@@ -0,0 +1,73 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MVISOR_DEVICES_ISA_I8254_PIT_H
+#define _MVISOR_DEVICES_ISA_I8254_PIT_H
+
+#include <mutex>
+#include "device.h"
+#include "device_manager.h"
+
+struct PitChannel {
+  uint32_t    count; /* 0 means 0x10000 */
+  uint16_t    latched_count;
+  uint8_t     count_latched;
+  uint8_t     status_latched;
+  uint8_t     status;
+  uint8_t     read_state;
+  uint8_t     write_state;
+  uint8_t     write_latch;
+  uint8_t     rw_mode;
+  uint8_t     mode;
+  uint8_t     bcd;
+  uint8_t     gate;
+  IoTimePoint count_load_time;
+  IoTimePoint gate_low_time;
+};
+
+/* The 8254 PIT emulated in userspace with split irqchip, since the in-kernel PIT
+ * requires the in-kernel PIC. Channel 2 is gated by the PC speaker port.
+ */
+class I8254Pit : public Device {
+ private:
+  std::recursive_mutex  mutex_;
+  PitChannel            channels_[3];
+  IoTimer*              irq_timer_ = nullptr;
+  uint                  irq_timer_generation_ = 0;
+
+  int64_t GetElapsedTicks(PitChannel* channel);
+  uint16_t GetCount(PitChannel* channel);
+  int GetOutput(PitChannel* channel);
+  void LatchCount(PitChannel* channel);
+  void LoadCount(int index, uint32_t value);
+  void UpdateIrqTimer();
+
+ public:
+  I8254Pit();
+  virtual void Disconnect();
+  virtual void Reset();
+  virtual void Read(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size);
+  virtual void Write(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size);
+
+  /* Used by PC speaker */
+  void SetGate(int index, int gate);
+  int GetGate(int index);
+  int GetOutput(int index);
+};
+
+#endif // _MVISOR_DEVICES_ISA_I8254_PIT_H
@@ -0,0 +1,329 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <mutex>
+#include <cstring>
+#include "device.h"
+#include "device_manager.h"
+#include "device_interface.h"
+#include "logger.h"
+
+#define PIC_MASTER_BASE   0x20
+#define PIC_SLAVE_BASE    0xA0
+#define PIC_ELCR_BASE     0x4D0
+#define PIC_CASCADE_IRQ   2
+
+struct PicState {
+  uint8_t   last_irr; /* edge detection */
+  uint8_t   irr;
+  uint8_t   imr;
+  uint8_t   isr;
+  uint8_t   priority_add;
+  uint8_t   irq_base;
+  uint8_t   read_reg_select;
+  uint8_t   poll;
+  uint8_t   special_mask;
+  uint8_t   init_state;
+  uint8_t   auto_eoi;
+  uint8_t   rotate_on_auto_eoi;
+  uint8_t   special_fully_nested_mode;
+  uint8_t   init4;
+  uint8_t   single_mode;
+  uint8_t   elcr;
+  uint8_t   elcr_mask;
+};
+
+/* The cascaded 8259A PICs emulated in userspace with split irqchip, the master
+ * output is connected to LINT0 of the BSP and acknowledged by the vCPU thread
+ * https://pdos.csail.mit.edu/6.828/2005/readings/hardware/8259A.pdf
+ */
+class I8259Pic : public Device, public InterruptControllerInterface, public ExternalInterruptInterface {
+ private:
+  std::mutex  mutex_;
+  PicState    pics_[2];
+  bool        output_;
+
+ public:
+  I8259Pic() {
+    AddIoResource(kIoResourceTypePio, PIC_MASTER_BASE, 2, "PIC Master");
+    AddIoResource(kIoResourceTypePio, PIC_SLAVE_BASE, 2, "PIC Slave");
+    AddIoResource(kIoResourceTypePio, PIC_ELCR_BASE, 2, "PIC ELCR");
+  }
+
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < 2; i++) {
+      bzero(&pics_[i], sizeof(PicState));
+    }
+    /* IRQ 0, 1, 2, 8, 13 are always edge-triggered */
+    pics_[0].elcr_mask = 0xF8;
+    pics_[1].elcr_mask = 0xDE;
+    output_ = false;
+  }
+
+  void SetIrqLevel(uint irq, uint level) {
+    if (irq >= 16) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    SetPinLevel(&pics_[irq >> 3], irq & 7, level);
+    Update();
+  }
+
+  /* Only the IOAPIC handles EOI exits */
+  void EndOfInterrupt(uint vector) {
+  }
+
+  bool HasExternalInterrupt() {
+    return output_;
+  }
+
+  /* INTA cycle, returns the vector of the highest priority interrupt */
+  int AcknowledgeExternalInterrupt() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int vector;
+    int irq = GetIrq(&pics_[0]);
+    if (irq >= 0) {
+      Acknowledge(&pics_[0], irq);
+      if (irq == PIC_CASCADE_IRQ) {
+        int slave_irq = GetIrq(&pics_[1]);
+        if (slave_irq >= 0) {
+          Acknowledge(&pics_[1], slave_irq);
+        } else {
+          slave_irq = 7; /* spurious IRQ on slave controller */
+        }
+        vector = pics_[1].irq_base + slave_irq;
+      } else {
+        vector = pics_[0].irq_base + irq;
+      }
+    } else {
+      vector = pics_[0].irq_base + 7; /* spurious IRQ on host controller */
+    }
+    Update();
+    return vector;
+  }
+
+  void Read(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (resource->base == PIC_ELCR_BASE) {
+      data[0] = pics_[offset].elcr;
+      return;
+    }
+
+    auto pic = &pics_[resource->base == PIC_MASTER_BASE ? 0 : 1];
+    if (pic->poll) {
+      int irq = GetIrq(pic);
+      if (irq >= 0) {
+        Acknowledge(pic, irq);
+        data[0] = irq | 0x80;
+      } else {
+        data[0] = 0;
+      }
+      pic->poll = 0;
+      Update();
+    } else if (offset == 0) {
+      data[0] = pic->read_reg_select ? pic->isr : pic->irr;
+    } else {
+      data[0] = pic->imr;
+    }
+  }
+
+  void Write(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint8_t value = data[0];
+    if (resource->base == PIC_ELCR_BASE) {
+      pics_[offset].elcr = value & pics_[offset].elcr_mask;
+      return;
+    }
+
+    auto pic = &pics_[resource->base == PIC_MASTER_BASE ? 0 : 1];
+    if (offset == 0) {
+      WriteCommand(pic, value);
+    } else {
+      WriteData(pic, value);
+    }
+    Update();
+  }
+
+ private:
+  void SetPinLevel(PicState* pic, int pin, int level) {
+    uint8_t mask = 1 << pin;
+    if (pic->elcr & mask) {
+      /* level triggered */
+      if (level) {
+        pic->irr |= mask;
+        pic->last_irr |= mask;
+      } else {
+        pic->irr &= ~mask;
+        pic->last_irr &= ~mask;
+      }
+    } else {
+      /* edge triggered */
+      if (level) {
+        if (!(pic->last_irr & mask)) {
+          pic->irr |= mask;
+        }
+        pic->last_irr |= mask;
+      } else {
+        pic->last_irr &= ~mask;
+      }
+    }
+  }
+
+  /* Return 8 if no interrupt, otherwise the priority relative to priority_add */
+  int GetPriority(PicState* pic, uint8_t mask) {
+    if (mask == 0) {
+      return 8;
+    }
+    int priority = 0;
+    while ((mask & (1 << ((priority + pic->priority_add) & 7))) == 0) {
+      priority++;
+    }
+    return priority;
+  }
+
+  /* Return the pin to be delivered or -1 */
+  int GetIrq(PicState* pic) {
+    int priority = GetPriority(pic, pic->irr & ~pic->imr);
+    if (priority == 8) {
+      return -1;
+    }
+    /* Compare with the highest priority in service, in special fully nested mode
+     * the master accepts interrupts of the slave in service
+     */
+    uint8_t mask = pic->isr;
+    if (pic->special_mask) {
+      mask &= ~pic->imr;
+    }
+    if (pic->special_fully_nested_mode && pic == &pics_[0]) {
+      mask &= ~(1 << PIC_CASCADE_IRQ);
+    }
+    if (priority < GetPriority(pic, mask)) {
+      return (priority + pic->priority_add) & 7;
+    }
+    return -1;
+  }
+
+  void Acknowledge(PicState* pic, int irq) {
+    if (pic->auto_eoi) {
+      if (pic->rotate_on_auto_eoi) {
+        pic->priority_add = (irq + 1) & 7;
+      }
+    } else {
+      pic->isr |= 1 << irq;
+    }
+    /* We don't clear a level sensitive interrupt here */
+    if (!(pic->elcr & (1 << irq))) {
+      pic->irr &= ~(1 << irq);
+    }
+  }
+
+  /* Propagate the slave output to the master, and notify the BSP if the master has output */
+  void Update() {
+    SetPinLevel(&pics_[0], PIC_CASCADE_IRQ, GetIrq(&pics_[1]) >= 0);
+    bool output = GetIrq(&pics_[0]) >= 0;
+    output_ = output;
+    if (output) {
+      manager_->NotifyExternalInterrupt();
+    }
+  }
+
+  void WriteCommand(PicState* pic, uint8_t value) {
+    if (value & 0x10) {
+      /* ICW1 */
+      uint8_t elcr = pic->elcr, elcr_mask = pic->elcr_mask;
+      bzero(pic, sizeof(*pic));
+      pic->elcr = elcr;
+      pic->elcr_mask = elcr_mask;
+      pic->init_state = 1;
+      pic->init4 = value & 1;
+      pic->single_mode = value & 2;
+      if (value & 0x08) {
+        MV_ERROR("level sensitive irq not supported");
+      }
+    } else if (value & 0x08) {
+      /* OCW3 */
+      if (value & 0x04) {
+        pic->poll = 1;
+      }
+      if (value & 0x02) {
+        pic->read_reg_select = value & 1;
+      }
+      if (value & 0x40) {
+        pic->special_mask = (value >> 5) & 1;
+      }
+    } else {
+      /* OCW2 */
+      int command = value >> 5;
+      switch (command)
+      {
+      case 0:
+      case 4:
+        pic->rotate_on_auto_eoi = command >> 2;
+        break;
+      case 1: /* end of interrupt */
+      case 5: {
+        int priority = GetPriority(pic, pic->isr);
+        if (priority != 8) {
+          int irq = (priority + pic->priority_add) & 7;
+          pic->isr &= ~(1 << irq);
+          if (command == 5) {
+            pic->priority_add = (irq + 1) & 7;
+          }
+        }
+        break;
+      }
+      case 3: /* specific end of interrupt */
+        pic->isr &= ~(1 << (value & 7));
+        break;
+      case 6: /* set priority */
+        pic->priority_add = (value + 1) & 7;
+        break;
+      case 7: /* rotate on specific end of interrupt */
+        pic->isr &= ~(1 << (value & 7));
+        pic->priority_add = ((value & 7) + 1) & 7;
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  void WriteData(PicState* pic, uint8_t value) {
+    switch (pic->init_state)
+    {
+    case 0: /* OCW1 */
+      pic->imr = value;
+      break;
+    case 1: /* ICW2 */
+      pic->irq_base = value & 0xF8;
+      pic->init_state = pic->single_mode ? (pic->init4 ? 3 : 0) : 2;
+      break;
+    case 2: /* ICW3 */
+      pic->init_state = pic->init4 ? 3 : 0;
+      break;
+    case 3: /* ICW4 */
+      pic->special_fully_nested_mode = (value >> 4) & 1;
+      pic->auto_eoi = (value >> 1) & 1;
+      pic->init_state = 0;
+      break;
+    }
+  }
+};
+
+DECLARE_DEVICE(I8259Pic);
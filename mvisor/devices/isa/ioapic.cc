@@ -0,0 +1,252 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <mutex>
+#include "device.h"
+#include "device_manager.h"
+#include "device_interface.h"
+#include "machine.h"
+#include "logger.h"
+
+#define IOAPIC_BASE_ADDRESS       0xFEC00000
+#define IOAPIC_VERSION            0x20
+
+#define IOAPIC_REG_SELECT         0x00
+#define IOAPIC_REG_WINDOW         0x10
+#define IOAPIC_REG_EOI            0x40
+
+#define IOAPIC_INDEX_ID           0x00
+#define IOAPIC_INDEX_VERSION      0x01
+#define IOAPIC_INDEX_ARBITRATION  0x02
+#define IOAPIC_INDEX_REDIRECTION  0x10
+
+#define IOAPIC_RTE_VECTOR_MASK    0xFFULL
+#define IOAPIC_RTE_DELIVERY_SHIFT 8
+#define IOAPIC_RTE_DEST_MODE      (1ULL << 11)
+#define IOAPIC_RTE_REMOTE_IRR     (1ULL << 14)
+#define IOAPIC_RTE_LEVEL_TRIGGER  (1ULL << 15)
+#define IOAPIC_RTE_MASKED         (1ULL << 16)
+#define IOAPIC_RTE_DEST_SHIFT     56
+#define IOAPIC_RTE_READONLY_BITS  ((1ULL << 12) | IOAPIC_RTE_REMOTE_IRR)
+
+#define IOAPIC_DELIVERY_EXTINT    7
+
+#define MSI_ADDRESS_BASE          0xFEE00000
+#define MSI_DATA_LEVEL_ASSERT     (1 << 14)
+#define MSI_DATA_LEVEL_TRIGGER    (1 << 15)
+
+/* The 82093AA IOAPIC emulated in userspace with split irqchip. Interrupts are
+ * delivered as MSIs to the in-kernel LAPICs. Each unmasked pin is also written
+ * to the GSI routing table, so that KVM exits on EOI of level-triggered vectors.
+ * https://pdos.csail.mit.edu/6.828/2016/readings/ia32/ioapic.pdf
+ */
+class Ioapic : public Device, public InterruptControllerInterface {
+ private:
+  std::mutex  mutex_;
+  uint32_t    id_;
+  uint32_t    select_;
+  uint32_t    irr_;
+  uint32_t    line_level_;
+  uint64_t    redirection_table_[IOAPIC_NUM_PINS];
+
+ public:
+  Ioapic() {
+    AddIoResource(kIoResourceTypeMmio, IOAPIC_BASE_ADDRESS, 0x1000, "IOAPIC");
+    for (auto &entry : redirection_table_) {
+      entry = IOAPIC_RTE_MASKED;
+    }
+  }
+
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    id_ = 0;
+    select_ = 0;
+    irr_ = 0;
+    line_level_ = 0;
+    for (uint pin = 0; pin < IOAPIC_NUM_PINS; pin++) {
+      if (!(redirection_table_[pin] & IOAPIC_RTE_MASKED)) {
+        manager_->SetIoapicRoute(pin, 0, 0);
+      }
+      redirection_table_[pin] = IOAPIC_RTE_MASKED;
+    }
+  }
+
+  /* ISA IRQ 0 is connected to pin 2, the same as the ACPI interrupt source override */
+  void SetIrqLevel(uint irq, uint level) {
+    uint pin = irq == 0 ? 2 : irq;
+    if (pin >= IOAPIC_NUM_PINS) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t mask = 1U << pin;
+    if (redirection_table_[pin] & IOAPIC_RTE_LEVEL_TRIGGER) {
+      if (level) {
+        irr_ |= mask;
+      } else {
+        irr_ &= ~mask;
+      }
+    } else if (level && !(line_level_ & mask)) {
+      irr_ |= mask;
+    }
+    if (level) {
+      line_level_ |= mask;
+    } else {
+      line_level_ &= ~mask;
+    }
+    Service();
+  }
+
+  /* A level-triggered interrupt is delivered again if the line is still asserted */
+  void EndOfInterrupt(uint vector) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ClearRemoteIrr(vector);
+  }
+
+  void Read(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t value = 0;
+    if (offset == IOAPIC_REG_SELECT) {
+      value = select_;
+    } else if (offset == IOAPIC_REG_WINDOW) {
+      value = ReadRegister(select_);
+    }
+    memcpy(data, &value, size < sizeof(value) ? size : sizeof(value));
+  }
+
+  void Write(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t value = 0;
+    memcpy(&value, data, size < sizeof(value) ? size : sizeof(value));
+    if (offset == IOAPIC_REG_SELECT) {
+      select_ = value & 0xFF;
+    } else if (offset == IOAPIC_REG_WINDOW) {
+      WriteRegister(select_, value);
+    } else if (offset == IOAPIC_REG_EOI) {
+      ClearRemoteIrr(value & 0xFF);
+    }
+  }
+
+ private:
+  void ClearRemoteIrr(uint vector) {
+    for (uint pin = 0; pin < IOAPIC_NUM_PINS; pin++) {
+      auto &entry = redirection_table_[pin];
+      if ((entry & IOAPIC_RTE_VECTOR_MASK) == vector && (entry & IOAPIC_RTE_REMOTE_IRR)) {
+        entry &= ~IOAPIC_RTE_REMOTE_IRR;
+        if (line_level_ & (1U << pin)) {
+          irr_ |= 1U << pin;
+        }
+      }
+    }
+    Service();
+  }
+
+  uint32_t ReadRegister(uint32_t index) {
+    switch (index)
+    {
+    case IOAPIC_INDEX_ID:
+    case IOAPIC_INDEX_ARBITRATION:
+      return id_ << 24;
+    case IOAPIC_INDEX_VERSION:
+      return IOAPIC_VERSION | ((IOAPIC_NUM_PINS - 1) << 16);
+    default:
+      if (index >= IOAPIC_INDEX_REDIRECTION && index < IOAPIC_INDEX_REDIRECTION + IOAPIC_NUM_PINS * 2) {
+        uint pin = (index - IOAPIC_INDEX_REDIRECTION) / 2;
+        return (index & 1) ? redirection_table_[pin] >> 32 : (uint32_t)redirection_table_[pin];
+      }
+      return 0;
+    }
+  }
+
+  void WriteRegister(uint32_t index, uint32_t value) {
+    if (index == IOAPIC_INDEX_ID) {
+      id_ = (value >> 24) & 0x0F;
+      return;
+    }
+    if (index < IOAPIC_INDEX_REDIRECTION || index >= IOAPIC_INDEX_REDIRECTION + IOAPIC_NUM_PINS * 2) {
+      return;
+    }
+
+    uint pin = (index - IOAPIC_INDEX_REDIRECTION) / 2;
+    auto &entry = redirection_table_[pin];
+    uint64_t readonly = entry & IOAPIC_RTE_READONLY_BITS;
+    if (index & 1) {
+      entry = (entry & 0xFFFFFFFFULL) | ((uint64_t)value << 32);
+    } else {
+      entry = (entry & 0xFFFFFFFF00000000ULL) | (value & ~IOAPIC_RTE_READONLY_BITS);
+    }
+    entry |= readonly;
+    if (!(entry & IOAPIC_RTE_LEVEL_TRIGGER)) {
+      entry &= ~IOAPIC_RTE_REMOTE_IRR;
+    }
+
+    uint64_t address;
+    uint32_t msi_data;
+    bool extint = ((entry >> IOAPIC_RTE_DELIVERY_SHIFT) & 7) == IOAPIC_DELIVERY_EXTINT;
+    if ((entry & IOAPIC_RTE_MASKED) || extint) {
+      manager_->SetIoapicRoute(pin, 0, 0);
+    } else {
+      GetMsiMessage(entry, &address, &msi_data);
+      manager_->SetIoapicRoute(pin, address, msi_data);
+    }
+
+    /* Level-triggered interrupts pending while masked are delivered now */
+    if ((entry & IOAPIC_RTE_LEVEL_TRIGGER) && (line_level_ & (1U << pin))) {
+      irr_ |= 1U << pin;
+    }
+    Service();
+  }
+
+  void GetMsiMessage(uint64_t entry, uint64_t* address, uint32_t* data) {
+    uint32_t dest = entry >> IOAPIC_RTE_DEST_SHIFT;
+    *address = MSI_ADDRESS_BASE | (dest << 12) | ((entry & IOAPIC_RTE_DEST_MODE) ? (1 << 2) : 0);
+    *data = (entry & IOAPIC_RTE_VECTOR_MASK) | (entry & (7 << IOAPIC_RTE_DELIVERY_SHIFT));
+    if (entry & IOAPIC_RTE_LEVEL_TRIGGER) {
+      *data |= MSI_DATA_LEVEL_TRIGGER | MSI_DATA_LEVEL_ASSERT;
+    }
+  }
+
+  /* Deliver pending unmasked pins, called with mutex locked */
+  void Service() {
+    for (uint pin = 0; pin < IOAPIC_NUM_PINS && irr_; pin++) {
+      uint32_t mask = 1U << pin;
+      auto &entry = redirection_table_[pin];
+      if (!(irr_ & mask) || (entry & IOAPIC_RTE_MASKED)) {
+        continue;
+      }
+      if (entry & IOAPIC_RTE_LEVEL_TRIGGER) {
+        if (entry & IOAPIC_RTE_REMOTE_IRR) {
+          continue;
+        }
+        entry |= IOAPIC_RTE_REMOTE_IRR;
+      }
+      irr_ &= ~mask;
+
+      if (((entry >> IOAPIC_RTE_DELIVERY_SHIFT) & 7) == IOAPIC_DELIVERY_EXTINT) {
+        /* Virtual wire mode, the PIC delivers the interrupt through LINT0 */
+        continue;
+      }
+      uint64_t address;
+      uint32_t data;
+      GetMsiMessage(entry, &address, &data);
+      manager_->SignalMsi(address, data);
+    }
+  }
+};
+
+DECLARE_DEVICE(Ioapic);
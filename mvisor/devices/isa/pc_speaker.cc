@@ -16,33 +16,52 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <chrono>
 #include "device.h"
+#include "device_manager.h"
+#include "i8254_pit.h"
 #include "logger.h"
 
-/* The speaker is part of PIT. We use KVM in-kernel PIT, the speaker could be
- * implemented or dummied in userspace.
+/* The speaker is part of PIT. With KVM in-kernel PIT, the speaker could be
+ * implemented or dummied in userspace. With split irqchip, the userspace PIT
+ * channel 2 is gated by bit 0 and its output is read from bit 5.
  * https://wiki.osdev.org/PC_Speaker
  */
 class PcSpeaker : public Device {
  private:
   uint8_t state_;
+  I8254Pit* pit_ = nullptr;
 
  public:
   PcSpeaker () {
     AddIoResource(kIoResourceTypePio, 0x61, 1, "PC Speaker");
   }
 
+  /* All devices are connected before reset */
   void Reset() {
     state_ = 0;
+    pit_ = dynamic_cast<I8254Pit*>(manager_->LookupDeviceByName("i8254-pit"));
   }
 
   void Read(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+    if (pit_) {
+      /* Bit 4 is the DRAM refresh toggle, flipped every 15us */
+      auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+      data[0] = (state_ & 0x02) | pit_->GetGate(2) | (pit_->GetOutput(2) << 5) |
+        (((now_ns / 15085) & 1) << 4);
+      return;
+    }
     /* FIXME: this might be incorrect */
     data[0] = state_;
   }
 
   void Write(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
     state_ = data[0];
+    if (pit_) {
+      pit_->SetGate(2, state_ & 1);
+      return;
+    }
     MV_LOG("speaker %s, state=0x%x", (state_ & 1) ? "enabled" : "disabled", state_);
   }
 };
@@ -0,0 +1,131 @@
+/* 
+ * MVisor ACPI Tables
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "acpi.h"
+#include <cstring>
+#include "machine.h"
+#include "logger.h"
+
+/* The legacy VGA and ROM area between 640K and 1M is not RAM */
+#define LOW_MEMORY_HOLE_BEGIN   0xA0000
+#define LOW_MEMORY_HOLE_END     0x100000
+
+Acpi::Acpi(Machine* machine) : machine_(machine) {
+}
+
+/* Fill the header and the checksum after the table body is built */
+void Acpi::SetupHeader(std::string& table, const char* signature, uint8_t revision) {
+  auto header = (acpi_table_header*)table.data();
+  memcpy(header->signature, signature, 4);
+  header->length = table.size();
+  header->revision = revision;
+  memcpy(header->oem_id, "MVISOR", 6);
+  memcpy(header->oem_table_id, "MV", 2);
+  memcpy(header->oem_table_id + 2, signature, 4);
+  memcpy(header->oem_table_id + 6, "  ", 2);
+  header->oem_revision = 1;
+  memcpy(header->asl_compiler_id, "MVSR", 4);
+  header->asl_compiler_revision = 1;
+
+  uint8_t sum = 0;
+  header->checksum = 0;
+  for (auto c : table) {
+    sum += (uint8_t)c;
+  }
+  header->checksum = -sum;
+}
+
+void Acpi::AddMemoryAffinity(std::string& srat, uint32_t node, uint64_t base, uint64_t length) {
+  if (length == 0) {
+    return;
+  }
+  acpi_srat_memory_affinity memory = {
+    .type = ACPI_SRAT_TYPE_MEMORY_AFFINITY,
+    .length = sizeof(acpi_srat_memory_affinity),
+    .proximity = node,
+    .base_address = base,
+    .range_length = length,
+    .flags = ACPI_SRAT_ENABLED
+  };
+  srat.append((const char*)&memory, sizeof(memory));
+}
+
+/* SRAT describes the vCPUs and RAM ranges of each node, SLIT describes distances */
+void Acpi::GetNumaTables(std::string& srat, std::string& slit) {
+  auto &nodes = machine_->numa_nodes();
+
+  srat.assign(sizeof(acpi_srat_header), '\0');
+  auto srat_header = (acpi_srat_header*)srat.data();
+  srat_header->reserved1 = 1;
+
+  for (uint32_t node = 0; node < nodes.size(); node++) {
+    for (auto vcpu : nodes[node].vcpus) {
+      uint32_t apic_id = machine_->GetApicId(vcpu);
+      if (apic_id < 0xFF) {
+        acpi_srat_processor_affinity processor = {
+          .type = ACPI_SRAT_TYPE_PROCESSOR_AFFINITY,
+          .length = sizeof(acpi_srat_processor_affinity),
+          .proximity_lo = (uint8_t)node,
+          .local_apic_id = (uint8_t)apic_id,
+          .flags = ACPI_SRAT_ENABLED
+        };
+        srat.append((const char*)&processor, sizeof(processor));
+      } else {
+        acpi_srat_x2apic_affinity processor = {
+          .type = ACPI_SRAT_TYPE_X2APIC_AFFINITY,
+          .length = sizeof(acpi_srat_x2apic_affinity),
+          .proximity = node,
+          .x2apic_id = apic_id,
+          .flags = ACPI_SRAT_ENABLED
+        };
+        srat.append((const char*)&processor, sizeof(processor));
+      }
+    }
+  }
+
+  /* Node memory is assigned in the order of guest RAM, skipping the PCI hole */
+  uint64_t offset = 0;
+  for (uint32_t node = 0; node < nodes.size(); node++) {
+    uint64_t begin = offset;
+    uint64_t end = offset + nodes[node].memory;
+    offset = end;
+
+    if (begin < LOW_RAM_UPPER_BOUND) {
+      uint64_t low_end = end < LOW_RAM_UPPER_BOUND ? end : LOW_RAM_UPPER_BOUND;
+      if (begin == 0) {
+        AddMemoryAffinity(srat, node, 0, LOW_MEMORY_HOLE_BEGIN);
+        begin = LOW_MEMORY_HOLE_END;
+      }
+      AddMemoryAffinity(srat, node, begin, low_end - begin);
+      begin = low_end;
+    }
+    if (end > begin) {
+      uint64_t high_begin = begin - LOW_RAM_UPPER_BOUND + HIGH_RAM_LOWER_BOUND;
+      AddMemoryAffinity(srat, node, high_begin, end - begin);
+    }
+  }
+  SetupHeader(srat, "SRAT", 1);
+
+  slit.assign(sizeof(acpi_slit_header), '\0');
+  auto slit_header = (acpi_slit_header*)slit.data();
+  slit_header->locality_count = nodes.size();
+  for (auto &node : nodes) {
+    slit.append((const char*)node.distances.data(), node.distances.size());
+  }
+  SetupHeader(slit, "SLIT", 1);
+}
@@ -0,0 +1,108 @@
+/* 
+ * MVisor ACPI Tables
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MVISOR_DEVICES_ACPI_H
+#define _MVISOR_DEVICES_ACPI_H
+
+#include <cstdint>
+#include <string>
+
+/*
+ * ACPI spec defined tables
+ * SeaBIOS builds the fixed tables (RSDT, FADT, MADT, DSDT ...) by itself,
+ * other tables are loaded from fw_cfg files named "acpi/xxx".
+ */
+struct acpi_table_header {
+  char      signature[4];
+  uint32_t  length;
+  uint8_t   revision;
+  uint8_t   checksum;
+  char      oem_id[6];
+  char      oem_table_id[8];
+  uint32_t  oem_revision;
+  char      asl_compiler_id[4];
+  uint32_t  asl_compiler_revision;
+} __attribute__((packed));
+
+/* System Resource Affinity Table */
+struct acpi_srat_header {
+  acpi_table_header header;
+  uint32_t  reserved1;  /* must be 1 */
+  uint64_t  reserved2;
+} __attribute__((packed));
+
+#define ACPI_SRAT_TYPE_PROCESSOR_AFFINITY   0
+#define ACPI_SRAT_TYPE_MEMORY_AFFINITY      1
+#define ACPI_SRAT_TYPE_X2APIC_AFFINITY      2
+
+#define ACPI_SRAT_ENABLED                   (1 << 0)
+
+struct acpi_srat_processor_affinity {
+  uint8_t   type;
+  uint8_t   length;
+  uint8_t   proximity_lo;
+  uint8_t   local_apic_id;
+  uint32_t  flags;
+  uint8_t   local_sapic_eid;
+  uint8_t   proximity_hi[3];
+  uint32_t  clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic_affinity {
+  uint8_t   type;
+  uint8_t   length;
+  uint16_t  reserved1;
+  uint32_t  proximity;
+  uint32_t  x2apic_id;
+  uint32_t  flags;
+  uint32_t  clock_domain;
+  uint32_t  reserved2;
+} __attribute__((packed));
+
+struct acpi_srat_memory_affinity {
+  uint8_t   type;
+  uint8_t   length;
+  uint32_t  proximity;
+  uint16_t  reserved1;
+  uint64_t  base_address;
+  uint64_t  range_length;
+  uint32_t  reserved2;
+  uint32_t  flags;
+  uint64_t  reserved3;
+} __attribute__((packed));
+
+/* System Locality Information Table */
+struct acpi_slit_header {
+  acpi_table_header header;
+  uint64_t  locality_count;
+} __attribute__((packed));
+
+
+class Machine;
+class Acpi {
+ public:
+  Acpi(Machine* machine);
+  void GetNumaTables(std::string& srat, std::string& slit);
+
+ private:
+  void AddMemoryAffinity(std::string& srat, uint32_t node, uint64_t base, uint64_t length);
+  void SetupHeader(std::string& table, const char* signature, uint8_t revision);
+  Machine* machine_;
+};
+
+#endif // _MVISOR_DEVICES_ACPI_H
@@ -18,39 +18,128 @@
 
 #include "firmware_config.h"
 #include <cstring>
+#include <memory>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "logger.h"
+#include "utilities.h"
 #include "device_manager.h"
 #include "memory_manager.h"
 #include "machine.h"
 #include "smbios.h"
+#include "acpi.h"
 
 #define FW_CFG_ACPI_DEVICE_ID "QEMU0002"
 
+/* Linux boot protocol load addresses, the same as QEMU */
+#define KERNEL_REAL_ADDR      0x10000
+#define KERNEL_CMDLINE_ADDR   0x20000
+#define KERNEL_PROT_ADDR      0x100000
+/* SeaBIOS places ACPI tables and its high zone below the end of low RAM */
+#define KERNEL_ACPI_DATA_SIZE 0x28000
+
+/* A local file is mapped on the first access, so that large blobs like kernels and
+ * initrds are neither read at startup nor copied to the heap
+ */
+class MappedFile {
+ private:
+  std::string path_;
+  int         fd_ = -1;
+  size_t      size_ = 0;
+  uint8_t*    data_ = nullptr;
+
+ public:
+  MappedFile(const std::string& path) : path_(path) {
+    fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+      MV_PANIC("failed to locate file %s", path.c_str());
+    }
+    struct stat st;
+    fstat(fd_, &st);
+    size_ = st.st_size;
+  }
+
+  ~MappedFile() {
+    if (data_) {
+      munmap(data_, size_);
+    }
+    safe_close(&fd_);
+  }
+
+  inline size_t size() { return size_; }
+
+  const uint8_t* data() {
+    if (data_ == nullptr && size_ > 0) {
+      void* map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (map == MAP_FAILED) {
+        MV_PANIC("failed to map file %s", path_.c_str());
+      }
+      madvise(map, size_, MADV_SEQUENTIAL);
+      data_ = (uint8_t*)map;
+      safe_close(&fd_);
+    }
+    return data_;
+  }
+};
+
+/* An entry is either bytes in memory or a range of a mapped file */
+struct ConfigEntry {
+  std::string                 bytes;
+  std::shared_ptr<MappedFile> file;
+  size_t                      offset = 0;
+  size_t                      size = 0;
+
+  const uint8_t* data() {
+    return file ? file->data() + offset : (const uint8_t*)bytes.data();
+  }
+};
+
 class FirmwareConfig : public Device {
  private:
   uint16_t current_index_ = 0;
   uint32_t current_offset_ = 0;
   uint64_t dma_address_ = 0;
-  std::map<uint16_t, std::string> config_;
-  std::map<std::string, std::string> files_;
-
+  std::map<uint16_t, ConfigEntry> config_;
+  std::map<std::string, ConfigEntry> files_;
+
+
+  /* Copy to guest page by page, guest RAM is not contiguous in host across slots.
+   * Bytes beyond the end of an entry are read as zeros.
+   */
+  void CopyToGuest(uint64_t gpa, const uint8_t* data, size_t size, size_t length) {
+    size_t copied = 0;
+    while (copied < length) {
+      size_t chunk = std::min(length - copied, PAGE_SIZE - ((gpa + copied) & (PAGE_SIZE - 1)));
+      uint8_t* host = (uint8_t*)manager_->TranslateGuestMemory(gpa + copied);
+      if (copied < size) {
+        chunk = std::min(chunk, size - copied);
+        memcpy(host, data + copied, chunk);
+      } else {
+        memset(host, 0, chunk);
+      }
+      copied += chunk;
+    }
+  }
 
   void DmaTransfer() {
     fw_cfg_dma_access* dma = (fw_cfg_dma_access*)manager_->TranslateGuestMemory(dma_address_);
     dma_address_ = 0;
 
-    dma->control = be32toh(dma->control);
-    dma->address = be64toh(dma->address);
-    dma->length = be32toh(dma->length);
+    uint32_t control = be32toh(dma->control);
+    uint32_t length = be32toh(dma->length);
+    uint64_t address = be64toh(dma->address);
     
-    if (dma->control & FW_CFG_DMA_CTL_SELECT) {
-      current_index_ = dma->control >> 16;
+    if (control & FW_CFG_DMA_CTL_SELECT) {
+      current_index_ = control >> 16;
       current_offset_ = 0;
     }
 
     auto it = config_.find(current_index_);
     if (it == config_.end()) {
-      dma->control = be32toh(FW_CFG_DMA_CTL_ERROR);
+      dma->control = htobe32(FW_CFG_DMA_CTL_ERROR);
       if (current_index_ & 0x8000) {
         /* Skip ARCH_LOCAL entries like ACPI, SMBIOS */
         return;
@@ -58,54 +147,63 @@ class FirmwareConfig : public Device {
       MV_PANIC("config entry not found 0x%x", current_index_);
     }
 
-    uint8_t* data = (uint8_t*)manager_->TranslateGuestMemory(dma->address);
-    if (dma->control & FW_CFG_DMA_CTL_READ) {
-      uint32_t size = it->second.size() - current_offset_;
-      if (size > dma->length)
-        size = dma->length;
-      memcpy(data, it->second.data() + current_offset_, size);
+    auto &entry = it->second;
+    size_t size = 0;
+    if (current_offset_ < entry.size) {
+      size = std::min(entry.size - current_offset_, (size_t)length);
+    }
+    if (control & FW_CFG_DMA_CTL_READ) {
+      CopyToGuest(address, size ? entry.data() + current_offset_ : nullptr, size, length);
       current_offset_ += size;
-    } else if (dma->control & FW_CFG_DMA_CTL_WRITE) {
+    } else if (control & FW_CFG_DMA_CTL_WRITE) {
       MV_PANIC("not supported");
+    } else if (control & FW_CFG_DMA_CTL_SKIP) {
+      current_offset_ += size;
     }
     dma->control = 0;
   }
 
   void SetConfigBytes(uint16_t index, std::string bytes) {
-    config_[index] = bytes;
+    auto &entry = config_[index];
+    entry.size = bytes.size();
+    entry.bytes = std::move(bytes);
+    entry.file.reset();
   }
 
   void SetConfigUInt32(uint16_t index, uint32_t value) {
-    config_[index] = std::string((const char*)&value, sizeof(value));
+    SetConfigBytes(index, std::string((const char*)&value, sizeof(value)));
   }
 
   void SetConfigUInt16(uint16_t index, uint16_t value) {
-    config_[index] = std::string((const char*)&value, sizeof(value));
+    SetConfigBytes(index, std::string((const char*)&value, sizeof(value)));
+  }
+
+  void SetConfigFile(uint16_t index, std::shared_ptr<MappedFile> file, size_t offset, size_t size) {
+    auto &entry = config_[index];
+    entry.bytes.clear();
+    entry.file = file;
+    entry.offset = offset;
+    entry.size = size;
   }
 
   void AddConfigFile(std::string path, void* data, size_t size) {
-    files_[path] = std::string((const char*)data, size);
+    auto &entry = files_[path];
+    entry.bytes = std::string((const char*)data, size);
+    entry.size = size;
     if (debug_) {
       MV_LOG("AddConfigFile %s", path.c_str());
-      DumpHex(files_[path].data(), files_[path].size());
+      DumpHex(entry.bytes.data(), entry.bytes.size());
     }
   }
 
   void AddConfigFile(std::string path, std::string local_path) {
-    FILE *fp = fopen(local_path.c_str(), "rb");
-    if (fp == NULL) {
-      MV_PANIC("failed to locate file %s", local_path.c_str());
+    auto file = std::make_shared<MappedFile>(local_path);
+    auto &entry = files_[path];
+    entry.file = file;
+    entry.size = file->size();
+    if (debug_) {
+      MV_LOG("AddConfigFile %s from %s size=%lu", path.c_str(), local_path.c_str(), entry.size);
     }
-    fseek(fp, 0, SEEK_END);
-    ssize_t file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    uint8_t* buf = new uint8_t[file_size];
-    fread(buf, file_size, 1, fp);
-    fclose(fp);
-
-    AddConfigFile(path, buf, file_size);
-    delete buf;
   }
 
   void InitializeConfig() {
@@ -116,9 +214,12 @@ class FirmwareConfig : public Device {
 
     auto machine = manager_->machine();
     int num_vcpus = machine->num_vcpus();
+    /* SeaBIOS enumerates APIC IDs below max cpus, there may be gaps in the topology */
+    int max_cpus = machine->GetApicIdLimit();
     SetConfigUInt16(FW_CFG_NB_CPUS, num_vcpus);
-    SetConfigUInt16(FW_CFG_MAX_CPUS, num_vcpus);
-    uint64_t numa_cfg[num_vcpus + 1] = { 0 };
+    SetConfigUInt16(FW_CFG_MAX_CPUS, max_cpus);
+    /* NUMA tables are provided as ACPI files, leave the legacy NUMA entry empty */
+    uint64_t numa_cfg[max_cpus + 1] = { 0 };
     SetConfigBytes(FW_CFG_NUMA, std::string((const char*)numa_cfg, sizeof(numa_cfg)));
     SetConfigUInt16(FW_CFG_NOGRAPHIC, 0);
     SetConfigUInt32(FW_CFG_IRQ0_OVERRIDE, 1);
@@ -131,6 +232,7 @@ class FirmwareConfig : public Device {
     }
 
     InitializeE820Table();
+    InitializeKernelBoot();
 
     InitializeFiles();
     InitializeFileDir();
@@ -144,18 +246,26 @@ class FirmwareConfig : public Device {
     smbios.GetTables(smbios_anchor, smbios_table);
     AddConfigFile("etc/smbios/smbios-tables", smbios_table.data(), smbios_table.size());
     AddConfigFile("etc/smbios/smbios-anchor", smbios_anchor.data(), smbios_anchor.size());
+
+    if (!manager_->machine()->numa_nodes().empty()) {
+      std::string srat, slit;
+      Acpi acpi(manager_->machine());
+      acpi.GetNumaTables(srat, slit);
+      AddConfigFile("acpi/srat", srat.data(), srat.size());
+      AddConfigFile("acpi/slit", slit.data(), slit.size());
+    }
   }
 
   void InitializeFileDir() {
     fw_cfg_files dir;
     int index = 0;
-    for (auto item : files_) {
+    for (auto &item : files_) {
       auto cfg_file = &dir.files[index];
       strncpy(cfg_file->name, item.first.c_str(), item.first.size());
-      cfg_file->size = htobe32(item.second.size());
+      cfg_file->size = htobe32(item.second.size);
       cfg_file->select = htobe16(FW_CFG_FILE_FIRST + index);
       cfg_file->reserved = 0;
-      SetConfigBytes(FW_CFG_FILE_FIRST + index, item.second);
+      config_[FW_CFG_FILE_FIRST + index] = item.second;
 
       if (++index >= FW_CFG_MAX_FILES) {
         break;
@@ -184,6 +294,80 @@ class FirmwareConfig : public Device {
     AddConfigFile("etc/e820", entries.data(), sizeof(e820_entry) * entries.size());
   }
 
+  /* Split a bzImage into the real mode setup and the protected mode kernel like QEMU.
+   * The linuxboot option ROM loads them with DMA and jumps to the setup code.
+   */
+  void InitializeKernelBoot() {
+    auto machine = manager_->machine();
+    auto &boot = machine->kernel_boot();
+    if (boot.kernel.empty()) {
+      return;
+    }
+
+    auto kernel = std::make_shared<MappedFile>(boot.kernel);
+    const uint8_t* image = kernel->data();
+    if (kernel->size() < 0x1000 || memcmp(image + 0x202, "HdrS", 4) != 0) {
+      MV_PANIC("%s is not a bzImage", boot.kernel.c_str());
+    }
+    uint16_t protocol = *(uint16_t*)(image + 0x206);
+    if (protocol < 0x203 || !(image[0x211] & 0x01)) {
+      MV_PANIC("unsupported boot protocol 0x%x of %s", protocol, boot.kernel.c_str());
+    }
+    size_t setup_size = image[0x1f1] ? image[0x1f1] : 4;
+    setup_size = (setup_size + 1) * 512;
+    MV_ASSERT(setup_size < kernel->size());
+
+    /* Only the setup header is patched, the kernel is served from the mapped file */
+    std::string setup((const char*)image, setup_size);
+    uint8_t* header = (uint8_t*)setup.data();
+    header[0x210] = 0xB0; // type_of_loader
+    header[0x211] |= 0x80; // CAN_USE_HEAP
+    *(uint16_t*)(header + 0x224) = KERNEL_CMDLINE_ADDR - KERNEL_REAL_ADDR - 0x200; // heap_end_ptr
+    *(uint32_t*)(header + 0x228) = KERNEL_CMDLINE_ADDR; // cmd_line_ptr
+
+    std::string cmdline = boot.cmdline;
+    cmdline.push_back('\0');
+    if (protocol >= 0x206 && cmdline.size() > *(uint32_t*)(header + 0x238) + 1UL) {
+      MV_PANIC("kernel command line is too long");
+    }
+
+    if (!boot.initrd.empty()) {
+      auto initrd = std::make_shared<MappedFile>(boot.initrd);
+      uint64_t initrd_max = *(uint32_t*)(header + 0x22c);
+      uint64_t low_ram_end = std::min<uint64_t>(machine->ram_size(), LOW_RAM_UPPER_BOUND);
+      if (initrd_max >= low_ram_end - KERNEL_ACPI_DATA_SIZE) {
+        initrd_max = low_ram_end - KERNEL_ACPI_DATA_SIZE - 1;
+      }
+      if (initrd->size() > initrd_max - KERNEL_PROT_ADDR) {
+        MV_PANIC("initrd %s is too large", boot.initrd.c_str());
+      }
+      uint32_t initrd_addr = (initrd_max - initrd->size()) & ~(PAGE_SIZE - 1);
+      *(uint32_t*)(header + 0x218) = initrd_addr; // ramdisk_image
+      *(uint32_t*)(header + 0x21c) = initrd->size(); // ramdisk_size
+
+      SetConfigUInt32(FW_CFG_INITRD_ADDR, initrd_addr);
+      SetConfigUInt32(FW_CFG_INITRD_SIZE, initrd->size());
+      SetConfigFile(FW_CFG_INITRD_DATA, initrd, 0, initrd->size());
+    }
+
+    SetConfigUInt32(FW_CFG_KERNEL_ADDR, KERNEL_PROT_ADDR);
+    SetConfigUInt32(FW_CFG_KERNEL_SIZE, kernel->size() - setup_size);
+    SetConfigFile(FW_CFG_KERNEL_DATA, kernel, setup_size, kernel->size() - setup_size);
+
+    SetConfigUInt32(FW_CFG_CMDLINE_ADDR, KERNEL_CMDLINE_ADDR);
+    SetConfigUInt32(FW_CFG_CMDLINE_SIZE, cmdline.size());
+    SetConfigBytes(FW_CFG_CMDLINE_DATA, cmdline);
+
+    SetConfigUInt32(FW_CFG_SETUP_ADDR, KERNEL_REAL_ADDR);
+    SetConfigUInt32(FW_CFG_SETUP_SIZE, setup.size());
+    SetConfigBytes(FW_CFG_SETUP_DATA, std::move(setup));
+
+    /* SeaBIOS runs option ROMs under genroms/ and boots the first entry in bootorder */
+    AddConfigFile("genroms/linuxboot_dma.bin", boot.option_rom);
+    std::string bootorder = "/rom@genroms/linuxboot_dma.bin";
+    AddConfigFile("bootorder", bootorder.data(), bootorder.size() + 1);
+  }
+
 
  public:
   FirmwareConfig() {
@@ -226,13 +410,18 @@ class FirmwareConfig : public Device {
       if (it == config_.end()) {
         MV_PANIC("config entry %d not found", current_index_);
       }
-      while (size--) {
-        if (current_offset_ < it->second.size()) {
-          *data++ = it->second[current_offset_++];
-        } else {
-          *data++ = 0;
-        }
+      auto &entry = it->second;
+      uint32_t length = 0;
+      if (current_offset_ < entry.size) {
+        length = std::min(entry.size - current_offset_, (size_t)size);
+        memcpy(data, entry.data() + current_offset_, length);
+        current_offset_ += length;
       }
+      memset(data + length, 0, size - length);
+    } else if (resource->base == FW_CFG_DMA_IO_BASE && offset + size <= sizeof(uint64_t)) {
+      /* The DMA register reads as "QEMU CFG" */
+      uint64_t signature = htobe64(FW_CFG_DMA_SIGNATURE);
+      memcpy(data, (uint8_t*)&signature + offset, size);
     } else {
       MV_PANIC("not implemented Read for %s offset=0x%lx size=%d", name_, offset, size);
     }
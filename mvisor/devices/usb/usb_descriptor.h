@@ -40,6 +40,7 @@ struct UsbEndpointDescriptor {
   uint8_t                   bSynchAddress;
 
   const bool                is_audio; /* has bRefresh + bSynchAddress */
+  /* Descriptors following the endpoint, e.g. SuperSpeed companion, ended with zero */
   const uint8_t*            extra;
 } __attribute__((packed));
 
@@ -57,6 +58,9 @@ struct UsbInterfaceDescriptor {
   uint8_t                         ndesc;
   const UsbOtherDescriptor*       descriptors;
   const UsbEndpointDescriptor*    endpoints;
+  /* Alternate settings of this interface, bAlternateSetting starts from 1 */
+  uint8_t                         nalternates;
+  const UsbInterfaceDescriptor*   alternates;
 } __attribute__((packed));
 
 struct UsbConfigurationDescriptor {
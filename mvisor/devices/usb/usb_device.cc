@@ -18,6 +18,7 @@
 
 #include "usb_device.h"
 #include <cstring>
+#include <algorithm>
 #include "usb.h"
 #include "logger.h"
 #include "device_manager.h"
@@ -25,13 +26,17 @@
 void UsbDevice::Reset() {
   configuration_value_ = 0;
   config_ = nullptr;
-  speed_ = kUsbSpeedHigh;
+  bzero(alternate_settings_, sizeof(alternate_settings_));
 
-  /* remove all endpoints */
+  /* remove all endpoints, pending tokens are released by the host controller later */
   for (auto endpoint : endpoints_) {
     if (endpoint->timer) {
       manager_->io()->RemoveTimer(endpoint->timer);
     }
+    for (auto packet : endpoint->tokens) {
+      packet->endpoint = nullptr;
+    }
+    delete endpoint;
   }
   endpoints_.clear();
 }
@@ -51,9 +56,12 @@ UsbPacket* UsbDevice::CreatePacket(uint endpoint_address, uint stream_id, uint64
   }
   /* called by XHCI controller */
   packet->Release = [=]() {
+    if (packet->status == USB_RET_ASYNC) {
+      OnCancelPacket(packet);
+    }
     auto endpoint = packet->endpoint;
     if (endpoint) {
-      auto it = endpoint->tokens.find(packet);
+      auto it = std::find(endpoint->tokens.begin(), endpoint->tokens.end(), packet);
       if (it != endpoint->tokens.end()) {
         endpoint->tokens.erase(it);
       }
@@ -63,19 +71,26 @@ UsbPacket* UsbDevice::CreatePacket(uint endpoint_address, uint stream_id, uint64
   return packet;
 }
 
+/* Returns true if the packet is completed by control endpoint. Data packets are queued
+ * as tokens and completed by NotifyEndpoint(), maybe before this function returns,
+ * or later by the device if OnDataPacket() returns USB_RET_ASYNC. Control packets
+ * of USB_RET_ASYNC are also completed later by the device.
+ */
 bool UsbDevice::HandlePacket(UsbPacket* packet) {
   if (packet->endpoint_address & 0xF) { // data endpoints
     auto endpoint = packet->endpoint;
-    if (endpoint->type == kUsbEndpointIsochronous || endpoint->type == kUsbEndpointInterrupt) {
-      packet->status = USB_RET_NAK;
-      endpoint->tokens.insert(packet);
-      NotifyEndpoint(endpoint->address);
-      return false;
-    } else {
+    if (endpoint->type == kUsbEndpointControl) {
       MV_PANIC("not impemented endpoint type=%d", endpoint->type);
     }
+    packet->status = USB_RET_NAK;
+    endpoint->tokens.push_back(packet);
+    NotifyEndpoint(endpoint->address);
+    return false;
   } else { // control
     OnControlPacket(packet);
+    if (packet->status == USB_RET_ASYNC) {
+      return false;
+    }
   }
 
   packet->OnComplete();
@@ -131,32 +146,61 @@ void UsbDevice::OnDataPacket(UsbPacket* packet) {
   }
 }
 
-void UsbDevice::NotifyEndpoint(uint endpoint_address) {
+void UsbDevice::OnCancelPacket(UsbPacket* packet) {
+}
+
+void UsbDevice::SetEndpointInterval(uint endpoint_address, uint interval_us) {
   auto endpoint = FindEndpoint(endpoint_address);
   if (endpoint) {
-    auto timer_callback = [this, endpoint]() {
-      if (endpoint->tokens.empty()) {
-        /* wait for next tick */
-        return;
-      }
-      auto it = endpoint->tokens.begin();
-      auto packet = *it;
-      endpoint->tokens.erase(it);
-      OnDataPacket(packet);
-      if (packet->status == USB_RET_NAK) {
-        manager_->io()->RemoveTimer(endpoint->timer);
+    endpoint->interval = interval_us;
+  }
+}
+
+/* Called on the IO thread when tokens are queued or the device has new data. The
+ * queued tokens are serviced in order until the device NAKs, then the device should
+ * call NotifyEndpoint() again when data is available. Packets of USB_RET_ASYNC are
+ * owned by the device and completed by calling OnComplete(). Interrupt and isochronous
+ * endpoints are serviced at most once per interval, intervals shorter than the
+ * IO thread timer resolution (1ms) are not throttled.
+ */
+void UsbDevice::NotifyEndpoint(uint endpoint_address) {
+  auto endpoint = FindEndpoint(endpoint_address);
+  if (!endpoint) {
+    MV_PANIC("endpoint not found 0x%x", endpoint_address);
+  }
+  if (endpoint->timer) {
+    /* wait for the next interval */
+    return;
+  }
+
+  bool throttled = endpoint->interval >= 1000 &&
+    (endpoint->type == kUsbEndpointInterrupt || endpoint->type == kUsbEndpointIsochronous);
+  while (!endpoint->tokens.empty()) {
+    auto now = std::chrono::steady_clock::now();
+    if (throttled && now < endpoint->next_service_time) {
+      auto delay_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        endpoint->next_service_time - now + std::chrono::microseconds(999)).count();
+      endpoint->timer = manager_->io()->AddTimer(delay_ms, false, [this, endpoint]() {
         endpoint->timer = nullptr;
-        endpoint->tokens.insert(packet);
-      } else {
-        packet->OnComplete();
-      }
-    };
-  
-    if (!endpoint->timer) {
-      endpoint->timer = manager_->io()->AddTimer(20, true, timer_callback);
+        NotifyEndpoint(endpoint->address);
+      });
+      return;
     }
-  } else {
-    MV_PANIC("endpoint not found 0x%x", endpoint_address);
+
+    auto packet = endpoint->tokens.front();
+    endpoint->tokens.pop_front();
+    OnDataPacket(packet);
+    if (packet->status == USB_RET_NAK) {
+      endpoint->tokens.push_front(packet);
+      return;
+    }
+    if (packet->status == USB_RET_ASYNC) {
+      continue;
+    }
+    if (throttled) {
+      endpoint->next_service_time = now + std::chrono::microseconds(endpoint->interval);
+    }
+    packet->OnComplete();
   }
 }
 
@@ -238,6 +282,10 @@ int UsbDevice::OnControl(uint request, uint value, uint index, uint8_t* data, in
   case InterfaceOutRequest | USB_REQ_SET_INTERFACE:
     return SetInterface(index, value);
 
+  case EndpointOutRequest | USB_REQ_CLEAR_FEATURE:
+    /* ENDPOINT_HALT, the host controller resets the endpoint state */
+    return 0;
+
   case VendorDeviceRequest | 'Q':
   case VendorInterfaceRequest | 'Q':
     return GetMicrosoftOsDescriptor(index, data, length);
@@ -282,6 +330,35 @@ int UsbDevice::CopyStringsDescriptor(uint index, uint8_t* data, int length) {
   return pos;
 }
 
+int UsbDevice::CopyInterfaceDescriptor(const UsbInterfaceDescriptor* interface, uint8_t* data) {
+  int total_length = 0;
+  // interface
+  memcpy(&data[total_length], interface, interface->bLength);
+  total_length += interface->bLength;
+  // other
+  for (int j = 0; j < interface->ndesc; j++) {
+    auto other = &interface->descriptors[j];
+    uint length = other->data[0];
+    memcpy(&data[total_length], other->data, length);
+    total_length += length;
+  }
+  // endpoint
+  for (int j = 0; j < interface->bNumEndpoints; j++) {
+    auto endpoint = &interface->endpoints[j];
+    uint length = endpoint->is_audio ? endpoint->bLength : endpoint->bLength - 2;
+    memcpy(&data[total_length], endpoint, length);
+    data[total_length] = length;
+    total_length += length;
+
+    for (auto extra = endpoint->extra; extra && extra[0]; extra += length) {
+      length = extra[0];
+      memcpy(&data[total_length], extra, length);
+      total_length += length;
+    }
+  }
+  return total_length;
+}
+
 int UsbDevice::CopyConfigurationDescriptor(uint index, uint8_t* data, int length) {
   if (index >= device_descriptor_->bNumConfigurations) {
     return USB_RET_IOERROR;
@@ -295,32 +372,12 @@ int UsbDevice::CopyConfigurationDescriptor(uint index, uint8_t* data, int length
   memcpy(&buffer[wTotalLength], config, config->bLength);
   wTotalLength += config->bLength;
 
-  // Copy interfaces
+  // Copy interfaces and their alternate settings
   for (int i = 0; i < config->bNumInterfaces; i++) {
-    // interface
     auto interface = &config->interfaces[i];
-    memcpy(&buffer[wTotalLength], interface, interface->bLength);
-    wTotalLength += interface->bLength;
-    // other
-    for (int j = 0; j < interface->ndesc; j++) {
-      auto other = &interface->descriptors[j];
-      uint length = other->data[0];
-      memcpy(&buffer[wTotalLength], other->data, length);
-      wTotalLength += length;
-    }
-    // endpoint
-    for (int j = 0; j < interface->bNumEndpoints; j++) {
-      auto endpoint = &interface->endpoints[j];
-      uint length = endpoint->is_audio ? endpoint->bLength : endpoint->bLength - 2;
-      memcpy(&buffer[wTotalLength], endpoint, length);
-      buffer[wTotalLength] = length;
-      wTotalLength += length;
-
-      if (endpoint->extra) {
-        length = endpoint->extra[0];
-        memcpy(&buffer[wTotalLength], endpoint->extra, length);
-        wTotalLength += length;
-      }
+    wTotalLength += CopyInterfaceDescriptor(interface, &buffer[wTotalLength]);
+    for (int j = 0; j < interface->nalternates; j++) {
+      wTotalLength += CopyInterfaceDescriptor(&interface->alternates[j], &buffer[wTotalLength]);
     }
   }
 
@@ -351,6 +408,18 @@ int UsbDevice::GetDescriptor(uint value, uint8_t* data, int length) {
   case USB_DT_STRING:
     return CopyStringsDescriptor(index, data, length);
 
+  case USB_DT_BOS: {
+    if (!bos_descriptor_) {
+      return USB_RET_STALL;
+    }
+    int total_length = *(uint16_t*)&bos_descriptor_[2];
+    if (length > total_length) {
+      length = total_length;
+    }
+    memcpy(data, bos_descriptor_, length);
+    return length;
+  }
+
   default:
     MV_PANIC("unknown type=%d", type);
     return USB_RET_STALL;
@@ -358,8 +427,18 @@ int UsbDevice::GetDescriptor(uint value, uint8_t* data, int length) {
 }
 
 int UsbDevice::GetStatus(uint8_t* data, int length) {
-  MV_PANIC("not impl");
-  return USB_RET_STALL;
+  if (length < 2) {
+    return USB_RET_STALL;
+  }
+  data[0] = 0;
+  data[1] = 0;
+  if (config_ && (config_->bmAttributes & USB_CFG_ATT_SELFPOWER)) {
+    data[0] |= 1 << USB_DEVICE_SELF_POWERED;
+  }
+  if (remote_wakeup_) {
+    data[0] |= 1 << USB_DEVICE_REMOTE_WAKEUP;
+  }
+  return 2;
 }
 
 int UsbDevice::SetConfiguration(uint value) {
@@ -375,18 +454,9 @@ int UsbDevice::SetConfiguration(uint value) {
     if (c->bConfigurationValue == value) {
       config_ = c;
       configuration_value_ = value;
-      /* initialize interfaces */
+      /* initialize interfaces with alternate setting 0 */
       for (uint j = 0; j < config_->bNumInterfaces; j++) {
-        auto interface = &config_->interfaces[j];
-        for (uint k = 0; k < interface->bNumEndpoints; k++) {
-          auto desc = &interface->endpoints[k];
-          /* create endpoint */
-          endpoints_.push_back(new UsbEndpoint {
-            .address = desc->bEndpointAddress,
-            .type = UsbEndpointType(desc->bmAttributes & 3),
-            .interface = j
-          });
-        }
+        CreateEndpoints(j, &config_->interfaces[j]);
       }
     }
   }
@@ -394,8 +464,66 @@ int UsbDevice::SetConfiguration(uint value) {
 }
 
 int UsbDevice::SetInterface(uint index, uint value) {
-  MV_PANIC("not implemented");
-  return USB_RET_STALL;
+  if (!config_ || index >= config_->bNumInterfaces) {
+    return USB_RET_STALL;
+  }
+  auto interface = FindInterface(index, value);
+  if (!interface) {
+    return USB_RET_STALL;
+  }
+
+  RemoveEndpoints(index);
+  CreateEndpoints(index, interface);
+  alternate_settings_[index] = value;
+  return 0;
+}
+
+const UsbInterfaceDescriptor* UsbDevice::FindInterface(uint index, uint alternate_setting) {
+  auto interface = &config_->interfaces[index];
+  if (alternate_setting == 0) {
+    return interface;
+  }
+  for (uint i = 0; i < interface->nalternates; i++) {
+    if (interface->alternates[i].bAlternateSetting == alternate_setting) {
+      return &interface->alternates[i];
+    }
+  }
+  return nullptr;
+}
+
+void UsbDevice::CreateEndpoints(uint index, const UsbInterfaceDescriptor* interface) {
+  for (uint k = 0; k < interface->bNumEndpoints; k++) {
+    auto desc = &interface->endpoints[k];
+    AddEndpoint(desc->bEndpointAddress, UsbEndpointType(desc->bmAttributes & 3), index);
+  }
+}
+
+UsbEndpoint* UsbDevice::AddEndpoint(uint address, UsbEndpointType type, uint interface) {
+  auto endpoint = new UsbEndpoint {
+    .address = address,
+    .type = type,
+    .interface = interface
+  };
+  endpoints_.push_back(endpoint);
+  return endpoint;
+}
+
+void UsbDevice::RemoveEndpoints(uint index) {
+  for (auto it = endpoints_.begin(); it != endpoints_.end();) {
+    auto endpoint = *it;
+    if (endpoint->interface != index) {
+      ++it;
+      continue;
+    }
+    if (endpoint->timer) {
+      manager_->io()->RemoveTimer(endpoint->timer);
+    }
+    for (auto packet : endpoint->tokens) {
+      packet->endpoint = nullptr;
+    }
+    delete endpoint;
+    it = endpoints_.erase(it);
+  }
 }
 
 UsbEndpoint* UsbDevice::FindEndpoint(uint address) {
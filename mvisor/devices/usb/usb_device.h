@@ -22,7 +22,7 @@
 #include "device.h"
 #include "usb_descriptor.h"
 #include <sys/uio.h>
-#include <set>
+#include <deque>
 #include "io_thread.h"
 
 #define USB_MAX_INTERFACES 16
@@ -45,10 +45,11 @@ struct UsbPacket;
 struct UsbEndpoint {
   uint                    address;
   UsbEndpointType         type;
-  std::set<UsbPacket*>    tokens;
+  std::deque<UsbPacket*>  tokens;
   uint                    interface;
+  /* for interrupt/isoch endpoints, in microseconds, set by the host controller */
   uint                    interval;
-  /* for interrupt/isoch endpoints */
+  IoTimePoint             next_service_time;
   IoTimer*                timer;
 };
 
@@ -75,15 +76,17 @@ class UsbDevice : public Device {
   UsbPacket* CreatePacket(uint endpoint_address, uint stream_id, uint64_t id, VoidCallback on_complete);
   bool HandlePacket(UsbPacket* packet);
   void CancelPacket(UsbPacket* packet);
+  void SetEndpointInterval(uint endpoint_address, uint interval_us);
   virtual void Reset();
 
  protected:
-  int speed_;
+  int speed_ = kUsbSpeedHigh;
   UsbEndpoint control_endpoint_;
   std::vector<UsbEndpoint*> endpoints_;
   const UsbDeviceDescriptor* device_descriptor_ = nullptr;
   const UsbStringsDescriptor* strings_descriptor_ = nullptr;
   const UsbConfigurationDescriptor* config_ = nullptr;
+  const uint8_t* bos_descriptor_ = nullptr;
   uint8_t configuration_value_ = 0;
   bool remote_wakeup_ = false;
   int alternate_settings_[16] = { 0 };
@@ -93,16 +96,23 @@ class UsbDevice : public Device {
   /* Low level interfaces */
   virtual void OnControlPacket(UsbPacket* packet);
   virtual void OnDataPacket(UsbPacket* packet);
+  /* Called if a packet returned USB_RET_ASYNC is released by the host controller */
+  virtual void OnCancelPacket(UsbPacket* packet);
 
   virtual int OnControl(uint request, uint value, uint index, uint8_t* data, int length);
   virtual int OnInputData(uint endpoint_address, uint8_t* data, int length);
   virtual int OnOutputData(uint endpoint_address, uint8_t* data, int length);
 
   UsbEndpoint* FindEndpoint(uint endpoint_address);
+  UsbEndpoint* AddEndpoint(uint address, UsbEndpointType type, uint interface);
+  void RemoveEndpoints(uint index);
   virtual void NotifyEndpoint(uint endpoint_address);
+  void CopyPacketData(UsbPacket* packet, uint8_t* data, int length);
 
  private:
-  void CopyPacketData(UsbPacket* packet, uint8_t* data, int length);
+  const UsbInterfaceDescriptor* FindInterface(uint number, uint alternate_setting);
+  void CreateEndpoints(uint index, const UsbInterfaceDescriptor* interface);
+  int CopyInterfaceDescriptor(const UsbInterfaceDescriptor* interface, uint8_t* data);
   int CopyConfigurationDescriptor(uint index, uint8_t* data, int length);
   int CopyStringsDescriptor(uint index, uint8_t* data, int length);
   int GetDescriptor(uint value, uint8_t* data, int length);
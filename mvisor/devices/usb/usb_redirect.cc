@@ -0,0 +1,914 @@
+/*
+ * MVisor USB Redirection
+ * Copyright (C) 2022 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "usb_device.h"
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <sys/un.h>
+#include "usb.h"
+#include "device_manager.h"
+#include "utilities.h"
+#include "logger.h"
+
+/* https://gitlab.freedesktop.org/spice/usbredir/-/blob/main/docs/usb-redirection-protocol.md */
+#define USBREDIR_VERSION  "mvisor usbredir 0.1"
+
+enum UsbRedirType {
+  kUsbRedirHello = 0,
+  kUsbRedirDeviceConnect,
+  kUsbRedirDeviceDisconnect,
+  kUsbRedirReset,
+  kUsbRedirInterfaceInfo,
+  kUsbRedirEpInfo,
+  kUsbRedirSetConfiguration,
+  kUsbRedirGetConfiguration,
+  kUsbRedirConfigurationStatus,
+  kUsbRedirSetAltSetting,
+  kUsbRedirGetAltSetting,
+  kUsbRedirAltSettingStatus,
+  kUsbRedirStartIsoStream,
+  kUsbRedirStopIsoStream,
+  kUsbRedirIsoStreamStatus,
+  kUsbRedirStartInterruptReceiving,
+  kUsbRedirStopInterruptReceiving,
+  kUsbRedirInterruptReceivingStatus,
+  kUsbRedirAllocBulkStreams,
+  kUsbRedirFreeBulkStreams,
+  kUsbRedirBulkStreamsStatus,
+  kUsbRedirCancelDataPacket,
+  kUsbRedirFilterReject,
+  kUsbRedirFilterFilter,
+  kUsbRedirDeviceDisconnectAck,
+  kUsbRedirControlPacket = 100,
+  kUsbRedirBulkPacket,
+  kUsbRedirIsoPacket,
+  kUsbRedirInterruptPacket
+};
+
+enum UsbRedirCapability {
+  kUsbRedirCapBulkStreams = 0,
+  kUsbRedirCapConnectDeviceVersion,
+  kUsbRedirCapFilter,
+  kUsbRedirCapDeviceDisconnectAck,
+  kUsbRedirCapEpInfoMaxPacketSize,
+  kUsbRedirCap64BitsIds,
+  kUsbRedirCap32BitsBulkLength
+};
+
+enum UsbRedirStatus {
+  kUsbRedirSuccess = 0,
+  kUsbRedirCancelled,
+  kUsbRedirInvalid,
+  kUsbRedirIoError,
+  kUsbRedirStall,
+  kUsbRedirTimeout,
+  kUsbRedirBabble
+};
+
+#define USBREDIR_EP_TYPE_INVALID  255
+#define USBREDIR_MAX_ENDPOINTS    32
+/* Buffered interrupt and isochronous input packets of each endpoint */
+#define USBREDIR_MAX_BUFFERED     32
+
+struct UsbRedirHelloHeader {
+  char      version[64];
+  uint32_t  capabilities[1];
+} __attribute__((packed));
+
+struct UsbRedirDeviceConnectHeader {
+  uint8_t   speed;
+  uint8_t   device_class;
+  uint8_t   device_subclass;
+  uint8_t   device_protocol;
+  uint16_t  vendor_id;
+  uint16_t  product_id;
+  uint16_t  device_version_bcd;
+} __attribute__((packed));
+
+struct UsbRedirEpInfoHeader {
+  uint8_t   type[USBREDIR_MAX_ENDPOINTS];
+  uint8_t   interval[USBREDIR_MAX_ENDPOINTS];
+  uint8_t   interface[USBREDIR_MAX_ENDPOINTS];
+  uint16_t  max_packet_size[USBREDIR_MAX_ENDPOINTS];
+} __attribute__((packed));
+
+struct UsbRedirConfigurationStatusHeader {
+  uint8_t   status;
+  uint8_t   configuration;
+} __attribute__((packed));
+
+struct UsbRedirAltSettingStatusHeader {
+  uint8_t   status;
+  uint8_t   interface;
+  uint8_t   alt;
+} __attribute__((packed));
+
+struct UsbRedirControlPacketHeader {
+  uint8_t   endpoint;
+  uint8_t   request;
+  uint8_t   requesttype;
+  uint8_t   status;
+  uint16_t  value;
+  uint16_t  index;
+  uint16_t  length;
+} __attribute__((packed));
+
+struct UsbRedirBulkPacketHeader {
+  uint8_t   endpoint;
+  uint8_t   status;
+  uint16_t  length;
+  uint32_t  stream_id;
+  uint16_t  length_high; /* with 32 bits bulk length capability */
+} __attribute__((packed));
+
+/* Also used for isochronous packets */
+struct UsbRedirInterruptPacketHeader {
+  uint8_t   endpoint;
+  uint8_t   status;
+  uint16_t  length;
+} __attribute__((packed));
+
+struct UsbRedirStartIsoStreamHeader {
+  uint8_t   endpoint;
+  uint8_t   pkts_per_urb;
+  uint8_t   no_urbs;
+} __attribute__((packed));
+
+struct UsbRedirStreamStatusHeader {
+  uint8_t   status;
+  uint8_t   endpoint;
+} __attribute__((packed));
+
+struct UsbRedirPendingPacket {
+  UsbPacket*  packet;
+  uint        request;
+};
+
+struct UsbRedirEndpoint {
+  uint8_t   type = USBREDIR_EP_TYPE_INVALID;
+  uint8_t   interface;
+  bool      receiving;
+  std::deque<std::vector<uint8_t>> buffered;
+};
+
+/* Forwards a USB device from a usbredir host (e.g. usbredirect) connected by a Unix
+ * socket. Control requests are sent to the real device except SET_ADDRESS, which is
+ * handled by the host controller. Bulk and interrupt OUT packets are completed when
+ * the peer replies. Since the queued tokens of an endpoint are all submitted before
+ * any reply, bulk transfers are pipelined instead of stop-and-wait.
+ */
+class UsbRedirect : public UsbDevice {
+ private:
+  std::recursive_mutex  mutex_;
+  std::string           socket_path_;
+  int                   fd_ = -1;
+  bool                  connecting_ = false;
+  bool                  can_write_ = false;
+  std::string           output_buffer_;
+  std::vector<uint8_t>  input_buffer_;
+  IoTimer*              reconnect_timer_ = nullptr;
+
+  uint32_t              capabilities_;
+  uint32_t              peer_capabilities_ = 0;
+  bool                  peer_hello_ = false;
+  bool                  device_connected_ = false;
+  uint64_t              next_packet_id_ = 1;
+
+  std::map<uint64_t, UsbRedirPendingPacket> pending_packets_;
+  /* control packets received before the device is connected */
+  std::deque<UsbPacket*>  waiting_packets_;
+  UsbRedirEndpoint        endpoints_info_[USBREDIR_MAX_ENDPOINTS];
+  /* completed packets and endpoints to notify, handled with mutex unlocked */
+  std::vector<UsbPacket*> completed_packets_;
+  std::vector<uint>       notify_endpoints_;
+
+ public:
+  UsbRedirect() {
+    capabilities_ = (1 << kUsbRedirCapConnectDeviceVersion) | (1 << kUsbRedirCapDeviceDisconnectAck) |
+      (1 << kUsbRedirCapEpInfoMaxPacketSize) | (1 << kUsbRedirCap64BitsIds) |
+      (1 << kUsbRedirCap32BitsBulkLength);
+  }
+
+  virtual void Connect() {
+    UsbDevice::Connect();
+
+    if (!has_key("socket")) {
+      MV_PANIC("usb-redirect requires a socket path");
+    }
+    socket_path_ = std::get<std::string>(key_values_["socket"]);
+
+    /* The host controller attaches devices to ports by speed before the peer connects */
+    if (has_key("speed")) {
+      std::string speed = std::get<std::string>(key_values_["speed"]);
+      if (speed == "low") {
+        speed_ = kUsbSpeedLow;
+      } else if (speed == "full") {
+        speed_ = kUsbSpeedFull;
+      } else if (speed == "super") {
+        speed_ = kUsbSpeedSuper;
+      } else {
+        speed_ = kUsbSpeedHigh;
+      }
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    ConnectSocket();
+  }
+
+  virtual void Disconnect() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (reconnect_timer_) {
+      manager_->io()->RemoveTimer(reconnect_timer_);
+      reconnect_timer_ = nullptr;
+    }
+    CloseSocket();
+    UsbDevice::Disconnect();
+  }
+
+  virtual void Reset() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    bool configured = configuration_value_ > 0;
+    UsbDevice::Reset();
+
+    for (uint i = 0; i < USBREDIR_MAX_ENDPOINTS; i++) {
+      StopReceiving(i);
+    }
+    /* Devices are reset again when the slot is addressed, only reset the real device once */
+    if (configured && device_connected_) {
+      Send(kUsbRedirReset, 0, nullptr, 0);
+    }
+    UpdateEndpoints();
+  }
+
+ protected:
+  virtual void OnControlPacket(UsbPacket* packet) {
+    std::unique_lock<std::recursive_mutex> lock(mutex_);
+    packet->status = USB_RET_ASYNC;
+    if (device_connected_) {
+      SubmitControlPacket(packet);
+    } else {
+      waiting_packets_.push_back(packet);
+    }
+    lock.unlock();
+    NotifyCompletedPackets();
+  }
+
+  virtual void OnDataPacket(UsbPacket* packet) {
+    std::unique_lock<std::recursive_mutex> lock(mutex_);
+    if (!device_connected_ || !packet->endpoint) {
+      packet->status = USB_RET_NODEV;
+      return;
+    }
+
+    uint index = GetEndpointIndex(packet->endpoint_address);
+    auto &info = endpoints_info_[index];
+    bool in = packet->endpoint_address & USB_DIR_IN;
+    switch (packet->endpoint->type)
+    {
+    case kUsbEndpointBulk:
+      SubmitBulkPacket(packet);
+      break;
+    case kUsbEndpointInterrupt:
+      if (in) {
+        if (!info.receiving) {
+          uint8_t endpoint = packet->endpoint_address;
+          Send(kUsbRedirStartInterruptReceiving, 0, &endpoint, sizeof(endpoint));
+          info.receiving = true;
+        }
+        ReceiveBuffered(packet, info, USB_RET_NAK);
+      } else {
+        SubmitInterruptPacket(packet);
+      }
+      break;
+    case kUsbEndpointIsochronous:
+      if (!info.receiving) {
+        UsbRedirStartIsoStreamHeader header = {
+          .endpoint = (uint8_t)packet->endpoint_address,
+          .pkts_per_urb = uint8_t(speed_ >= kUsbSpeedHigh ? 32 : 8),
+          .no_urbs = 3
+        };
+        Send(kUsbRedirStartIsoStream, 0, &header, sizeof(header));
+        info.receiving = true;
+      }
+      if (in) {
+        /* isochronous IN packets are not retried, return an empty packet if no data */
+        ReceiveBuffered(packet, info, USB_RET_SUCCESS);
+      } else {
+        UsbRedirInterruptPacketHeader header = {
+          .endpoint = (uint8_t)packet->endpoint_address,
+          .status = kUsbRedirSuccess,
+          .length = (uint16_t)packet->size
+        };
+        SendPacketData(kUsbRedirIsoPacket, next_packet_id_++, &header, sizeof(header), packet, packet->size);
+        packet->status = USB_RET_SUCCESS;
+      }
+      break;
+    default:
+      packet->status = USB_RET_STALL;
+      break;
+    }
+  }
+
+  virtual void OnCancelPacket(UsbPacket* packet) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto waiting = std::find(waiting_packets_.begin(), waiting_packets_.end(), packet);
+    if (waiting != waiting_packets_.end()) {
+      waiting_packets_.erase(waiting);
+      return;
+    }
+    for (auto it = pending_packets_.begin(); it != pending_packets_.end(); ++it) {
+      if (it->second.packet == packet) {
+        /* the reply of a cancelled packet is dropped */
+        Send(kUsbRedirCancelDataPacket, it->first, nullptr, 0);
+        pending_packets_.erase(it);
+        break;
+      }
+    }
+  }
+
+ private:
+  bool HasCapability(int capability) {
+    return peer_hello_ && (capabilities_ & peer_capabilities_ & (1 << capability));
+  }
+
+  size_t GetHeaderSize() {
+    return HasCapability(kUsbRedirCap64BitsIds) ? 16 : 12;
+  }
+
+  uint GetEndpointIndex(uint address) {
+    return ((address & 0x80) >> 3) | (address & 0x0F);
+  }
+
+  /* The socket is connected without blocking the IO thread, the connection is
+   * finished when the socket becomes writable
+   */
+  void ConnectSocket() {
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    MV_ASSERT(fd_ >= 0);
+
+    sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, socket_path_.c_str(), sizeof(address.sun_path) - 1);
+    if (connect(fd_, (sockaddr*)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+      if (debug_) {
+        MV_LOG("failed to connect %s, retry later", socket_path_.c_str());
+      }
+      safe_close(&fd_);
+      ScheduleReconnect();
+      return;
+    }
+
+    connecting_ = true;
+    can_write_ = false;
+    manager_->io()->StartPolling(fd_, EPOLLIN | EPOLLOUT | EPOLLET, [this](auto events) {
+      std::unique_lock<std::recursive_mutex> lock(mutex_);
+      if (connecting_) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) || !FinishConnect()) {
+          return;
+        }
+      }
+      if (events & EPOLLOUT) {
+        can_write_ = true;
+        FlushOutput();
+      }
+      if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ReadSocket();
+      }
+      lock.unlock();
+      NotifyCompletedPackets();
+    });
+  }
+
+  /* Returns false if the connection failed, then a reconnect is scheduled */
+  bool FinishConnect() {
+    connecting_ = false;
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error) {
+      if (debug_) {
+        MV_LOG("failed to connect %s, error=%d, retry later", socket_path_.c_str(), error);
+      }
+      CloseSocket();
+      ScheduleReconnect();
+      return false;
+    }
+    can_write_ = true;
+
+    /* Send hello with 32-bit ids, the capabilities are negotiated after hello */
+    UsbRedirHelloHeader hello;
+    bzero(&hello, sizeof(hello));
+    strncpy(hello.version, USBREDIR_VERSION, sizeof(hello.version) - 1);
+    hello.capabilities[0] = capabilities_;
+    Send(kUsbRedirHello, 0, &hello, sizeof(hello));
+    return true;
+  }
+
+  void CloseSocket() {
+    if (fd_ == -1) {
+      return;
+    }
+    manager_->io()->StopPolling(fd_);
+    safe_close(&fd_);
+    connecting_ = false;
+    output_buffer_.clear();
+    input_buffer_.clear();
+    peer_hello_ = false;
+    peer_capabilities_ = 0;
+    OnDeviceDisconnected();
+  }
+
+  void ScheduleReconnect() {
+    if (reconnect_timer_) {
+      return;
+    }
+    reconnect_timer_ = manager_->io()->AddTimer(1000, false, [this]() {
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      reconnect_timer_ = nullptr;
+      ConnectSocket();
+    });
+  }
+
+  void Send(uint32_t type, uint64_t id, const void* header, size_t header_length,
+    const void* data = nullptr, size_t data_length = 0) {
+    /* Nothing is sent before hello */
+    if (fd_ == -1 || connecting_) {
+      return;
+    }
+    AppendMessageHeader(type, id, header, header_length, data_length);
+    if (data_length) {
+      output_buffer_.append((char*)data, data_length);
+    }
+    FlushOutput();
+  }
+
+  /* OUT data is appended from the packet iovecs without an intermediate copy */
+  void SendPacketData(uint32_t type, uint64_t id, const void* header, size_t header_length,
+    UsbPacket* packet, size_t length) {
+    MV_ASSERT(packet->content_length + length <= packet->size);
+    packet->content_length += length;
+    if (fd_ == -1 || connecting_) {
+      return;
+    }
+    AppendMessageHeader(type, id, header, header_length, length);
+    size_t left = length;
+    for (auto &v : packet->iov) {
+      size_t copy = std::min(left, v.iov_len);
+      output_buffer_.append((char*)v.iov_base, copy);
+      left -= copy;
+      if (left == 0)
+        break;
+    }
+    FlushOutput();
+  }
+
+  void AppendMessageHeader(uint32_t type, uint64_t id, const void* header, size_t header_length,
+    size_t data_length) {
+    uint32_t length = header_length + data_length;
+    output_buffer_.append((char*)&type, sizeof(type));
+    output_buffer_.append((char*)&length, sizeof(length));
+    if (GetHeaderSize() == 16) {
+      output_buffer_.append((char*)&id, sizeof(id));
+    } else {
+      uint32_t id32 = id;
+      output_buffer_.append((char*)&id32, sizeof(id32));
+    }
+    if (header_length) {
+      output_buffer_.append((char*)header, header_length);
+    }
+  }
+
+  void FlushOutput() {
+    while (can_write_ && !output_buffer_.empty()) {
+      ssize_t ret = send(fd_, output_buffer_.data(), output_buffer_.size(), MSG_NOSIGNAL);
+      if (ret < 0) {
+        if (errno == EAGAIN) {
+          can_write_ = false;
+        } else {
+          MV_ERROR("failed to write %s, errno=%d", socket_path_.c_str(), errno);
+          output_buffer_.clear();
+        }
+        return;
+      }
+      output_buffer_.erase(0, ret);
+    }
+  }
+
+  void ReadSocket() {
+    uint8_t buffer[65536];
+    while (fd_ != -1) {
+      ssize_t ret = recv(fd_, buffer, sizeof(buffer), 0);
+      if (ret < 0 && errno == EAGAIN) {
+        break;
+      }
+      if (ret <= 0) {
+        MV_LOG("usbredir peer %s disconnected", socket_path_.c_str());
+        CloseSocket();
+        ScheduleReconnect();
+        return;
+      }
+      input_buffer_.insert(input_buffer_.end(), buffer, buffer + ret);
+    }
+
+    size_t offset = 0;
+    while (fd_ != -1) {
+      size_t header_size = GetHeaderSize();
+      if (input_buffer_.size() - offset < header_size) {
+        break;
+      }
+      auto ptr = &input_buffer_[offset];
+      uint32_t type = *(uint32_t*)&ptr[0];
+      uint32_t length = *(uint32_t*)&ptr[4];
+      uint64_t id = header_size == 16 ? *(uint64_t*)&ptr[8] : *(uint32_t*)&ptr[8];
+      if (input_buffer_.size() - offset < header_size + length) {
+        break;
+      }
+      offset += header_size + length;
+      OnMessage(type, id, ptr + header_size, length);
+    }
+    if (fd_ != -1) {
+      input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + offset);
+    }
+  }
+
+  void OnMessage(uint32_t type, uint64_t id, uint8_t* data, size_t length) {
+    if (debug_) {
+      MV_LOG("usbredir type=%u id=%lu length=%lu", type, id, length);
+    }
+    switch (type)
+    {
+    case kUsbRedirHello: {
+      auto hello = (UsbRedirHelloHeader*)data;
+      if (length >= sizeof(UsbRedirHelloHeader)) {
+        peer_capabilities_ = hello->capabilities[0];
+      }
+      peer_hello_ = true;
+      MV_LOG("usbredir peer version: %.64s", hello->version);
+      break;
+    }
+    case kUsbRedirDeviceConnect:
+      OnDeviceConnected((UsbRedirDeviceConnectHeader*)data, length);
+      break;
+    case kUsbRedirDeviceDisconnect:
+      OnDeviceDisconnected();
+      if (HasCapability(kUsbRedirCapDeviceDisconnectAck)) {
+        Send(kUsbRedirDeviceDisconnectAck, 0, nullptr, 0);
+      }
+      break;
+    case kUsbRedirInterfaceInfo:
+      break;
+    case kUsbRedirEpInfo:
+      OnEpInfo((UsbRedirEpInfoHeader*)data, length);
+      break;
+    case kUsbRedirConfigurationStatus: {
+      auto status = (UsbRedirConfigurationStatusHeader*)data;
+      CompleteControlStatus(id, status->status, status->configuration);
+      break;
+    }
+    case kUsbRedirAltSettingStatus: {
+      auto status = (UsbRedirAltSettingStatusHeader*)data;
+      CompleteControlStatus(id, status->status, status->alt);
+      break;
+    }
+    case kUsbRedirIsoStreamStatus:
+    case kUsbRedirInterruptReceivingStatus: {
+      auto status = (UsbRedirStreamStatusHeader*)data;
+      if (status->status != kUsbRedirSuccess) {
+        endpoints_info_[GetEndpointIndex(status->endpoint)].receiving = false;
+        if (debug_) {
+          MV_LOG("endpoint 0x%x stopped receiving, status=%u", status->endpoint, status->status);
+        }
+      }
+      break;
+    }
+    case kUsbRedirFilterReject:
+      MV_ERROR("usbredir peer rejected the device");
+      break;
+    case kUsbRedirControlPacket: {
+      auto header = (UsbRedirControlPacketHeader*)data;
+      size_t header_length = sizeof(*header);
+      CompleteDataPacket(id, header->status, data + header_length, length - header_length);
+      break;
+    }
+    case kUsbRedirBulkPacket: {
+      size_t header_length = sizeof(UsbRedirBulkPacketHeader);
+      if (!HasCapability(kUsbRedirCap32BitsBulkLength)) {
+        header_length -= sizeof(uint16_t);
+      }
+      auto header = (UsbRedirBulkPacketHeader*)data;
+      CompleteDataPacket(id, header->status, data + header_length, length - header_length);
+      break;
+    }
+    case kUsbRedirIsoPacket:
+    case kUsbRedirInterruptPacket: {
+      auto header = (UsbRedirInterruptPacketHeader*)data;
+      size_t header_length = sizeof(*header);
+      if (header->endpoint & USB_DIR_IN) {
+        OnInputData(header, data + header_length, length - header_length);
+      } else {
+        CompleteDataPacket(id, header->status, nullptr, 0);
+      }
+      break;
+    }
+    default:
+      if (debug_) {
+        MV_LOG("unhandled usbredir type=%u", type);
+      }
+      break;
+    }
+  }
+
+  void OnDeviceConnected(UsbRedirDeviceConnectHeader* header, size_t length) {
+    static const int speeds[] = { kUsbSpeedLow, kUsbSpeedFull, kUsbSpeedHigh, kUsbSpeedSuper };
+    if (header->speed < 4 && speeds[header->speed] != speed_) {
+      MV_ERROR("usbredir device speed %u mismatches the configured speed %d", header->speed, speed_);
+    }
+    MV_LOG("usbredir device %04x:%04x connected", header->vendor_id, header->product_id);
+
+    device_connected_ = true;
+    while (!waiting_packets_.empty()) {
+      auto packet = waiting_packets_.front();
+      waiting_packets_.pop_front();
+      SubmitControlPacket(packet);
+    }
+  }
+
+  void OnDeviceDisconnected() {
+    if (!device_connected_) {
+      return;
+    }
+    device_connected_ = false;
+    for (auto &it : pending_packets_) {
+      it.second.packet->status = USB_RET_NODEV;
+      completed_packets_.push_back(it.second.packet);
+    }
+    pending_packets_.clear();
+    for (uint i = 0; i < USBREDIR_MAX_ENDPOINTS; i++) {
+      endpoints_info_[i].receiving = false;
+      endpoints_info_[i].buffered.clear();
+    }
+  }
+
+  /* The endpoints are updated after the configuration or alternate setting changes */
+  void OnEpInfo(UsbRedirEpInfoHeader* header, size_t length) {
+    for (uint i = 0; i < USBREDIR_MAX_ENDPOINTS; i++) {
+      auto &info = endpoints_info_[i];
+      if (info.type != header->type[i] || info.interface != header->interface[i]) {
+        info.receiving = false;
+        info.buffered.clear();
+      }
+      info.type = header->type[i];
+      info.interface = header->interface[i];
+    }
+    UpdateEndpoints();
+  }
+
+  void UpdateEndpoints() {
+    for (uint i = 0; i < USBREDIR_MAX_ENDPOINTS; i++) {
+      auto &info = endpoints_info_[i];
+      uint address = ((i & 0x10) << 3) | (i & 0x0F);
+      if ((address & 0x0F) == 0 || info.type == USBREDIR_EP_TYPE_INVALID) {
+        continue;
+      }
+      auto endpoint = FindEndpoint(address);
+      if (endpoint) {
+        endpoint->type = UsbEndpointType(info.type);
+        endpoint->interface = info.interface;
+      } else {
+        AddEndpoint(address, UsbEndpointType(info.type), info.interface);
+      }
+    }
+  }
+
+  void StopReceiving(uint index) {
+    auto &info = endpoints_info_[index];
+    if (info.receiving) {
+      uint8_t endpoint = ((index & 0x10) << 3) | (index & 0x0F);
+      Send(info.type == kUsbEndpointIsochronous ? kUsbRedirStopIsoStream : kUsbRedirStopInterruptReceiving,
+        0, &endpoint, sizeof(endpoint));
+      info.receiving = false;
+    }
+    info.buffered.clear();
+  }
+
+  void SubmitControlPacket(UsbPacket* packet) {
+    uint8_t* setup = (uint8_t*)&packet->control_parameter;
+    uint request = (setup[0] << 8) | setup[1];
+    uint16_t value = (setup[3] << 8) | setup[2];
+    uint16_t index = (setup[5] << 8) | setup[4];
+    uint16_t length = (setup[7] << 8) | setup[6];
+    uint64_t id = next_packet_id_++;
+
+    /* Configuration and interface requests are handled by the peer */
+    switch (request)
+    {
+    case DeviceOutRequest | USB_REQ_SET_CONFIGURATION: {
+      uint8_t configuration = value;
+      Send(kUsbRedirSetConfiguration, id, &configuration, sizeof(configuration));
+      break;
+    }
+    case DeviceRequest | USB_REQ_GET_CONFIGURATION:
+      Send(kUsbRedirGetConfiguration, id, nullptr, 0);
+      break;
+    case InterfaceOutRequest | USB_REQ_SET_INTERFACE: {
+      uint8_t header[2] = { (uint8_t)index, (uint8_t)value };
+      Send(kUsbRedirSetAltSetting, id, header, sizeof(header));
+      break;
+    }
+    case InterfaceRequest | USB_REQ_GET_INTERFACE: {
+      uint8_t interface = index;
+      Send(kUsbRedirGetAltSetting, id, &interface, sizeof(interface));
+      break;
+    }
+    default: {
+      UsbRedirControlPacketHeader header = {
+        .endpoint = (uint8_t)(setup[0] & USB_DIR_IN),
+        .request = setup[1],
+        .requesttype = setup[0],
+        .status = kUsbRedirSuccess,
+        .value = value,
+        .index = index,
+        .length = length
+      };
+      if (setup[0] & USB_DIR_IN) {
+        Send(kUsbRedirControlPacket, id, &header, sizeof(header));
+      } else {
+        SendPacketData(kUsbRedirControlPacket, id, &header, sizeof(header), packet, length);
+      }
+      break;
+    }
+    }
+    pending_packets_[id] = UsbRedirPendingPacket { packet, request };
+  }
+
+  void SubmitBulkPacket(UsbPacket* packet) {
+    if (packet->size >= 0x10000 && !HasCapability(kUsbRedirCap32BitsBulkLength)) {
+      MV_ERROR("bulk packet size=0x%lx is not supported by peer", packet->size);
+      packet->status = USB_RET_STALL;
+      return;
+    }
+    uint64_t id = next_packet_id_++;
+    UsbRedirBulkPacketHeader header = {
+      .endpoint = (uint8_t)packet->endpoint_address,
+      .status = kUsbRedirSuccess,
+      .length = uint16_t(packet->size & 0xFFFF),
+      .stream_id = packet->stream_id,
+      .length_high = uint16_t(packet->size >> 16)
+    };
+    size_t header_length = sizeof(header);
+    if (!HasCapability(kUsbRedirCap32BitsBulkLength)) {
+      header_length -= sizeof(uint16_t);
+    }
+    if (packet->endpoint_address & USB_DIR_IN) {
+      Send(kUsbRedirBulkPacket, id, &header, header_length);
+    } else {
+      SendPacketData(kUsbRedirBulkPacket, id, &header, header_length, packet, packet->size);
+    }
+    packet->status = USB_RET_ASYNC;
+    pending_packets_[id] = UsbRedirPendingPacket { packet, 0 };
+  }
+
+  void SubmitInterruptPacket(UsbPacket* packet) {
+    uint64_t id = next_packet_id_++;
+    UsbRedirInterruptPacketHeader header = {
+      .endpoint = (uint8_t)packet->endpoint_address,
+      .status = kUsbRedirSuccess,
+      .length = (uint16_t)packet->size
+    };
+    SendPacketData(kUsbRedirInterruptPacket, id, &header, sizeof(header), packet, packet->size);
+    packet->status = USB_RET_ASYNC;
+    pending_packets_[id] = UsbRedirPendingPacket { packet, 0 };
+  }
+
+  void ReceiveBuffered(UsbPacket* packet, UsbRedirEndpoint& info, int empty_status) {
+    if (info.buffered.empty()) {
+      packet->status = empty_status;
+      return;
+    }
+    auto &data = info.buffered.front();
+    size_t length = data.size();
+    packet->status = USB_RET_SUCCESS;
+    if (length > packet->size) {
+      length = packet->size;
+      packet->status = USB_RET_BABBLE;
+    }
+    CopyPacketData(packet, data.data(), length);
+    info.buffered.pop_front();
+  }
+
+  /* Interrupt or isochronous input data */
+  void OnInputData(UsbRedirInterruptPacketHeader* header, uint8_t* data, size_t length) {
+    auto &info = endpoints_info_[GetEndpointIndex(header->endpoint)];
+    if (header->status != kUsbRedirSuccess || !info.receiving) {
+      return;
+    }
+    if (info.buffered.size() >= USBREDIR_MAX_BUFFERED) {
+      info.buffered.pop_front();
+    }
+    info.buffered.emplace_back(data, data + length);
+    if (info.type == kUsbEndpointInterrupt) {
+      notify_endpoints_.push_back(header->endpoint);
+    }
+  }
+
+  int TranslateStatus(uint8_t status) {
+    switch (status)
+    {
+    case kUsbRedirSuccess:
+      return USB_RET_SUCCESS;
+    case kUsbRedirStall:
+      return USB_RET_STALL;
+    case kUsbRedirBabble:
+      return USB_RET_BABBLE;
+    default:
+      return USB_RET_IOERROR;
+    }
+  }
+
+  void CompleteDataPacket(uint64_t id, uint8_t status, uint8_t* data, size_t length) {
+    auto it = pending_packets_.find(id);
+    if (it == pending_packets_.end()) {
+      return;
+    }
+    auto packet = it->second.packet;
+    pending_packets_.erase(it);
+
+    packet->status = TranslateStatus(status);
+    if (packet->endpoint_address & USB_DIR_IN) {
+      if (length > packet->size) {
+        length = packet->size;
+        packet->status = USB_RET_BABBLE;
+      }
+      if (length > 0) {
+        CopyPacketData(packet, data, length);
+      }
+    }
+    completed_packets_.push_back(packet);
+  }
+
+  void CompleteControlStatus(uint64_t id, uint8_t status, uint8_t value) {
+    auto it = pending_packets_.find(id);
+    if (it == pending_packets_.end()) {
+      return;
+    }
+    auto packet = it->second.packet;
+    uint request = it->second.request;
+    pending_packets_.erase(it);
+
+    packet->status = TranslateStatus(status);
+    if (packet->status == USB_RET_SUCCESS) {
+      switch (request)
+      {
+      case DeviceOutRequest | USB_REQ_SET_CONFIGURATION:
+        configuration_value_ = value;
+        break;
+      case DeviceRequest | USB_REQ_GET_CONFIGURATION:
+      case InterfaceRequest | USB_REQ_GET_INTERFACE:
+        if (packet->size > 0) {
+          CopyPacketData(packet, &value, 1);
+        }
+        break;
+      }
+    }
+    completed_packets_.push_back(packet);
+  }
+
+  /* OnComplete() locks the host controller, so it's called with our mutex unlocked */
+  void NotifyCompletedPackets() {
+    std::vector<UsbPacket*> packets;
+    std::vector<uint> endpoints;
+    {
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      packets.swap(completed_packets_);
+      endpoints.swap(notify_endpoints_);
+    }
+    for (auto packet : packets) {
+      packet->OnComplete();
+    }
+    for (auto address : endpoints) {
+      if (FindEndpoint(address)) {
+        NotifyEndpoint(address);
+      }
+    }
+  }
+};
+
+DECLARE_DEVICE(UsbRedirect);
@@ -0,0 +1,1067 @@
+/*
+ * MVisor USB Storage
+ * Copyright (C) 2022 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "usb_device.h"
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include "usb_descriptor.h"
+#include "usb.h"
+#include "disk_image.h"
+#include "device_manager.h"
+#include "logger.h"
+
+/*
+ *  SENSE KEYS
+ */
+
+#define NO_SENSE            0x00
+#define NOT_READY           0x02
+#define MEDIUM_ERROR        0x03
+#define ILLEGAL_REQUEST     0x05
+#define DATA_PROTECT        0x07
+#define ABORTED_COMMAND     0x0b
+
+#define ASC_WRITE_ERROR                      0x0c
+#define ASC_READ_ERROR                       0x11
+#define ASC_ILLEGAL_OPCODE                   0x20
+#define ASC_LOGICAL_BLOCK_OOR                0x21
+#define ASC_INV_FIELD_IN_CDB                 0x24
+#define ASC_WRITE_PROTECTED                  0x27
+
+#define SCSI_STATUS_GOOD                     0x00
+#define SCSI_STATUS_CHECK_CONDITION          0x02
+
+/* Bulk-only transport */
+#define BOT_CBW_SIGNATURE   0x43425355
+#define BOT_CSW_SIGNATURE   0x53425355
+#define BOT_CBW_DATA_IN     0x80
+#define BOT_CSW_PASSED      0
+#define BOT_CSW_FAILED      1
+
+/* USB attached SCSI information units */
+#define UAS_IU_COMMAND          0x01
+#define UAS_IU_SENSE            0x03
+#define UAS_IU_RESPONSE         0x04
+#define UAS_IU_TASK_MANAGEMENT  0x05
+
+#define UAS_TMF_ABORT_TASK      0x01
+#define UAS_RC_TMF_COMPLETE     0x00
+#define UAS_RC_INVALID_IU       0x02
+#define UAS_RC_TMF_NOT_SUPPORTED 0x04
+#define UAS_RC_OVERLAPPED_TAG   0x0a
+
+#define UAS_PIPE_COMMAND    0x01
+#define UAS_PIPE_STATUS     0x82
+#define UAS_PIPE_DATA_IN    0x83
+#define UAS_PIPE_DATA_OUT   0x04
+
+#define UAS_MAX_STREAMS_SHIFT 5
+
+struct BotCommandBlockWrapper {
+  uint32_t  signature;
+  uint32_t  tag;
+  uint32_t  data_length;
+  uint8_t   flags;
+  uint8_t   lun;
+  uint8_t   cdb_length;
+  uint8_t   cdb[16];
+} __attribute__((packed));
+
+struct BotCommandStatusWrapper {
+  uint32_t  signature;
+  uint32_t  tag;
+  uint32_t  residue;
+  uint8_t   status;
+} __attribute__((packed));
+
+struct UasCommandIu {
+  uint8_t   id;
+  uint8_t   reserved;
+  uint16_t  tag;        /* big endian */
+  uint8_t   priority_attribute;
+  uint8_t   reserved2;
+  uint8_t   additional_cdb_length;
+  uint8_t   reserved3;
+  uint64_t  lun;
+  uint8_t   cdb[16];
+} __attribute__((packed));
+
+struct UasTaskManagementIu {
+  uint8_t   id;
+  uint8_t   reserved;
+  uint16_t  tag;
+  uint8_t   function;
+  uint8_t   reserved2;
+  uint16_t  task_tag;
+  uint64_t  lun;
+} __attribute__((packed));
+
+struct UasSenseIu {
+  uint8_t   id;
+  uint8_t   reserved;
+  uint16_t  tag;
+  uint16_t  status_qualifier;
+  uint8_t   status;
+  uint8_t   reserved2[7];
+  uint16_t  sense_length;
+  uint8_t   sense[18];
+} __attribute__((packed));
+
+struct UasResponseIu {
+  uint8_t   id;
+  uint8_t   reserved;
+  uint16_t  tag;
+  uint8_t   additional_info[3];
+  uint8_t   response_code;
+} __attribute__((packed));
+
+struct ScsiSense {
+  uint8_t   key;
+  uint8_t   asc;
+  uint8_t   ascq;
+};
+
+/* A SCSI command, or a UAS task management function if is_task_management is set */
+struct StorageRequest {
+  uint16_t              tag;
+  uint8_t               cdb[16];
+  bool                  is_task_management;
+  uint8_t               response_code;
+  bool                  data_in;
+  /* bytes to transfer for data-out, or bytes available for data-in when completed */
+  size_t                data_length;
+  /* BOT host expected length from CBW */
+  size_t                host_length;
+  size_t                transferred;
+  std::vector<uint8_t>  buffer;
+  off_t                 position;
+  bool                  completed;
+  bool                  canceled;
+  uint8_t               status;
+  ScsiSense             sense;
+};
+
+enum BotState {
+  kBotCommand,
+  kBotData,
+  kBotStatus
+};
+
+enum {
+  STR_MANUFACTURER = 1,
+  STR_PRODUCT,
+  STR_CONFIG,
+  STR_SERIAL
+};
+
+static const UsbStringsDescriptor strings_desc = {
+  [0] = "",
+  [STR_MANUFACTURER]     = "Tenclass",
+  [STR_PRODUCT]          = "Tenclass USB Storage",
+  [STR_CONFIG]           = "Mass Storage",
+  [STR_SERIAL]           = "20220617",
+};
+
+/* SuperSpeed endpoint companion, bMaxBurst = 15 */
+static const uint8_t bulk_companion_desc[] = {
+  6, USB_DT_ENDPOINT_COMPANION, 15, 0, 0, 0,
+  0
+};
+
+/* UAS pipes, the status and data pipes support 2 ^ UAS_MAX_STREAMS_SHIFT streams */
+static const uint8_t uas_command_pipe_desc[] = {
+  6, USB_DT_ENDPOINT_COMPANION, 15, 0, 0, 0,
+  4, USB_DT_CS_INTERFACE, 1, 0,
+  0
+};
+
+static const uint8_t uas_status_pipe_desc[] = {
+  6, USB_DT_ENDPOINT_COMPANION, 15, UAS_MAX_STREAMS_SHIFT, 0, 0,
+  4, USB_DT_CS_INTERFACE, 2, 0,
+  0
+};
+
+static const uint8_t uas_data_in_pipe_desc[] = {
+  6, USB_DT_ENDPOINT_COMPANION, 15, UAS_MAX_STREAMS_SHIFT, 0, 0,
+  4, USB_DT_CS_INTERFACE, 3, 0,
+  0
+};
+
+static const uint8_t uas_data_out_pipe_desc[] = {
+  6, USB_DT_ENDPOINT_COMPANION, 15, UAS_MAX_STREAMS_SHIFT, 0, 0,
+  4, USB_DT_CS_INTERFACE, 4, 0,
+  0
+};
+
+static const UsbInterfaceDescriptor uas_interfaces[] = {
+  {
+    .bInterfaceNumber   = 0,
+    .bAlternateSetting  = 1,
+    .bNumEndpoints      = 4,
+    .bInterfaceClass    = USB_CLASS_MASS_STORAGE,
+    .bInterfaceSubClass = 0x06, /* SCSI */
+    .bInterfaceProtocol = 0x62, /* UAS */
+    .endpoints = (UsbEndpointDescriptor[]) {
+      {
+        .bEndpointAddress      = UAS_PIPE_COMMAND,
+        .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize        = 1024,
+        .extra                 = uas_command_pipe_desc
+      },
+      {
+        .bEndpointAddress      = UAS_PIPE_STATUS,
+        .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize        = 1024,
+        .extra                 = uas_status_pipe_desc
+      },
+      {
+        .bEndpointAddress      = UAS_PIPE_DATA_IN,
+        .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize        = 1024,
+        .extra                 = uas_data_in_pipe_desc
+      },
+      {
+        .bEndpointAddress      = UAS_PIPE_DATA_OUT,
+        .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize        = 1024,
+        .extra                 = uas_data_out_pipe_desc
+      }
+    }
+  }
+};
+
+static const UsbEndpointDescriptor bot_endpoints[] = {
+  {
+    .bEndpointAddress      = USB_DIR_IN | 0x01,
+    .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+    .wMaxPacketSize        = 1024,
+    .extra                 = bulk_companion_desc
+  },
+  {
+    .bEndpointAddress      = USB_DIR_OUT | 0x02,
+    .bmAttributes          = USB_ENDPOINT_XFER_BULK,
+    .wMaxPacketSize        = 1024,
+    .extra                 = bulk_companion_desc
+  }
+};
+
+/* Alternate setting 0 is bulk-only transport, alternate setting 1 is UAS */
+static const UsbInterfaceDescriptor interfaces[] = {
+  {
+    .bInterfaceNumber   = 0,
+    .bNumEndpoints      = 2,
+    .bInterfaceClass    = USB_CLASS_MASS_STORAGE,
+    .bInterfaceSubClass = 0x06, /* SCSI */
+    .bInterfaceProtocol = 0x50, /* Bulk-only */
+    .endpoints          = bot_endpoints,
+    .nalternates        = 1,
+    .alternates         = uas_interfaces
+  }
+};
+
+static const UsbInterfaceDescriptor bot_interfaces[] = {
+  {
+    .bInterfaceNumber   = 0,
+    .bNumEndpoints      = 2,
+    .bInterfaceClass    = USB_CLASS_MASS_STORAGE,
+    .bInterfaceSubClass = 0x06, /* SCSI */
+    .bInterfaceProtocol = 0x50, /* Bulk-only */
+    .endpoints          = bot_endpoints
+  }
+};
+
+static const UsbConfigurationDescriptor configurations[] = {
+  {
+    .bNumInterfaces        = 1,
+    .bConfigurationValue   = 1,
+    .iConfiguration        = STR_CONFIG,
+    .bmAttributes          = USB_CFG_ATT_ONE | USB_CFG_ATT_SELFPOWER,
+    .bMaxPower             = 2, /* 8mA units at SuperSpeed */
+    .interfaces = interfaces
+  }
+};
+
+static const UsbConfigurationDescriptor bot_configurations[] = {
+  {
+    .bNumInterfaces        = 1,
+    .bConfigurationValue   = 1,
+    .iConfiguration        = STR_CONFIG,
+    .bmAttributes          = USB_CFG_ATT_ONE | USB_CFG_ATT_SELFPOWER,
+    .bMaxPower             = 2,
+    .interfaces = bot_interfaces
+  }
+};
+
+static const UsbDeviceDescriptor device_desc = {
+  .bcdUSB                        = 0x0300,
+  .bMaxPacketSize0               = 9, /* 2 ^ 9 = 512 bytes */
+  .idVendor                      = 0x46F4,
+  .idProduct                     = 0x0001,
+  .bcdDevice                     = 0,
+  .iManufacturer                 = STR_MANUFACTURER,
+  .iProduct                      = STR_PRODUCT,
+  .iSerialNumber                 = STR_SERIAL,
+  .bNumConfigurations            = 1,
+  .configurations = configurations
+};
+
+static const UsbDeviceDescriptor bot_device_desc = {
+  .bcdUSB                        = 0x0300,
+  .bMaxPacketSize0               = 9,
+  .idVendor                      = 0x46F4,
+  .idProduct                     = 0x0001,
+  .bcdDevice                     = 0,
+  .iManufacturer                 = STR_MANUFACTURER,
+  .iProduct                      = STR_PRODUCT,
+  .iSerialNumber                 = STR_SERIAL,
+  .bNumConfigurations            = 1,
+  .configurations = bot_configurations
+};
+
+/* USB 2.0 extension (LPM) and SuperSpeed device capabilities */
+static const uint8_t bos_desc[] = {
+  5, USB_DT_BOS, 22, 0, 2,
+  7, USB_DT_DEVICE_CAPABILITY, 0x02, 0x02, 0x00, 0x00, 0x00,
+  10, USB_DT_DEVICE_CAPABILITY, 0x03, 0x00, 0x0E, 0x00, 0x01, 0x0A, 0xFF, 0x07
+};
+
+/* A SuperSpeed SCSI disk backed by a disk image. Guests supporting UAS switch to
+ * alternate setting 1, and each command is identified by its stream ID. All
+ * packets are handled on the IO thread, data packets which could not be answered
+ * immediately are held by the device and completed when the disk IO is done.
+ */
+class UsbStorage : public UsbDevice {
+ private:
+  std::recursive_mutex  mutex_;
+  DiskImage*            image_ = nullptr;
+  bool                  readonly_ = false;
+  size_t                block_size_ = 512;
+  uint64_t              total_blocks_ = 0;
+  ScsiSense             sense_;
+  /* packets completed by the device, they are notified with mutex unlocked */
+  std::vector<UsbPacket*> completed_packets_;
+
+  /* bulk-only transport */
+  BotState                          bot_state_ = kBotCommand;
+  std::shared_ptr<StorageRequest>   bot_request_;
+  std::deque<UsbPacket*>            bot_in_packets_;
+
+  /* USB attached SCSI, packets are indexed by stream ID */
+  std::map<uint, std::shared_ptr<StorageRequest>> uas_requests_;
+  std::map<uint, UsbPacket*>        uas_status_packets_;
+  std::map<uint, UsbPacket*>        uas_data_in_packets_;
+  std::map<uint, UsbPacket*>        uas_data_out_packets_;
+
+ public:
+  UsbStorage() {
+    speed_ = kUsbSpeedSuper;
+    bos_descriptor_ = bos_desc;
+    bzero(&sense_, sizeof(sense_));
+  }
+
+  virtual void Connect() {
+    UsbDevice::Connect();
+
+    if (!has_key("image")) {
+      MV_PANIC("usb-storage requires an image");
+    }
+    if (has_key("readonly")) {
+      readonly_ = std::get<bool>(key_values_["readonly"]);
+    }
+    std::string path = std::get<std::string>(key_values_["image"]);
+    image_ = DiskImage::Create(this, path, readonly_);
+
+    auto info = image_->information();
+    block_size_ = info.block_size;
+    total_blocks_ = info.total_blocks;
+
+    bool uas = true;
+    if (has_key("uas")) {
+      uas = std::get<bool>(key_values_["uas"]);
+    }
+    SetupDescriptor(uas ? &device_desc : &bot_device_desc, &strings_desc);
+  }
+
+  virtual void Disconnect() {
+    if (image_) {
+      delete image_;
+      image_ = nullptr;
+    }
+    UsbDevice::Disconnect();
+  }
+
+  virtual void Reset() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    UsbDevice::Reset();
+    ResetTransport();
+    bzero(&sense_, sizeof(sense_));
+  }
+
+ protected:
+  virtual int OnControl(uint request, uint value, uint index, uint8_t* data, int length) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    switch (request)
+    {
+    case ClassInterfaceOutRequest | 0xFF: /* Bulk-Only Mass Storage Reset */
+      ResetTransport();
+      return 0;
+    case ClassInterfaceRequest | 0xFE: /* Get Max LUN */
+      data[0] = 0;
+      return 1;
+    case InterfaceOutRequest | USB_REQ_SET_INTERFACE:
+      /* switching between BOT and UAS drops all pending commands */
+      ResetTransport();
+      break;
+    }
+    return UsbDevice::OnControl(request, value, index, data, length);
+  }
+
+  virtual void OnDataPacket(UsbPacket* packet) {
+    std::unique_lock<std::recursive_mutex> lock(mutex_);
+    packet->status = USB_RET_SUCCESS;
+    if (alternate_settings_[0] == 1) {
+      OnUasPacket(packet);
+    } else {
+      OnBotPacket(packet);
+    }
+
+    /* the caller completes the current packet */
+    auto it = std::find(completed_packets_.begin(), completed_packets_.end(), packet);
+    if (it != completed_packets_.end()) {
+      completed_packets_.erase(it);
+    }
+    lock.unlock();
+    NotifyCompletedPackets();
+  }
+
+  virtual void OnCancelPacket(UsbPacket* packet) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto it = std::find(bot_in_packets_.begin(), bot_in_packets_.end(), packet);
+    if (it != bot_in_packets_.end()) {
+      bot_in_packets_.erase(it);
+    }
+    for (auto packets : { &uas_status_packets_, &uas_data_in_packets_, &uas_data_out_packets_ }) {
+      auto it = packets->find(packet->stream_id);
+      if (it != packets->end() && it->second == packet) {
+        packets->erase(it);
+      }
+    }
+  }
+
+ private:
+  /* Pending disk IO is not interrupted, the completion is ignored */
+  void ResetTransport() {
+    if (bot_request_) {
+      bot_request_->canceled = true;
+      bot_request_.reset();
+    }
+    bot_state_ = kBotCommand;
+    bot_in_packets_.clear();
+
+    for (auto &it : uas_requests_) {
+      it.second->canceled = true;
+    }
+    uas_requests_.clear();
+    uas_status_packets_.clear();
+    uas_data_in_packets_.clear();
+    uas_data_out_packets_.clear();
+    completed_packets_.clear();
+  }
+
+  void CompletePacket(UsbPacket* packet, uint8_t* data, size_t length) {
+    if (length > packet->size) {
+      length = packet->size;
+    }
+    if (length > 0) {
+      CopyPacketData(packet, data, length);
+    }
+    packet->status = USB_RET_SUCCESS;
+    completed_packets_.push_back(packet);
+  }
+
+  /* OnComplete() locks the host controller, so it's called with our mutex unlocked */
+  void NotifyCompletedPackets() {
+    std::vector<UsbPacket*> packets;
+    {
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      packets.swap(completed_packets_);
+    }
+    for (auto packet : packets) {
+      packet->OnComplete();
+    }
+  }
+
+  void OnBotPacket(UsbPacket* packet) {
+    if (packet->endpoint_address & USB_DIR_IN) {
+      packet->status = USB_RET_ASYNC;
+      bot_in_packets_.push_back(packet);
+      ServiceBot();
+      return;
+    }
+
+    if (bot_state_ == kBotCommand) {
+      BotCommandBlockWrapper cbw;
+      if (packet->size != sizeof(cbw)) {
+        MV_ERROR("invalid CBW size=%lu", packet->size);
+        packet->status = USB_RET_STALL;
+        return;
+      }
+      CopyPacketData(packet, (uint8_t*)&cbw, sizeof(cbw));
+      if (cbw.signature != BOT_CBW_SIGNATURE || cbw.cdb_length == 0 || cbw.cdb_length > 16) {
+        MV_ERROR("invalid CBW signature=0x%x cdb_length=%u", cbw.signature, cbw.cdb_length);
+        packet->status = USB_RET_STALL;
+        return;
+      }
+
+      auto request = CreateRequest(cbw.tag, cbw.cdb, cbw.cdb_length);
+      request->host_length = cbw.data_length;
+      request->data_in = cbw.flags & BOT_CBW_DATA_IN;
+      bot_request_ = request;
+      bot_state_ = request->host_length ? kBotData : kBotStatus;
+      ExecuteCommand(request);
+      CheckBotDataOut(request.get());
+    } else if (bot_state_ == kBotData && bot_request_ && !bot_request_->data_in) {
+      auto request = bot_request_;
+      size_t length = packet->size;
+      if (request->transferred + length > request->host_length) {
+        length = request->host_length - request->transferred;
+      }
+      if (request->transferred < request->buffer.size()) {
+        size_t copy = std::min(length, request->buffer.size() - request->transferred);
+        CopyPacketData(packet, &request->buffer[request->transferred], copy);
+      }
+      /* discard the rest, or all data if the command has failed */
+      packet->content_length = packet->size;
+      request->transferred += length;
+      if (request->transferred >= request->host_length || length < packet->size) {
+        bot_state_ = kBotStatus;
+      }
+      if (!request->completed && request->transferred >= request->data_length) {
+        WriteBlocks(request);
+      }
+      CheckBotDataOut(request.get());
+    } else {
+      MV_ERROR("unexpected BOT OUT packet in state %d", bot_state_);
+      packet->status = USB_RET_STALL;
+      return;
+    }
+    ServiceBot();
+  }
+
+  /* The data-out stage ended before all blocks of a write command are received */
+  void CheckBotDataOut(StorageRequest* request) {
+    if (bot_state_ == kBotStatus && !request->completed && request->transferred < request->data_length) {
+      SetError(request, ILLEGAL_REQUEST, ASC_INV_FIELD_IN_CDB);
+    }
+  }
+
+  void ServiceBot() {
+    while (!bot_in_packets_.empty() && bot_request_) {
+      auto packet = bot_in_packets_.front();
+      auto request = bot_request_;
+
+      if (bot_state_ == kBotData && request->data_in) {
+        if (!request->completed) {
+          break;
+        }
+        size_t available = 0;
+        if (request->transferred < request->data_length) {
+          available = request->data_length - request->transferred;
+        }
+        size_t length = std::min(packet->size, request->host_length - request->transferred);
+        length = std::min(length, available);
+        bot_in_packets_.pop_front();
+        CompletePacket(packet, request->buffer.data() + request->transferred, length);
+        request->transferred += length;
+        /* a short packet ends the data stage */
+        if (request->transferred >= request->host_length || length < packet->size) {
+          bot_state_ = kBotStatus;
+        }
+      } else if (bot_state_ == kBotStatus) {
+        if (!request->completed) {
+          break;
+        }
+        BotCommandStatusWrapper csw = {
+          .signature = BOT_CSW_SIGNATURE,
+          .tag = request->tag,
+          .residue = uint32_t(request->host_length - std::min(request->host_length, request->transferred)),
+          .status = uint8_t(request->status == SCSI_STATUS_GOOD ? BOT_CSW_PASSED : BOT_CSW_FAILED)
+        };
+        bot_in_packets_.pop_front();
+        CompletePacket(packet, (uint8_t*)&csw, sizeof(csw));
+        bot_request_.reset();
+        bot_state_ = kBotCommand;
+      } else {
+        /* IN token during command stage or data-out stage */
+        break;
+      }
+    }
+  }
+
+  void OnUasPacket(UsbPacket* packet) {
+    switch (packet->endpoint_address)
+    {
+    case UAS_PIPE_COMMAND:
+      OnUasCommand(packet);
+      break;
+    case UAS_PIPE_STATUS:
+    case UAS_PIPE_DATA_IN:
+    case UAS_PIPE_DATA_OUT: {
+      auto &packets = packet->endpoint_address == UAS_PIPE_STATUS ? uas_status_packets_ :
+        packet->endpoint_address == UAS_PIPE_DATA_IN ? uas_data_in_packets_ : uas_data_out_packets_;
+      if (packets.find(packet->stream_id) != packets.end()) {
+        MV_ERROR("stream %u of endpoint 0x%x is busy", packet->stream_id, packet->endpoint_address);
+        packet->status = USB_RET_STALL;
+        return;
+      }
+      packet->status = USB_RET_ASYNC;
+      packets[packet->stream_id] = packet;
+      ServiceUas(packet->stream_id);
+      break;
+    }
+    default:
+      packet->status = USB_RET_STALL;
+      break;
+    }
+  }
+
+  void OnUasCommand(UsbPacket* packet) {
+    uint8_t iu[64] = { 0 };
+    size_t length = std::min(packet->size, sizeof(iu));
+    CopyPacketData(packet, iu, length);
+
+    auto command = (UasCommandIu*)iu;
+    uint16_t tag = be16toh(command->tag);
+    std::shared_ptr<StorageRequest> request;
+
+    switch (command->id)
+    {
+    case UAS_IU_COMMAND:
+      request = CreateRequest(tag, command->cdb, sizeof(command->cdb));
+      break;
+    case UAS_IU_TASK_MANAGEMENT: {
+      auto tmf = (UasTaskManagementIu*)iu;
+      request = CreateRequest(tag, nullptr, 0);
+      request->is_task_management = true;
+      request->completed = true;
+      if (tmf->function == UAS_TMF_ABORT_TASK) {
+        uint16_t task_tag = be16toh(tmf->task_tag);
+        auto it = uas_requests_.find(task_tag);
+        if (it != uas_requests_.end()) {
+          it->second->canceled = true;
+          uas_requests_.erase(it);
+        }
+        request->response_code = UAS_RC_TMF_COMPLETE;
+      } else {
+        request->response_code = UAS_RC_TMF_NOT_SUPPORTED;
+      }
+      break;
+    }
+    default:
+      MV_ERROR("invalid UAS IU id=0x%x", command->id);
+      request = CreateRequest(tag, nullptr, 0);
+      request->is_task_management = true;
+      request->completed = true;
+      request->response_code = UAS_RC_INVALID_IU;
+      break;
+    }
+
+    if (uas_requests_.find(tag) != uas_requests_.end()) {
+      MV_ERROR("overlapped UAS tag=%u", tag);
+      request->is_task_management = true;
+      request->completed = true;
+      request->response_code = UAS_RC_OVERLAPPED_TAG;
+      uas_requests_[tag]->canceled = true;
+    }
+    uas_requests_[tag] = request;
+    if (!request->is_task_management) {
+      ExecuteCommand(request);
+    }
+    ServiceUas(tag);
+  }
+
+  void ServiceUas(uint tag) {
+    auto it = uas_requests_.find(tag);
+    if (it == uas_requests_.end()) {
+      return;
+    }
+    auto request = it->second;
+
+    if (request->is_task_management) {
+      auto status_it = uas_status_packets_.find(tag);
+      if (status_it == uas_status_packets_.end()) {
+        return;
+      }
+      UasResponseIu response = {
+        .id = UAS_IU_RESPONSE,
+        .tag = htobe16(request->tag),
+        .response_code = request->response_code
+      };
+      CompletePacket(status_it->second, (uint8_t*)&response, sizeof(response));
+      uas_status_packets_.erase(status_it);
+      uas_requests_.erase(it);
+      return;
+    }
+
+    /* data stage */
+    if (request->data_in) {
+      auto data_it = uas_data_in_packets_.find(tag);
+      if (request->completed && data_it != uas_data_in_packets_.end() &&
+          request->transferred < request->data_length) {
+        auto packet = data_it->second;
+        size_t length = std::min(packet->size, request->data_length - request->transferred);
+        CompletePacket(packet, request->buffer.data() + request->transferred, length);
+        request->transferred += length;
+        uas_data_in_packets_.erase(data_it);
+      }
+    } else {
+      auto data_it = uas_data_out_packets_.find(tag);
+      if (data_it != uas_data_out_packets_.end() && request->transferred < request->data_length) {
+        auto packet = data_it->second;
+        size_t length = std::min(packet->size, request->data_length - request->transferred);
+        CopyPacketData(packet, &request->buffer[request->transferred], length);
+        packet->content_length = packet->size;
+        request->transferred += length;
+        packet->status = USB_RET_SUCCESS;
+        completed_packets_.push_back(packet);
+        uas_data_out_packets_.erase(data_it);
+        if (request->transferred >= request->data_length) {
+          WriteBlocks(request);
+        }
+      }
+    }
+
+    /* status stage */
+    if (!request->completed || request->transferred < request->data_length) {
+      return;
+    }
+    auto status_it = uas_status_packets_.find(tag);
+    if (status_it == uas_status_packets_.end()) {
+      return;
+    }
+    UasSenseIu sense_iu;
+    bzero(&sense_iu, sizeof(sense_iu));
+    sense_iu.id = UAS_IU_SENSE;
+    sense_iu.tag = htobe16(request->tag);
+    sense_iu.status = request->status;
+    size_t length = offsetof(UasSenseIu, sense);
+    if (request->status != SCSI_STATUS_GOOD) {
+      sense_iu.sense_length = htobe16(sizeof(sense_iu.sense));
+      FillSenseData(request->sense, sense_iu.sense);
+      length = sizeof(sense_iu);
+    }
+    CompletePacket(status_it->second, (uint8_t*)&sense_iu, length);
+    uas_status_packets_.erase(status_it);
+    uas_requests_.erase(it);
+  }
+
+  /* Called when the disk IO of a request is done */
+  void OnRequestCompleted(std::shared_ptr<StorageRequest> request) {
+    std::unique_lock<std::recursive_mutex> lock(mutex_);
+    if (request->canceled) {
+      return;
+    }
+    if (alternate_settings_[0] == 1) {
+      ServiceUas(request->tag);
+    } else {
+      ServiceBot();
+    }
+    lock.unlock();
+    NotifyCompletedPackets();
+  }
+
+  std::shared_ptr<StorageRequest> CreateRequest(uint32_t tag, uint8_t* cdb, size_t cdb_length) {
+    auto request = std::make_shared<StorageRequest>();
+    request->tag = tag;
+    bzero(request->cdb, sizeof(request->cdb));
+    if (cdb) {
+      memcpy(request->cdb, cdb, std::min(cdb_length, sizeof(request->cdb)));
+    }
+    request->is_task_management = false;
+    request->response_code = 0;
+    request->data_in = false;
+    request->data_length = 0;
+    request->host_length = 0;
+    request->transferred = 0;
+    request->position = 0;
+    request->completed = false;
+    request->canceled = false;
+    request->status = SCSI_STATUS_GOOD;
+    bzero(&request->sense, sizeof(request->sense));
+    return request;
+  }
+
+  void FillSenseData(const ScsiSense& sense, uint8_t* data) {
+    bzero(data, 18);
+    data[0] = 0x70; /* current errors, fixed format */
+    data[2] = sense.key;
+    data[7] = 10;   /* additional sense length */
+    data[12] = sense.asc;
+    data[13] = sense.ascq;
+  }
+
+  void SetError(StorageRequest* request, uint8_t key, uint8_t asc) {
+    request->status = SCSI_STATUS_CHECK_CONDITION;
+    request->sense = { key, asc, 0 };
+    request->data_length = 0;
+    request->buffer.clear();
+    request->completed = true;
+    sense_ = request->sense;
+  }
+
+  /* Set the data-in response, truncated to the allocation length */
+  void SetResponse(StorageRequest* request, const uint8_t* data, size_t length, size_t allocation_length) {
+    length = std::min(length, allocation_length);
+    request->buffer.assign(data, data + length);
+    request->data_length = length;
+    request->data_in = true;
+    request->completed = true;
+  }
+
+  void ExecuteCommand(std::shared_ptr<StorageRequest> request) {
+    auto cdb = request->cdb;
+    uint64_t lba = 0;
+    uint32_t blocks = 0;
+    bool write = false;
+
+    switch (cdb[0])
+    {
+    case 0x00: // test unit ready
+    case 0x1B: // start stop unit
+    case 0x1E: // prevent allow medium removal
+    case 0x2F: // verify 10
+      request->completed = true;
+      return;
+    case 0x03: { // request sense
+      uint8_t data[18];
+      FillSenseData(sense_, data);
+      bzero(&sense_, sizeof(sense_));
+      SetResponse(request.get(), data, sizeof(data), cdb[4]);
+      return;
+    }
+    case 0x12: // inquiry
+      Inquiry(request.get());
+      return;
+    case 0x1A: // mode sense 6
+    case 0x5A: // mode sense 10
+      ModeSense(request.get());
+      return;
+    case 0x23: { // read format capacities
+      uint8_t data[12] = { 0 };
+      data[3] = 8;
+      *(uint32_t*)&data[4] = htobe32(std::min<uint64_t>(total_blocks_, 0xFFFFFFFF));
+      *(uint32_t*)&data[8] = htobe32(block_size_);
+      data[8] = 0x02; /* formatted media */
+      SetResponse(request.get(), data, sizeof(data), be16toh(*(uint16_t*)&cdb[7]));
+      return;
+    }
+    case 0x25: { // read capacity 10
+      uint8_t data[8];
+      *(uint32_t*)&data[0] = htobe32(std::min<uint64_t>(total_blocks_ - 1, 0xFFFFFFFF));
+      *(uint32_t*)&data[4] = htobe32(block_size_);
+      SetResponse(request.get(), data, sizeof(data), sizeof(data));
+      return;
+    }
+    case 0x9E: { // service action in 16
+      if ((cdb[1] & 0x1F) != 0x10) { // read capacity 16
+        SetError(request.get(), ILLEGAL_REQUEST, ASC_INV_FIELD_IN_CDB);
+        return;
+      }
+      uint8_t data[32] = { 0 };
+      *(uint64_t*)&data[0] = htobe64(total_blocks_ - 1);
+      *(uint32_t*)&data[8] = htobe32(block_size_);
+      SetResponse(request.get(), data, sizeof(data), be32toh(*(uint32_t*)&cdb[10]));
+      return;
+    }
+    case 0xA0: { // report luns
+      uint8_t data[16] = { 0 };
+      data[3] = 8;
+      SetResponse(request.get(), data, sizeof(data), be32toh(*(uint32_t*)&cdb[6]));
+      return;
+    }
+    case 0x35: // synchronize cache 10
+    case 0x91: // synchronize cache 16
+      image_->FlushAsync([this, request](ssize_t ret) {
+        if (ret < 0) {
+          SetError(request.get(), MEDIUM_ERROR, ASC_WRITE_ERROR);
+        }
+        request->completed = true;
+        OnRequestCompleted(request);
+      });
+      return;
+    case 0x0A: // write 6
+      write = true;
+    case 0x08: // read 6
+      lba = ((cdb[1] & 0x1F) << 16) | (cdb[2] << 8) | cdb[3];
+      blocks = cdb[4] ? cdb[4] : 256;
+      break;
+    case 0x2A: // write 10
+      write = true;
+    case 0x28: // read 10
+      lba = be32toh(*(uint32_t*)&cdb[2]);
+      blocks = be16toh(*(uint16_t*)&cdb[7]);
+      break;
+    case 0xAA: // write 12
+      write = true;
+    case 0xA8: // read 12
+      lba = be32toh(*(uint32_t*)&cdb[2]);
+      blocks = be32toh(*(uint32_t*)&cdb[6]);
+      break;
+    case 0x8A: // write 16
+      write = true;
+    case 0x88: // read 16
+      lba = be64toh(*(uint64_t*)&cdb[2]);
+      blocks = be32toh(*(uint32_t*)&cdb[10]);
+      break;
+    default:
+      if (debug_) {
+        MV_LOG("unsupported SCSI command 0x%x", cdb[0]);
+      }
+      SetError(request.get(), ILLEGAL_REQUEST, ASC_ILLEGAL_OPCODE);
+      return;
+    }
+
+    if (lba + blocks > total_blocks_) {
+      SetError(request.get(), ILLEGAL_REQUEST, ASC_LOGICAL_BLOCK_OOR);
+      return;
+    }
+    if (write && readonly_) {
+      SetError(request.get(), DATA_PROTECT, ASC_WRITE_PROTECTED);
+      return;
+    }
+
+    request->data_in = !write;
+    request->position = lba * block_size_;
+    request->data_length = blocks * block_size_;
+    request->buffer.resize(request->data_length);
+    if (request->data_length == 0) {
+      request->completed = true;
+    } else if (!write) {
+      image_->ReadAsync(request->buffer.data(), request->position, request->data_length,
+        [this, request](ssize_t ret) {
+        if (ret != (ssize_t)request->data_length) {
+          SetError(request.get(), MEDIUM_ERROR, ASC_READ_ERROR);
+        }
+        request->completed = true;
+        OnRequestCompleted(request);
+      });
+    }
+  }
+
+  /* Data-out stage is finished */
+  void WriteBlocks(std::shared_ptr<StorageRequest> request) {
+    image_->WriteAsync(request->buffer.data(), request->position, request->data_length,
+      [this, request](ssize_t ret) {
+      if (ret != (ssize_t)request->data_length) {
+        SetError(request.get(), MEDIUM_ERROR, ASC_WRITE_ERROR);
+      }
+      request->completed = true;
+      OnRequestCompleted(request);
+    });
+  }
+
+  void Inquiry(StorageRequest* request) {
+    auto cdb = request->cdb;
+    size_t allocation_length = be16toh(*(uint16_t*)&cdb[3]);
+    uint8_t data[96] = { 0 };
+    const char* serial = strings_desc[STR_SERIAL];
+
+    if (!(cdb[1] & 1)) {
+      if (cdb[2]) {
+        SetError(request, ILLEGAL_REQUEST, ASC_INV_FIELD_IN_CDB);
+        return;
+      }
+      data[0] = 0x00; /* direct access block device */
+      data[2] = 0x06; /* SPC-4 */
+      data[3] = 0x02; /* response data format */
+      data[4] = 36 - 5;
+      data[7] = 0x02; /* command queuing */
+      memcpy(&data[8], "Tenclass", 8);
+      memcpy(&data[16], "USB Storage     ", 16);
+      memcpy(&data[32], "1.0 ", 4);
+      SetResponse(request, data, 36, allocation_length);
+      return;
+    }
+
+    /* vital product data pages */
+    size_t length;
+    data[1] = cdb[2];
+    switch (cdb[2])
+    {
+    case 0x00: // supported pages
+      data[4] = 0x00;
+      data[5] = 0x80;
+      data[6] = 0x83;
+      length = 3;
+      break;
+    case 0x80: // unit serial number
+      length = strlen(serial);
+      memcpy(&data[4], serial, length);
+      break;
+    case 0x83: // device identification, T10 vendor ID based
+      data[4] = 0x02; /* ASCII */
+      data[5] = 0x01; /* T10 vendor ID */
+      memcpy(&data[8], "Tenclass", 8);
+      memcpy(&data[16], serial, strlen(serial));
+      data[7] = 8 + strlen(serial);
+      length = 4 + data[7];
+      break;
+    default:
+      SetError(request, ILLEGAL_REQUEST, ASC_INV_FIELD_IN_CDB);
+      return;
+    }
+    data[3] = length;
+    SetResponse(request, data, 4 + length, allocation_length);
+  }
+
+  void ModeSense(StorageRequest* request) {
+    auto cdb = request->cdb;
+    bool mode_sense_10 = cdb[0] == 0x5A;
+    uint page = cdb[2] & 0x3F;
+    size_t allocation_length = mode_sense_10 ? be16toh(*(uint16_t*)&cdb[7]) : cdb[4];
+    uint8_t data[64] = { 0 };
+    size_t header_length = mode_sense_10 ? 8 : 4;
+    size_t length = header_length;
+
+    if (page == 0x08 || page == 0x3F) {
+      /* caching page, write cache enabled */
+      data[length] = 0x08;
+      data[length + 1] = 0x12;
+      data[length + 2] = 0x04;
+      length += 20;
+    } else if (page != 0x00) {
+      SetError(request, ILLEGAL_REQUEST, ASC_INV_FIELD_IN_CDB);
+      return;
+    }
+
+    /* no block descriptors */
+    if (mode_sense_10) {
+      *(uint16_t*)&data[0] = htobe16(length - 2);
+      data[3] = readonly_ ? 0x80 : 0x00;
+    } else {
+      data[0] = length - 1;
+      data[2] = readonly_ ? 0x80 : 0x00;
+    }
+    SetResponse(request, data, length, allocation_length);
+  }
+};
+
+DECLARE_DEVICE(UsbStorage);
@@ -38,8 +38,31 @@ struct UsbPortState {
 struct XhciRing {
   bool      consumer_cycle_bit;
   uint64_t  dequeue;
+  /* host address of the guest page being consumed, to avoid translating every TRB */
+  uint64_t  cached_page;
+  uint8_t*  cached_hva;
 };
 
+/* Event ring and interrupt moderation state of an interrupter */
+struct XhciInterrupter {
+  uint8_t*      event_ring;
+  bool          pending;
+  IoTimePoint   next_interrupt_time;
+  IoTimer*      moderation_timer;
+};
+
+/* Primary stream context in the linear stream context array */
+struct XhciStream {
+  bool      valid;
+  XhciRing  ring;
+  uint32_t  type;
+  uint64_t  context_address;
+};
+
+#define STREAM_TYPE_SHIFT   1
+#define STREAM_TYPE_MASK    0x7
+#define STREAM_TYPE_PRIMARY 1
+
 struct XhciTransfer;
 struct XhciEndpointContext {
   uint      id;
@@ -50,6 +73,7 @@ struct XhciEndpointContext {
   bool      linear_stream_array;
   uint      interval;
   XhciRing  ring;
+  std::vector<XhciStream> streams;
   int64_t   mfindex_last;
   uint      state;
   uint      kick_active;
@@ -99,14 +123,15 @@ class XhciHost : public PciDevice {
     std::array<UsbPortState, 128> port_states_ = { 0 };
     std::array<XhciPortRegisters, 128> port_regs_ = { 0 };
     std::array<XhciInterruptRegisters, 128> interrupt_regs_ = { 0 };
+    std::array<XhciInterrupter, 128> interrupters_ = { 0 };
     std::array<XhciSlot, 128> slots_ = { 0 };
     XhciRing command_ring_;
     IoTimePoint microframe_index_start_;
     XhciCapabilityRegisters capability_regs_;
     XhciOperationalRegisters operational_regs_;
     XhciRuntimeRegisters runtime_regs_;
-    /* global mutex */
-    std::mutex mutex_;
+    /* global mutex, transfers may complete while kicking endpoints */
+    std::recursive_mutex mutex_;
 
  public:
   XhciHost() {
@@ -182,7 +207,8 @@ class XhciHost : public PciDevice {
     capability_regs_.max_ports = max_ports_;
     capability_regs_.hcs_params2 = 0x0000000F;
     capability_regs_.hcs_params3 = 0x00000000;
-    capability_regs_.capability_params1 = 0x00080001 | (max_pstreams_mask_ << 12);
+    /* 64-bit addressing, no secondary stream ID support */
+    capability_regs_.capability_params1 = 0x00080081 | (max_pstreams_mask_ << 12);
     capability_regs_.doorbell_offset = 0x2000;
     capability_regs_.runtime_registers_offset = 0x1000;
 
@@ -210,6 +236,13 @@ class XhciHost : public PciDevice {
     for (auto &interrupt: interrupt_regs_) {
       bzero(&interrupt, sizeof(interrupt));
       interrupt.producer_cycle_bit = true;
+      interrupt.moderation = 4000; /* 1ms */
+    }
+    for (auto &interrupter : interrupters_) {
+      if (interrupter.moderation_timer) {
+        manager_->io()->RemoveTimer(interrupter.moderation_timer);
+      }
+      interrupter = XhciInterrupter();
     }
     
     for (uint i = 0; i < max_ports_; i++) {
@@ -239,20 +272,22 @@ class XhciHost : public PciDevice {
     } else {
       WriteEvent(vector, event);
     }
-    RaiseInterrupt(vector);
+    ScheduleInterrupt(vector);
   }
 
+  /* The cycle bit is written last, so the guest never sees a partial event */
   void WriteEvent(uint vector, XhciEvent &event) {
     auto &interrupt = interrupt_regs_[vector];
-    auto addr = interrupt.event_ring_segment.start + interrupt.event_ring_enqueue_index * TRB_SIZE;
-    auto trb = (XhciTransferRequestBlock*)manager_->TranslateGuestMemory(addr);
+    auto trb = (XhciTransferRequestBlock*)(interrupters_[vector].event_ring +
+      interrupt.event_ring_enqueue_index * TRB_SIZE);
     trb->parameter = event.poniter;
     trb->status = event.length | (event.completion_code << 24);
-    trb->control = (event.slot_id << 24) | (event.endpoint_id << 16) |
+    uint32_t control = (event.slot_id << 24) | (event.endpoint_id << 16) |
       event.flags | (event.type << TRB_TYPE_SHIFT);
     if (interrupt.producer_cycle_bit) {
-      trb->control |= TRB_C;
+      control |= TRB_C;
     }
+    __atomic_store_n(&trb->control, control, __ATOMIC_RELEASE);
 
     interrupt.event_ring_enqueue_index++;
     if (interrupt.event_ring_enqueue_index >= interrupt.event_ring_segment.size) {
@@ -264,11 +299,22 @@ class XhciHost : public PciDevice {
   void SetupRing(XhciRing &ring, uint64_t base) {
     ring.consumer_cycle_bit = true;
     ring.dequeue = base;
+    ring.cached_hva = nullptr;
+  }
+
+  /* TRBs never cross a page, the page of the last access is cached */
+  void* TranslateRingAddress(XhciRing &ring, uint64_t address) {
+    uint64_t page = address & ~0xFFFULL;
+    if (!ring.cached_hva || ring.cached_page != page) {
+      ring.cached_hva = (uint8_t*)manager_->TranslateGuestMemory(page);
+      ring.cached_page = page;
+    }
+    return ring.cached_hva + (address & 0xFFF);
   }
 
   bool PopRing(XhciRing &ring, XhciTransferRequestBlock &trb) {
     while (true) {
-      void* hva = manager_->TranslateGuestMemory(ring.dequeue);
+      void* hva = TranslateRingAddress(ring, ring.dequeue);
       memcpy(&trb, hva, TRB_SIZE);
       trb.address = ring.dequeue;
       trb.cycle_bit = ring.consumer_cycle_bit;
@@ -311,6 +357,48 @@ class XhciHost : public PciDevice {
       MV_LOG("reset event ring[%d] start=0x%lX size=%d", index, segment.start, segment.size); 
     }
     MV_ASSERT(segment.size >= 16 && segment.size < 4096);
+    /* The segment is physically contiguous */
+    interrupters_[index].event_ring = (uint8_t*)manager_->TranslateGuestMemory(segment.start);
+  }
+
+  /* Events pushed in the same IO thread iteration are delivered by one interrupt, and
+   * interrupts are delayed to honour the moderation interval (IMODI, 250ns units).
+   * Intervals shorter than the IO thread timer resolution (1ms) are not throttled.
+   */
+  void ScheduleInterrupt(uint vector) {
+    auto &interrupter = interrupters_[vector];
+    if (interrupter.pending) {
+      return;
+    }
+    interrupter.pending = true;
+    manager_->io()->Schedule([this, vector]() {
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
+      ModerateInterrupt(vector);
+    });
+  }
+
+  void ModerateInterrupt(uint vector) {
+    auto &interrupter = interrupters_[vector];
+    if (!interrupter.pending || interrupter.moderation_timer) {
+      return;
+    }
+
+    auto interval = std::chrono::nanoseconds((interrupt_regs_[vector].moderation & 0xFFFF) * 250);
+    auto now = std::chrono::steady_clock::now();
+    if (interval >= std::chrono::milliseconds(1) && now < interrupter.next_interrupt_time) {
+      auto delay_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        interrupter.next_interrupt_time - now + std::chrono::microseconds(999)).count();
+      interrupter.moderation_timer = manager_->io()->AddTimer(delay_ms, false, [this, vector]() {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        interrupters_[vector].moderation_timer = nullptr;
+        ModerateInterrupt(vector);
+      });
+      return;
+    }
+
+    interrupter.pending = false;
+    interrupter.next_interrupt_time = now + interval;
+    RaiseInterrupt(vector);
   }
 
   void RaiseInterrupt(uint vector) {
@@ -383,7 +471,7 @@ class XhciHost : public PciDevice {
         uint64_t dequeue_index = (dequeue - segment.start) / TRB_SIZE;
         if (dequeue >= segment.start && dequeue < (segment.start + TRB_SIZE * segment.size) &&
           dequeue_index != interrupt.event_ring_enqueue_index) {
-          RaiseInterrupt(index);
+          ScheduleInterrupt(index);
         }
       }
       break;
@@ -807,7 +895,7 @@ class XhciHost : public PciDevice {
   /* ======================== Endpoint Functions ======================= */
 
   XhciEndpointContext* CreateEndpointContext(uint slot_id, uint endpoint_id, uint32_t* context) {
-    auto endpoint = new XhciEndpointContext { 0 };
+    auto endpoint = new XhciEndpointContext();
     endpoint->id = endpoint_id;
     endpoint->slot_id = slot_id;
 
@@ -819,7 +907,10 @@ class XhciHost : public PciDevice {
     endpoint->max_pstreams = (context[0] >> 10) & max_pstreams_mask_;
     endpoint->linear_stream_array = (context[0] >> 15) & 1;
     if (endpoint->max_pstreams) {
-      MV_PANIC("not implemented");
+      /* Secondary stream arrays are disabled by HCCPARAMS1.NSS */
+      MV_ASSERT(endpoint->linear_stream_array);
+      endpoint->ring.dequeue = dequee_pointer;
+      endpoint->streams.resize(1 << (endpoint->max_pstreams + 1));
     } else {
       SetupRing(endpoint->ring, dequee_pointer);
       endpoint->ring.consumer_cycle_bit = context[2] & 1;
@@ -888,6 +979,7 @@ class XhciHost : public PciDevice {
 
     TerminateAllTransfers(endpoint, CC_STOPPED);
     SetEndpointState(endpoint, EP_STOPPED);
+    InvalidateStreams(endpoint);
     return CC_SUCCESS;
   }
 
@@ -909,6 +1001,7 @@ class XhciHost : public PciDevice {
     
     TerminateAllTransfers(endpoint, CC_INVALID);
     SetEndpointState(endpoint, EP_STOPPED);
+    InvalidateStreams(endpoint);
     return CC_SUCCESS;
   }
 
@@ -928,19 +1021,62 @@ class XhciHost : public PciDevice {
       return CC_CONTEXT_STATE_ERROR;
     }
 
-    SetupRing(endpoint->ring, dequeue & ~0xF);
-    endpoint->ring.consumer_cycle_bit = dequeue & 1;
+    XhciRing* ring = &endpoint->ring;
+    if (endpoint->max_pstreams) {
+      ring = GetStreamRing(endpoint, stream_id);
+      if (!ring) {
+        return CC_INVALID_STREAM_ID_ERROR;
+      }
+    }
+    SetupRing(*ring, dequeue & ~0xF);
+    ring->consumer_cycle_bit = dequeue & 1;
     
     SetEndpointState(endpoint, EP_STOPPED);
     return CC_SUCCESS;
   }
 
+  /* Streams are loaded from the guest stream context array when kicked */
+  XhciRing* GetStreamRing(XhciEndpointContext* endpoint, uint stream_id) {
+    if (stream_id == 0 || stream_id >= endpoint->streams.size()) {
+      return nullptr;
+    }
+    auto &stream = endpoint->streams[stream_id];
+    if (!stream.valid) {
+      stream.context_address = endpoint->ring.dequeue + stream_id * 16;
+      auto context = (uint64_t*)manager_->TranslateGuestMemory(stream.context_address);
+      stream.type = (context[0] >> STREAM_TYPE_SHIFT) & STREAM_TYPE_MASK;
+      if (stream.type != STREAM_TYPE_PRIMARY) {
+        MV_LOG("invalid stream %u type=%u", stream_id, stream.type);
+        return nullptr;
+      }
+      SetupRing(stream.ring, context[0] & ~0xFULL);
+      stream.ring.consumer_cycle_bit = context[0] & 1;
+      stream.valid = true;
+    }
+    return &stream.ring;
+  }
+
+  void InvalidateStreams(XhciEndpointContext* endpoint) {
+    for (auto &stream : endpoint->streams) {
+      stream.valid = false;
+    }
+  }
+
+  XhciRing* GetTransferRing(XhciEndpointContext* endpoint, uint stream_id) {
+    if (endpoint->max_pstreams) {
+      return GetStreamRing(endpoint, stream_id);
+    }
+    return &endpoint->ring;
+  }
+
   void StallEndpoint(XhciTransfer* transfer) {
     auto endpoint = transfer->endpoint;
     MV_ASSERT(endpoint->type != ET_ISO_IN && endpoint->type != ET_ISO_OUT);
 
-    endpoint->ring.dequeue = transfer->trbs[0].address;
-    endpoint->ring.consumer_cycle_bit = transfer->trbs[0].cycle_bit;
+    auto ring = GetTransferRing(endpoint, transfer->stream_id);
+    MV_ASSERT(ring);
+    ring->dequeue = transfer->trbs[0].address;
+    ring->consumer_cycle_bit = transfer->trbs[0].cycle_bit;
 
     SetEndpointState(endpoint, EP_HALTED);
     if (debug_) {
@@ -953,11 +1089,23 @@ class XhciHost : public PciDevice {
       endpoint->context_address);
     context[0] &= ~EP_STATE_MASK;
     context[0] |= state;
+    endpoint->state = state;
+
+    /* With streams, the dequeue pointers are saved in the stream contexts */
+    for (auto &stream : endpoint->streams) {
+      if (stream.valid) {
+        auto stream_context = (uint64_t*)manager_->TranslateGuestMemory(stream.context_address);
+        stream_context[0] = stream.ring.dequeue | (stream.type << STREAM_TYPE_SHIFT) |
+          stream.ring.consumer_cycle_bit;
+      }
+    }
+    if (endpoint->max_pstreams) {
+      return;
+    }
 
     auto &ring = endpoint->ring;
     context[2] = ring.dequeue | ring.consumer_cycle_bit;
     context[3] = ring.dequeue >> 32;
-    endpoint->state = state;
     if (debug_) {
       MV_LOG("set endpoint=%d state=%d dequeue=0x%lx", endpoint->id, state, ring.dequeue);
     }
@@ -1119,6 +1267,8 @@ class XhciHost : public PciDevice {
     auto packet = transfer->device->CreatePacket(transfer->endpoint->endpoint_address,
       transfer->stream_id, transfer->trbs[0].address, [=]()
     {
+      /* Data transfers are completed by devices on the IO thread */
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
       CompleteTransfer(transfer);
       FreeTransfer(transfer);
     });
@@ -1160,6 +1310,11 @@ class XhciHost : public PciDevice {
       FreeTransfer(transfer);
       return;
     }
+    /* The interval in the endpoint context is in 125us microframes */
+    if (endpoint->type == ET_INTR_IN || endpoint->type == ET_INTR_OUT ||
+        endpoint->type == ET_ISO_IN || endpoint->type == ET_ISO_OUT) {
+      transfer->device->SetEndpointInterval(endpoint->endpoint_address, endpoint->interval * 125);
+    }
     transfer->device->HandlePacket(transfer->packet);
   }
 
@@ -1192,7 +1347,7 @@ class XhciHost : public PciDevice {
     auto dequeue = ring.dequeue;
     while (true) {
       XhciTransferRequestBlock trb;
-      memcpy(&trb, manager_->TranslateGuestMemory(dequeue), TRB_SIZE);
+      memcpy(&trb, TranslateRingAddress(ring, dequeue), TRB_SIZE);
       if ((trb.control & TRB_C) != cycle_bit) {
         return -length;
       }
@@ -1242,8 +1397,12 @@ class XhciHost : public PciDevice {
       return;
     }
 
-    auto &ring = endpoint->ring;
-    MV_ASSERT(stream_id == 0);
+    auto ring_pointer = GetTransferRing(endpoint, stream_id);
+    if (!ring_pointer) {
+      MV_LOG("kick invalid stream %u of endpoint %d", stream_id, endpoint_id);
+      return;
+    }
+    auto &ring = *ring_pointer;
     SetEndpointState(endpoint, EP_RUNNING);
     MV_ASSERT(ring.dequeue);
 
@@ -1366,7 +1525,7 @@ class XhciHost : public PciDevice {
     uint32_t value = *(uint32_t*)data;
 
     manager_->io()->Schedule([=]() {
-      std::lock_guard<std::mutex> lock(mutex_);
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
       if (slot_id == 0) {
         ProcessCommands();
       } else {
@@ -1400,7 +1559,7 @@ class XhciHost : public PciDevice {
 
   void Write(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
     if (resource->base == pci_bars_[0].address && offset < 0x3000) {
-      std::lock_guard<std::mutex> lock(mutex_);
+      std::lock_guard<std::recursive_mutex> lock(mutex_);
       // if (debug_) {
       //   MV_LOG("Write offset=0x%lx size=%u data=0x%lx", offset, size, *(uint64_t*)data);
       // }
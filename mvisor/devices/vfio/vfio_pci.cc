@@ -32,9 +32,9 @@
 VfioPci::VfioPci() {
   devfn_ = PCI_MAKE_DEVFN(7, 0);
   for (auto &interrupt : interrupts_) {
-    interrupt.event_fd = -1;
-    interrupt.gsi = -1;
+    interrupt = VfioInterrupt { .event_fd = -1, .resample_fd = -1, .gsi = -1 };
   }
+  intx_ = VfioInterrupt { .event_fd = -1, .resample_fd = -1, .gsi = -1 };
 }
 
 VfioPci::~VfioPci() {
@@ -58,19 +58,16 @@ void VfioPci::Connect() {
 }
 
 void VfioPci::Disconnect() {
-  if (memory_listener_) {
+  if (ram_view_listener_) {
     auto mm = manager_->machine()->memory_manager();
-    mm->UnregisterMemoryListener(&memory_listener_);
+    mm->UnregisterRamViewListener(&ram_view_listener_);
   }
+  DisableInterrupts();
   for (auto &interrupt : interrupts_) {
-    if (interrupt.gsi > 0) {
-      manager_->UpdateMsiRoute(interrupt.gsi, 0, 0, -1);
-    }
-    if (interrupt.event_fd > 0) {
-      // manager_->io()->StopPolling(interrupt.event_fd);
-      safe_close(&interrupt.event_fd);
-    }
+    safe_close(&interrupt.event_fd);
   }
+  safe_close(&intx_.event_fd);
+  safe_close(&intx_.resample_fd);
   safe_close(&device_fd_);
   safe_close(&container_fd_);
   safe_close(&group_fd_);
@@ -78,6 +75,10 @@ void VfioPci::Disconnect() {
 }
 
 void VfioPci::Reset() {
+  /* The device forgets its interrupt setup after reset */
+  DisableInterrupts();
+  msi_config_.enabled = false;
+
   /* reset vfio device */
   if (device_fd_ > 0 && (device_info_.flags & VFIO_DEVICE_FLAGS_RESET)) {
     if (ioctl(device_fd_, VFIO_DEVICE_RESET) < 0) {
@@ -97,8 +98,11 @@ void VfioPci::SetupPciConfiguration() {
   if (ret < (int)config_size) {
     MV_PANIC("failed to read device config space, ret=%d", ret);
   }
-  /* Disable IRQ, use MSI instead, should we update the vfio device ??? */
-  pci_header_.irq_pin = 0;
+  /* INTx needs the resample fd of the in-kernel irqchip, otherwise use MSI only */
+  if (!intx_supported_ || !pci_header_.irq_pin) {
+    intx_supported_ = false;
+    pci_header_.irq_pin = 0;
+  }
   /* Multifunction is not supported yet */
   pci_header_.header_type &= ~PCI_MULTI_FUNCTION;
   MV_ASSERT(pci_header_.header_type == PCI_HEADER_TYPE_NORMAL);
@@ -108,13 +112,13 @@ void VfioPci::SetupPciConfiguration() {
     auto &bar_region = regions_[i];
     if (!bar_region.size)
       continue;
-    auto &bar = pci_header_.bars[i];
+    uint32_t bar = pci_header_.bars[i];
     if (bar & PCI_BASE_ADDRESS_SPACE_IO) {
       AddPciBar(i, bar_region.size, kIoResourceTypePio);
     } else {
       /* 64bit bar is not supported yet */
       if (bar & PCI_BASE_ADDRESS_MEM_TYPE_64) {
-        bar &= ~PCI_BASE_ADDRESS_MEM_TYPE_64;
+        pci_header_.bars[i] = bar & ~PCI_BASE_ADDRESS_MEM_TYPE_64;
       }
       AddPciBar(i, bar_region.size, kIoResourceTypeMmio);
     }
@@ -128,6 +132,10 @@ void VfioPci::SetupPciConfiguration() {
       switch (cap->type)
       {
       case PCI_CAP_ID_MSI: {
+        /* MSI-X is preferred if the device has both */
+        if (msi_config_.is_msix) {
+          break;
+        }
         /* Only support 64bit MSI currently */
         auto msi_cap = (MsiCapability64*)cap;
         MV_ASSERT(!(msi_cap->control & PCI_MSI_FLAGS_MASKBIT));
@@ -139,9 +147,29 @@ void VfioPci::SetupPciConfiguration() {
         msi_config_.msi64 = msi_cap;
         break;
       }
-      case PCI_CAP_ID_MSIX:
-        MV_PANIC("FIXME: not implemented vfio msix");
+      case PCI_CAP_ID_MSIX: {
+        /* The MSI-X table is emulated, the vectors are set up with VFIO */
+        auto msix_cap = (MsiXCapability*)cap;
+        uint table_size = (msix_cap->control & PCI_MSIX_FLAGS_QSIZE) + 1;
+        if (table_size > MAX_VFIO_INTERRUPTS) {
+          MV_LOG("limit MSI-X vectors from %u to %u", table_size, MAX_VFIO_INTERRUPTS);
+          table_size = MAX_VFIO_INTERRUPTS;
+        }
+        msi_config_.is_msix = true;
+        msi_config_.is_64bit = true;
+        msi_config_.offset = pos;
+        msi_config_.length = sizeof(*msix_cap);
+        msi_config_.msix = msix_cap;
+        msi_config_.msix_bar = msix_cap->table_offset & PCI_MSIX_TABLE_BIR;
+        msi_config_.msix_table_size = table_size;
+        msi_config_.msix_space_offset = msix_cap->table_offset & PCI_MSIX_TABLE_OFFSET;
+        msi_config_.msix_space_size = table_size * sizeof(MsiXTableEntry);
+        for (auto &entry : msi_config_.msix_table) {
+          entry.control = 1;
+        }
+        msix_cap->control = (msix_cap->control & ~PCI_MSIX_FLAGS_QSIZE) | (table_size - 1);
         break;
+      }
       case PCI_CAP_ID_VNDR:
         /* ignore vendor specific data */
         break;
@@ -152,11 +180,57 @@ void VfioPci::SetupPciConfiguration() {
       pos = cap->next;
     }
   }
+  if (msi_config_.is_msix) {
+    ExcludeMsixTable();
+  }
 
   /* Update changes to device */
   pwrite(device_fd_, pci_header_.data, config_size, config_region.offset);
 }
 
+/* The mmap areas of the MSI-X BAR must not cover the table, which is trapped and
+ * emulated. A BAR without sparse areas is split around the table pages, so the
+ * registers besides the table are still accessed without VM exits.
+ */
+void VfioPci::ExcludeMsixTable() {
+  auto &region = regions_[msi_config_.msix_bar];
+  if (!(region.flags & VFIO_REGION_INFO_FLAG_MMAP)) {
+    return;
+  }
+  if (region.mmap_areas.empty()) {
+    region.mmap_areas.push_back({ .offset = 0, .size = region.size });
+  }
+
+  uint64_t table_begin = msi_config_.msix_space_offset & ~(PAGE_SIZE - 1);
+  uint64_t table_end = (msi_config_.msix_space_offset + msi_config_.msix_space_size + PAGE_SIZE - 1) &
+    ~(PAGE_SIZE - 1);
+  std::vector<VfioMmapArea> areas;
+  for (auto &area : region.mmap_areas) {
+    uint64_t area_end = area.offset + area.size;
+    if (area_end <= table_begin || area.offset >= table_end) {
+      areas.push_back(area);
+      continue;
+    }
+    if (area.offset < table_begin) {
+      areas.push_back({ .offset = area.offset, .size = table_begin - area.offset });
+    }
+    if (area_end > table_end) {
+      areas.push_back({ .offset = table_end, .size = area_end - table_end });
+    }
+  }
+  region.mmap_areas = areas;
+
+  /* Nothing left to map, trap the whole BAR */
+  if (region.mmap_areas.empty()) {
+    region.flags &= ~VFIO_REGION_INFO_FLAG_MMAP;
+  }
+  if (debug_) {
+    for (auto &area : region.mmap_areas) {
+      MV_LOG("BAR%u mmap area offset=0x%lx size=0x%lx", msi_config_.msix_bar, area.offset, area.size);
+    }
+  }
+}
+
 void VfioPci::SetupGfxPlane() {
   vfio_device_gfx_plane_info gfx_plane_info = {
     .argsz = sizeof(gfx_plane_info),
@@ -168,48 +242,70 @@ void VfioPci::SetupGfxPlane() {
   }
 }
 
-void VfioPci::MapDmaPages(const MemorySlot* slot) {
+void VfioPci::MapDmaPages(const MemoryExtent& extent) {
   vfio_iommu_type1_dma_map dma_map = {
     .argsz = sizeof(dma_map),
     .flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
-    .vaddr = slot->hva,
-    .iova = slot->begin,
-    .size = slot->end - slot->begin
+    .vaddr = extent.hva,
+    .iova = extent.begin,
+    .size = extent.end - extent.begin
   };
   if (ioctl(container_fd_, VFIO_IOMMU_MAP_DMA, &dma_map) < 0) {
     MV_PANIC("failed to map vaddr=0x%lx size=0x%lx", dma_map.iova, dma_map.size);
   }
+  dma_maps_[extent.begin] = extent;
 }
 
-void VfioPci::UnmapDmaPages(const MemorySlot* slot) {
-  vfio_iommu_type1_dma_unmap dma_ummap = {
-    .argsz = sizeof(dma_ummap),
-    .iova = slot->begin,
-    .size = slot->end - slot->begin
-  };
-  if (ioctl(container_fd_, VFIO_IOMMU_UNMAP_DMA, &dma_ummap) < 0) {
-    MV_PANIC("failed to unmap vaddr=0x%lx size=0x%lx", dma_ummap.iova, dma_ummap.size);
+/* Type1v2 IOMMU cannot unmap a part of a mapping. A mapping partly removed is
+ * unmapped and the rest of it is mapped again.
+ */
+void VfioPci::UnmapDmaPages(const MemoryExtent& range) {
+  auto it = dma_maps_.upper_bound(range.begin);
+  if (it != dma_maps_.begin() && std::prev(it)->second.end > range.begin) {
+    --it;
+  }
+  while (it != dma_maps_.end() && it->second.begin < range.end) {
+    auto extent = it->second;
+    it = dma_maps_.erase(it);
+
+    vfio_iommu_type1_dma_unmap dma_ummap = {
+      .argsz = sizeof(dma_ummap),
+      .iova = extent.begin,
+      .size = extent.end - extent.begin
+    };
+    if (ioctl(container_fd_, VFIO_IOMMU_UNMAP_DMA, &dma_ummap) < 0) {
+      MV_PANIC("failed to unmap vaddr=0x%lx size=0x%lx", dma_ummap.iova, dma_ummap.size);
+    }
+
+    if (extent.begin < range.begin) {
+      MapDmaPages(MemoryExtent { .begin = extent.begin, .end = range.begin, .hva = extent.hva });
+    }
+    if (extent.end > range.end) {
+      MapDmaPages(MemoryExtent { .begin = range.end, .end = extent.end,
+        .hva = extent.hva + (range.end - extent.begin) });
+    }
   }
 }
 
+/* DMA is mapped by the coalesced RAM extents. Guest and host addresses are huge
+ * page aligned, so the IOMMU can use large pages, and only the ranges changed
+ * are remapped.
+ */
 void VfioPci::SetupDmaMaps() {
   auto mm = manager_->machine()->memory_manager();
 
-  /* Map all current slots */
-  for (auto slot : mm->GetMemoryFlatView()) {
-    if (slot->type == kMemoryTypeRam) {
-      MapDmaPages(slot);
-    }
+  /* Map all current extents */
+  for (auto &extent : mm->GetRamFlatView()) {
+    MapDmaPages(extent);
   }
 
   /* Add memory listener to keep DMA maps synchronized */
-  memory_listener_ = mm->RegisterMemoryListener([this](auto slot, bool unmap) {
-    if (slot->type == kMemoryTypeRam) {
-      if (unmap) {
-        UnmapDmaPages(slot);
-      } else {
-        MapDmaPages(slot);
-      }
+  ram_view_listener_ = mm->RegisterRamViewListener([this](auto &removed, auto &added) {
+    for (auto &extent : removed) {
+      UnmapDmaPages(extent);
+    }
+    for (auto &extent : added) {
+      MapDmaPages(extent);
     }
   });
 }
@@ -365,10 +461,9 @@ void VfioPci::SetupVfioDevice() {
       MV_LOG("irq index=%d size=%u flags=%x count=%d ret=%d", index,
         irq_info.argsz, irq_info.flags, irq_info.count, ret);
     }
-    /* FIXME: currently my mdev only uses one IRQ */
-    if (index == VFIO_PCI_MSI_IRQ_INDEX) {
-      MV_ASSERT(irq_info.count == 1);
-      MV_ASSERT(irq_info.flags & VFIO_IRQ_INFO_EVENTFD);
+    if (index == VFIO_PCI_INTX_IRQ_INDEX) {
+      intx_supported_ = ret == 0 && irq_info.count > 0 && (irq_info.flags & VFIO_IRQ_INFO_EVENTFD) &&
+        !manager_->machine()->split_irqchip();
     }
   }
 }
@@ -383,6 +478,9 @@ void VfioPci::MapBarRegion(uint8_t index) {
     protect |= PROT_WRITE;
   if (region.mmap_areas.empty()) {
     bar.host_memory = mmap(nullptr, region.size, protect, MAP_SHARED, device_fd_, region.offset);
+    if (bar.host_memory == MAP_FAILED) {
+      MV_PANIC("failed to map region %d size=0x%lx", index, region.size);
+    }
     AddIoResource(kIoResourceTypeRam, bar.address, bar.size, bar.host_memory, "VFIO BAR RAM");
   } else {
     /* The MMIO region is overlapped by the mmap areas */
@@ -452,7 +550,25 @@ ssize_t VfioPci::WriteRegion(uint8_t index, uint64_t offset, uint8_t* data, uint
   return pwrite(device_fd_, data, length, region.offset + offset);
 }
 
+bool VfioPci::IsMsixTableAccess(const IoResource* resource, uint64_t offset, uint32_t size) {
+  return msi_config_.is_msix && resource->base == pci_bars_[msi_config_.msix_bar].address &&
+    offset >= msi_config_.msix_space_offset &&
+    offset + size <= msi_config_.msix_space_offset + msi_config_.msix_space_size;
+}
+
 void VfioPci::Write(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+  if (IsMsixTableAccess(resource, offset, size)) {
+    /* Only the vector written is updated */
+    PciDevice::Write(resource, offset, data, size);
+    uint vector = (offset - msi_config_.msix_space_offset) / sizeof(MsiXTableEntry);
+    if (irq_index_ == VFIO_PCI_MSIX_IRQ_INDEX) {
+      auto &entry = msi_config_.msix_table[vector];
+      bool masked = (entry.control & 1) || (msi_config_.msix->control & PCI_MSIX_FLAGS_MASKALL);
+      UpdateMsiVector(vector, ((uint64_t)entry.message.address_hi << 32) | entry.message.address_lo,
+        entry.message.data, masked);
+    }
+    return;
+  }
   for (int i = 0; i < PCI_BAR_NUMS; i++) {
     if (pci_bars_[i].address == resource->base) {
       WriteRegion(i, offset, data, size);
@@ -463,6 +579,10 @@ void VfioPci::Write(const IoResource* resource, uint64_t offset, uint8_t* data,
 }
 
 void VfioPci::Read(const IoResource* resource, uint64_t offset, uint8_t* data, uint32_t size) {
+  if (IsMsixTableAccess(resource, offset, size)) {
+    PciDevice::Read(resource, offset, data, size);
+    return;
+  }
   for (int i = 0; i < PCI_BAR_NUMS; i++) {
     if (pci_bars_[i].address == resource->base) {
       ReadRegion(i, offset, data, size);
@@ -472,56 +592,166 @@ void VfioPci::Read(const IoResource* resource, uint64_t offset, uint8_t* data, u
   PciDevice::Read(resource, offset, data, size);
 }
 
-void VfioPci::UpdateMsiRoutes() {
-  /* FIXME: only 64bit MSI is implemented now */
-  MV_ASSERT(!msi_config_.is_msix);
-  MV_ASSERT(msi_config_.is_64bit);
+void VfioPci::SetIrqEventfds(uint index, uint action, uint start, uint count, const int* fds) {
+  uint8_t buffer[sizeof(vfio_irq_set) + sizeof(int) * count];
+  auto irq_set = (vfio_irq_set*)buffer;
+  irq_set->argsz = sizeof(buffer);
+  irq_set->flags = (count ? VFIO_IRQ_SET_DATA_EVENTFD : VFIO_IRQ_SET_DATA_NONE) | action;
+  irq_set->index = index;
+  irq_set->start = start;
+  irq_set->count = count;
+  memcpy(irq_set->data, fds, sizeof(int) * count);
+
+  auto ret = ioctl(device_fd_, VFIO_DEVICE_SET_IRQS, irq_set);
+  if (debug_) {
+    MV_LOG("set irqs index=%u action=0x%x start=%u count=%u ret=%d", index, action, start, count, ret);
+  }
+  if (ret < 0) {
+    MV_PANIC("failed to set irqs index=%u action=0x%x start=%u count=%u", index, action, start, count);
+  }
+}
+
+/* VFIO allows one of INTx, MSI and MSI-X at a time. Switching between them tears
+ * down the old vectors, otherwise only the vectors changed are updated.
+ */
+void VfioPci::UpdateInterrupts() {
+  int index = -1;
+  if (msi_config_.enabled) {
+    index = msi_config_.is_msix ? VFIO_PCI_MSIX_IRQ_INDEX : VFIO_PCI_MSI_IRQ_INDEX;
+  } else if (intx_supported_) {
+    index = VFIO_PCI_INTX_IRQ_INDEX;
+  }
 
-  msi_config_.enabled = msi_config_.msi64->control & PCI_MSI_FLAGS_ENABLE;
-  uint nr_vectors = 1 << ((msi_config_.msi64->control & PCI_MSI_FLAGS_QSIZE) >> 4);
+  manager_->BeginGsiRoutingUpdate();
+  if (index != irq_index_ || (index == VFIO_PCI_INTX_IRQ_INDEX && intx_.gsi != pci_header_.irq_line)) {
+    DisableInterrupts();
+    EnableInterrupts(index);
+  } else if (index == VFIO_PCI_MSI_IRQ_INDEX || index == VFIO_PCI_MSIX_IRQ_INDEX) {
+    UpdateMsiVectors();
+  }
+  manager_->EndGsiRoutingUpdate();
+}
+
+void VfioPci::EnableInterrupts(int index) {
+  if (index == VFIO_PCI_INTX_IRQ_INDEX) {
+    EnableIntx();
+    return;
+  } else if (index < 0) {
+    return;
+  }
 
-  /* FIXME: nr_vectors > 1 not tested yet */
-  MV_ASSERT(nr_vectors == 1);
+  if (index == VFIO_PCI_MSIX_IRQ_INDEX) {
+    nr_msi_vectors_ = msi_config_.msix_table_size;
+  } else {
+    nr_msi_vectors_ = 1 << ((msi_config_.msi64->control & PCI_MSI_FLAGS_QSIZE) >> 4);
+    MV_ASSERT(nr_msi_vectors_ <= MAX_VFIO_INTERRUPTS);
+  }
 
-  for (uint vector = 0; vector < nr_vectors; vector++) {
+  int fds[nr_msi_vectors_];
+  for (uint vector = 0; vector < nr_msi_vectors_; vector++) {
     auto &interrupt = interrupts_[vector];
-    auto msi = msi_config_.msi64;
     if (interrupt.event_fd == -1) {
-      interrupt.event_fd = eventfd(0, 0);
+      interrupt.event_fd = eventfd(0, EFD_CLOEXEC);
+      MV_ASSERT(interrupt.event_fd >= 0);
     }
-    auto address = ((uint64_t)msi->address1 << 32) | msi->address0;
+    fds[vector] = interrupt.event_fd;
+  }
+  irq_index_ = index;
+  UpdateMsiVectors();
+  SetIrqEventfds(index, VFIO_IRQ_SET_ACTION_TRIGGER, 0, nr_msi_vectors_, fds);
+}
 
-    if (msi_config_.enabled) {
-      if (interrupt.gsi == -1) {
-        interrupt.gsi = manager_->AddMsiRoute(address, msi->data, interrupt.event_fd);
-      } else {
-        manager_->UpdateMsiRoute(interrupt.gsi, address, msi->data, interrupt.event_fd);
-      }
-    } else {
-      if (interrupt.gsi != -1) {
-        manager_->UpdateMsiRoute(interrupt.gsi, 0, 0, interrupt.event_fd);
-        interrupt.gsi = -1;
-      }
+/* Level-triggered INTx is handled by the kernel. VFIO masks the line when it fires,
+ * after the guest EOI, KVM signals the resample fd which unmasks it in VFIO.
+ */
+void VfioPci::EnableIntx() {
+  uint irq = pci_header_.irq_line;
+  if (irq == 0 || irq >= IOAPIC_NUM_PINS) {
+    return;
+  }
+  if (intx_.event_fd == -1) {
+    intx_.event_fd = eventfd(0, EFD_CLOEXEC);
+    intx_.resample_fd = eventfd(0, EFD_CLOEXEC);
+    MV_ASSERT(intx_.event_fd >= 0 && intx_.resample_fd >= 0);
+  }
+  intx_.gsi = irq;
+  manager_->AssignIrqfd(intx_.gsi, intx_.event_fd, intx_.resample_fd);
+  SetIrqEventfds(VFIO_PCI_INTX_IRQ_INDEX, VFIO_IRQ_SET_ACTION_TRIGGER, 0, 1, &intx_.event_fd);
+  SetIrqEventfds(VFIO_PCI_INTX_IRQ_INDEX, VFIO_IRQ_SET_ACTION_UNMASK, 0, 1, &intx_.resample_fd);
+  irq_index_ = VFIO_PCI_INTX_IRQ_INDEX;
+}
+
+void VfioPci::DisableInterrupts() {
+  if (irq_index_ < 0) {
+    return;
+  }
+  SetIrqEventfds(irq_index_, VFIO_IRQ_SET_ACTION_TRIGGER, 0, 0, nullptr);
+  if (irq_index_ == VFIO_PCI_INTX_IRQ_INDEX) {
+    manager_->DeassignIrqfd(intx_.gsi, intx_.event_fd);
+    intx_.gsi = -1;
+  } else {
+    for (uint vector = 0; vector < nr_msi_vectors_; vector++) {
+      ReleaseMsiVector(vector);
     }
-  
-    uint8_t buffer[sizeof(vfio_irq_set) + sizeof(int)];
-    auto irq_set = (vfio_irq_set*)buffer;
-    irq_set->argsz = sizeof(vfio_irq_set) + sizeof(int);
-    irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
-    irq_set->index = VFIO_PCI_MSI_IRQ_INDEX;
-    irq_set->start = vector;
-    irq_set->count = 1;
-    int event_fd = msi_config_.enabled ? interrupt.event_fd : -1;
-    memcpy(irq_set->data, &event_fd, sizeof(int));
-
-    auto ret = ioctl(device_fd_, VFIO_DEVICE_SET_IRQS, irq_set);
-    if (debug_) {
-      MV_LOG("update MSI %d eventfd=%d ret=%d", vector, event_fd, ret);
+    nr_msi_vectors_ = 0;
+  }
+  irq_index_ = -1;
+}
+
+void VfioPci::UpdateMsiVectors() {
+  if (irq_index_ == VFIO_PCI_MSIX_IRQ_INDEX) {
+    bool mask_all = msi_config_.msix->control & PCI_MSIX_FLAGS_MASKALL;
+    for (uint vector = 0; vector < nr_msi_vectors_; vector++) {
+      auto &entry = msi_config_.msix_table[vector];
+      UpdateMsiVector(vector, ((uint64_t)entry.message.address_hi << 32) | entry.message.address_lo,
+        entry.message.data, mask_all || (entry.control & 1));
+    }
+  } else if (irq_index_ == VFIO_PCI_MSI_IRQ_INDEX) {
+    auto msi = msi_config_.msi64;
+    auto address = ((uint64_t)msi->address1 << 32) | msi->address0;
+    for (uint vector = 0; vector < nr_msi_vectors_; vector++) {
+      UpdateMsiVector(vector, address, msi->data | vector, false);
     }
-    if (ret < 0) {
-      MV_PANIC("failed to set MSI %u event_fd=%d", vector, event_fd);
+  }
+}
+
+/* The route is reloaded only if the message changed. A masked vector is detached
+ * from KVM, and the interrupt pending in the eventfd is injected when attached.
+ */
+void VfioPci::UpdateMsiVector(uint vector, uint64_t address, uint32_t data, bool masked) {
+  auto &interrupt = interrupts_[vector];
+  if (address) {
+    if (interrupt.gsi == -1) {
+      interrupt.gsi = manager_->AddMsiRoute(address, data);
+    } else if (interrupt.address != address || interrupt.data != data) {
+      manager_->UpdateMsiRoute(interrupt.gsi, address, data);
     }
+    interrupt.address = address;
+    interrupt.data = data;
+  }
+
+  bool attach = !masked && interrupt.gsi != -1;
+  if (attach && !interrupt.irqfd) {
+    manager_->AssignIrqfd(interrupt.gsi, interrupt.event_fd);
+    interrupt.irqfd = true;
+  } else if (!attach && interrupt.irqfd) {
+    manager_->DeassignIrqfd(interrupt.gsi, interrupt.event_fd);
+    interrupt.irqfd = false;
+  }
+}
+
+void VfioPci::ReleaseMsiVector(uint vector) {
+  auto &interrupt = interrupts_[vector];
+  if (interrupt.irqfd) {
+    manager_->DeassignIrqfd(interrupt.gsi, interrupt.event_fd);
+    interrupt.irqfd = false;
+  }
+  if (interrupt.gsi != -1) {
+    manager_->UpdateMsiRoute(interrupt.gsi, 0, 0);
+    interrupt.gsi = -1;
   }
+  interrupt.address = 0;
+  interrupt.data = 0;
 }
 
 void VfioPci::WritePciConfigSpace(uint64_t offset, uint8_t* data, uint32_t length) {
@@ -536,9 +766,10 @@ void VfioPci::WritePciConfigSpace(uint64_t offset, uint8_t* data, uint32_t lengt
   /* the default bahavior detects BAR activate/deactivate */
   PciDevice::WritePciConfigSpace(offset, data, length);
 
-  /* update interrupts if needed */
-  if (ranges_overlap(offset, length, msi_config_.offset + PCI_MSI_FLAGS, 1)) {
-    UpdateMsiRoutes();
+  /* update interrupts if the MSI capability or the INTx line changed */
+  if ((msi_config_.offset && ranges_overlap(offset, length, msi_config_.offset, msi_config_.length)) ||
+      ranges_overlap(offset, length, PCI_INTERRUPT_LINE, 1)) {
+    UpdateInterrupts();
   }
 }
 
@@ -549,6 +780,13 @@ void VfioPci::ReadPciConfigSpace(uint64_t offset, uint8_t* data, uint32_t length
   /* read from VFIO device */
   auto ret = pread(device_fd_, pci_header_.data + offset, length, config_region.offset + offset);
   MV_ASSERT(ret == (ssize_t)length);
+  if (!intx_supported_) {
+    pci_header_.irq_pin = 0;
+  }
+  if (msi_config_.is_msix) {
+    auto msix = msi_config_.msix;
+    msix->control = (msix->control & ~PCI_MSIX_FLAGS_QSIZE) | (msi_config_.msix_table_size - 1);
+  }
 
   PciDevice::ReadPciConfigSpace(offset, data, length);
 }
@@ -21,6 +21,7 @@
 
 #include <cstdint>
 #include <string>
+#include <map>
 #include "linuz/vfio.h"
 #include "pci_device.h"
 #include "memory_manager.h"
@@ -44,9 +45,16 @@ struct VfioRegion {
   std::vector<VfioMmapArea> mmap_areas;
 };
 
+/* Each vector is an eventfd signaled by VFIO and bound to a GSI with irqfd,
+ * so interrupts are injected by the kernel without exiting to userspace
+ */
 struct VfioInterrupt {
   int       event_fd;
+  int       resample_fd;
   int       gsi;
+  bool      irqfd;
+  uint64_t  address;
+  uint32_t  data;
 };
 
 class VfioPci : public PciDevice {
@@ -71,10 +79,19 @@ class VfioPci : public PciDevice {
   void SetupPciConfiguration();
   void SetupPciInterrupts();
   void SetupGfxPlane();
+  void ExcludeMsixTable();
   void SetupDmaMaps();
-  void UpdateMsiRoutes();
-  void MapDmaPages(const MemorySlot* slot);
-  void UnmapDmaPages(const MemorySlot* slot);
+  void UpdateInterrupts();
+  void EnableInterrupts(int index);
+  void DisableInterrupts();
+  void EnableIntx();
+  void UpdateMsiVectors();
+  void UpdateMsiVector(uint vector, uint64_t address, uint32_t data, bool masked);
+  void ReleaseMsiVector(uint vector);
+  void SetIrqEventfds(uint index, uint action, uint start, uint count, const int* fds);
+  bool IsMsixTableAccess(const IoResource* resource, uint64_t offset, uint32_t size);
+  void MapDmaPages(const MemoryExtent& extent);
+  void UnmapDmaPages(const MemoryExtent& range);
   void MapBarRegion(uint8_t index);
   void UnmapBarRegion(uint8_t index);
   ssize_t ReadRegion(uint8_t index, uint64_t offset, uint8_t* data, uint32_t length);
@@ -90,7 +107,12 @@ class VfioPci : public PciDevice {
   vfio_device_info                                device_info_ = { 0 };
   std::array<VfioRegion, MAX_VFIO_REGIONS>        regions_;
   std::array<VfioInterrupt, MAX_VFIO_INTERRUPTS>  interrupts_;
-  const MemoryListener*                           memory_listener_ = nullptr;
+  VfioInterrupt                                   intx_;
+  bool                                            intx_supported_ = false;
+  int                                             irq_index_ = -1;
+  uint                                            nr_msi_vectors_ = 0;
+  const RamViewListener*                          ram_view_listener_ = nullptr;
+  std::map<uint64_t, MemoryExtent>                dma_maps_;
 };
 
 #endif // _MVISOR_DEVICES_VFIO_VFIO_PCI_H
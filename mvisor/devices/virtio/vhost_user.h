@@ -0,0 +1,119 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MVISOR_DEVICES_VHOST_USER_H
+#define _MVISOR_DEVICES_VHOST_USER_H
+
+/* Messages of the vhost-user protocol, shared by the frontend devices and the
+ * test backend in tools/. See docs/interop/vhost-user.rst of QEMU.
+ */
+#include <cstdint>
+
+enum VhostUserRequest {
+  kVhostUserGetFeatures = 1,
+  kVhostUserSetFeatures = 2,
+  kVhostUserSetOwner = 3,
+  kVhostUserResetOwner = 4,
+  kVhostUserSetMemTable = 5,
+  kVhostUserSetVringNum = 8,
+  kVhostUserSetVringAddr = 9,
+  kVhostUserSetVringBase = 10,
+  kVhostUserGetVringBase = 11,
+  kVhostUserSetVringKick = 12,
+  kVhostUserSetVringCall = 13,
+  kVhostUserSetVringErr = 14,
+  kVhostUserGetProtocolFeatures = 15,
+  kVhostUserSetProtocolFeatures = 16,
+  kVhostUserGetQueueNum = 17,
+  kVhostUserSetVringEnable = 18,
+  kVhostUserGetConfig = 24,
+  kVhostUserSetConfig = 25
+};
+
+/* Virtio feature bit which enables the protocol features */
+#define VHOST_USER_F_PROTOCOL_FEATURES      30
+
+#define VHOST_USER_PROTOCOL_F_MQ            0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK     3
+#define VHOST_USER_PROTOCOL_F_CONFIG        9
+
+#define VHOST_USER_VERSION                  0x1
+#define VHOST_USER_FLAG_REPLY               (1 << 2)
+#define VHOST_USER_FLAG_NEED_REPLY          (1 << 3)
+
+/* The queue index is in the low byte of kick / call / err messages */
+#define VHOST_USER_VRING_INDEX_MASK         0xFF
+#define VHOST_USER_VRING_NOFD               (1 << 8)
+
+#define VHOST_USER_MAX_FDS                  8
+#define VHOST_USER_MAX_CONFIG_SIZE          256
+
+struct VhostUserHeader {
+  uint32_t  request;
+  uint32_t  flags;
+  uint32_t  size;
+} __attribute__((packed));
+
+struct VhostUserVringState {
+  uint32_t  index;
+  uint32_t  num;
+} __attribute__((packed));
+
+/* Ring addresses are in the address space of the frontend */
+struct VhostUserVringAddress {
+  uint32_t  index;
+  uint32_t  flags;
+  uint64_t  descriptor;
+  uint64_t  used;
+  uint64_t  available;
+  uint64_t  log;
+} __attribute__((packed));
+
+/* Each region comes with a file descriptor, mapped at mmap_offset */
+struct VhostUserMemoryRegion {
+  uint64_t  guest_address;
+  uint64_t  size;
+  uint64_t  user_address;
+  uint64_t  mmap_offset;
+} __attribute__((packed));
+
+struct VhostUserMemory {
+  uint32_t  count;
+  uint32_t  padding;
+  VhostUserMemoryRegion regions[VHOST_USER_MAX_FDS];
+} __attribute__((packed));
+
+struct VhostUserConfig {
+  uint32_t  offset;
+  uint32_t  size;
+  uint32_t  flags;
+  uint8_t   region[VHOST_USER_MAX_CONFIG_SIZE];
+} __attribute__((packed));
+
+struct VhostUserMessage {
+  VhostUserHeader header;
+  union {
+    uint64_t              u64;
+    VhostUserVringState   state;
+    VhostUserVringAddress address;
+    VhostUserMemory       memory;
+    VhostUserConfig       config;
+  } payload;
+} __attribute__((packed));
+
+#endif // _MVISOR_DEVICES_VHOST_USER_H
@@ -0,0 +1,88 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vhost_user_device.h"
+#include <cstring>
+#include "linuz/virtio_blk.h"
+#include "logger.h"
+
+#define DEFAULT_QUEUE_SIZE 256
+#define MAX_QUEUES 16
+
+/* Virtio block served by a vhost-user-blk backend, e.g. SPDK or
+ * tools/vhost-user-blk. The disk geometry comes from the backend config.
+ */
+class VhostUserBlock : public VhostUserDevice {
+ private:
+  virtio_blk_config block_config_;
+
+ public:
+  VhostUserBlock() {
+    devfn_ = PCI_MAKE_DEVFN(11, 0);
+    pci_header_.class_code = 0x010000;
+    pci_header_.device_id = 0x1001;
+    pci_header_.subsys_id = 0x0002;
+
+    AddPciBar(1, 0x1000, kIoResourceTypeMmio);
+    AddMsiXCapability(1, MAX_QUEUES + 1, 0, 0x1000);
+
+    /* Offered if the backend has them, the writeback cache is not switchable */
+    device_features_ |= (1UL << VIRTIO_BLK_F_SIZE_MAX) |
+      (1UL << VIRTIO_BLK_F_SEG_MAX) |
+      (1UL << VIRTIO_BLK_F_GEOMETRY) |
+      (1UL << VIRTIO_BLK_F_RO) |
+      (1UL << VIRTIO_BLK_F_BLK_SIZE) |
+      (1UL << VIRTIO_BLK_F_FLUSH) |
+      (1UL << VIRTIO_BLK_F_TOPOLOGY) |
+      (1UL << VIRTIO_BLK_F_MQ) |
+      (1UL << VIRTIO_BLK_F_DISCARD) |
+      (1UL << VIRTIO_BLK_F_WRITE_ZEROES);
+    bzero(&block_config_, sizeof(block_config_));
+  }
+
+  virtual void Connect() {
+    VhostUserDevice::Connect();
+
+    if (!GetConfig(&block_config_, sizeof(block_config_))) {
+      MV_PANIC("%s backend does not support GET_CONFIG", name_);
+    }
+
+    int num_queues = 1;
+    if (device_features_ & (1UL << VIRTIO_BLK_F_MQ)) {
+      num_queues = std::min<int>(block_config_.num_queues, MAX_QUEUES);
+      num_queues = std::min<int>(num_queues, max_queues_);
+    }
+    block_config_.num_queues = std::max(num_queues, 1);
+  }
+
+  void Reset() {
+    /* Stop the backend and reset all queues */
+    VhostUserDevice::Reset();
+
+    for (int i = 0; i < block_config_.num_queues; ++i) {
+      AddQueue(DEFAULT_QUEUE_SIZE, VoidCallback());
+    }
+  }
+
+  void ReadDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size) {
+    MV_ASSERT(offset + size <= sizeof(block_config_));
+    memcpy(data, (uint8_t*)&block_config_ + offset, size);
+  }
+};
+
+DECLARE_DEVICE(VhostUserBlock);
@@ -0,0 +1,323 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vhost_user_device.h"
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "logger.h"
+#include "device_manager.h"
+#include "machine.h"
+
+#define SUPPORTED_PROTOCOL_FEATURES ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+  (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+VhostUserDevice::VhostUserDevice() {
+  /* The vring base of a packed ring carries the wrap counters, not supported yet */
+  device_features_ &= ~(1UL << VIRTIO_F_RING_PACKED);
+  device_features_ |= (1UL << VIRTIO_F_IN_ORDER);
+  external_queues_ = true;
+  call_fds_.resize(queues_.size(), -1);
+}
+
+void VhostUserDevice::Connect() {
+  VirtioPci::Connect();
+
+  if (!has_key("socket")) {
+    MV_PANIC("%s requires the socket of the vhost-user backend", name_);
+  }
+  path_ = std::get<std::string>(key_values_["socket"]);
+  if (path_.size() >= sizeof(sockaddr_un::sun_path)) {
+    MV_PANIC("socket path is too long: %s", path_.c_str());
+  }
+  if (manager_->machine()->memory_manager()->ram_fd() < 0) {
+    MV_PANIC("%s requires shared_memory: Yes in the machine config", name_);
+  }
+  ConnectBackend();
+}
+
+void VhostUserDevice::Disconnect() {
+  VirtioPci::Disconnect();
+  safe_close(&fd_);
+}
+
+void VhostUserDevice::Reset() {
+  if (started_) {
+    StopBackend();
+  }
+  VirtioPci::Reset();
+}
+
+void VhostUserDevice::OnDriverOk() {
+  if (!started_) {
+    StartBackend();
+  }
+}
+
+void VhostUserDevice::ConnectBackend() {
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  MV_ASSERT(fd_ >= 0);
+
+  sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+  if (connect(fd_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    MV_PANIC("failed to connect to vhost-user backend %s", path_.c_str());
+  }
+
+  VhostUserMessage message = { .header = { .request = kVhostUserSetOwner } };
+  Request(message, false);
+
+  backend_features_ = GetU64(kVhostUserGetFeatures);
+  if (backend_features_ & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+    uint64_t features = GetU64(kVhostUserGetProtocolFeatures) & SUPPORTED_PROTOCOL_FEATURES;
+    SetU64(kVhostUserSetProtocolFeatures, features);
+    /* Set after the message, REPLY_ACK is not used before it is negotiated */
+    protocol_features_ = features;
+    if (HasProtocolFeature(VHOST_USER_PROTOCOL_F_MQ)) {
+      max_queues_ = GetU64(kVhostUserGetQueueNum);
+    }
+  }
+
+  device_features_ = (device_features_ & backend_features_) | local_features_;
+  if (debug_) {
+    MV_LOG("%s connected to %s features=0x%lx protocol=0x%lx queues=%u", name_, path_.c_str(),
+      backend_features_, protocol_features_, max_queues_);
+  }
+}
+
+/* Sends a message with optional fds, then waits for the reply of GET requests, or
+ * for the ack of SET requests if REPLY_ACK is negotiated
+ */
+void VhostUserDevice::Request(VhostUserMessage& message, bool has_reply, const int* fds, int fd_count) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t request = message.header.request;
+  bool need_ack = !has_reply && HasProtocolFeature(VHOST_USER_PROTOCOL_F_REPLY_ACK);
+  message.header.flags = VHOST_USER_VERSION | (need_ack ? VHOST_USER_FLAG_NEED_REPLY : 0);
+
+  iovec iov = { .iov_base = &message, .iov_len = sizeof(message.header) + message.header.size };
+  msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  uint8_t control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)];
+  if (fd_count > 0) {
+    MV_ASSERT(fd_count <= VHOST_USER_MAX_FDS);
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  }
+
+  ssize_t ret;
+  do {
+    ret = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+  } while (ret < 0 && errno == EINTR);
+  if (ret != (ssize_t)iov.iov_len) {
+    MV_PANIC("%s failed to send request=%u, errno=%d", name_, request, errno);
+  }
+  if (!has_reply && !need_ack) {
+    return;
+  }
+
+  if (recv(fd_, &message.header, sizeof(message.header), MSG_WAITALL) != sizeof(message.header) ||
+      message.header.request != request || !(message.header.flags & VHOST_USER_FLAG_REPLY) ||
+      message.header.size > sizeof(message.payload)) {
+    MV_PANIC("%s invalid reply of request=%u", name_, request);
+  }
+  if (message.header.size > 0 &&
+      recv(fd_, &message.payload, message.header.size, MSG_WAITALL) != message.header.size) {
+    MV_PANIC("%s failed to receive reply of request=%u", name_, request);
+  }
+  if (need_ack && message.payload.u64 != 0) {
+    MV_PANIC("%s request=%u failed with 0x%lx", name_, request, message.payload.u64);
+  }
+}
+
+uint64_t VhostUserDevice::GetU64(VhostUserRequest request) {
+  VhostUserMessage message = { .header = { .request = request } };
+  Request(message, true);
+  return message.payload.u64;
+}
+
+void VhostUserDevice::SetU64(VhostUserRequest request, uint64_t value) {
+  VhostUserMessage message = { .header = { .request = request, .size = sizeof(uint64_t) } };
+  message.payload.u64 = value;
+  Request(message, false);
+}
+
+void VhostUserDevice::SetVringState(VhostUserRequest request, uint32_t index, uint32_t num) {
+  VhostUserMessage message = { .header = { .request = request, .size = sizeof(VhostUserVringState) } };
+  message.payload.state = { .index = index, .num = num };
+  Request(message, false);
+}
+
+void VhostUserDevice::SetVringFd(VhostUserRequest request, uint32_t index, int fd) {
+  VhostUserMessage message = { .header = { .request = request, .size = sizeof(uint64_t) } };
+  message.payload.u64 = index & VHOST_USER_VRING_INDEX_MASK;
+  Request(message, false, &fd, 1);
+}
+
+/* Returns false if the backend does not provide the device config */
+bool VhostUserDevice::GetConfig(void* config, uint32_t size) {
+  if (!HasProtocolFeature(VHOST_USER_PROTOCOL_F_CONFIG)) {
+    return false;
+  }
+  MV_ASSERT(size <= VHOST_USER_MAX_CONFIG_SIZE);
+  uint32_t header_size = offsetof(VhostUserConfig, region);
+  VhostUserMessage message = { .header = { .request = kVhostUserGetConfig, .size = header_size + size } };
+  message.payload.config.offset = 0;
+  message.payload.config.size = size;
+  message.payload.config.flags = 0;
+  bzero(message.payload.config.region, size);
+  Request(message, true);
+  if (message.header.size != header_size + size) {
+    MV_PANIC("%s invalid config size=%u", name_, message.header.size);
+  }
+  memcpy(config, message.payload.config.region, size);
+  return true;
+}
+
+/* The backend maps the guest RAM extents from the memfd. Extents not backed by
+ * the memfd, like the BIOS, are never used for DMA.
+ */
+void VhostUserDevice::SetMemoryTable() {
+  auto mm = manager_->machine()->memory_manager();
+  VhostUserMessage message = { .header = { .request = kVhostUserSetMemTable } };
+  int fds[VHOST_USER_MAX_FDS];
+  auto &memory = message.payload.memory;
+  memory.count = 0;
+  memory.padding = 0;
+
+  for (auto &extent : mm->GetRamFlatView()) {
+    uint64_t size = extent.end - extent.begin;
+    uint64_t offset;
+    if (!mm->GetRamFileOffset(extent.hva, size, &offset)) {
+      continue;
+    }
+    if (memory.count == VHOST_USER_MAX_FDS) {
+      MV_PANIC("%s too many memory regions for vhost-user", name_);
+    }
+    memory.regions[memory.count] = VhostUserMemoryRegion {
+      .guest_address = extent.begin,
+      .size = size,
+      .user_address = extent.hva,
+      .mmap_offset = offset
+    };
+    fds[memory.count++] = mm->ram_fd();
+  }
+
+  message.header.size = offsetof(VhostUserMemory, regions) + memory.count * sizeof(VhostUserMemoryRegion);
+  Request(message, false, fds, memory.count);
+}
+
+/* The backend signals the call eventfd when the guest should be interrupted */
+void VhostUserDevice::OnCall(VirtQueue& vq) {
+  uint64_t value;
+  if (read(call_fds_[vq.index], &value, sizeof(value)) != sizeof(value)) {
+    return;
+  }
+
+  isr_status_ = 1;
+  if (!msi_config_.enabled) {
+    SetPciIrqLevel(1);
+  } else if (vq.msix_vector != VIRTIO_MSI_NO_VECTOR) {
+    SignalMsi(vq.msix_vector);
+  }
+}
+
+void VhostUserDevice::StartBackend() {
+  uint64_t features = (((uint64_t)driver_features_[1] << 32) | driver_features_[0]) & backend_features_;
+  bool has_protocol_features = backend_features_ & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+  if (has_protocol_features) {
+    features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+  }
+  SetU64(kVhostUserSetFeatures, features);
+  SetMemoryTable();
+
+  for (auto &vq : queues_) {
+    if (!vq.enabled) {
+      continue;
+    }
+    MV_ASSERT(vq.io_event && !vq.packed);
+    SetVringState(kVhostUserSetVringNum, vq.index, vq.size);
+    SetVringState(kVhostUserSetVringBase, vq.index, vq.last_available_index);
+
+    VhostUserMessage message = { .header = { .request = kVhostUserSetVringAddr,
+      .size = sizeof(VhostUserVringAddress) } };
+    message.payload.address = VhostUserVringAddress {
+      .index = (uint32_t)vq.index,
+      .flags = 0,
+      .descriptor = (uint64_t)vq.descriptor_table,
+      .used = (uint64_t)vq.used_ring,
+      .available = (uint64_t)vq.available_ring,
+      .log = 0
+    };
+    Request(message, false);
+
+    int &call_fd = call_fds_[vq.index];
+    call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    MV_ASSERT(call_fd >= 0);
+    manager_->io()->StartPolling(call_fd, EPOLLIN, [this, &vq](auto events) {
+      OnCall(vq);
+    });
+    SetVringFd(kVhostUserSetVringCall, vq.index, call_fd);
+    SetVringFd(kVhostUserSetVringKick, vq.index, vq.io_event->fd);
+
+    /* Rings start disabled if protocol features are negotiated */
+    if (has_protocol_features) {
+      SetVringState(kVhostUserSetVringEnable, vq.index, 1);
+    }
+  }
+
+  /* Keep the memory table of the backend synchronized */
+  auto mm = manager_->machine()->memory_manager();
+  ram_view_listener_ = mm->RegisterRamViewListener([this](auto &removed, auto &added) {
+    SetMemoryTable();
+  });
+  started_ = true;
+}
+
+/* GET_VRING_BASE stops the ring, after that the backend does not touch the guest
+ * memory of the queue
+ */
+void VhostUserDevice::StopBackend() {
+  auto mm = manager_->machine()->memory_manager();
+  mm->UnregisterRamViewListener(&ram_view_listener_);
+
+  bool has_protocol_features = backend_features_ & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+  for (auto &vq : queues_) {
+    if (!vq.enabled) {
+      continue;
+    }
+    if (has_protocol_features) {
+      SetVringState(kVhostUserSetVringEnable, vq.index, 0);
+    }
+    VhostUserMessage message = { .header = { .request = kVhostUserGetVringBase,
+      .size = sizeof(VhostUserVringState) } };
+    message.payload.state = { .index = (uint32_t)vq.index, .num = 0 };
+    Request(message, true);
+    vq.last_available_index = message.payload.state.num;
+
+    manager_->io()->StopPolling(call_fds_[vq.index]);
+    safe_close(&call_fds_[vq.index]);
+  }
+  started_ = false;
+}
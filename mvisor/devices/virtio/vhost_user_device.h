@@ -0,0 +1,71 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MVISOR_DEVICES_VHOST_USER_DEVICE_H
+#define _MVISOR_DEVICES_VHOST_USER_DEVICE_H
+
+#include "virtio_pci.h"
+#include "vhost_user.h"
+#include "memory_manager.h"
+#include <string>
+#include <mutex>
+
+/* The data path of a vhost-user device is served by a backend process connected
+ * by a Unix socket. When the driver is ready, the guest RAM memfd, the ring
+ * addresses and the kick / call eventfds are passed to the backend. Guest kicks go
+ * to the backend without mvisor, calls are injected as MSI-X by the IO thread.
+ */
+class VhostUserDevice : public VirtioPci {
+ public:
+  VhostUserDevice();
+  virtual void Connect();
+  virtual void Disconnect();
+  virtual void Reset();
+
+ protected:
+  virtual void OnDriverOk();
+  bool GetConfig(void* config, uint32_t size);
+  inline bool HasProtocolFeature(int bit) { return protocol_features_ & (1ULL << bit); }
+
+  /* Features emulated by mvisor, offered whether or not the backend has them */
+  uint64_t                    local_features_ = 0;
+  uint64_t                    backend_features_ = 0;
+  uint64_t                    protocol_features_ = 0;
+  uint32_t                    max_queues_ = 1;
+
+ private:
+  void ConnectBackend();
+  void StartBackend();
+  void StopBackend();
+  void SetMemoryTable();
+  void OnCall(VirtQueue& vq);
+  void Request(VhostUserMessage& message, bool has_reply, const int* fds = nullptr, int fd_count = 0);
+  uint64_t GetU64(VhostUserRequest request);
+  void SetU64(VhostUserRequest request, uint64_t value);
+  void SetVringState(VhostUserRequest request, uint32_t index, uint32_t num);
+  void SetVringFd(VhostUserRequest request, uint32_t index, int fd);
+
+  std::string                 path_;
+  int                         fd_ = -1;
+  bool                        started_ = false;
+  std::vector<int>            call_fds_;
+  const RamViewListener*      ram_view_listener_ = nullptr;
+  std::mutex                  mutex_;
+};
+
+#endif // _MVISOR_DEVICES_VHOST_USER_DEVICE_H
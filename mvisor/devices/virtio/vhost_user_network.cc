@@ -0,0 +1,102 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vhost_user_device.h"
+#include <cstring>
+#include <cstdlib>
+#include "linuz/virtio_net.h"
+#include "logger.h"
+
+#define DEFAULT_QUEUE_SIZE 256
+
+/* Virtio network served by a vhost-user backend, e.g. a DPDK vswitch. The control
+ * queue is not offered, the MAC address and link status are emulated here.
+ */
+class VhostUserNetwork : public VhostUserDevice {
+ private:
+  virtio_net_config net_config_;
+
+ public:
+  VhostUserNetwork() {
+    devfn_ = PCI_MAKE_DEVFN(12, 0);
+    pci_header_.class_code = 0x020000;
+    pci_header_.device_id = 0x1000;
+    pci_header_.subsys_id = 0x0001;
+
+    AddPciBar(1, 0x1000, kIoResourceTypeMmio);
+    AddMsiXCapability(1, 3, 0, 0x1000);
+
+    /* Offloads are offered if the backend has them */
+    device_features_ |= (1UL << VIRTIO_NET_F_CSUM) |
+      (1UL << VIRTIO_NET_F_GUEST_CSUM) |
+      (1UL << VIRTIO_NET_F_GUEST_TSO4) |
+      (1UL << VIRTIO_NET_F_GUEST_TSO6) |
+      (1UL << VIRTIO_NET_F_GUEST_ECN) |
+      (1UL << VIRTIO_NET_F_GUEST_UFO) |
+      (1UL << VIRTIO_NET_F_HOST_TSO4) |
+      (1UL << VIRTIO_NET_F_HOST_TSO6) |
+      (1UL << VIRTIO_NET_F_HOST_ECN) |
+      (1UL << VIRTIO_NET_F_HOST_UFO) |
+      (1UL << VIRTIO_NET_F_MRG_RXBUF);
+    local_features_ = (1UL << VIRTIO_NET_F_MAC) | (1UL << VIRTIO_NET_F_STATUS);
+
+    bzero(&net_config_, sizeof(net_config_));
+    net_config_.mac[0] = 0x00;
+    net_config_.mac[1] = 0x50;
+    net_config_.mac[2] = 0x00;
+    for (int i = 3; i < 6; i++) {
+      net_config_.mac[i] = rand() & 0xFF;
+    }
+    net_config_.status = VIRTIO_NET_S_LINK_UP;
+  }
+
+  virtual void Connect() {
+    VhostUserDevice::Connect();
+
+    /* Configurable MAC address */
+    if (has_key("mac")) {
+      uint32_t mac[6];
+      std::string mac_string = std::get<std::string>(key_values_["mac"]);
+      sscanf(mac_string.c_str(), "%02x:%02x:%02x:%02x:%02x:%02x", &mac[0], &mac[1], &mac[2],
+        &mac[3], &mac[4], &mac[5]);
+      for (int i = 0; i < 6; i++)
+        net_config_.mac[i] = mac[i];
+    }
+  }
+
+  void Reset() {
+    /* Stop the backend and reset all queues */
+    VhostUserDevice::Reset();
+
+    /* MQ is not supported yet */
+    AddQueue(DEFAULT_QUEUE_SIZE, VoidCallback());
+    AddQueue(DEFAULT_QUEUE_SIZE, VoidCallback());
+  }
+
+  void ReadDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size) {
+    MV_ASSERT(offset + size <= sizeof(net_config_));
+    memcpy(data, (uint8_t*)&net_config_ + offset, size);
+  }
+
+  void WriteDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size) {
+    MV_ASSERT(offset + size <= sizeof(net_config_));
+    memcpy((uint8_t*)&net_config_ + offset, data, size);
+  }
+};
+
+DECLARE_DEVICE(VhostUserNetwork);
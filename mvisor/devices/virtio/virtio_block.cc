@@ -79,6 +79,11 @@ class VirtioBlock : public VirtioPci {
         device_features_ |= VIRTIO_BLK_F_RO;
       }
     }
+    InitializePolling();
+    /* Polled queues are locked, so the image worker completes requests without the IO thread */
+    if (image_ && poll_ns_ > 0) {
+      image_->set_direct_completion(true);
+    }
   }
 
   void InitializeGeometry() {
@@ -123,10 +128,12 @@ class VirtioBlock : public VirtioPci {
   }
 
   void BlockIoAsync(VirtElement* element, size_t position, bool is_write, IoCallback callback) {
-    auto vector(element->vector);
-    for (auto &iov : vector) {
-      void* buffer = iov.iov_base;
-      size_t length = iov.iov_len;
+    /* Completions pop the vector to count pending IOs, popping keeps the buffers in place */
+    iovec* buffers = element->vector.begin();
+    size_t count = element->vector.size();
+    for (size_t i = 0; i < count; i++) {
+      void* buffer = buffers[i].iov_base;
+      size_t length = buffers[i].iov_len;
 
       auto io_complete = [=](auto ret) {
         if (!is_write && ret != (ssize_t)length) {
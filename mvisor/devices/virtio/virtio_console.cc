@@ -18,17 +18,32 @@
 
 #include <cstring>
 #include <array>
+#include <map>
+#include <mutex>
 #include <functional>
+#include <climits>
 #include <linux/virtio_console.h>
 #include "device_interface.h"
 #include "logger.h"
 #include "device_manager.h"
 #include "virtio_pci.h"
 
+#define VIRTIO_CONSOLE_MAX_IOV 128
+
+/* An element partially taken by the port */
+struct VirtioConsolePending {
+  VirtElement*  element;
+  size_t        offset;
+};
+
 class VirtioConsole : public VirtioPci, public SerialDeviceInterface {
  private:
+  std::recursive_mutex              mutex_;
   virtio_console_config             console_config_;
   std::vector<SerialPortInterface*> console_ports_;
+  /* Guest buffers popped but not filled, and guest output refused by the ports */
+  std::map<uint32_t, VirtElement*>  pending_input_;
+  std::map<uint32_t, VirtioConsolePending> pending_output_;
 
  public:
   VirtioConsole() {
@@ -42,6 +57,8 @@ class VirtioConsole : public VirtioPci, public SerialDeviceInterface {
 
     /* Device specific features */
     device_features_ |= (1UL << VIRTIO_CONSOLE_F_MULTIPORT);
+    /* Each port queue completes its buffers in order */
+    device_features_ |= (1UL << VIRTIO_F_IN_ORDER);
 
     bzero(&console_config_, sizeof(console_config_));
     console_config_.max_nr_ports = common_config_.num_queues / 2 - 1;
@@ -62,6 +79,11 @@ class VirtioConsole : public VirtioPci, public SerialDeviceInterface {
   }
 
   void Reset() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    /* Pending elements return to the queue pools when the queues are added again */
+    pending_input_.clear();
+    pending_output_.clear();
+
     /* Reset all queues */
     VirtioPci::Reset();
   
@@ -87,26 +109,142 @@ class VirtioConsole : public VirtioPci, public SerialDeviceInterface {
   }
 
   void OnPortInput(uint32_t id) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     auto port = FindPortById(id);
     port->OnWritable();
   }
 
+  /* Build iovecs of an element starting at offset, returns the count */
+  int GetElementIovecs(VirtElement* element, size_t offset, iovec* iov) {
+    int count = 0;
+    for (auto &item : element->vector) {
+      if (count == VIRTIO_CONSOLE_MAX_IOV) {
+        break;
+      }
+      if (offset >= item.iov_len) {
+        offset -= item.iov_len;
+        continue;
+      }
+      iov[count].iov_base = (uint8_t*)item.iov_base + offset;
+      iov[count].iov_len = item.iov_len - offset;
+      offset = 0;
+      count++;
+    }
+    return count;
+  }
+
+  /* Pass guest output to the port and notify once. If the port can not take all
+   * of it, the element is kept until the port calls ResumeGuestOutput().
+   */
   void OnPortOutput(uint32_t id) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     auto port = FindPortById(id);
     auto &vq = queues_[3 + id * 2];
-  
-    while (auto element = PopQueue(vq)) {
-      for (auto &iov : element->vector) {
-        port->OnMessage((uint8_t*)iov.iov_base, iov.iov_len);
+    bool pushed = false;
+    iovec iov[VIRTIO_CONSOLE_MAX_IOV];
+
+    while (true) {
+      VirtioConsolePending pending = { nullptr, 0 };
+      auto it = pending_output_.find(id);
+      if (it != pending_output_.end()) {
+        pending = it->second;
+        pending_output_.erase(it);
+      } else {
+        pending.element = PopQueue(vq);
+        if (!pending.element) {
+          break;
+        }
+      }
+
+      auto element = pending.element;
+      size_t offset = pending.offset;
+      bool blocked = false;
+      while (offset < element->size) {
+        int count = GetElementIovecs(element, offset, iov);
+        size_t offered = 0;
+        for (int i = 0; i < count; i++) {
+          offered += iov[i].iov_len;
+        }
+        size_t taken = port->OnMessageVector(iov, count);
+        offset += taken;
+        if (taken < offered) {
+          blocked = true;
+          break;
+        }
+      }
+      if (blocked) {
+        pending_output_[id] = VirtioConsolePending { element, offset };
+        break;
+      }
+      PushQueue(vq, element);
+      pushed = true;
+    }
+    if (pushed) {
+      NotifyQueue(vq);
+    }
+  }
+
+  void ResumeGuestOutput(SerialPortInterface* port) {
+    OnPortOutput(port->port_id());
+  }
+
+  /* Let the port fill the receive buffers, the last buffer not filled is kept for
+   * next time. The guest is notified once for all buffers filled.
+   */
+  size_t FillGuestBuffers(SerialPortInterface* port, SerialFillCallback callback) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    uint32_t id = port->port_id();
+    auto &vq = queues_[2 + id * 2];
+    if (!vq.enabled) {
+      return 0;
+    }
+
+    size_t total = 0;
+    bool pushed = false;
+    iovec iov[VIRTIO_CONSOLE_MAX_IOV];
+    while (true) {
+      VirtElement* element;
+      auto it = pending_input_.find(id);
+      if (it != pending_input_.end()) {
+        element = it->second;
+        pending_input_.erase(it);
+      } else {
+        element = PopQueue(vq);
+        if (!element) {
+          break;
+        }
+      }
+
+      int count = GetElementIovecs(element, 0, iov);
+      ssize_t ret = callback(iov, count);
+      if (ret <= 0) {
+        pending_input_[id] = element;
+        break;
       }
+      element->length = ret;
       PushQueue(vq, element);
+      pushed = true;
+      total += ret;
+      /* Short read means nothing more to read now */
+      if ((size_t)ret < element->size) {
+        break;
+      }
+    }
+    if (pushed) {
       NotifyQueue(vq);
     }
+    return total;
   }
 
   void SendMessage(SerialPortInterface* port, uint8_t* data, size_t size) {
+    iovec iov = { .iov_base = data, .iov_len = size };
+    SendMessage(port, &iov, 1);
+  }
+
+  void SendMessage(SerialPortInterface* port, const iovec* iov, int iovcnt) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     auto &vq = queues_[2 + port->port_id() * 2];
-    WriteBuffer(vq, data, size);
+    WriteBuffer(vq, iov, iovcnt);
   }
 
   void OnControlInput() {
@@ -114,7 +252,9 @@ class VirtioConsole : public VirtioPci, public SerialDeviceInterface {
   }
 
   void OnControlOutput() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     auto &vq = queues_[3];
+    bool pushed = false;
   
     while (auto element = PopQueue(vq)) {
       for (auto &iov : element->vector) {
@@ -122,32 +262,52 @@ class VirtioConsole : public VirtioPci, public SerialDeviceInterface {
         HandleConsoleControl(vcc);
       }
       PushQueue(vq, element);
+      pushed = true;
+    }
+    if (pushed) {
       NotifyQueue(vq);
     }
   }
 
-  void WriteBuffer(VirtQueue& vq, void* buffer, size_t size) {
+  /* Gather the iovecs to guest buffers and notify once */
+  void WriteBuffer(VirtQueue& vq, const iovec* iov, int iovcnt) {
+    int index = 0;
     size_t offset = 0;
-    while (offset < size) {
+    bool pushed = false;
+    while (index < iovcnt) {
       auto element = PopQueue(vq);
       if (!element) {
         break;
       }
 
-      size_t remain_bytes = size - offset;
-      for (auto &iov : element->vector) {
-        size_t bytes = iov.iov_len < remain_bytes ? iov.iov_len : remain_bytes;
-        memcpy(iov.iov_base, (uint8_t*)buffer + offset, bytes);
-        offset += bytes;
-        remain_bytes -= bytes;
-        element->length += bytes;
+      for (auto &buffer : element->vector) {
+        size_t buffer_offset = 0;
+        while (buffer_offset < buffer.iov_len && index < iovcnt) {
+          size_t bytes = std::min(buffer.iov_len - buffer_offset, iov[index].iov_len - offset);
+          memcpy((uint8_t*)buffer.iov_base + buffer_offset, (uint8_t*)iov[index].iov_base + offset, bytes);
+          buffer_offset += bytes;
+          offset += bytes;
+          element->length += bytes;
+          if (offset == iov[index].iov_len) {
+            offset = 0;
+            index++;
+          }
+        }
       }
 
       PushQueue(vq, element);
+      pushed = true;
+    }
+    if (pushed) {
       NotifyQueue(vq);
     }
   }
 
+  void WriteBuffer(VirtQueue& vq, void* buffer, size_t size) {
+    iovec iov = { .iov_base = buffer, .iov_len = size };
+    WriteBuffer(vq, &iov, 1);
+  }
+
   void SendControlEvent(SerialPortInterface* port, uint16_t event, uint16_t value) {
     virtio_console_control vcc = {
       .id = port->port_id(),
@@ -0,0 +1,409 @@
+/*
+ * MVisor VirtIO Input Device
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <linux/virtio_config.h>
+#include <linux/virtio_input.h>
+#include <linux/input.h>
+#include "device_interface.h"
+#include "logger.h"
+#include "device_manager.h"
+#include "virtio_pci.h"
+
+#define VIRTIO_INPUT_QUEUE_SIZE     64
+#define VIRTIO_INPUT_MAX_PENDING    1024
+#define VIRTIO_INPUT_ABS_MAX        0x7FFF
+
+/* Scancode set 1 to Linux keycodes, the same mapping as ui/keymap.c. Scancodes
+ * not listed equal to the keycodes, and the second table is for 0xE0 prefixed codes.
+ */
+static const struct {
+  uint8_t   scancode;
+  uint16_t  keycode;
+} kScancodeToKeycode[] = {
+  { 0x54, KEY_SYSRQ }, { 0x59, KEY_KPEQUAL }, { 0x5B, KEY_LINEFEED }, { 0x64, KEY_OPEN },
+  { 0x65, KEY_PASTE }, { 0x70, KEY_KATAKANAHIRAGANA }, { 0x73, KEY_RO }, { 0x77, KEY_HIRAGANA },
+  { 0x79, KEY_HENKAN }, { 0x7B, KEY_MUHENKAN }, { 0x7D, KEY_YEN }, { 0x7E, KEY_KPCOMMA }
+}, kExtendedScancodeToKeycode[] = {
+  { 0x05, KEY_AGAIN }, { 0x06, KEY_PROPS }, { 0x07, KEY_UNDO }, { 0x0C, KEY_FRONT },
+  { 0x10, KEY_PREVIOUSSONG }, { 0x19, KEY_NEXTSONG }, { 0x1C, KEY_KPENTER }, { 0x1D, KEY_RIGHTCTRL },
+  { 0x1E, KEY_MENU }, { 0x20, KEY_MUTE }, { 0x21, KEY_CALC }, { 0x22, KEY_PLAYPAUSE },
+  { 0x24, KEY_STOPCD }, { 0x2E, KEY_VOLUMEDOWN }, { 0x30, KEY_VOLUMEUP }, { 0x32, KEY_HOMEPAGE },
+  { 0x35, KEY_KPSLASH }, { 0x38, KEY_RIGHTALT }, { 0x3C, KEY_CUT }, { 0x41, KEY_FIND },
+  { 0x46, KEY_PAUSE }, { 0x47, KEY_HOME }, { 0x48, KEY_UP }, { 0x49, KEY_PAGEUP },
+  { 0x4B, KEY_LEFT }, { 0x4D, KEY_RIGHT }, { 0x4F, KEY_END }, { 0x50, KEY_DOWN },
+  { 0x51, KEY_PAGEDOWN }, { 0x52, KEY_INSERT }, { 0x53, KEY_DELETE }, { 0x5B, KEY_LEFTMETA },
+  { 0x5C, KEY_RIGHTMETA }, { 0x5D, KEY_COMPOSE }, { 0x5E, KEY_POWER }, { 0x5F, KEY_SLEEP },
+  { 0x63, KEY_WAKEUP }, { 0x66, KEY_BOOKMARKS }, { 0x67, KEY_REFRESH }, { 0x68, KEY_STOP },
+  { 0x69, KEY_FORWARD }, { 0x6A, KEY_BACK }, { 0x6B, KEY_COMPUTER }, { 0x6C, KEY_MAIL },
+  { 0x6D, KEY_MEDIA }, { 0x75, KEY_HELP }, { 0x78, KEY_COPY }
+};
+
+/* The virtio input device reports evdev events. Compared with the PS/2 keyboard,
+ * which needs several port IO exits and IRQ toggles per scancode, and the USB tablet,
+ * which is polled by the xHCI endpoint timer, a whole input report is written
+ * to the event queue at once with a single interrupt.
+ * https://docs.oasis-open.org/virtio/virtio/v1.1/cs01/virtio-v1.1-cs01.html#x1-3390008
+ */
+class VirtioInput : public VirtioPci {
+ protected:
+  std::mutex                          mutex_;
+  virtio_input_config                 input_config_;
+  std::string                         input_name_;
+  uint16_t                            product_id_;
+  std::vector<uint8_t>                event_bits_[EV_CNT];
+  std::deque<virtio_input_event>      pending_events_;
+  /* Events of the first pending report were written to the guest */
+  bool                                report_started_ = false;
+
+ public:
+  VirtioInput() {
+    pci_header_.class_code = 0x098000;
+    pci_header_.device_id = 0x1052;
+    pci_header_.subsys_id = 0x0012;
+
+    AddPciBar(1, 0x1000, kIoResourceTypeMmio);
+    AddMsiXCapability(1, 3, 0, 0x1000);
+
+    /* Events and status are completed as soon as they are popped */
+    device_features_ |= (1UL << VIRTIO_F_IN_ORDER);
+
+    common_config_.num_queues = 2;
+    bzero(&input_config_, sizeof(input_config_));
+  }
+
+  void Reset() {
+    VirtioPci::Reset();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_events_.clear();
+    report_started_ = false;
+    AddQueue(VIRTIO_INPUT_QUEUE_SIZE, std::bind(&VirtioInput::OnEventQueue, this));
+    AddQueue(VIRTIO_INPUT_QUEUE_SIZE, std::bind(&VirtioInput::OnStatusQueue, this));
+  }
+
+  void ReadDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size) {
+    MV_ASSERT(offset + size <= sizeof(input_config_));
+    std::lock_guard<std::mutex> lock(mutex_);
+    memcpy(data, (uint8_t*)&input_config_ + offset, size);
+  }
+
+  /* The driver selects a config item with select and subsel, then reads size and data */
+  void WriteDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size) {
+    MV_ASSERT(offset + size <= offsetof(virtio_input_config, size));
+    std::lock_guard<std::mutex> lock(mutex_);
+    memcpy((uint8_t*)&input_config_ + offset, data, size);
+    UpdateConfigSelection();
+  }
+
+  bool InputAcceptable() {
+    return queues_[0].enabled && (common_config_.device_status & VIRTIO_CONFIG_S_DRIVER_OK);
+  }
+
+ protected:
+  void SetEventBit(uint type, uint code) {
+    auto &bits = event_bits_[type];
+    if (bits.size() <= code / 8) {
+      bits.resize(code / 8 + 1, 0);
+    }
+    bits[code / 8] |= 1 << (code % 8);
+  }
+
+  virtual void GetAbsInfo(uint code, virtio_input_absinfo* info) {
+  }
+
+  void UpdateConfigSelection() {
+    auto &u = input_config_.u;
+    bzero(&u, sizeof(u));
+    input_config_.size = 0;
+
+    switch (input_config_.select)
+    {
+    case VIRTIO_INPUT_CFG_ID_NAME:
+      input_config_.size = input_name_.size() < sizeof(u.string) ? input_name_.size() : sizeof(u.string);
+      memcpy(u.string, input_name_.data(), input_config_.size);
+      break;
+    case VIRTIO_INPUT_CFG_ID_DEVIDS:
+      u.ids.bustype = BUS_VIRTUAL;
+      u.ids.vendor = 0x0627; /* same as QEMU */
+      u.ids.product = product_id_;
+      u.ids.version = 1;
+      input_config_.size = sizeof(u.ids);
+      break;
+    case VIRTIO_INPUT_CFG_EV_BITS:
+      if (input_config_.subsel < EV_CNT) {
+        auto &bits = event_bits_[input_config_.subsel];
+        input_config_.size = bits.size();
+        memcpy(u.bitmap, bits.data(), bits.size());
+      }
+      break;
+    case VIRTIO_INPUT_CFG_ABS_INFO:
+      if (input_config_.subsel < ABS_CNT && !event_bits_[EV_ABS].empty()) {
+        GetAbsInfo(input_config_.subsel, &u.abs);
+        input_config_.size = sizeof(u.abs);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  void AddEvent(uint16_t type, uint16_t code, int32_t value) {
+    pending_events_.push_back(virtio_input_event {
+      .type = type,
+      .code = code,
+      .value = (uint32_t)value
+    });
+  }
+
+  /* Write pending events to the event queue and notify the guest once.
+   * Called with mutex locked.
+   */
+  void FlushEvents() {
+    if (!InputAcceptable()) {
+      pending_events_.clear();
+      report_started_ = false;
+      return;
+    }
+
+    if (pending_events_.size() > VIRTIO_INPUT_MAX_PENDING) {
+      DropOldReports();
+    }
+
+    auto &vq = queues_[0];
+    bool pushed = false;
+    while (!pending_events_.empty()) {
+      auto element = PopQueue(vq);
+      if (!element) {
+        break;
+      }
+      auto &event = pending_events_.front();
+      auto &iov = element->vector.front();
+      MV_ASSERT(iov.iov_len >= sizeof(event));
+      memcpy(iov.iov_base, &event, sizeof(event));
+      element->length = sizeof(event);
+      PushQueue(vq, element);
+      report_started_ = !(event.type == EV_SYN && event.code == SYN_REPORT);
+      pending_events_.pop_front();
+      pushed = true;
+    }
+    if (pushed) {
+      NotifyQueue(vq);
+    }
+  }
+
+  /* The guest doesn't consume events, drop whole reports from the oldest until the
+   * backlog fits. A report partly written to the guest, the report not finished yet
+   * and reports releasing a key or button are kept, so no key is stuck down.
+   */
+  void DropOldReports() {
+    std::deque<virtio_input_event> events;
+    size_t size = pending_events_.size();
+    auto report_begin = pending_events_.begin();
+    bool first_report = true;
+    for (auto it = pending_events_.begin(); it != pending_events_.end(); ++it) {
+      if (it->type != EV_SYN || it->code != SYN_REPORT) {
+        continue;
+      }
+      auto report_end = it + 1;
+      bool keep = (first_report && report_started_) || size <= VIRTIO_INPUT_MAX_PENDING;
+      for (auto event = report_begin; !keep && event != report_end; ++event) {
+        keep = event->type == EV_KEY && event->value == 0;
+      }
+      if (keep) {
+        events.insert(events.end(), report_begin, report_end);
+      } else {
+        size -= report_end - report_begin;
+      }
+      report_begin = report_end;
+      first_report = false;
+    }
+    events.insert(events.end(), report_begin, pending_events_.end());
+    pending_events_.swap(events);
+  }
+
+  /* The guest adds buffers to the event queue */
+  void OnEventQueue() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FlushEvents();
+  }
+
+  /* LED and other status updates from the guest are ignored */
+  void OnStatusQueue() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &vq = queues_[1];
+    bool pushed = false;
+    while (auto element = PopQueue(vq)) {
+      PushQueue(vq, element);
+      pushed = true;
+    }
+    if (pushed) {
+      NotifyQueue(vq);
+    }
+  }
+};
+
+
+class VirtioKeyboard : public VirtioInput, public KeyboardInputInterface {
+ private:
+  bool  extended_ = false;
+  bool  key_pressed_[KEY_CNT];
+
+ public:
+  VirtioKeyboard() {
+    devfn_ = PCI_MAKE_DEVFN(8, 0);
+    input_name_ = "MVisor Virtio Keyboard";
+    product_id_ = 0x0001;
+
+    SetEventBit(EV_KEY, 0);
+    for (uint scancode = 1; scancode < 0x80; scancode++) {
+      SetEventBit(EV_KEY, TranslateScancode(scancode, false));
+    }
+    for (auto &item : kExtendedScancodeToKeycode) {
+      SetEventBit(EV_KEY, item.keycode);
+    }
+    SetEventBit(EV_SYN, 0);
+  }
+
+  void Reset() {
+    VirtioInput::Reset();
+    extended_ = false;
+    bzero(key_pressed_, sizeof(key_pressed_));
+  }
+
+  /* The scancodes are translated to set 1 by the UI, ended with zero */
+  void QueueKeyboardEvent(uint8_t scancode[10]) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < 10 && scancode[i]; i++) {
+      if (scancode[i] == 0xE0) {
+        extended_ = true;
+        continue;
+      }
+      uint16_t keycode = TranslateScancode(scancode[i] & 0x7F, extended_);
+      extended_ = false;
+      if (keycode == KEY_RESERVED) {
+        continue;
+      }
+
+      bool pressed = !(scancode[i] & 0x80);
+      /* Repeated key downs from the UI are reported as autorepeat */
+      int value = pressed ? (key_pressed_[keycode] ? 2 : 1) : 0;
+      key_pressed_[keycode] = pressed;
+      AddEvent(EV_KEY, keycode, value);
+      AddEvent(EV_SYN, SYN_REPORT, 0);
+    }
+    FlushEvents();
+  }
+
+  /* Relative mouse is not supported, the tablet is used instead */
+  void QueueMouseEvent(uint buttons, int rel_x, int rel_y, int rel_z) {
+  }
+
+  bool InputAcceptable() {
+    return VirtioInput::InputAcceptable();
+  }
+
+ private:
+  uint16_t TranslateScancode(uint8_t scancode, bool extended) {
+    if (extended) {
+      for (auto &item : kExtendedScancodeToKeycode) {
+        if (item.scancode == scancode) {
+          return item.keycode;
+        }
+      }
+      return KEY_RESERVED;
+    }
+    for (auto &item : kScancodeToKeycode) {
+      if (item.scancode == scancode) {
+        return item.keycode;
+      }
+    }
+    return scancode;
+  }
+};
+
+
+class VirtioTablet : public VirtioInput, public PointerInputInterface {
+ private:
+  uint  last_buttons_;
+
+ public:
+  VirtioTablet() {
+    devfn_ = PCI_MAKE_DEVFN(9, 0);
+    input_name_ = "MVisor Virtio Tablet";
+    product_id_ = 0x0003;
+
+    SetEventBit(EV_KEY, BTN_LEFT);
+    SetEventBit(EV_KEY, BTN_RIGHT);
+    SetEventBit(EV_KEY, BTN_MIDDLE);
+    SetEventBit(EV_REL, REL_WHEEL);
+    SetEventBit(EV_ABS, ABS_X);
+    SetEventBit(EV_ABS, ABS_Y);
+    SetEventBit(EV_SYN, 0);
+  }
+
+  void Reset() {
+    VirtioInput::Reset();
+    last_buttons_ = 0;
+  }
+
+  /* The buttons are SPICE buttons, bit 1 is left, bit 2 is middle and bit 3 is right */
+  void QueuePointerEvent(PointerEvent event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!event.screen_width || !event.screen_height) {
+      return;
+    }
+
+    static const struct {
+      uint      mask;
+      uint16_t  code;
+    } buttons[] = { { 2, BTN_LEFT }, { 4, BTN_MIDDLE }, { 8, BTN_RIGHT } };
+    for (auto &button : buttons) {
+      if ((event.buttons ^ last_buttons_) & button.mask) {
+        AddEvent(EV_KEY, button.code, (event.buttons & button.mask) ? 1 : 0);
+      }
+    }
+    last_buttons_ = event.buttons;
+
+    AddEvent(EV_ABS, ABS_X, (int64_t)event.x * VIRTIO_INPUT_ABS_MAX / event.screen_width);
+    AddEvent(EV_ABS, ABS_Y, (int64_t)event.y * VIRTIO_INPUT_ABS_MAX / event.screen_height);
+    if (event.z) {
+      AddEvent(EV_REL, REL_WHEEL, event.z);
+    }
+    AddEvent(EV_SYN, SYN_REPORT, 0);
+    FlushEvents();
+  }
+
+  bool InputAcceptable() {
+    return VirtioInput::InputAcceptable();
+  }
+
+ protected:
+  void GetAbsInfo(uint code, virtio_input_absinfo* info) {
+    if (code == ABS_X || code == ABS_Y) {
+      info->min = 0;
+      info->max = VIRTIO_INPUT_ABS_MAX;
+    }
+  }
+};
+
+DECLARE_DEVICE(VirtioKeyboard);
+DECLARE_DEVICE(VirtioTablet);
@@ -61,7 +61,8 @@ class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface {
       (1UL << VIRTIO_NET_F_CTRL_RX) |
       (1UL << VIRTIO_NET_F_CTRL_VLAN) |
       (1UL << VIRTIO_NET_F_CTRL_RX_EXTRA) |
-      (1UL << VIRTIO_NET_F_GUEST_ANNOUNCE);
+      (1UL << VIRTIO_NET_F_GUEST_ANNOUNCE) |
+      (1UL << VIRTIO_F_IN_ORDER);
 
     bzero(&net_config_, sizeof(net_config_));
     GenerateRandomMac(net_config_.mac);
@@ -214,7 +215,7 @@ class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface {
       front.iov_base = &header[1];
       front.iov_len -= sizeof(*header);
     }
-    backend_->OnFrameFromGuest(vector);
+    backend_->OnFrameFromGuest(vector.begin(), vector.size());
   }
 
   void HandleControl(VirtQueue& vq, VirtElement* element) {
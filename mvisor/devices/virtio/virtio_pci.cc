@@ -17,10 +17,15 @@
  */
 
 #include "virtio_pci.h"
+#include "virtio_ring.h"
 #include <cstring>
+#include <chrono>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <linux/virtio_config.h>
 #include "logger.h"
 #include "device_manager.h"
+#include "machine.h"
 
 VirtioPci::VirtioPci() {
     pci_header_.vendor_id = 0x1AF4;
@@ -63,7 +68,7 @@ VirtioPci::VirtioPci() {
     bzero(driver_features_, sizeof(driver_features_));
     /* Device common features */
     device_features_ = (1UL << VIRTIO_RING_F_INDIRECT_DESC) | (1UL << VIRTIO_RING_F_EVENT_IDX) | \
-      (1UL << VIRTIO_F_VERSION_1);
+      (1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_F_RING_PACKED);
 
     common_config_.num_queues = queues_.size();
     use_ioevent_ = true;
@@ -76,6 +81,7 @@ void VirtioPci::Disconnect() {
 }
 
 void VirtioPci::Reset() {
+  StopPoller();
   PciDevice::Reset();
   isr_status_ = 0;
   for (uint index = 0; index < queues_.size(); index++) {
@@ -86,10 +92,151 @@ void VirtioPci::Reset() {
     }
     queues_[index].enabled = false;
     queues_[index].size = 0;
+    queues_[index].io_event = nullptr;
   }
 }
 
+/* Busy polling trades a host CPU for request latency, the poller thread pops the
+ * queues without guest kicks, and waits on the ioeventfds after poll_us idle
+ */
+void VirtioPci::InitializePolling() {
+  if (!has_key("poll_us")) {
+    return;
+  }
+  poll_ns_ = std::get<uint64_t>(key_values_["poll_us"]) * 1000;
+  if (has_key("poll_cpus")) {
+    auto &value = key_values_["poll_cpus"];
+    if (std::holds_alternative<uint64_t>(value)) {
+      poll_cpus_ = parse_cpu_list(std::to_string(std::get<uint64_t>(value)));
+    } else {
+      poll_cpus_ = parse_cpu_list(std::get<std::string>(value));
+    }
+  }
+}
+
+void VirtioPci::StartPoller() {
+  if (poller_running_) {
+    return;
+  }
+  poller_wakeup_fd_ = eventfd(0, EFD_CLOEXEC);
+  MV_ASSERT(poller_wakeup_fd_ >= 0);
+  poller_running_ = true;
+  poller_thread_ = std::thread(&VirtioPci::PollQueues, this);
+  manager_->machine()->PlaceThread(poller_thread_, ThreadPlacement { .cpus = poll_cpus_, .priority = 0 });
+}
+
+void VirtioPci::StopPoller() {
+  if (!poller_running_) {
+    return;
+  }
+  poller_running_ = false;
+  uint64_t value = 1;
+  write(poller_wakeup_fd_, &value, sizeof(value));
+  poller_thread_.join();
+  safe_close(&poller_wakeup_fd_);
+}
+
+void VirtioPci::PollQueues() {
+  SetThreadName("mvisor-vq-poll");
+
+  std::vector<VirtQueue*> polled;
+  std::vector<pollfd> fds = { pollfd { .fd = poller_wakeup_fd_, .events = POLLIN } };
+  for (auto &vq : queues_) {
+    if (vq.polling && vq.enabled) {
+      polled.push_back(&vq);
+      /* Without an ioeventfd, the kick is forwarded to the wakeup fd */
+      if (vq.io_event) {
+        fds.push_back(pollfd { .fd = vq.io_event->fd, .events = POLLIN });
+      }
+      SetQueueNotification(vq, false);
+    }
+  }
+
+  auto idle_since = std::chrono::steady_clock::now();
+  while (poller_running_) {
+    bool busy = false;
+    for (auto vq : polled) {
+      if (vring_is_available(*vq)) {
+        vq->notification_callback();
+        busy = true;
+      }
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (busy) {
+      idle_since = now;
+      continue;
+    }
+    if (now - idle_since < std::chrono::nanoseconds(poll_ns_)) {
+      asm volatile ("pause": : :"memory");
+      continue;
+    }
+
+    /* Idle for too long, sleep until the guest kicks */
+    bool available = false;
+    for (auto vq : polled) {
+      available |= SetQueueNotification(*vq, true);
+    }
+    if (!available) {
+      poll(fds.data(), fds.size(), -1);
+      for (auto &fd : fds) {
+        if (fd.revents & POLLIN) {
+          uint64_t value;
+          read(fd.fd, &value, sizeof(value));
+        }
+      }
+    }
+    for (auto vq : polled) {
+      SetQueueNotification(*vq, false);
+    }
+    idle_since = std::chrono::steady_clock::now();
+  }
+
+  for (auto vq : polled) {
+    SetQueueNotification(*vq, true);
+  }
+}
+
+/* While the poller spins, the guest is asked not to kick. Returns true if buffers were
+ * made available before the guest could see notifications enabled again.
+ */
+bool VirtioPci::SetQueueNotification(VirtQueue& vq, bool enable) {
+  vq.notification_disabled = !enable;
+  if (vq.packed) {
+    vq.device_event->flags = enable ? VRING_PACKED_EVENT_FLAG_ENABLE : VRING_PACKED_EVENT_FLAG_DISABLE;
+  } else if (enable) {
+    vq.used_ring->flags &= ~VRING_USED_F_NO_NOTIFY;
+  } else {
+    vq.used_ring->flags |= VRING_USED_F_NO_NOTIFY;
+  }
+  if (!enable) {
+    return false;
+  }
+
+  /* With EVENT_IDX, the guest ignores the flags and follows the avail event */
+  vring_arm_available_event(vq, HasFeature(VIRTIO_RING_F_EVENT_IDX));
+  asm volatile ("mfence": : :"memory");
+  return vring_is_available(vq);
+}
+
+std::unique_lock<std::mutex> VirtioPci::LockQueue(VirtQueue& vq) {
+  if (vq.polling) {
+    return std::unique_lock<std::mutex>(vq.mutex);
+  }
+  return std::unique_lock<std::mutex>();
+}
+
 void VirtioPci::PrintQueue(VirtQueue& vq) {
+  if (vq.packed) {
+    MV_LOG("packed queue index=%d size=%d avail=%u/%d used=%u/%d: ", vq.index, vq.size,
+      vq.last_available_index, vq.available_wrap_counter, vq.used_index, vq.used_wrap_counter);
+    for (int i = 0; i < vq.size; i++) {
+      auto descriptor = &vq.packed_ring[i];
+      MV_LOG("descriptor address=0x%lx length=%x id=%x flags=%x", descriptor->address,
+        descriptor->length, descriptor->id, descriptor->flags);
+    }
+    return;
+  }
   MV_LOG("queue index=%d size=%d descriptors: ", vq.index, vq.size);
   for (int i = 0; i < vq.size; i++) {
     auto descriptor = &vq.descriptor_table[i];
@@ -108,13 +255,17 @@ void VirtioPci::PrintQueue(VirtQueue& vq) {
   }
 }
 
-void VirtioPci::AddDescriptorToElement(VirtElement& element,  VRingDescriptor* descriptor) {
-  void* host = manager_->TranslateGuestMemory(descriptor->address);
+void VirtioPci::AddBufferToElement(VirtElement& element, uint64_t address, uint32_t length) {
+  void* host = manager_->TranslateGuestMemory(address);
   element.vector.push_back(iovec {
     .iov_base = host,
-    .iov_len = descriptor->length
+    .iov_len = length
   });
-  element.size += descriptor->length;
+  element.size += length;
+}
+
+void VirtioPci::AddDescriptorToElement(VirtElement& element,  VRingDescriptor* descriptor) {
+  AddBufferToElement(element, descriptor->address, descriptor->length);
 }
 
 void VirtioPci::ReadIndirectDescriptorTable(VirtElement& element, VRingDescriptor* table) {
@@ -128,19 +279,68 @@ void VirtioPci::ReadIndirectDescriptorTable(VirtElement& element, VRingDescripto
   }
 }
 
+VirtElement* VirtioPci::AllocateElement(VirtQueue& vq) {
+  auto lock = LockQueue(vq);
+  if (vq.free_elements.empty()) {
+    MV_PANIC("%s queue %d has more than %d elements in use", name_, vq.index, vq.size);
+  }
+  auto element = vq.free_elements.back();
+  vq.free_elements.pop_back();
+  element->Initialize();
+  return element;
+}
+
+/* The chain of a packed ring descriptor follows in the next slots */
+VirtElement* VirtioPci::PopPackedQueue(VirtQueue& vq) {
+  VRingPackedDescriptor* descriptor = &vq.packed_ring[vq.last_available_index];
+  auto element = AllocateElement(vq);
+  element->index = vq.last_available_index;
+
+  while (true) {
+    /* Read each descriptor once, the driver may reuse the slot after it is used */
+    VRingPackedDescriptor current = *descriptor;
+    if (current.flags & VRING_DESC_F_INDIRECT) {
+      auto table = (VRingPackedDescriptor*)manager_->TranslateGuestMemory(current.address);
+      size_t count = current.length / sizeof(VRingPackedDescriptor);
+      for (size_t i = 0; i < count; i++) {
+        AddBufferToElement(*element, table[i].address, table[i].length);
+      }
+    } else {
+      AddBufferToElement(*element, current.address, current.length);
+    }
+    element->descriptor_count++;
+
+    if (++vq.last_available_index >= vq.size) {
+      vq.last_available_index = 0;
+      vq.available_wrap_counter = !vq.available_wrap_counter;
+    }
+    if ((current.flags & VRING_DESC_F_NEXT) == 0) {
+      /* The buffer ID is in the last descriptor of the chain */
+      element->id = current.id;
+      break;
+    }
+    descriptor = &vq.packed_ring[vq.last_available_index];
+  }
+  element->length = 0;
+  return element;
+}
+
 VirtElement* VirtioPci::PopQueue(VirtQueue& vq) {
-  if (vq.available_ring->index == vq.last_available_index) {
+  if (!vring_is_available(vq) && !vring_arm_available_event(vq, HasFeature(VIRTIO_RING_F_EVENT_IDX))) {
     return nullptr;
   }
-  asm volatile ("mfence": : :"memory");
+  /* x86 does not reorder loads, only the compiler must read the ring index first */
+  asm volatile ("": : :"memory");
 
-  auto element = new VirtElement;
-  element->Initialize();
+  if (vq.packed) {
+    return PopPackedQueue(vq);
+  }
+
+  auto element = AllocateElement(vq);
+  element->index = vq.last_available_index;
+  element->descriptor_count = 1;
 
   auto item = vq.available_ring->items[vq.last_available_index++ % vq.size];
-  if (driver_features_[0] & (1 << VIRTIO_RING_F_EVENT_IDX)) {
-    *(uint16_t*)&vq.used_ring->items[vq.size] = vq.last_available_index;
-  }
 
   VRingDescriptor* descriptor = &vq.descriptor_table[item];
   while (true) {
@@ -161,7 +361,7 @@ VirtElement* VirtioPci::PopQueue(VirtQueue& vq) {
   return element;
 }
 
-void VirtioPci::PushQueue(VirtQueue& vq, VirtElement* element) {
+void VirtioPci::PushSplitQueue(VirtQueue& vq, VirtElement* element) {
   auto &item = vq.used_ring->items[vq.used_ring->index % vq.size];
   item.id = element->id;
   item.length = element->length;
@@ -170,20 +370,49 @@ void VirtioPci::PushQueue(VirtQueue& vq, VirtElement* element) {
   asm volatile ("sfence": : :"memory");
 
   ++vq.used_ring->index;
+}
+
+/* The used descriptor is written at the used index, then the used index skips the
+ * slots of the whole chain
+ */
+void VirtioPci::PushPackedQueue(VirtQueue& vq, VirtElement* element) {
+  VRingPackedDescriptor* descriptor = &vq.packed_ring[vq.used_index];
+  descriptor->id = element->id;
+  descriptor->length = element->length;
+
+  /* x86 does not reorder stores, the flags make the descriptor visible to the guest */
+  asm volatile ("": : :"memory");
+  descriptor->flags = vq.used_wrap_counter ? (VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED) : 0;
+
+  vq.used_index += element->descriptor_count;
+  if (vq.used_index >= vq.size) {
+    vq.used_index -= vq.size;
+    vq.used_wrap_counter = !vq.used_wrap_counter;
+  }
+}
+
+void VirtioPci::PushQueue(VirtQueue& vq, VirtElement* element) {
+  auto lock = LockQueue(vq);
+  /* Devices offer VIRTIO_F_IN_ORDER only if their backends complete in order */
+  if (HasFeature(VIRTIO_F_IN_ORDER)) {
+    MV_ASSERT(element->index == (vq.packed ? vq.used_index : vq.used_ring->index));
+  }
 
-  delete element;
+  if (vq.packed) {
+    PushPackedQueue(vq, element);
+  } else {
+    PushSplitQueue(vq, element);
+  }
+  vq.free_elements.push_back(element);
 }
 
 void VirtioPci::NotifyQueue(VirtQueue& vq) {
+  auto lock = LockQueue(vq);
   asm volatile ("mfence": : :"memory");
 
-  if (driver_features_[0] & (1 << VIRTIO_RING_F_EVENT_IDX)) {
-    /* Carefully handle the overflow */
-    uint16_t compare = vq.used_ring->index - vq.available_ring->items[vq.size];
-    if (compare != 1) {
-      return;
-    }
-  } else if (vq.available_ring->flags & VRING_AVAIL_F_NO_INTERRUPT) {
+  bool needs_notify = vq.packed ? vring_packed_needs_notify(vq) :
+    vring_split_needs_notify(vq, HasFeature(VIRTIO_RING_F_EVENT_IDX));
+  if (!needs_notify) {
     return;
   }
 
@@ -195,8 +424,8 @@ void VirtioPci::NotifyQueue(VirtQueue& vq) {
   }
   if (msi_config_.enabled) {
     SignalMsi(vq.msix_vector);
-  } else if (pci_header_.irq_line) {
-    manager_->SetIrq(pci_header_.irq_line, isr_status_ & 1);
+  } else {
+    SetPciIrqLevel(isr_status_ & 1);
   }
 }
 
@@ -206,9 +435,25 @@ void VirtioPci::AddQueue(uint16_t queue_size, VoidCallback callback) {
       continue;
     vq.size = queue_size;
     vq.notification_callback = callback;
+    /* Elements still held by the device before reset are returned here */
+    if (vq.elements_size != queue_size) {
+      vq.elements.reset(new VirtElement[queue_size]);
+      vq.elements_size = queue_size;
+      vq.free_elements.reserve(queue_size);
+    }
+    vq.free_elements.clear();
+    for (int i = 0; i < queue_size; i++) {
+      vq.free_elements.push_back(&vq.elements[i]);
+    }
     vq.descriptor_table = nullptr;
     vq.available_ring = nullptr;
     vq.used_ring = nullptr;
+    vq.packed = false;
+    vq.polling = poll_ns_ > 0;
+    vq.notification_disabled = false;
+    vq.packed_ring = nullptr;
+    vq.driver_event = nullptr;
+    vq.device_event = nullptr;
     vq.enabled = false;
     vq.last_available_index = 0;
     return;
@@ -219,14 +464,34 @@ void VirtioPci::AddQueue(uint16_t queue_size, VoidCallback callback) {
 void VirtioPci::EnableQueue(uint16_t queue_index, uint64_t desc_gpa, uint64_t avail_gpa, uint64_t used_gpa) {
   auto &vq = queues_[queue_index];
   MV_ASSERT(!vq.enabled);
-  vq.descriptor_table = (VRingDescriptor*)manager_->TranslateGuestMemory(desc_gpa);
-  vq.available_ring = (VRingAvailable*)manager_->TranslateGuestMemory(avail_gpa);
-  vq.used_ring = (VRingUsed*)manager_->TranslateGuestMemory(used_gpa);
-  MV_ASSERT(vq.descriptor_table && vq.available_ring && vq.used_ring);
+  vq.last_available_index = 0;
+  vq.signalled_used_valid = false;
+  if (HasFeature(VIRTIO_F_RING_PACKED)) {
+    /* The descriptor ring, driver area and device area of a packed ring */
+    vq.packed = true;
+    vq.packed_ring = (VRingPackedDescriptor*)manager_->TranslateGuestMemory(desc_gpa);
+    vq.driver_event = (VRingPackedEvent*)manager_->TranslateGuestMemory(avail_gpa);
+    vq.device_event = (VRingPackedEvent*)manager_->TranslateGuestMemory(used_gpa);
+    MV_ASSERT(vq.packed_ring && vq.driver_event && vq.device_event);
+    vq.device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    vq.available_wrap_counter = true;
+    vq.used_wrap_counter = true;
+    vq.used_index = 0;
+  } else {
+    vq.packed = false;
+    vq.descriptor_table = (VRingDescriptor*)manager_->TranslateGuestMemory(desc_gpa);
+    vq.available_ring = (VRingAvailable*)manager_->TranslateGuestMemory(avail_gpa);
+    vq.used_ring = (VRingUsed*)manager_->TranslateGuestMemory(used_gpa);
+    MV_ASSERT(vq.descriptor_table && vq.available_ring && vq.used_ring);
+  }
 
   if (use_ioevent_) {
     uint64_t notify_address = pci_bars_[4].address + 0x3000 + queue_index * 4;
-    manager_->RegisterIoEvent(this, kIoResourceTypeMmio, notify_address);
+    if (vq.polling || external_queues_) {
+      vq.io_event = manager_->RegisterIoEventFd(this, kIoResourceTypeMmio, notify_address);
+    } else {
+      vq.io_event = manager_->RegisterIoEvent(this, kIoResourceTypeMmio, notify_address);
+    }
   }
 
   vq.enabled = true;
@@ -240,6 +505,11 @@ void VirtioPci::WriteCommonConfig(uint64_t offset, uint8_t* data, uint32_t size)
   case VIRTIO_PCI_COMMON_STATUS:
     if (!common_config_.device_status) {
       Reset();
+    } else if (common_config_.device_status & VIRTIO_CONFIG_S_DRIVER_OK) {
+      if (poll_ns_ > 0) {
+        StartPoller();
+      }
+      OnDriverOk();
     }
     break;
   case VIRTIO_PCI_COMMON_GF:
@@ -320,7 +590,15 @@ void VirtioPci::WriteNotification(uint64_t offset, uint8_t* data, uint32_t size)
   MV_ASSERT(queue < queues_.size());
   auto &vq = queues_[queue];
   if (vq.enabled) {
-    if (use_ioevent_) {
+    if (vq.polling || external_queues_) {
+      /* The poller or backend waits on the ioeventfd, which KVM signals without exits */
+      uint64_t value = 1;
+      if (vq.io_event) {
+        write(vq.io_event->fd, &value, sizeof(value));
+      } else if (vq.polling && poller_running_) {
+        write(poller_wakeup_fd_, &value, sizeof(value));
+      }
+    } else if (use_ioevent_) {
       vq.notification_callback();
     } else {
       manager_->io()->Schedule(vq.notification_callback);
@@ -353,7 +631,7 @@ void VirtioPci::Read(const IoResource* resource, uint64_t offset, uint8_t* data,
     } else if (offset < 0x2000) { /* ISR Status */
       *data = isr_status_;
       isr_status_ = 0;
-      manager_->SetIrq(pci_header_.irq_line, 0);
+      SetPciIrqLevel(0);
     } else if (offset < 0x3000) { /* Device config */
       ReadDeviceConfig(offset - 0x2000, data, size);
     } else if (offset < 0x4000) { /* Notification */
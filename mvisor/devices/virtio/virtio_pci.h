@@ -22,8 +22,14 @@
 #include "pci_device.h"
 
 #include <linux/virtio_pci.h>
+#include <linux/virtio_config.h>
 #include <sys/uio.h>
-#include <deque>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <atomic>
 
 /* We support indirect buffer descriptors */
 #define VIRTIO_RING_F_INDIRECT_DESC  28
@@ -82,29 +88,111 @@ struct VRingUsed {
   struct VRingUsedElement items[];
 } __attribute__((packed));
 
+/* Packed ring descriptors are made available and used in place, the avail and used
+ * bits equal to the wrap counter of the driver or the device mark the owner.
+ */
+struct VRingPackedDescriptor {
+  uint64_t address;
+  uint32_t length;
+  uint16_t id;
+#define VRING_PACKED_DESC_F_AVAIL  (1 << 7)
+#define VRING_PACKED_DESC_F_USED   (1 << 15)
+  uint16_t flags;
+} __attribute__((packed));
 
-typedef std::function<void (void)> VoidCallback;
-struct VirtQueue {
-  bool              enabled = false;
-  int               msix_vector;
-  VoidCallback      notification_callback;
-  
-  int               index;
-  int               size;
-  VRingDescriptor*  descriptor_table;
-  VRingAvailable*   available_ring;
-  VRingUsed*        used_ring;
-  uint16_t          last_available_index;
+/* Event suppression structures in the driver and device areas of a packed ring */
+struct VRingPackedEvent {
+#define VRING_PACKED_EVENT_F_WRAP_CTR 15
+  uint16_t offset_wrap;
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+  uint16_t flags;
+} __attribute__((packed));
+
+
+/* Most chains fit in the element, longer chains move to a heap buffer which is kept
+ * for the next use of the element. Removing from the front only moves the start.
+ */
+#define VIRT_ELEMENT_INLINE_IOVECS  16
+
+class IovecArray {
+ public:
+  IovecArray() {}
+  IovecArray(const IovecArray& other) { *this = other; }
+  ~IovecArray() { free(heap_); }
+
+  IovecArray& operator=(const IovecArray& other) {
+    clear();
+    for (auto &iov : other) {
+      push_back(iov);
+    }
+    return *this;
+  }
+
+  inline iovec* begin() { return data() + start_; }
+  inline iovec* end() { return data() + end_; }
+  inline const iovec* begin() const { return data() + start_; }
+  inline const iovec* end() const { return data() + end_; }
+  inline size_t size() const { return end_ - start_; }
+  inline bool empty() const { return start_ == end_; }
+  inline iovec& operator[](size_t index) { return begin()[index]; }
+  inline iovec& front() { return begin()[0]; }
+  inline iovec& back() { return end()[-1]; }
+  inline void pop_front() { ++start_; }
+  inline void pop_back() { --end_; }
+
+  inline void clear() {
+    start_ = end_ = 0;
+    use_heap_ = false;
+  }
+
+  void push_back(const iovec& iov) {
+    if (end_ == capacity()) {
+      Grow();
+    }
+    data()[end_++] = iov;
+  }
+
+ private:
+  inline iovec* data() { return use_heap_ ? heap_ : inline_; }
+  inline const iovec* data() const { return use_heap_ ? heap_ : inline_; }
+  inline size_t capacity() const { return use_heap_ ? heap_capacity_ : VIRT_ELEMENT_INLINE_IOVECS; }
+
+  void Grow() {
+    size_t capacity = end_ * 2;
+    if (heap_capacity_ < capacity) {
+      iovec* heap = (iovec*)malloc(capacity * sizeof(iovec));
+      memcpy(heap, data(), end_ * sizeof(iovec));
+      free(heap_);
+      heap_ = heap;
+      heap_capacity_ = capacity;
+    } else {
+      memcpy(heap_, inline_, end_ * sizeof(iovec));
+    }
+    use_heap_ = true;
+  }
+
+  iovec     inline_[VIRT_ELEMENT_INLINE_IOVECS];
+  iovec*    heap_ = nullptr;
+  size_t    heap_capacity_ = 0;
+  size_t    start_ = 0;
+  size_t    end_ = 0;
+  bool      use_heap_ = false;
 };
 
 struct VirtElement {
   int                       id;
   uint32_t                  length;
-  std::deque<struct iovec>  vector;
+  IovecArray                vector;
   size_t                    size;
+  /* Ring position and number of ring descriptors of the chain */
+  uint16_t                  index;
+  uint16_t                  descriptor_count;
 
   void Initialize() {
     id = length = size = 0;
+    index = descriptor_count = 0;
     vector.clear();
   }
 
@@ -113,6 +201,46 @@ struct VirtElement {
   const VirtElement& operator=(const VirtElement&);
 };
 
+struct IoEvent;
+typedef std::function<void (void)> VoidCallback;
+struct VirtQueue {
+  bool              enabled = false;
+  int               msix_vector;
+  VoidCallback      notification_callback;
+  
+  int               index;
+  int               size;
+  VRingDescriptor*  descriptor_table;
+  VRingAvailable*   available_ring;
+  VRingUsed*        used_ring;
+  uint16_t          last_available_index;
+  /* The used index at the last interrupt, for EVENT_IDX */
+  uint16_t          signalled_used;
+  bool              signalled_used_valid;
+
+  /* Packed ring, the ring indexes wrap at the queue size */
+  bool                    packed;
+  VRingPackedDescriptor*  packed_ring;
+  VRingPackedEvent*       driver_event;
+  VRingPackedEvent*       device_event;
+  bool                    available_wrap_counter;
+  bool                    used_wrap_counter;
+  uint16_t                used_index;
+
+  /* The guest cannot make more chains available than the queue size, so elements are
+   * allocated once per queue and recycled by PushQueue
+   */
+  std::unique_ptr<VirtElement[]>  elements;
+  int                             elements_size = 0;
+  std::vector<VirtElement*>       free_elements;
+
+  /* Polled queues are popped by the poller thread and completed by any thread */
+  bool                            polling = false;
+  bool                            notification_disabled = false;
+  IoEvent*                        io_event = nullptr;
+  std::mutex                      mutex;
+};
+
 class VirtioPci : public PciDevice {
  public:
   VirtioPci();
@@ -122,6 +250,16 @@ class VirtioPci : public PciDevice {
  private:
   void ReadIndirectDescriptorTable(VirtElement& element, VRingDescriptor* table);
   void AddDescriptorToElement(VirtElement& element,  VRingDescriptor* descriptor);
+  void AddBufferToElement(VirtElement& element, uint64_t address, uint32_t length);
+  VirtElement* AllocateElement(VirtQueue& vq);
+  VirtElement* PopPackedQueue(VirtQueue& vq);
+  void PushPackedQueue(VirtQueue& vq, VirtElement* element);
+  void PushSplitQueue(VirtQueue& vq, VirtElement* element);
+  bool SetQueueNotification(VirtQueue& vq, bool enable);
+  std::unique_lock<std::mutex> LockQueue(VirtQueue& vq);
+  void StartPoller();
+  void StopPoller();
+  void PollQueues();
   void ReadCommonConfig(uint64_t offset, uint8_t* data, uint32_t size);
   void WriteCommonConfig(uint64_t offset, uint8_t* data, uint32_t size);
   void WriteNotification(uint64_t offset, uint8_t* data, uint32_t size);
@@ -135,8 +273,11 @@ class VirtioPci : public PciDevice {
   void PushQueue(VirtQueue& vq, VirtElement* element);
   void NotifyQueue(VirtQueue& vq);
   void AddQueue(uint16_t queue_size, VoidCallback callback);
+  void InitializePolling();
   virtual void ReadDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size);
   virtual void WriteDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size);
+  virtual void OnDriverOk() {}
+  inline bool HasFeature(int bit) { return driver_features_[bit / 32] & (1U << (bit % 32)); }
 
   virtio_pci_common_cfg       common_config_;
   uint64_t                    device_features_;
@@ -144,6 +285,18 @@ class VirtioPci : public PciDevice {
   std::array<VirtQueue, 64>   queues_;
   uint8_t                     isr_status_;
   bool                        use_ioevent_ = false;
+  /* Queues are processed out of process, e.g. by a vhost-user backend, which is
+   * kicked with the ioeventfds directly
+   */
+  bool                        external_queues_ = false;
+
+  /* Busy polling mode, disabled if poll_ns_ is zero */
+  uint64_t                    poll_ns_ = 0;
+  std::vector<int>            poll_cpus_;
+  std::thread                 poller_thread_;
+  std::atomic<bool>           poller_running_ = false;
+  /* Signaled to stop the poller, or to wake it up for a queue without ioeventfd */
+  int                         poller_wakeup_fd_ = -1;
 };
 
 #endif // _MVISOR_DEVICES_VIRTIO_PCI_H
@@ -0,0 +1,126 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MVISOR_DEVICES_VIRTIO_RING_H
+#define _MVISOR_DEVICES_VIRTIO_RING_H
+
+/* Event suppression of split and packed rings, which decides when the device
+ * interrupts the guest and when the guest kicks the device. These only touch the
+ * ring memory, so they are tested against simulated rings in tests/virtio.
+ */
+#include "virtio_pci.h"
+
+/* Whether the event index is within [old, new), the window of used entries since the
+ * last notification. Arithmetic is done in 16 bits to handle the wrap around.
+ */
+static inline bool vring_need_event(uint16_t event, uint16_t new_index, uint16_t old_index) {
+  return (uint16_t)(new_index - event - 1) < (uint16_t)(new_index - old_index);
+}
+
+/* A packed ring descriptor is available when its avail bit matches the driver wrap
+ * counter and its used bit does not
+ */
+static inline bool vring_is_available(VirtQueue& vq) {
+  if (vq.packed) {
+    uint16_t flags = vq.packed_ring[vq.last_available_index].flags;
+    return bool(flags & VRING_PACKED_DESC_F_AVAIL) == vq.available_wrap_counter &&
+      bool(flags & VRING_PACKED_DESC_F_USED) != vq.available_wrap_counter;
+  } else {
+    return vq.available_ring->index != vq.last_available_index;
+  }
+}
+
+/* With EVENT_IDX, the avail event is moved only after the ring is drained, so the
+ * guest does not kick for buffers added while the queue is being processed.
+ * Returns true if buffers were added before the guest could see the new event.
+ */
+static inline bool vring_arm_available_event(VirtQueue& vq, bool event_index) {
+  if (vq.notification_disabled || !event_index) {
+    return false;
+  }
+  if (vq.packed) {
+    uint16_t offset_wrap = vq.last_available_index |
+      (vq.available_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+    if (vq.device_event->flags == VRING_PACKED_EVENT_FLAG_DESC && vq.device_event->offset_wrap == offset_wrap) {
+      return false;
+    }
+    vq.device_event->offset_wrap = offset_wrap;
+    vq.device_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+  } else {
+    uint16_t* available_event = (uint16_t*)&vq.used_ring->items[vq.size];
+    if (*available_event == vq.last_available_index) {
+      return false;
+    }
+    *available_event = vq.last_available_index;
+  }
+  asm volatile ("mfence": : :"memory");
+  return vring_is_available(vq);
+}
+
+/* The guest publishes the used index it expects an interrupt for after the avail ring,
+ * signal if it is within the used entries added since the last interrupt
+ */
+static inline bool vring_split_needs_notify(VirtQueue& vq, bool event_index) {
+  if (!event_index) {
+    return !(vq.available_ring->flags & VRING_AVAIL_F_NO_INTERRUPT);
+  }
+
+  uint16_t old_used = vq.signalled_used;
+  uint16_t new_used = vq.used_ring->index;
+  bool valid = vq.signalled_used_valid;
+  vq.signalled_used = new_used;
+  vq.signalled_used_valid = true;
+
+  uint16_t used_event = vq.available_ring->items[vq.size];
+  return !valid || vring_need_event(used_event, new_used, old_used);
+}
+
+/* The driver area holds the event suppression of a packed ring, with EVENT_IDX the
+ * driver asks for an interrupt when the used index passes the descriptor offset.
+ * Indexes are compared in the current lap, an index of the previous lap is one
+ * queue size below, as in the DPDK vhost library.
+ */
+static inline bool vring_packed_needs_notify(VirtQueue& vq) {
+  uint16_t old_used = vq.signalled_used;
+  uint16_t new_used = vq.used_index;
+  bool valid = vq.signalled_used_valid;
+  vq.signalled_used = new_used;
+  vq.signalled_used_valid = true;
+
+  uint16_t flags = vq.driver_event->flags;
+  if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+    return false;
+  } else if (flags == VRING_PACKED_EVENT_FLAG_ENABLE || !valid) {
+    return true;
+  }
+
+  /* The used index has wrapped since the last interrupt, a full lap is also
+   * treated as wrapped, an extra interrupt is harmless but a lost one is not
+   */
+  if (new_used <= old_used) {
+    old_used -= vq.size;
+  }
+  uint16_t offset_wrap = vq.driver_event->offset_wrap;
+  uint16_t event = offset_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+  if (bool(offset_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq.used_wrap_counter) {
+    event -= vq.size;
+  }
+  return vring_need_event(event, new_used, old_used);
+}
+
+#endif // _MVISOR_DEVICES_VIRTIO_RING_H
@@ -0,0 +1,539 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <linux/virtio_config.h>
+#include <linux/virtio_snd.h>
+#include "audio_backend.h"
+#include "logger.h"
+#include "device_manager.h"
+#include "virtio_pci.h"
+
+#define VIRTIO_SOUND_QUEUE_SIZE     64
+#define VIRTIO_SOUND_PERIOD_MS      10
+#define VIRTIO_SOUND_PREFILL_PERIODS 2
+#define VIRTIO_SOUND_BUFFER_SIZE    8192
+
+/* Indexed by VIRTIO_SND_PCM_RATE_XXX */
+static const uint32_t kPcmRates[] = { 5512, 8000, 11025, 16000, 22050, 32000, 44100, 48000 };
+
+struct VirtioSoundStream {
+  uint32_t                  id;
+  uint8_t                   direction;
+  bool                      prepared;
+  bool                      running;
+  virtio_snd_pcm_set_params params;
+  AudioFormat               format;
+  size_t                    frame_size;
+  size_t                    bytes_per_second;
+  /* Pending IO messages and the bytes consumed from the front one */
+  std::deque<VirtElement*>  elements;
+  size_t                    offset;
+  AudioResampler            resampler;
+  std::vector<int16_t>      resample_buffer;
+  IoTimer*                  timer;
+  IoTimePoint               start_time;
+  size_t                    position;
+  uint8_t                   buffer[VIRTIO_SOUND_BUFFER_SIZE];
+};
+
+/* Copy between a buffer and the iovecs of an element, starting at offset */
+static void CopyElementData(VirtElement* element, size_t offset, void* buffer, size_t length, bool to_element) {
+  uint8_t* data = (uint8_t*)buffer;
+  for (auto &iov : element->vector) {
+    if (length == 0) {
+      break;
+    }
+    if (offset >= iov.iov_len) {
+      offset -= iov.iov_len;
+      continue;
+    }
+    size_t n = std::min(length, iov.iov_len - offset);
+    if (to_element) {
+      memcpy((uint8_t*)iov.iov_base + offset, data, n);
+    } else {
+      memcpy(data, (uint8_t*)iov.iov_base + offset, n);
+    }
+    data += n;
+    length -= n;
+    offset = 0;
+  }
+}
+
+/* The virtio sound device has one playback and one capture PCM stream, which
+ * feed the same audio backend as the HDA codec. A control request is a single
+ * queue message and PCM data moves in period sized messages, so a stream costs
+ * a few notifications per period instead of the CORB / RIRB round trips and
+ * position register reads of HDA.
+ * https://docs.oasis-open.org/virtio/virtio/v1.2/cs01/virtio-v1.2-cs01.html#x1-52900014
+ */
+class VirtioSound : public VirtioPci {
+ private:
+  std::mutex                      mutex_;
+  virtio_snd_config               sound_config_;
+  std::array<VirtioSoundStream, 2> streams_;
+  AudioBackend*                   backend_ = nullptr;
+  uint32_t                        period_ms_ = VIRTIO_SOUND_PERIOD_MS;
+
+ public:
+  VirtioSound() {
+    devfn_ = PCI_MAKE_DEVFN(10, 0);
+    pci_header_.class_code = 0x040100;
+    pci_header_.device_id = 0x1059;
+    pci_header_.subsys_id = 0x0019;
+
+    AddPciBar(1, 0x1000, kIoResourceTypeMmio);
+    AddMsiXCapability(1, 5, 0, 0x1000);
+
+    common_config_.num_queues = VIRTIO_SND_VQ_MAX;
+    bzero(&sound_config_, sizeof(sound_config_));
+    sound_config_.streams = streams_.size();
+
+    for (uint32_t i = 0; i < streams_.size(); i++) {
+      auto &stream = streams_[i];
+      stream.id = i;
+      stream.direction = i == 0 ? VIRTIO_SND_D_OUTPUT : VIRTIO_SND_D_INPUT;
+      stream.prepared = stream.running = false;
+      stream.timer = nullptr;
+      stream.offset = stream.position = 0;
+      stream.format = AudioFormat { .frequency = 0, .nchannels = 0 };
+    }
+  }
+
+  void Connect() {
+    VirtioPci::Connect();
+
+    if (has_key("period_ms")) {
+      period_ms_ = std::get<uint64_t>(key_values_["period_ms"]);
+      MV_ASSERT(period_ms_ > 0);
+    }
+    if (has_key("backend")) {
+      std::string backend = std::get<std::string>(key_values_["backend"]);
+      std::string path = has_key("path") ? std::get<std::string>(key_values_["path"]) : "";
+      AudioFormat format = { .frequency = 48000, .nchannels = 2 };
+      if (has_key("rate")) {
+        format.frequency = std::get<uint64_t>(key_values_["rate"]);
+      }
+      backend_ = AudioBackend::Create(this, backend, path, format, period_ms_);
+    }
+  }
+
+  void Disconnect() {
+    VirtioPci::Disconnect();
+    if (backend_) {
+      delete backend_;
+      backend_ = nullptr;
+    }
+  }
+
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &stream : streams_) {
+      SetStreamRunning(stream, false);
+      /* The elements return to the queue pools when the queues are added again */
+      stream.elements.clear();
+      stream.offset = 0;
+      stream.prepared = false;
+    }
+
+    VirtioPci::Reset();
+    AddQueue(VIRTIO_SOUND_QUEUE_SIZE, std::bind(&VirtioSound::OnControlQueue, this));
+    AddQueue(VIRTIO_SOUND_QUEUE_SIZE, std::bind(&VirtioSound::OnEventQueue, this));
+    AddQueue(VIRTIO_SOUND_QUEUE_SIZE, std::bind(&VirtioSound::OnTransmitQueue, this));
+    AddQueue(VIRTIO_SOUND_QUEUE_SIZE, std::bind(&VirtioSound::OnReceiveQueue, this));
+  }
+
+  void ReadDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size) {
+    MV_ASSERT(offset + size <= sizeof(sound_config_));
+    memcpy(data, (uint8_t*)&sound_config_ + offset, size);
+  }
+
+ private:
+  /* A control message is the request followed by the response header and optional
+   * payload written by the device.
+   */
+  void OnControlQueue() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &vq = queues_[VIRTIO_SND_VQ_CONTROL];
+    bool pushed = false;
+    while (auto element = PopQueue(vq)) {
+      HandleControl(element);
+      PushQueue(vq, element);
+      pushed = true;
+    }
+    if (pushed) {
+      NotifyQueue(vq);
+    }
+  }
+
+  void HandleControl(VirtElement* element) {
+    virtio_snd_hdr header;
+    MV_ASSERT(element->size >= sizeof(header) * 2);
+    CopyElementData(element, 0, &header, sizeof(header), false);
+
+    uint32_t status = VIRTIO_SND_S_OK;
+    size_t request_size = sizeof(header);
+    std::vector<uint8_t> payload;
+
+    switch (header.code)
+    {
+    case VIRTIO_SND_R_PCM_INFO: {
+      virtio_snd_query_info query;
+      request_size = sizeof(query);
+      CopyElementData(element, 0, &query, sizeof(query), false);
+      status = QueryPcmInfo(query, payload);
+      break;
+    }
+    case VIRTIO_SND_R_PCM_SET_PARAMS: {
+      virtio_snd_pcm_set_params params;
+      request_size = sizeof(params);
+      CopyElementData(element, 0, &params, sizeof(params), false);
+      status = SetParameters(params);
+      break;
+    }
+    case VIRTIO_SND_R_PCM_PREPARE:
+    case VIRTIO_SND_R_PCM_RELEASE:
+    case VIRTIO_SND_R_PCM_START:
+    case VIRTIO_SND_R_PCM_STOP: {
+      virtio_snd_pcm_hdr request;
+      request_size = sizeof(request);
+      CopyElementData(element, 0, &request, sizeof(request), false);
+      status = ControlStream(header.code, request.stream_id);
+      break;
+    }
+    case VIRTIO_SND_R_JACK_INFO:
+    case VIRTIO_SND_R_CHMAP_INFO:
+      request_size = sizeof(virtio_snd_query_info);
+      status = VIRTIO_SND_S_NOT_SUPP;
+      break;
+    default:
+      if (debug_) {
+        MV_LOG("unsupported control code 0x%x", header.code);
+      }
+      status = VIRTIO_SND_S_NOT_SUPP;
+      break;
+    }
+
+    MV_ASSERT(element->size >= request_size + sizeof(header) + payload.size());
+    header.code = status;
+    CopyElementData(element, request_size, &header, sizeof(header), true);
+    if (!payload.empty()) {
+      CopyElementData(element, request_size + sizeof(header), payload.data(), payload.size(), true);
+    }
+    element->length = sizeof(header) + payload.size();
+  }
+
+  uint32_t QueryPcmInfo(const virtio_snd_query_info& query, std::vector<uint8_t>& payload) {
+    if (query.start_id + query.count > streams_.size() || query.size < sizeof(virtio_snd_pcm_info)) {
+      return VIRTIO_SND_S_BAD_MSG;
+    }
+    payload.resize(query.count * query.size, 0);
+    for (uint32_t i = 0; i < query.count; i++) {
+      auto &stream = streams_[query.start_id + i];
+      auto info = (virtio_snd_pcm_info*)&payload[i * query.size];
+      info->features = 0;
+      info->formats = 1ULL << VIRTIO_SND_PCM_FMT_S16;
+      /* Any rate is converted to the sink rate */
+      info->rates = (1ULL << VIRTIO_SND_PCM_RATE_8000) | (1ULL << VIRTIO_SND_PCM_RATE_11025) |
+        (1ULL << VIRTIO_SND_PCM_RATE_16000) | (1ULL << VIRTIO_SND_PCM_RATE_22050) |
+        (1ULL << VIRTIO_SND_PCM_RATE_32000) | (1ULL << VIRTIO_SND_PCM_RATE_44100) |
+        (1ULL << VIRTIO_SND_PCM_RATE_48000);
+      info->direction = stream.direction;
+      info->channels_min = 1;
+      info->channels_max = 2;
+    }
+    return VIRTIO_SND_S_OK;
+  }
+
+  uint32_t SetParameters(const virtio_snd_pcm_set_params& params) {
+    if (params.hdr.stream_id >= streams_.size()) {
+      return VIRTIO_SND_S_BAD_MSG;
+    }
+    auto &stream = streams_[params.hdr.stream_id];
+    if (stream.running) {
+      return VIRTIO_SND_S_BAD_MSG;
+    }
+    if (params.format != VIRTIO_SND_PCM_FMT_S16 || params.channels < 1 || params.channels > 2 ||
+        params.rate >= sizeof(kPcmRates) / sizeof(kPcmRates[0]) || params.rate == VIRTIO_SND_PCM_RATE_5512 ||
+        params.features) {
+      return VIRTIO_SND_S_NOT_SUPP;
+    }
+
+    stream.params = params;
+    stream.format.frequency = kPcmRates[params.rate];
+    stream.format.nchannels = params.channels;
+    stream.frame_size = params.channels * sizeof(int16_t);
+    stream.bytes_per_second = stream.frame_size * stream.format.frequency;
+    stream.prepared = false;
+    if (debug_) {
+      MV_LOG("stream[%u] rate=%u channels=%u buffer=%u period=%u", stream.id, stream.format.frequency,
+        stream.format.nchannels, params.buffer_bytes, params.period_bytes);
+    }
+    return VIRTIO_SND_S_OK;
+  }
+
+  uint32_t ControlStream(uint32_t code, uint32_t stream_id) {
+    if (stream_id >= streams_.size()) {
+      return VIRTIO_SND_S_BAD_MSG;
+    }
+    auto &stream = streams_[stream_id];
+    switch (code)
+    {
+    case VIRTIO_SND_R_PCM_PREPARE:
+      if (stream.running || stream.format.nchannels == 0) {
+        return VIRTIO_SND_S_BAD_MSG;
+      }
+      stream.prepared = true;
+      break;
+    case VIRTIO_SND_R_PCM_RELEASE:
+      if (stream.running) {
+        return VIRTIO_SND_S_BAD_MSG;
+      }
+      /* All pending messages must be completed before release */
+      CompleteAllElements(stream);
+      stream.prepared = false;
+      break;
+    case VIRTIO_SND_R_PCM_START:
+      if (!stream.prepared || stream.running) {
+        return VIRTIO_SND_S_BAD_MSG;
+      }
+      SetStreamRunning(stream, true);
+      break;
+    case VIRTIO_SND_R_PCM_STOP:
+      if (!stream.running) {
+        return VIRTIO_SND_S_BAD_MSG;
+      }
+      SetStreamRunning(stream, false);
+      break;
+    }
+    return VIRTIO_SND_S_OK;
+  }
+
+  void SetStreamRunning(VirtioSoundStream& stream, bool running) {
+    if (stream.running == running) {
+      return;
+    }
+    stream.running = running;
+
+    if (running) {
+      stream.position = 0;
+      stream.start_time = std::chrono::steady_clock::now();
+      size_t stream_frames = VIRTIO_SOUND_BUFFER_SIZE / stream.frame_size;
+      if (stream.direction == VIRTIO_SND_D_OUTPUT && backend_) {
+        stream.resampler.Initialize(stream.format, backend_->format());
+        size_t max_frames = stream.resampler.MaxOutputFrames(stream_frames);
+        stream.resample_buffer.resize(max_frames * backend_->format().nchannels);
+        backend_->StartPlayback([this, &stream]() {
+          std::lock_guard<std::mutex> lock(mutex_);
+          OnPlaybackPeriod(stream);
+        });
+      } else {
+        if (stream.direction == VIRTIO_SND_D_INPUT && backend_ && backend_->capture_supported()) {
+          stream.resampler.Initialize(backend_->format(), stream.format);
+          size_t max_frames = stream_frames * backend_->format().frequency / stream.format.frequency + 1;
+          stream.resample_buffer.resize(max_frames * backend_->format().nchannels);
+          backend_->StartCapture();
+        }
+        MV_ASSERT(stream.timer == nullptr);
+        stream.timer = manager_->io()->AddTimer(period_ms_, true, [this, &stream]() {
+          std::lock_guard<std::mutex> lock(mutex_);
+          OnStreamTimer(stream);
+        });
+      }
+    } else {
+      if (stream.timer) {
+        manager_->io()->RemoveTimer(stream.timer);
+        stream.timer = nullptr;
+      }
+      if (backend_) {
+        if (stream.direction == VIRTIO_SND_D_OUTPUT) {
+          backend_->StopPlayback();
+        } else {
+          backend_->StopCapture();
+        }
+      }
+    }
+  }
+
+  /* An IO message is the xfer header, PCM data and the status written by device */
+  size_t GetPayloadSize(VirtElement* element) {
+    return element->size - sizeof(virtio_snd_pcm_xfer) - sizeof(virtio_snd_pcm_status);
+  }
+
+  VirtQueue& GetStreamQueue(VirtioSoundStream& stream) {
+    return queues_[stream.direction == VIRTIO_SND_D_OUTPUT ? VIRTIO_SND_VQ_TX : VIRTIO_SND_VQ_RX];
+  }
+
+  void CompleteElement(VirtioSoundStream& stream, VirtElement* element, uint32_t written) {
+    virtio_snd_pcm_status status = {
+      .status = VIRTIO_SND_S_OK,
+      .latency_bytes = 0
+    };
+    if (stream.direction == VIRTIO_SND_D_OUTPUT && backend_) {
+      status.latency_bytes = backend_->ring().readable() * stream.format.frequency /
+        backend_->format().frequency * stream.frame_size;
+    }
+    CopyElementData(element, element->size - sizeof(status), &status, sizeof(status), true);
+    element->length = written + sizeof(status);
+    PushQueue(GetStreamQueue(stream), element);
+  }
+
+  void CompleteAllElements(VirtioSoundStream& stream) {
+    if (stream.elements.empty()) {
+      return;
+    }
+    while (!stream.elements.empty()) {
+      auto element = stream.elements.front();
+      stream.elements.pop_front();
+      CompleteElement(stream, element, 0);
+    }
+    stream.offset = 0;
+    NotifyQueue(GetStreamQueue(stream));
+  }
+
+  /* Queue PCM messages until the stream consumes them */
+  void PopStreamElements(uint32_t queue_index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &vq = queues_[queue_index];
+    bool rejected = false;
+    while (auto element = PopQueue(vq)) {
+      virtio_snd_pcm_xfer xfer;
+      if (element->size < sizeof(xfer) + sizeof(virtio_snd_pcm_status)) {
+        MV_ERROR("invalid PCM message size %lu", element->size);
+        PushQueue(vq, element);
+        rejected = true;
+        continue;
+      }
+      CopyElementData(element, 0, &xfer, sizeof(xfer), false);
+      if (xfer.stream_id >= streams_.size()) {
+        MV_ERROR("invalid PCM stream id %u", xfer.stream_id);
+        PushQueue(vq, element);
+        rejected = true;
+        continue;
+      }
+      streams_[xfer.stream_id].elements.push_back(element);
+    }
+    if (rejected) {
+      NotifyQueue(vq);
+    }
+  }
+
+  void OnTransmitQueue() {
+    PopStreamElements(VIRTIO_SND_VQ_TX);
+  }
+
+  void OnReceiveQueue() {
+    PopStreamElements(VIRTIO_SND_VQ_RX);
+  }
+
+  /* No jack or PCM events are reported */
+  void OnEventQueue() {
+  }
+
+  /* Called by the sink clock after each period, keep a few periods queued in the
+   * ring and complete the messages once their data is consumed.
+   */
+  void OnPlaybackPeriod(VirtioSoundStream& stream) {
+    if (!stream.running) {
+      return;
+    }
+
+    auto &ring = backend_->ring();
+    size_t target_frames = backend_->period_frames() * VIRTIO_SOUND_PREFILL_PERIODS;
+    bool completed = false;
+
+    while (ring.readable() < target_frames && !stream.elements.empty()) {
+      auto element = stream.elements.front();
+      size_t payload = GetPayloadSize(element) / stream.frame_size * stream.frame_size;
+      size_t chunk = std::min(payload - stream.offset, sizeof(stream.buffer) / stream.frame_size * stream.frame_size);
+      if (chunk > 0) {
+        size_t frames = chunk / stream.frame_size;
+        if (ring.writable() < stream.resampler.MaxOutputFrames(frames)) {
+          break;
+        }
+        CopyElementData(element, sizeof(virtio_snd_pcm_xfer) + stream.offset, stream.buffer, chunk, false);
+        frames = stream.resampler.Process((int16_t*)stream.buffer, frames, stream.resample_buffer.data());
+        ring.Write(stream.resample_buffer.data(), frames);
+        stream.offset += chunk;
+      }
+      if (stream.offset >= payload) {
+        stream.elements.pop_front();
+        stream.offset = 0;
+        CompleteElement(stream, element, 0);
+        completed = true;
+      }
+    }
+    if (completed) {
+      NotifyQueue(GetStreamQueue(stream));
+    }
+  }
+
+  /* Fill a capture message from the backend, padded with silence on underrun */
+  void FillCaptureElement(VirtioSoundStream& stream, VirtElement* element, size_t payload) {
+    bool capture = backend_ && backend_->capture_supported();
+    size_t offset = 0;
+    while (offset < payload) {
+      size_t chunk = std::min(payload - offset, sizeof(stream.buffer));
+      size_t filled = 0;
+      size_t out_frames = chunk / stream.frame_size;
+      if (capture && out_frames > 2) {
+        size_t input_frames = (out_frames - 2) * backend_->format().frequency / stream.format.frequency;
+        input_frames = std::min(input_frames, stream.resample_buffer.size() / backend_->format().nchannels);
+        input_frames = backend_->capture_ring().Read(stream.resample_buffer.data(), input_frames);
+        filled = stream.resampler.Process(stream.resample_buffer.data(), input_frames,
+          (int16_t*)stream.buffer) * stream.frame_size;
+      }
+      bzero(stream.buffer + filled, chunk - filled);
+      CopyElementData(element, sizeof(virtio_snd_pcm_xfer) + offset, stream.buffer, chunk, true);
+      offset += chunk;
+    }
+  }
+
+  /* Capture and playback without a sink are paced by a period timer, and catch up
+   * with the time elapsed since the stream started.
+   */
+  void OnStreamTimer(VirtioSoundStream& stream) {
+    auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - stream.start_time).count() + period_ms_ * 1000;
+    size_t expected = elapsed_us * stream.bytes_per_second / 1000000;
+    bool completed = false;
+
+    while (stream.position < expected && !stream.elements.empty()) {
+      auto element = stream.elements.front();
+      stream.elements.pop_front();
+      size_t payload = GetPayloadSize(element);
+      if (stream.direction == VIRTIO_SND_D_INPUT) {
+        FillCaptureElement(stream, element, payload);
+        CompleteElement(stream, element, payload);
+      } else {
+        CompleteElement(stream, element, 0);
+      }
+      stream.position += payload;
+      completed = true;
+    }
+    if (completed) {
+      NotifyQueue(GetStreamQueue(stream));
+    }
+  }
+};
+
+DECLARE_DEVICE(VirtioSound);
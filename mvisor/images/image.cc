@@ -90,11 +90,22 @@ void DiskImage::WorkerProcess() {
   }
 }
 
+/* Completions run on the IO thread, or on the worker if the device handles them on
+ * any thread
+ */
+void DiskImage::Complete(const IoCallback& callback, ssize_t ret) {
+  if (direct_completion_) {
+    callback(ret);
+  } else {
+    io_->Schedule([=]() { callback(ret); });
+  }
+}
+
 void DiskImage::ReadAsync(void *buffer, off_t position, size_t length, IoCallback callback) {
   worker_mutex_.lock();
   worker_queue_.push_back([this, buffer, position, length, callback]() {
     auto ret = Read(buffer, position, length);
-    io_->Schedule([=]() { callback(ret); });
+    Complete(callback, ret);
   });
   worker_mutex_.unlock();
   worker_cv_.notify_all();
@@ -108,7 +119,7 @@ void DiskImage::WriteAsync(void *buffer, off_t position, size_t length, IoCallba
   worker_mutex_.lock();
   worker_queue_.push_back([this, buffer, position, length, callback]() {
     auto ret = Write(buffer, position, length);
-    io_->Schedule([=]() { callback(ret); });
+    Complete(callback, ret);
   });
   worker_mutex_.unlock();
   worker_cv_.notify_all();
@@ -122,7 +133,7 @@ void DiskImage::DiscardAsync(off_t position, size_t length, IoCallback callback)
   worker_mutex_.lock();
   worker_queue_.push_back([this, position, length, callback]() {
     auto ret = Discard(position, length);
-    io_->Schedule([=]() { callback(ret); });
+    Complete(callback, ret);
   });
   worker_mutex_.unlock();
   worker_cv_.notify_all();
@@ -132,9 +143,7 @@ void DiskImage::FlushAsync(IoCallback callback) {
   worker_mutex_.lock();
   worker_queue_.push_back([this, callback]() {
     auto ret = Flush();
-    io_->Schedule([=]() {
-      callback(ret);
-    });
+    Complete(callback, ret);
   });
   worker_mutex_.unlock();
   worker_cv_.notify_all();
@@ -0,0 +1,143 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MVISOR_AUDIO_BACKEND_H
+#define _MVISOR_AUDIO_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+#include "utilities.h"
+#include "object.h"
+#include "io_thread.h"
+
+#define AUDIO_MAX_CHANNELS 16
+
+/* All samples are interleaved signed 16-bit little endian */
+struct AudioFormat {
+  uint32_t frequency;
+  uint32_t nchannels;
+};
+
+/* Single producer single consumer ring of audio frames. The producer is the device
+ * on the IO thread and the consumer is the sink thread, indexes are published with
+ * acquire / release ordering so no lock is needed.
+ */
+class AudioRingBuffer {
+ public:
+  void Initialize(size_t frames, uint32_t nchannels);
+  void Clear();
+  size_t Write(const int16_t* frames, size_t count);
+  size_t Read(int16_t* frames, size_t count);
+
+  size_t readable() {
+    return write_index_.load(std::memory_order_acquire) - read_index_.load(std::memory_order_acquire);
+  }
+  size_t writable() { return capacity_ - readable(); }
+  size_t capacity() { return capacity_; }
+
+ private:
+  std::vector<int16_t>  samples_;
+  size_t                capacity_ = 0;
+  uint32_t              nchannels_ = 0;
+  std::atomic<size_t>   write_index_ = 0;
+  std::atomic<size_t>   read_index_ = 0;
+};
+
+/* Converts between guest and sink formats with linear interpolation. The fraction
+ * and the last input frame are kept, so a stream can be processed in pieces.
+ */
+class AudioResampler {
+ public:
+  void Initialize(const AudioFormat& input, const AudioFormat& output);
+  size_t MaxOutputFrames(size_t input_frames);
+  size_t Process(const int16_t* input, size_t input_frames, int16_t* output);
+
+ private:
+  AudioFormat input_;
+  AudioFormat output_;
+  uint64_t    step_;      /* input frames per output frame, 32.32 fixed point */
+  uint64_t    position_;  /* 0 is last_frame_, 1 is the first input frame */
+  int16_t     last_frame_[AUDIO_MAX_CHANNELS];
+  uint32_t    channel_map_[AUDIO_MAX_CHANNELS];
+};
+
+typedef std::function<void()> AudioPeriodCallback;
+
+class Device;
+class AudioBackend : public Object {
+ public:
+  /* Always use this static method to create an AudioBackend */
+  static AudioBackend* Create(Device* device, const std::string& class_name, const std::string& path,
+    const AudioFormat& format, uint32_t period_ms);
+
+  AudioBackend();
+  virtual ~AudioBackend();
+
+  /* The sink clock consumes one period from the ring each time, and the callback
+   * is scheduled on the IO thread to let the device refill the ring.
+   */
+  void StartPlayback(AudioPeriodCallback callback);
+  void StopPlayback();
+  /* Captured periods are queued to the capture ring by the same clock */
+  void StartCapture();
+  void StopCapture();
+  virtual bool capture_supported() { return false; }
+
+  const AudioFormat& format() { return format_; }
+  size_t period_frames() { return period_frames_; }
+  AudioRingBuffer& ring() { return ring_; }
+  AudioRingBuffer& capture_ring() { return capture_ring_; }
+
+ protected:
+  Device*       device_ = nullptr;
+  IoThread*     io_ = nullptr;
+  AudioFormat   format_;
+  uint32_t      period_ms_ = 10;
+  size_t        period_frames_ = 0;
+
+  /* Interface for a sink to implement */
+  virtual void Initialize(const std::string& path) = 0;
+  virtual void WritePeriod(const int16_t* frames, size_t count) = 0;
+  /* Optional, returns the captured frames */
+  virtual size_t ReadPeriod(int16_t* frames, size_t count);
+  /* Optional, called after the clock stops */
+  virtual void Flush() {}
+
+  void StopClock();
+
+ private:
+  AudioRingBuffer         ring_;
+  AudioRingBuffer         capture_ring_;
+  AudioPeriodCallback     callback_;
+  std::thread             clock_thread_;
+  std::mutex              clock_mutex_;
+  std::condition_variable clock_cv_;
+  bool                    playback_ = false;
+  bool                    capture_ = false;
+
+  void UpdateClock(std::unique_lock<std::mutex>& lock);
+  void ClockProcess();
+};
+
+#endif // _MVISOR_AUDIO_BACKEND_H
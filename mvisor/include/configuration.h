@@ -38,6 +38,10 @@ class Configuration {
   void InitializePaths();
   bool LoadFile(std::string path);
   void LoadMachine(YAML::Node node);
+  void LoadParavirtFeatures(YAML::Node node);
+  void LoadNumaNodes(YAML::Node node);
+  void LoadAffinity(YAML::Node node);
+  void LoadKernelBoot(YAML::Node node);
   void LoadObjects(YAML::Node node);
 
   Machine*    machine_;
@@ -23,6 +23,7 @@
 #include <vector>
 #include <cstring>
 #include <deque>
+#include <string>
 #include <sys/uio.h>
 
 class KeyboardInputInterface {
@@ -46,9 +47,50 @@ class PointerInputInterface {
   virtual bool InputAcceptable() = 0;
 };
 
+/* Interrupt controllers emulated in userspace with split irqchip */
+class InterruptControllerInterface {
+ public:
+  virtual void SetIrqLevel(uint irq, uint level) = 0;
+  virtual void EndOfInterrupt(uint vector) = 0;
+};
+
+/* The 8259 PIC delivers ExtINT to the BSP, the vector is fetched by INTA */
+class ExternalInterruptInterface {
+ public:
+  virtual bool HasExternalInterrupt() = 0;
+  virtual int AcknowledgeExternalInterrupt() = 0;
+};
+
+/* Clipboard types are VD_AGENT_CLIPBOARD_xxx */
+enum ClipboardEventType {
+  kClipboardGrab,       /* The guest owns the clipboard, types are listed */
+  kClipboardRelease,
+  kClipboardRequest,    /* The guest asks for the host clipboard of type */
+  kClipboardData        /* A piece of the guest clipboard, last is set at the end */
+};
+struct ClipboardEvent {
+  ClipboardEventType  event;
+  uint32_t            type;
+  const uint32_t*     types;
+  size_t              ntypes;
+  const uint8_t*      data;
+  size_t              size;
+  bool                last;
+};
+typedef std::function <void(const ClipboardEvent& event)> ClipboardListener;
+/* Reads the next piece of a transfer, returns the bytes read */
+typedef std::function <size_t(uint8_t* buffer, size_t size)> AgentDataReader;
+
 class SpiceAgentInterface {
  public:
   virtual void Resize(uint32_t width, uint32_t height) = 0;
+  virtual void RegisterClipboardListener(ClipboardListener listener) = 0;
+  virtual void GrabClipboard(const std::vector<uint32_t>& types) = 0;
+  virtual void ReleaseClipboard() = 0;
+  virtual void RequestClipboard(uint32_t type) = 0;
+  /* Answers kClipboardRequest, the reader is called as the guest takes the data */
+  virtual void SendClipboard(uint32_t type, size_t size, AgentDataReader reader) = 0;
+  virtual bool SendFile(const std::string& path) = 0;
 };
 
 
@@ -110,9 +152,16 @@ class DisplayInterface {
 
 
 class SerialPortInterface;
+/* Fills the guest buffers and returns the bytes filled, 0 or negative to stop */
+typedef std::function <ssize_t(const iovec* iov, int iovcnt)> SerialFillCallback;
 class SerialDeviceInterface {
  public:
   virtual void SendMessage(SerialPortInterface* port, uint8_t* data, size_t size) = 0;
+  virtual void SendMessage(SerialPortInterface* port, const iovec* iov, int iovcnt) = 0;
+  /* Zero copy receive, the port reads into the guest buffers directly */
+  virtual size_t FillGuestBuffers(SerialPortInterface* port, SerialFillCallback callback) = 0;
+  /* Called by the port when it can take the output refused before */
+  virtual void ResumeGuestOutput(SerialPortInterface* port) = 0;
 };
 
 class SerialPortInterface {
@@ -120,11 +169,21 @@ class SerialPortInterface {
   virtual void OnMessage(uint8_t* data, size_t size) = 0;
   virtual void OnWritable() = 0;
 
+  /* Returns the bytes taken, the rest is kept by the device until ResumeGuestOutput() */
+  virtual size_t OnMessageVector(const iovec* iov, int iovcnt) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      OnMessage((uint8_t*)iov[i].iov_base, iov[i].iov_len);
+      size += iov[i].iov_len;
+    }
+    return size;
+  }
+
   virtual void SetReady(bool ready) {
     ready_ = ready;
   }
 
-  void Initialize(SerialDeviceInterface* device, uint32_t id) {
+  virtual void Initialize(SerialDeviceInterface* device, uint32_t id) {
     device_ = device;
     port_id_ = id;
   }
@@ -158,7 +217,7 @@ class NetworkBackendInterface {
  public:
   virtual void Initialize(NetworkDeviceInterface* device, MacAddress& mac) = 0;
   virtual void Reset() = 0;
-  virtual void OnFrameFromGuest(std::deque<iovec>& vector) = 0;
+  virtual void OnFrameFromGuest(const iovec* iov, int iovcnt) = 0;
   virtual bool OnPacketFromHost(Ipv4Packet* packet) = 0;
   virtual Ipv4Packet* AllocatePacket(bool urgent) = 0;
   virtual void OnReceiveAvailable() = 0;
@@ -28,6 +28,8 @@
 #include "pci_device.h"
 #include "device.h"
 #include "io_thread.h"
+#include "device_interface.h"
+#include "gsi_routing_table.h"
 
 struct MemoryRegion;
 struct IoHandler {
@@ -52,6 +54,8 @@ struct IoEvent {
   uint64_t        datamatch;
   uint32_t        flags;
   int             fd;
+  /* The fd is read by the IO thread, otherwise by the caller */
+  bool            polled;
 };
 
 class Machine;
@@ -68,6 +72,7 @@ class DeviceManager {
   void UnregisterIoHandler(Device* device, const IoResource* resource);
   IoEvent* RegisterIoEvent(Device* device, IoResourceType type, uint64_t address);
   IoEvent* RegisterIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch);
+  IoEvent* RegisterIoEventFd(Device* device, IoResourceType type, uint64_t address);
   void UnregisterIoEvent(Device* device, IoResourceType type, uint64_t address);
   void UnregisterIoEvent(IoEvent* event);
 
@@ -86,14 +91,26 @@ class DeviceManager {
   void SignalMsi(uint64_t address, uint32_t data);
   int AddMsiRoute(uint64_t address, uint32_t data, int trigger_fd = -1);
   void UpdateMsiRoute(int gsi, uint64_t address, uint32_t data, int trigger_fd = -1);
+  void AssignIrqfd(int gsi, int trigger_fd, int resample_fd = -1);
+  void DeassignIrqfd(int gsi, int trigger_fd);
+  /* Route changes between begin and end are loaded to KVM once */
+  void BeginGsiRoutingUpdate();
+  void EndGsiRoutingUpdate();
+
+  /* Split irqchip, the IOAPIC, PIC and PIT are emulated in userspace */
+  void SetIoapicRoute(uint pin, uint64_t address, uint32_t data);
+  void EndOfInterrupt(uint vector);
+  void NotifyExternalInterrupt();
+  bool HasExternalInterrupt();
+  int AcknowledgeExternalInterrupt();
 
   inline Machine* machine() { return machine_; }
   inline Device* root() { return root_; }
   IoThread* io();
 
  private:
-  void SetupGsiRoutingTable();
-  void UpdateGsiRoutingTable();
+  void SetupInterruptControllers();
+  IoEvent* CreateIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch);
 
  private:
   Machine*                machine_;
@@ -103,8 +120,9 @@ class DeviceManager {
   std::deque<IoHandler*>  pio_handlers_;
   std::set<IoEvent*>      ioevents_;
   std::recursive_mutex    mutex_;
-  std::vector<kvm_irq_routing_entry>  gsi_routing_table_;
-  int                     next_gsi_ = 0;
+  GsiRoutingTable         gsi_routing_table_;
+  std::vector<InterruptControllerInterface*> interrupt_controllers_;
+  ExternalInterruptInterface* external_interrupt_ = nullptr;
 };
 
 #endif // _MVISOR_DEVICE_MANAGER_H
@@ -55,6 +55,7 @@ class DiskImage : public Object {
   virtual ~DiskImage();
   virtual void Connect();
   bool readonly() { return readonly_; }
+  void set_direct_completion(bool direct) { direct_completion_ = direct; }
 
   /* Always use this static method to create a DiskImage */
 
@@ -88,8 +89,10 @@ class DiskImage : public Object {
   std::condition_variable   worker_cv_;
   std::deque<VoidCallback>  worker_queue_;
   bool        finalized_ = false;
+  bool        direct_completion_ = false;
 
   void WorkerProcess();
+  void Complete(const IoCallback& callback, ssize_t ret);
 };
 
 
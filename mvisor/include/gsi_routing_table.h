@@ -0,0 +1,58 @@
+/* 
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef _MVISOR_GSI_ROUTING_TABLE_H
+#define _MVISOR_GSI_ROUTING_TABLE_H
+
+#include <mutex>
+#include <vector>
+#include <linux/kvm.h>
+
+#define IOAPIC_NUM_PINS 24
+
+/* A copy of the KVM GSI routing table of the VM. KVM_SET_GSI_ROUTING replaces the
+ * whole table, so routes are kept here and loaded after each change. GSIs below
+ * IOAPIC_NUM_PINS belong to the interrupt controllers, MSI routes are allocated
+ * above them and the GSIs of removed routes are reused.
+ */
+class GsiRoutingTable {
+ public:
+  GsiRoutingTable(int vm_fd);
+
+  void Setup(bool split_irqchip);
+  int AddMsiRoute(uint64_t address, uint32_t data, int trigger_fd = -1);
+  void UpdateMsiRoute(int gsi, uint64_t address, uint32_t data, int trigger_fd = -1);
+  void SetIoapicRoute(uint pin, uint64_t address, uint32_t data);
+  void AssignIrqfd(int gsi, int trigger_fd, int resample_fd = -1);
+  void DeassignIrqfd(int gsi, int trigger_fd);
+  /* Route changes between begin and end are loaded to KVM once */
+  void BeginUpdate();
+  void EndUpdate();
+
+ private:
+  void Update();
+
+  int                                 vm_fd_;
+  std::mutex                          mutex_;
+  std::vector<kvm_irq_routing_entry>  entries_;
+  int                                 next_gsi_ = 0;
+  std::vector<int>                    free_gsis_;
+  int                                 depth_ = 0;
+  bool                                dirty_ = false;
+};
+
+#endif // _MVISOR_GSI_ROUTING_TABLE_H
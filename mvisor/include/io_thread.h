@@ -67,6 +67,8 @@ class IoThread {
   void ModifyTimer(IoTimer* timer, int interval_ms);
   void Schedule(VoidCallback callback);
 
+  std::thread& thread() { return thread_; }
+
  private:
   void RunLoop();
   int  CheckTimers();
@@ -33,6 +33,42 @@
 #include "device_manager.h"
 #include "configuration.h"
 
+/* Guest CPU topology, vCPUs are numbered by sockets, then cores, then threads */
+struct CpuTopology {
+  int sockets;
+  int cores;
+  int threads;
+};
+
+/* Virtual NUMA node with its vCPUs and guest RAM bound to a host node */
+struct NumaNode {
+  uint64_t              memory;
+  std::vector<int>      vcpus;
+  int                   host_node;
+  std::vector<uint8_t>  distances;
+};
+
+/* Host CPUs and SCHED_FIFO priority (0 means SCHED_OTHER) of a vCPU or IO thread */
+struct ThreadPlacement {
+  std::vector<int>      cpus;
+  int                   priority;
+};
+
+/* Per-VM halt-polling ceiling, adjusted by observed wakeup latency if adaptive */
+struct HaltPollPolicy {
+  int64_t   max_ns;
+  bool      adaptive;
+  bool      disable_hlt_exits;
+};
+
+/* Linux kernel, initrd and command line loaded through fw_cfg, skipping the boot disk */
+struct KernelBoot {
+  std::string kernel;
+  std::string initrd;
+  std::string cmdline;
+  std::string option_rom;
+};
+
 class Machine {
  public:
   Machine(std::string config_path);
@@ -52,6 +88,18 @@ class Machine {
   inline int num_vcpus() { return num_vcpus_; }
   inline uint64_t ram_size() { return ram_size_; }
   inline bool debug() { return debug_; }
+  inline uint32_t paravirt_features() { return paravirt_features_; }
+  inline bool split_irqchip() { return split_irqchip_; }
+  inline bool shared_memory() { return shared_memory_; }
+  inline const CpuTopology& topology() { return topology_; }
+  inline const std::vector<NumaNode>& numa_nodes() { return numa_nodes_; }
+  inline const KernelBoot& kernel_boot() { return kernel_boot_; }
+  uint32_t GetApicId(int vcpu_id);
+  uint32_t GetApicIdLimit();
+  void GetApicIdShifts(int* core_shift, int* package_shift);
+  void PlaceThread(std::thread& thread, const ThreadPlacement& placement);
+  const ThreadPlacement& GetVcpuPlacement(int vcpu_id);
+  const ThreadPlacement& io_thread_placement() { return io_thread_placement_; }
 
  private:
   friend class Vcpu;
@@ -60,6 +108,12 @@ class Machine {
   friend class Configuration;
 
   void InitializeKvm();
+  void CheckParavirtFeatures();
+  void CheckTopology();
+  void PrintThreadPlacement();
+  void SetupHaltPolling();
+  void SetHaltPollNs(uint64_t ns);
+  void AdjustHaltPolling();
   void CreateArchRelated();
   void CreateVcpu();
   void LoadBiosFile();
@@ -70,7 +124,16 @@ class Machine {
   int vm_fd_ = -1;
   
   uint64_t ram_size_ = 0;
+  bool shared_memory_ = false;
   int num_vcpus_ = 0;
+  CpuTopology topology_ = { 0 };
+  std::vector<NumaNode> numa_nodes_;
+  std::vector<ThreadPlacement> vcpu_placements_;
+  ThreadPlacement io_thread_placement_ = { .priority = 0 };
+  HaltPollPolicy halt_poll_ = { .max_ns = -1, .adaptive = false, .disable_hlt_exits = false };
+  uint64_t halt_poll_ns_ = 0;
+  VcpuHaltStats last_halt_stats_ = { 0 };
+  IoTimer* halt_poll_timer_ = nullptr;
   std::vector<Vcpu*> vcpus_;
   MemoryManager* memory_manager_;
   DeviceManager* device_manager_;
@@ -78,12 +141,15 @@ class Machine {
   IoThread* io_thread_;
 
   std::string bios_path_;
+  KernelBoot kernel_boot_;
   size_t bios_size_;
   void* bios_data_ = nullptr;
   void* bios_backup_ = nullptr;
 
   uint32_t cpuid_version_ = 0;
   uint32_t cpuid_features_ = 0;
+  uint32_t paravirt_features_ = 0;
+  bool split_irqchip_ = false;
 
   std::map<std::string, Object*> objects_;
   bool debug_ = false;
@@ -25,6 +25,10 @@
 #include <functional>
 #include <mutex>
 
+/* Guest RAM above 2GB is mapped from 4GB, leaving a hole for MMIO */
+#define LOW_RAM_UPPER_BOUND   (2ULL << 30)
+#define HIGH_RAM_LOWER_BOUND  (1ULL << 32)
+
 enum MemoryType {
   kMemoryTypeReserved = 0,
   kMemoryTypeRam = 1,
@@ -55,6 +59,25 @@ struct MemoryListener {
   MemoryListenerCallback callback;
 };
 
+/* Guest RAM as a flat view, adjacent slots are merged if the host memory is also
+ * contiguous. Changes are published as the ranges unmapped and mapped, a removed
+ * range may be a part of an extent published before.
+ */
+struct MemoryExtent {
+  uint64_t      begin;
+  uint64_t      end;
+  uint64_t      hva;
+  bool operator == (const MemoryExtent& e) const {
+    return begin == e.begin && end == e.end && hva == e.hva;
+  }
+};
+
+typedef std::function<void (const std::vector<MemoryExtent>& removed,
+  const std::vector<MemoryExtent>& added)> RamViewListenerCallback;
+struct RamViewListener {
+  RamViewListenerCallback callback;
+};
+
 class Machine;
 class MemoryManager {
  public:
@@ -70,19 +93,33 @@ class MemoryManager {
   std::vector<const MemorySlot*> GetMemoryFlatView();
   const MemoryListener* RegisterMemoryListener(MemoryListenerCallback callback);
   void UnregisterMemoryListener(const MemoryListener** plistener);
+  bool GetRamFileOffset(uint64_t hva, uint64_t size, uint64_t* offset);
+  std::vector<MemoryExtent> GetRamFlatView();
+  const RamViewListener* RegisterRamViewListener(RamViewListenerCallback callback);
+  void UnregisterRamViewListener(const RamViewListener** plistener);
+  /* Changes between begin and end are published to RAM view listeners once */
+  void BeginUpdate();
+  void EndUpdate();
 
   const std::set<MemoryRegion*>& regions() const { return regions_; }
+  inline int ram_fd() const { return ram_fd_; }
 
  private:
   void InitializeSystemRam();
+  void BindNumaNodes();
   void AddMemoryRegion(MemoryRegion* region);
   void UpdateKvmSlot(MemorySlot* slot, bool remove);
+  void UpdateRamView();
 
   const Machine*                  machine_;
   void*                           ram_host_;
+  int                             ram_fd_ = -1;
   std::set<MemoryRegion*>         regions_;
   std::map<uint64_t, MemorySlot*> kvm_slots_;
   std::set<const MemoryListener*> listeners_;
+  std::map<uint64_t, MemoryExtent> ram_view_;
+  std::set<const RamViewListener*> ram_view_listeners_;
+  int                             update_depth_ = 0;
   std::mutex                      mutex_;
 };
 
@@ -20,6 +20,7 @@
 #define _MVISOR_PCI_DEVICE_H
 
 #include <linux/pci_regs.h>
+#include <mutex>
 #include "device.h"
 #include "logger.h"
 
@@ -102,6 +103,22 @@ struct PciMsiConfig {
   MsiXTableEntry msix_table[PCI_MAX_MSIX_ENTRIES];
 };
 
+/* Each MSI vector is injected by writing to an irqfd bound to its own GSI */
+struct MsiVectorRoute {
+  int       gsi;
+  int       trigger_fd;
+  uint64_t  address;
+  uint32_t  data;
+};
+
+/* INTx is a level-triggered irqfd, the resample fd is signaled after guest EOI */
+struct PciIntxRoute {
+  int       gsi;
+  int       trigger_fd;
+  int       resample_fd;
+  int       level;
+};
+
 struct PciCapabilityHeader {
   uint8_t type;
   uint8_t next;
@@ -229,6 +246,8 @@ class PciDevice : public Device {
   void AddMsiCapability();
   void AddMsiXCapability(uint8_t bar, uint16_t table_size, uint64_t space_offset, uint64_t space_size);
   void SignalMsi(int vector = 0);
+  void SetPciIrqLevel(int level);
+  void ReleaseIrqfds();
 
   uint8_t devfn_;
   uint8_t bus_;
@@ -236,6 +255,9 @@ class PciDevice : public Device {
   PciBarInfo pci_bars_[PCI_BAR_NUMS];
   PciRomBarInfo pci_rom_;
   PciMsiConfig msi_config_;
+  MsiVectorRoute msi_routes_[PCI_MAX_MSIX_ENTRIES];
+  PciIntxRoute intx_route_;
+  std::mutex irqfd_mutex_;
   uint16_t next_capability_offset_;
 };
 
@@ -20,6 +20,8 @@
 #define _MVISOR_UTILITY_H
 
 #include <unistd.h>
+#include <string>
+#include <vector>
 
 class Object;
 typedef Object* (*ClassCreator) (void);
@@ -51,6 +53,7 @@ static void __attribute__ ((constructor)) __init__##cb(void) \
 #define DECLARE_NETWORK(classname)      __register_class(classname, 3)
 #define DECLARE_DISK_IMAGE(classname)   __register_class(classname, 4)
 #define DECLARE_AGENT(classname)        __register_class(classname, 5)
+#define DECLARE_AUDIO_BACKEND(classname) __register_class(classname, 6)
 
 /* Close fd and set to -1 */
 static inline void safe_close(int *fd) {
@@ -60,4 +63,9 @@ static inline void safe_close(int *fd) {
   }
 }
 
+/* Parse host CPU list like "0-3,8,10-11" */
+std::vector<int> parse_cpu_list(const std::string& list);
+/* Format host CPU list to string like "0-3,8" */
+std::string format_cpu_list(const std::vector<int>& cpus);
+
 #endif // _MVISOR_UTILITY_H
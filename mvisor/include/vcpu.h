@@ -24,6 +24,8 @@
 #include <deque>
 #include <functional>
 #include <mutex>
+#include <vector>
+#include <sys/types.h>
 
 #define SIG_USER_INTERRUPT (SIGRTMIN + 0)
 
@@ -34,6 +36,30 @@ struct VcpuRegisters {
   struct kvm_sregs sregs;
 };
 
+/* Para-virtualization features published to guests, see "paravirt" in the machine config */
+enum ParavirtFeature {
+  kParavirtKvmClock     = (1 << 0),
+  kParavirtPvEoi        = (1 << 1),
+  kParavirtPvTlbFlush   = (1 << 2),
+  kParavirtPvSpinlock   = (1 << 3),
+  kParavirtHvRelaxed    = (1 << 8),
+  kParavirtHvVapic      = (1 << 9),
+  kParavirtHvTime       = (1 << 10),
+  kParavirtHvSynic      = (1 << 11),
+  kParavirtHvStimer     = (1 << 12)
+};
+#define PARAVIRT_KVM_MASK     0x00FF
+#define PARAVIRT_HYPERV_MASK  0xFF00
+
+/* Cumulative halt counters from the vCPU binary stats, time in nanoseconds */
+struct VcpuHaltStats {
+  uint64_t successful_poll;
+  uint64_t wakeup;
+  uint64_t poll_success_ns;
+  uint64_t poll_fail_ns;
+  uint64_t wait_ns;
+};
+
 typedef std::function<void(void)> VoidCallback;
 struct VcpuTask {
   VoidCallback   callback;
@@ -57,7 +83,11 @@ class Vcpu {
   void EnableSingleStep();
   void PrintRegisters();
 
+  /* Read halt-polling counters, returns false if KVM has no binary stats */
+  bool GetHaltStats(VcpuHaltStats* stats);
+
   int vcpu_id() { return vcpu_id_; }
+  uint32_t apic_id() { return apic_id_; }
   std::thread& thread() { return thread_; }
   static Vcpu* current_vcpu() { return current_vcpu_; }
   const char* name() { return name_; }
@@ -66,17 +96,25 @@ class Vcpu {
   static void SignalHandler(int signum);
   void SetupSingalHandler();
   void SetupCpuid();
+  void SetupHyperV(struct kvm_cpuid2* cpuid);
+  uint32_t GetSupportedHyperVFeaturesEdx();
+  void ResetParavirtMsrs();
+  void SetupHaltStats();
   void SaveDefaultRegisters();
   void Process();
   void ProcessIo();
   void ProcessMmio();
   void ExecuteTasks();
+  void InjectExternalInterrupt();
 
   static __thread Vcpu* current_vcpu_;
 
   Machine* machine_;
   int vcpu_id_ = -1;
+  uint32_t apic_id_ = 0;
   int fd_ = -1;
+  int stats_fd_ = -1;
+  std::vector<off_t> halt_stats_offsets_;
   char name_[16];
   struct kvm_run *kvm_run_;
   struct kvm_coalesced_mmio_ring *mmio_ring_;
@@ -25,6 +25,8 @@
 #include "device_interface.h"
 #include <mutex>
 #include <deque>
+#include <memory>
+#include <string>
 
 struct SimulateCursor {
   bool visible;
@@ -60,12 +62,15 @@ class Viewer {
   void RenderSurface(const DisplayPartialBitmap* partial);
   void RenderCursor(const DisplayCursorUpdate* cursor_update);
   void HandleEvent(const SDL_Event& event);
+  void HandleClipboardEvent(const ClipboardEvent& event);
+  void UpdateClipboard();
   PointerInputInterface* GetActivePointer();
+  KeyboardInputInterface* GetActiveKeyboard();
 
   Machine* machine_;
   DeviceManager* device_manager_;
   DisplayInterface* display_;
-  KeyboardInputInterface* keyboard_;
+  std::vector<KeyboardInputInterface*> keyboards_;
   SpiceAgentInterface* spice_agent_;
   std::vector<PointerInputInterface*> pointers_;
 
@@ -88,6 +93,12 @@ class Viewer {
   bool grab_input_ = false;
   PointerEvent pointer_state_ = { 0 };
   PendingResize pending_resize_;
+
+  /* SDL only handles text, the guest text is set when complete */
+  std::string guest_clipboard_;
+  bool guest_clipboard_ready_ = false;
+  bool ignore_clipboard_update_ = false;
+  std::shared_ptr<std::string> host_clipboard_;
 };
 
 #endif // _MVISOR_VIEWER_H
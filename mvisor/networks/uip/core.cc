@@ -141,15 +141,15 @@ class Uip : public Object, public NetworkBackendInterface {
     }
   }
 
-  virtual void OnFrameFromGuest(std::deque<iovec>& vector) {
+  virtual void OnFrameFromGuest(const iovec* iov, int iovcnt) {
     auto packet = new Ipv4Packet;
     packet->Release = [packet]() {
       delete packet;
     };
     size_t copied = 0;
-    for (auto &v : vector) {
-      memcpy(packet->buffer + copied, v.iov_base, v.iov_len);
-      copied += v.iov_len;
+    for (int i = 0; i < iovcnt; i++) {
+      memcpy(packet->buffer + copied, iov[i].iov_base, iov[i].iov_len);
+      copied += iov[i].iov_len;
     }
     packet->eth = (ethhdr*)packet->buffer;
     ParseEthPacket(packet);
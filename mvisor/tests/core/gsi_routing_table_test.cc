@@ -0,0 +1,185 @@
+/* 
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/* Drives GsiRoutingTable with the fake VM fd of fake_kvm.h, ioctl() is replaced
+ * in this program
+ */
+#include <cstdarg>
+#include <set>
+#include <sys/ioctl.h>
+#include "gsi_routing_table.h"
+#include "../fake_kvm.h"
+
+int ioctl(int fd, unsigned long request, ...) __THROW {
+  va_list args;
+  va_start(args, request);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+
+  int ret = FakeKvmIoctl(fd, request, arg);
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+static void TestSetup() {
+  ResetKvm();
+  GsiRoutingTable table(FAKE_VM_FD);
+  table.Setup(false);
+  CHECK(kvm.routing_loads == 1, "loads=%d", kvm.routing_loads);
+  /* GSI 2 is the PIC cascade, the timer is routed by GSI 0 */
+  CHECK(kvm.routes.size() == IOAPIC_NUM_PINS - 1, "routes=%lu", kvm.routes.size());
+  CHECK(CountMsiRoutes() == 0, "");
+
+  /* The first MSI route is above the irqchip pins */
+  CHECK(table.AddMsiRoute(MsiAddress(0), 0x30) == IOAPIC_NUM_PINS, "");
+
+  ResetKvm();
+  GsiRoutingTable split_table(FAKE_VM_FD);
+  split_table.Setup(true);
+  CHECK(kvm.routing_loads == 1, "");
+  CHECK(kvm.routes.empty(), "");
+  CHECK(split_table.AddMsiRoute(MsiAddress(0), 0x30) == IOAPIC_NUM_PINS, "");
+}
+
+/* GSIs of removed routes are reused before new ones are allocated */
+static void TestAllocate() {
+  ResetKvm();
+  GsiRoutingTable table(FAKE_VM_FD);
+  table.Setup(false);
+
+  int gsis[4];
+  for (int i = 0; i < 4; i++) {
+    gsis[i] = table.AddMsiRoute(MsiAddress(i), 0x40 + i);
+    CHECK(gsis[i] == IOAPIC_NUM_PINS + i, "gsi=%d", gsis[i]);
+    CHECK(HasMsiRoute(gsis[i], MsiAddress(i), 0x40 + i), "gsi=%d", gsis[i]);
+  }
+  CHECK(kvm.routing_loads == 5, "loads=%d", kvm.routing_loads);
+
+  table.UpdateMsiRoute(gsis[1], 0, 0);
+  table.UpdateMsiRoute(gsis[2], 0, 0);
+  CHECK(!kvm.routes.count(gsis[1]) && !kvm.routes.count(gsis[2]), "");
+  CHECK(CountMsiRoutes() == 2, "");
+
+  std::set<int> reused;
+  reused.insert(table.AddMsiRoute(MsiAddress(5), 0x50));
+  reused.insert(table.AddMsiRoute(MsiAddress(6), 0x51));
+  CHECK(reused == std::set<int>({ gsis[1], gsis[2] }), "");
+  CHECK(table.AddMsiRoute(MsiAddress(7), 0x52) == IOAPIC_NUM_PINS + 4, "");
+  CHECK(CountMsiRoutes() == 5, "");
+
+  /* Removing and adding many times does not leak GSIs */
+  for (int round = 0; round < 100; round++) {
+    table.UpdateMsiRoute(gsis[3], 0, 0);
+    gsis[3] = table.AddMsiRoute(MsiAddress(round % 8), 0x60);
+    CHECK(gsis[3] == IOAPIC_NUM_PINS + 3, "gsi=%d", gsis[3]);
+  }
+  CHECK(CountMsiRoutes() == 5, "");
+}
+
+static void TestBatch() {
+  ResetKvm();
+  GsiRoutingTable table(FAKE_VM_FD);
+  table.Setup(true);
+  int loads = kvm.routing_loads;
+
+  /* An empty batch loads nothing */
+  table.BeginUpdate();
+  table.EndUpdate();
+  CHECK(kvm.routing_loads == loads, "");
+
+  /* Nested batches load once at the outermost end */
+  int gsis[8];
+  table.BeginUpdate();
+  for (int i = 0; i < 4; i++) {
+    gsis[i] = table.AddMsiRoute(MsiAddress(i), 0x40 + i, 100 + i);
+  }
+  table.BeginUpdate();
+  for (int i = 4; i < 8; i++) {
+    gsis[i] = table.AddMsiRoute(MsiAddress(i), 0x40 + i, 100 + i);
+  }
+  table.EndUpdate();
+  CHECK(kvm.routing_loads == loads, "");
+  CHECK(CountMsiRoutes() == 0, "");
+  table.EndUpdate();
+  CHECK(kvm.routing_loads == loads + 1, "loads=%d", kvm.routing_loads);
+  for (int i = 0; i < 8; i++) {
+    CHECK(HasMsiRoute(gsis[i], MsiAddress(i), 0x40 + i), "vector=%d", i);
+    CHECK(kvm.irqfds[100 + i].gsi == (uint)gsis[i], "vector=%d", i);
+  }
+
+  /* Unchanged messages do not reload */
+  loads = kvm.routing_loads;
+  table.BeginUpdate();
+  for (int i = 0; i < 8; i++) {
+    table.UpdateMsiRoute(gsis[i], MsiAddress(i), 0x40 + i);
+  }
+  table.EndUpdate();
+  table.UpdateMsiRoute(gsis[0], MsiAddress(0), 0x40);
+  CHECK(kvm.routing_loads == loads, "");
+
+  /* Remove all in a batch, the irqfds go with the routes */
+  table.BeginUpdate();
+  for (int i = 0; i < 8; i++) {
+    table.UpdateMsiRoute(gsis[i], 0, 0, 100 + i);
+  }
+  table.EndUpdate();
+  CHECK(kvm.routing_loads == loads + 1, "");
+  CHECK(CountMsiRoutes() == 0, "");
+  CHECK(kvm.irqfds.empty(), "");
+}
+
+/* The IOAPIC pins of split irqchip never collide with MSI routes */
+static void TestIoapicRoutes() {
+  ResetKvm();
+  GsiRoutingTable table(FAKE_VM_FD);
+  table.Setup(true);
+
+  int gsi = table.AddMsiRoute(MsiAddress(1), 0x41);
+  table.SetIoapicRoute(5, MsiAddress(0), 0x35);
+  CHECK(HasMsiRoute(5, MsiAddress(0), 0x35), "");
+  int loads = kvm.routing_loads;
+  table.SetIoapicRoute(5, MsiAddress(0), 0x35);
+  CHECK(kvm.routing_loads == loads, "unchanged");
+  table.SetIoapicRoute(5, MsiAddress(1), 0x35);
+  CHECK(HasMsiRoute(5, MsiAddress(1), 0x35), "");
+  table.SetIoapicRoute(5, 0, 0);
+  CHECK(!kvm.routes.count(5), "");
+  loads = kvm.routing_loads;
+  table.SetIoapicRoute(5, 0, 0);
+  CHECK(kvm.routing_loads == loads, "removed already");
+
+  table.UpdateMsiRoute(gsi, 0, 0);
+  CHECK(table.AddMsiRoute(MsiAddress(2), 0x42) == gsi, "");
+  CHECK(table.AddMsiRoute(MsiAddress(2), 0x43) == gsi + 1, "");
+}
+
+int main() {
+  TestSetup();
+  TestAllocate();
+  TestBatch();
+  TestIoapicRoutes();
+
+  if (failures) {
+    fprintf(stderr, "gsi_routing_table_test: %d checks failed\n", failures);
+    return 1;
+  }
+  printf("gsi_routing_table_test: passed\n");
+  return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/* A model of the KVM interrupt routing of a VM, for tests which replace ioctl().
+ * KVM_SET_GSI_ROUTING and KVM_IRQFD on the fake VM fd are applied to it, and
+ * what KVM rejects is rejected, e.g. a GSI routed twice or an eventfd assigned
+ * twice.
+ */
+#ifndef _MVISOR_TESTS_FAKE_KVM_H
+#define _MVISOR_TESTS_FAKE_KVM_H
+
+#include <cstdio>
+#include <cerrno>
+#include <map>
+#include <linux/kvm.h>
+
+#define FAKE_VM_FD 1000
+
+static int failures = 0;
+
+#define CHECK(cond, fmt, ...) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: CHECK(%s) failed: " fmt "\n", __FILE__, __LINE__, #cond, ##__VA_ARGS__); \
+    ++failures; \
+  } \
+} while (0)
+
+struct FakeIrqfd {
+  uint gsi;
+  int  resample_fd;
+};
+
+/* What KVM knows about the VM */
+struct FakeKvm {
+  std::map<uint, kvm_irq_routing_entry> routes;
+  std::map<uint, FakeIrqfd> irqfds; /* by eventfd */
+  int routing_loads = 0;
+} kvm;
+
+static int FakeKvmSetGsiRouting(kvm_irq_routing* table) {
+  std::map<uint, kvm_irq_routing_entry> routes;
+  for (uint i = 0; i < table->nr; i++) {
+    auto &entry = table->entries[i];
+    /* Only irqchip routes may share a GSI */
+    auto it = routes.find(entry.gsi);
+    if (it != routes.end() && (entry.type != KVM_IRQ_ROUTING_IRQCHIP || it->second.type != KVM_IRQ_ROUTING_IRQCHIP)) {
+      return -EINVAL;
+    }
+    routes[entry.gsi] = entry;
+  }
+  kvm.routes = routes;
+  ++kvm.routing_loads;
+  return 0;
+}
+
+static int FakeKvmIrqfd(kvm_irqfd* irqfd) {
+  if (irqfd->flags & KVM_IRQFD_FLAG_DEASSIGN) {
+    auto it = kvm.irqfds.find(irqfd->fd);
+    if (it == kvm.irqfds.end() || it->second.gsi != irqfd->gsi) {
+      return -ENOENT;
+    }
+    kvm.irqfds.erase(it);
+  } else {
+    if (kvm.irqfds.count(irqfd->fd)) {
+      return -EBUSY;
+    }
+    int resample_fd = (irqfd->flags & KVM_IRQFD_FLAG_RESAMPLE) ? (int)irqfd->resamplefd : -1;
+    kvm.irqfds[irqfd->fd] = FakeIrqfd { .gsi = irqfd->gsi, .resample_fd = resample_fd };
+  }
+  return 0;
+}
+
+/* Returns -EBADF if the request is not for the VM */
+static int FakeKvmIoctl(int fd, unsigned long request, void* arg) {
+  if (fd == FAKE_VM_FD && request == KVM_SET_GSI_ROUTING) {
+    return FakeKvmSetGsiRouting((kvm_irq_routing*)arg);
+  } else if (fd == FAKE_VM_FD && request == KVM_IRQFD) {
+    return FakeKvmIrqfd((kvm_irqfd*)arg);
+  }
+  return -EBADF;
+}
+
+static void ResetKvm() {
+  kvm.routes.clear();
+  kvm.irqfds.clear();
+  kvm.routing_loads = 0;
+}
+
+static bool HasMsiRoute(uint gsi, uint64_t address, uint32_t data) {
+  auto it = kvm.routes.find(gsi);
+  return it != kvm.routes.end() && it->second.type == KVM_IRQ_ROUTING_MSI &&
+    it->second.u.msi.address_lo == (uint32_t)address &&
+    it->second.u.msi.address_hi == (uint32_t)(address >> 32) && it->second.u.msi.data == data;
+}
+
+static int CountMsiRoutes() {
+  int count = 0;
+  for (auto &item : kvm.routes) {
+    if (item.second.type == KVM_IRQ_ROUTING_MSI) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+static uint64_t MsiAddress(int cpu) {
+  return 0xFEE00000 | (cpu << 12);
+}
+
+#endif // _MVISOR_TESTS_FAKE_KVM_H
@@ -0,0 +1,627 @@
+/*
+ * MVisor VFIO for vGPU
+ * Copyright (C) 2022 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/* Drives a real VfioPci with a fake VFIO device and the fake VM fd of fake_kvm.h.
+ * open(), readlink() and ioctl() are replaced in this program. The VFIO group and
+ * container are plain numbers, the device fd is a memfd holding the config space
+ * and BAR0, so pread() and pwrite() of VfioPci reach it unchanged. The machine,
+ * the memory manager and the device manager are reduced to what VfioPci uses, the
+ * GSI routes go through the real GsiRoutingTable.
+ */
+#include <cstdarg>
+#include <cstring>
+#include <memory>
+#include <set>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "vfio_pci.h"
+#include "device_manager.h"
+#include "memory_manager.h"
+#include "machine.h"
+#include "../fake_kvm.h"
+
+#define FAKE_GROUP_ID         42
+#define FAKE_GROUP_FD         1001
+#define FAKE_CONTAINER_FD     1002
+#define FAKE_SYSFS_PATH       "/sys/bus/mdev/devices/fake-vgpu"
+
+#define BAR0_SIZE             0x4000
+#define BAR0_REGION_OFFSET    0x10000
+#define BAR0_ADDRESS          0xE0000000
+#define MSIX_CAP_OFFSET       0x40
+#define MSIX_TABLE_OFFSET     0x2000
+#define MSIX_VECTORS          4
+#define RAM_SIZE              0x80000000
+
+/* What VFIO knows about the device */
+struct FakeVfio {
+  int device_fd = -1;
+  std::map<uint, std::vector<int>> triggers; /* eventfds by IRQ index */
+  int unmask_fd = -1;
+  int resets = 0;
+  std::map<uint64_t, uint64_t> dma_maps; /* size by IOVA */
+} vfio;
+
+static int SetIrqs(vfio_irq_set* irq_set) {
+  uint index = irq_set->index;
+  auto fds = (int*)irq_set->data;
+  if (irq_set->flags & VFIO_IRQ_SET_ACTION_TRIGGER) {
+    if (irq_set->flags & VFIO_IRQ_SET_DATA_NONE) {
+      if (irq_set->count) {
+        return -EINVAL;
+      }
+      vfio.triggers.erase(index);
+      if (index == VFIO_PCI_INTX_IRQ_INDEX) {
+        vfio.unmask_fd = -1;
+      }
+      return 0;
+    }
+    /* One of INTx, MSI and MSI-X at a time */
+    for (auto &item : vfio.triggers) {
+      if (item.first != index) {
+        return -EINVAL;
+      }
+    }
+    auto &triggers = vfio.triggers[index];
+    triggers.resize(std::max<size_t>(triggers.size(), irq_set->start + irq_set->count), -1);
+    for (uint i = 0; i < irq_set->count; i++) {
+      triggers[irq_set->start + i] = fds[i];
+    }
+    return 0;
+  } else if (irq_set->flags & VFIO_IRQ_SET_ACTION_UNMASK) {
+    if (index != VFIO_PCI_INTX_IRQ_INDEX || !vfio.triggers.count(index) || irq_set->count != 1) {
+      return -EINVAL;
+    }
+    vfio.unmask_fd = fds[0];
+    return 0;
+  }
+  return -EINVAL;
+}
+
+static int GetRegionInfo(vfio_region_info* info) {
+  info->cap_offset = 0;
+  if (info->index == VFIO_PCI_BAR0_REGION_INDEX) {
+    info->flags = VFIO_REGION_INFO_FLAG_READ | VFIO_REGION_INFO_FLAG_WRITE;
+    info->offset = BAR0_REGION_OFFSET;
+    info->size = BAR0_SIZE;
+  } else if (info->index == VFIO_PCI_CONFIG_REGION_INDEX) {
+    info->flags = VFIO_REGION_INFO_FLAG_READ | VFIO_REGION_INFO_FLAG_WRITE;
+    info->offset = 0;
+    info->size = PCI_DEVICE_CONFIG_SIZE;
+  } else {
+    info->flags = 0;
+    info->offset = 0;
+    info->size = 0;
+  }
+  return 0;
+}
+
+static int GetIrqInfo(vfio_irq_info* info) {
+  info->flags = VFIO_IRQ_INFO_EVENTFD;
+  if (info->index == VFIO_PCI_INTX_IRQ_INDEX) {
+    info->flags |= VFIO_IRQ_INFO_MASKABLE | VFIO_IRQ_INFO_AUTOMASKED;
+    info->count = 1;
+  } else if (info->index == VFIO_PCI_MSIX_IRQ_INDEX) {
+    info->flags |= VFIO_IRQ_INFO_NORESIZE;
+    info->count = MSIX_VECTORS;
+  } else {
+    info->count = 0;
+  }
+  return 0;
+}
+
+static int FakeVfioIoctl(int fd, unsigned long request, void* arg) {
+  if (fd == FAKE_GROUP_FD) {
+    switch (request)
+    {
+    case VFIO_GROUP_GET_STATUS:
+      ((vfio_group_status*)arg)->flags = VFIO_GROUP_FLAGS_VIABLE;
+      return 0;
+    case VFIO_GROUP_SET_CONTAINER:
+      return *(int*)arg == FAKE_CONTAINER_FD ? 0 : -EINVAL;
+    case VFIO_GROUP_GET_DEVICE_FD:
+      return strcmp((const char*)arg, basename(FAKE_SYSFS_PATH)) == 0 ? vfio.device_fd : -ENODEV;
+    }
+  } else if (fd == FAKE_CONTAINER_FD) {
+    switch (request)
+    {
+    case VFIO_GET_API_VERSION:
+      return VFIO_API_VERSION;
+    case VFIO_CHECK_EXTENSION:
+      return (uint64_t)arg == VFIO_TYPE1v2_IOMMU;
+    case VFIO_SET_IOMMU:
+      return 0;
+    case VFIO_IOMMU_GET_INFO:
+      ((vfio_iommu_type1_info*)arg)->flags = 0;
+      return 0;
+    case VFIO_IOMMU_MAP_DMA: {
+      auto dma_map = (vfio_iommu_type1_dma_map*)arg;
+      vfio.dma_maps[dma_map->iova] = dma_map->size;
+      return 0;
+    }
+    case VFIO_IOMMU_UNMAP_DMA: {
+      auto dma_unmap = (vfio_iommu_type1_dma_unmap*)arg;
+      auto it = vfio.dma_maps.find(dma_unmap->iova);
+      if (it == vfio.dma_maps.end() || it->second != dma_unmap->size) {
+        return -EINVAL;
+      }
+      vfio.dma_maps.erase(it);
+      return 0;
+    }
+    }
+  } else if (fd == vfio.device_fd) {
+    switch (request)
+    {
+    case VFIO_DEVICE_GET_INFO: {
+      auto info = (vfio_device_info*)arg;
+      info->flags = VFIO_DEVICE_FLAGS_RESET | VFIO_DEVICE_FLAGS_PCI;
+      info->num_regions = VFIO_PCI_NUM_REGIONS;
+      info->num_irqs = VFIO_PCI_NUM_IRQS;
+      return 0;
+    }
+    case VFIO_DEVICE_GET_REGION_INFO:
+      return GetRegionInfo((vfio_region_info*)arg);
+    case VFIO_DEVICE_GET_IRQ_INFO:
+      return GetIrqInfo((vfio_irq_info*)arg);
+    case VFIO_DEVICE_SET_IRQS:
+      return SetIrqs((vfio_irq_set*)arg);
+    case VFIO_DEVICE_RESET:
+      ++vfio.resets;
+      vfio.triggers.clear();
+      vfio.unmask_fd = -1;
+      return 0;
+    case VFIO_DEVICE_QUERY_GFX_PLANE:
+      return -ENOTTY;
+    }
+  }
+  return FakeKvmIoctl(fd, request, arg);
+}
+
+int ioctl(int fd, unsigned long request, ...) __THROW {
+  va_list args;
+  va_start(args, request);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+
+  int ret = FakeVfioIoctl(fd, request, arg);
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+int open(const char* path, int flags, ...) {
+  char group_path[64];
+  sprintf(group_path, "/dev/vfio/%d", FAKE_GROUP_ID);
+  if (strcmp(path, group_path) == 0) {
+    return FAKE_GROUP_FD;
+  } else if (strcmp(path, "/dev/vfio/vfio") == 0) {
+    return FAKE_CONTAINER_FD;
+  }
+  va_list args;
+  va_start(args, flags);
+  mode_t mode = va_arg(args, mode_t);
+  va_end(args);
+  return syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+}
+
+ssize_t readlink(const char* path, char* buffer, size_t size) __THROW {
+  const char* group = "../../../kernel/iommu_groups/42";
+  if (strcmp(path, FAKE_SYSFS_PATH "/iommu_group") == 0 && size >= strlen(group)) {
+    memcpy(buffer, group, strlen(group));
+    return strlen(group);
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+/* A VGA device with a MSI-X capability of 4 vectors, the table is in BAR0 */
+static void CreateFakeDevice() {
+  vfio = FakeVfio();
+  vfio.device_fd = memfd_create("fake-vfio-device", MFD_CLOEXEC);
+  MV_ASSERT(vfio.device_fd > 0);
+  MV_ASSERT(ftruncate(vfio.device_fd, BAR0_REGION_OFFSET + BAR0_SIZE) == 0);
+
+  PciConfigHeader header;
+  bzero(&header, sizeof(header));
+  header.vendor_id = 0x10DE;
+  header.device_id = 0x1EB8;
+  header.class_code = 0x030000;
+  header.status = PCI_STATUS_CAP_LIST;
+  header.header_type = PCI_HEADER_TYPE_NORMAL;
+  header.capability = MSIX_CAP_OFFSET;
+  header.irq_pin = 1;
+  auto msix = (MsiXCapability*)(header.data + MSIX_CAP_OFFSET);
+  msix->capability = PCI_CAP_ID_MSIX;
+  msix->next = 0;
+  msix->control = MSIX_VECTORS - 1;
+  msix->table_offset = MSIX_TABLE_OFFSET;
+  msix->pba_offset = MSIX_TABLE_OFFSET + 0x1000;
+  MV_ASSERT(pwrite(vfio.device_fd, header.data, PCI_DEVICE_CONFIG_SIZE, 0) == PCI_DEVICE_CONFIG_SIZE);
+}
+
+/* The machine, the memory manager and the device manager as VfioPci sees them */
+static bool fake_split_irqchip = false;
+static const RamViewListener* ram_view_listener = nullptr;
+
+Machine::Machine(std::string config_path) {
+  vm_fd_ = FAKE_VM_FD;
+  split_irqchip_ = fake_split_irqchip;
+  io_thread_ = nullptr;
+  config_ = nullptr;
+  device_manager_ = nullptr;
+  memory_manager_ = new MemoryManager(this);
+}
+
+Machine::~Machine() {
+  delete memory_manager_;
+}
+
+MemoryManager::MemoryManager(const Machine* machine) : machine_(machine) {
+}
+
+MemoryManager::~MemoryManager() {
+}
+
+std::vector<MemoryExtent> MemoryManager::GetRamFlatView() {
+  return { MemoryExtent { .begin = 0, .end = RAM_SIZE, .hva = 0x7F0000000000 } };
+}
+
+const RamViewListener* MemoryManager::RegisterRamViewListener(RamViewListenerCallback callback) {
+  MV_ASSERT(!ram_view_listener);
+  ram_view_listener = new RamViewListener { .callback = callback };
+  return ram_view_listener;
+}
+
+void MemoryManager::UnregisterRamViewListener(const RamViewListener** plistener) {
+  MV_ASSERT(*plistener == ram_view_listener);
+  delete ram_view_listener;
+  ram_view_listener = *plistener = nullptr;
+}
+
+void MemoryManager::BeginUpdate() {
+}
+
+void MemoryManager::EndUpdate() {
+}
+
+const MemoryRegion* MemoryManager::Map(uint64_t gpa, uint64_t size, void* host, MemoryType type, const char* name) {
+  MV_PANIC("not expected");
+  return nullptr;
+}
+
+void MemoryManager::Unmap(const MemoryRegion** region) {
+  MV_PANIC("not expected");
+}
+
+std::string Configuration::FindPath(std::string path) const {
+  return path;
+}
+
+EpollEvent* IoThread::StartPolling(int fd, uint poll_mask, IoCallback callback) {
+  MV_PANIC("not expected");
+  return nullptr;
+}
+
+void IoThread::StopPolling(int fd) {
+  MV_PANIC("not expected");
+}
+
+DeviceManager::DeviceManager(Machine* machine, Device* root) :
+  machine_(machine), root_(root), gsi_routing_table_(machine->vm_fd_)
+{
+  root_->manager_ = this;
+  gsi_routing_table_.Setup(machine_->split_irqchip());
+  root_->Connect();
+}
+
+DeviceManager::~DeviceManager() {
+  root_->Disconnect();
+}
+
+IoThread* DeviceManager::io() {
+  return nullptr;
+}
+
+void DeviceManager::RegisterDevice(Device* device) {
+  registered_devices_.insert(device);
+}
+
+void DeviceManager::UnregisterDevice(Device* device) {
+  registered_devices_.erase(device);
+}
+
+void DeviceManager::RegisterIoHandler(Device* device, const IoResource* resource) {
+}
+
+void DeviceManager::UnregisterIoHandler(Device* device, const IoResource* resource) {
+}
+
+void DeviceManager::SetIrq(uint32_t irq, uint32_t level) {
+  MV_PANIC("not expected");
+}
+
+void DeviceManager::BeginGsiRoutingUpdate() {
+  gsi_routing_table_.BeginUpdate();
+}
+
+void DeviceManager::EndGsiRoutingUpdate() {
+  gsi_routing_table_.EndUpdate();
+}
+
+int DeviceManager::AddMsiRoute(uint64_t address, uint32_t data, int trigger_fd) {
+  return gsi_routing_table_.AddMsiRoute(address, data, trigger_fd);
+}
+
+void DeviceManager::UpdateMsiRoute(int gsi, uint64_t address, uint32_t data, int trigger_fd) {
+  gsi_routing_table_.UpdateMsiRoute(gsi, address, data, trigger_fd);
+}
+
+void DeviceManager::AssignIrqfd(int gsi, int trigger_fd, int resample_fd) {
+  gsi_routing_table_.AssignIrqfd(gsi, trigger_fd, resample_fd);
+}
+
+void DeviceManager::DeassignIrqfd(int gsi, int trigger_fd) {
+  gsi_routing_table_.DeassignIrqfd(gsi, trigger_fd);
+}
+
+/* A connected VfioPci with BAR0 enabled, as the guest firmware leaves it */
+struct TestBed {
+  Machine                   machine;
+  std::unique_ptr<VfioPci>  device;
+  DeviceManager             manager;
+  const IoResource* bar0 = nullptr;
+
+  TestBed() : machine(""), device(CreateDevice()), manager(&machine, device.get()) {
+    WriteConfig(PCI_BAR_OFFSET(0), BAR0_ADDRESS, 4);
+    WriteConfig(PCI_COMMAND, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER, 2);
+    for (auto resource : device->io_resources()) {
+      if (resource->base == BAR0_ADDRESS) {
+        bar0 = resource;
+      }
+    }
+    MV_ASSERT(bar0);
+  }
+
+  static VfioPci* CreateDevice() {
+    CreateFakeDevice();
+    auto device = new VfioPci();
+    device->set_name("vfio-pci");
+    (*device)["sysfs"] = std::string(FAKE_SYSFS_PATH);
+    return device;
+  }
+
+  void WriteConfig(uint64_t offset, uint32_t value, uint32_t length) {
+    device->WritePciConfigSpace(offset, (uint8_t*)&value, length);
+  }
+
+  uint32_t ReadConfig(uint64_t offset, uint32_t length) {
+    uint32_t value = 0;
+    device->ReadPciConfigSpace(offset, (uint8_t*)&value, length);
+    return value;
+  }
+
+  void WriteMsixControl(uint16_t control) {
+    WriteConfig(MSIX_CAP_OFFSET + PCI_MSIX_FLAGS, control, 2);
+  }
+
+  void WriteMsixEntry(uint vector, uint offset, uint32_t value) {
+    device->Write(bar0, MSIX_TABLE_OFFSET + vector * sizeof(MsiXTableEntry) + offset, (uint8_t*)&value, 4);
+  }
+
+  /* The vector is programmed masked, then unmasked as Linux does */
+  void ProgramMsixVector(uint vector, uint64_t address, uint32_t data, bool unmask) {
+    WriteMsixEntry(vector, PCI_MSIX_ENTRY_VECTOR_CTRL, PCI_MSIX_ENTRY_CTRL_MASKBIT);
+    WriteMsixEntry(vector, PCI_MSIX_ENTRY_LOWER_ADDR, (uint32_t)address);
+    WriteMsixEntry(vector, PCI_MSIX_ENTRY_UPPER_ADDR, (uint32_t)(address >> 32));
+    WriteMsixEntry(vector, PCI_MSIX_ENTRY_DATA, data);
+    if (unmask) {
+      WriteMsixEntry(vector, PCI_MSIX_ENTRY_VECTOR_CTRL, 0);
+    }
+  }
+
+  /* The GSI which the VFIO eventfd of the vector is attached to, -1 if detached */
+  int AttachedGsi(uint index, uint vector) {
+    auto it = vfio.triggers.find(index);
+    if (it == vfio.triggers.end() || vector >= it->second.size()) {
+      return -1;
+    }
+    auto irqfd = kvm.irqfds.find(it->second[vector]);
+    return irqfd == kvm.irqfds.end() ? -1 : (int)irqfd->second.gsi;
+  }
+};
+
+static void TestConnect() {
+  ResetKvm();
+  TestBed bed;
+  CHECK(vfio.dma_maps.size() == 1 && vfio.dma_maps[0] == RAM_SIZE, "maps=%lu", vfio.dma_maps.size());
+  CHECK(ram_view_listener != nullptr, "");
+  CHECK(bed.ReadConfig(PCI_INTERRUPT_PIN, 1) == 1, "INTx is supported with the in-kernel irqchip");
+  CHECK(bed.ReadConfig(MSIX_CAP_OFFSET + PCI_MSIX_FLAGS, 2) == MSIX_VECTORS - 1, "");
+
+  /* Nothing is enabled before the guest asks for it */
+  CHECK(vfio.triggers.empty(), "");
+  CHECK(kvm.irqfds.empty(), "");
+  CHECK(CountMsiRoutes() == 0, "");
+
+  /* The RAM view is followed */
+  ram_view_listener->callback({ MemoryExtent { .begin = 0, .end = RAM_SIZE, .hva = 0x7F0000000000 } },
+    { MemoryExtent { .begin = 0, .end = 0x1000000, .hva = 0x7F0000000000 } });
+  CHECK(vfio.dma_maps.size() == 1 && vfio.dma_maps[0] == 0x1000000, "");
+}
+
+static void TestMsix() {
+  ResetKvm();
+  TestBed bed;
+
+  /* Enable with all vectors masked, the eventfds are given to VFIO */
+  bed.WriteMsixControl(PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL);
+  CHECK(vfio.triggers.count(VFIO_PCI_MSIX_IRQ_INDEX), "");
+  auto &fds = vfio.triggers[VFIO_PCI_MSIX_IRQ_INDEX];
+  CHECK(fds.size() == MSIX_VECTORS, "vectors=%lu", fds.size());
+  CHECK(std::set<int>(fds.begin(), fds.end()).size() == MSIX_VECTORS && fds[0] > 0, "");
+  CHECK(CountMsiRoutes() == 0, "");
+  CHECK(kvm.irqfds.empty(), "");
+
+  /* Program vectors 0 to 2, routes are added but nothing is attached under the function mask */
+  for (uint vector = 0; vector < 3; vector++) {
+    bed.ProgramMsixVector(vector, MsiAddress(vector), 0x40 + vector, true);
+  }
+  CHECK(CountMsiRoutes() == 3, "routes=%d", CountMsiRoutes());
+  CHECK(kvm.irqfds.empty(), "");
+
+  /* Clear the function mask, vectors 0 to 2 are attached without reloading routes */
+  int loads = kvm.routing_loads;
+  bed.WriteMsixControl(PCI_MSIX_FLAGS_ENABLE);
+  CHECK(kvm.routing_loads == loads, "");
+  int gsis[MSIX_VECTORS];
+  for (uint vector = 0; vector < 3; vector++) {
+    gsis[vector] = bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, vector);
+    CHECK(gsis[vector] >= IOAPIC_NUM_PINS, "vector=%u", vector);
+    CHECK(HasMsiRoute(gsis[vector], MsiAddress(vector), 0x40 + vector), "vector=%u", vector);
+  }
+  CHECK(bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, 3) == -1, "never programmed");
+
+  /* Mask vector 1, the route stays and only the irqfd is detached */
+  bed.WriteMsixEntry(1, PCI_MSIX_ENTRY_VECTOR_CTRL, PCI_MSIX_ENTRY_CTRL_MASKBIT);
+  CHECK(bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, 1) == -1, "");
+  CHECK(HasMsiRoute(gsis[1], MsiAddress(1), 0x41), "");
+  CHECK(kvm.routing_loads == loads, "");
+
+  /* Retarget vector 1 while masked, then unmask */
+  bed.ProgramMsixVector(1, MsiAddress(3), 0x51, false);
+  CHECK(HasMsiRoute(gsis[1], MsiAddress(3), 0x51), "");
+  CHECK(bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, 1) == -1, "");
+  bed.WriteMsixEntry(1, PCI_MSIX_ENTRY_VECTOR_CTRL, 0);
+  CHECK(bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, 1) == gsis[1], "");
+
+  /* Program vector 3 */
+  bed.ProgramMsixVector(3, MsiAddress(0), 0x43, true);
+  gsis[3] = bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, 3);
+  CHECK(HasMsiRoute(gsis[3], MsiAddress(0), 0x43), "");
+  CHECK(CountMsiRoutes() == MSIX_VECTORS, "");
+
+  /* The function mask detaches all, the routes stay */
+  loads = kvm.routing_loads;
+  bed.WriteMsixControl(PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL);
+  CHECK(kvm.irqfds.empty(), "");
+  CHECK(CountMsiRoutes() == MSIX_VECTORS, "");
+  bed.WriteMsixControl(PCI_MSIX_FLAGS_ENABLE);
+  CHECK(kvm.irqfds.size() == MSIX_VECTORS, "");
+  CHECK(kvm.routing_loads == loads, "");
+
+  /* Disable, VFIO and KVM are cleaned up */
+  bed.WriteMsixControl(0);
+  CHECK(vfio.triggers.empty(), "");
+  CHECK(kvm.irqfds.empty(), "");
+  CHECK(CountMsiRoutes() == 0, "");
+
+  /* Enable again, the table is kept and the GSIs are reused */
+  bed.WriteMsixControl(PCI_MSIX_FLAGS_ENABLE);
+  std::set<int> reused;
+  for (uint vector = 0; vector < MSIX_VECTORS; vector++) {
+    reused.insert(bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, vector));
+  }
+  CHECK(reused == std::set<int>(gsis, gsis + MSIX_VECTORS), "");
+
+  /* Reset forgets the interrupt setup */
+  bed.device->Reset();
+  CHECK(vfio.resets == 1, "");
+  CHECK(vfio.triggers.empty(), "");
+  CHECK(kvm.irqfds.empty(), "");
+  CHECK(CountMsiRoutes() == 0, "");
+}
+
+static void TestIntx() {
+  ResetKvm();
+  TestBed bed;
+
+  /* The guest assigns the line, the eventfd is attached with a resample fd */
+  bed.WriteConfig(PCI_INTERRUPT_LINE, 10, 1);
+  CHECK(vfio.triggers[VFIO_PCI_INTX_IRQ_INDEX].size() == 1, "");
+  int event_fd = vfio.triggers[VFIO_PCI_INTX_IRQ_INDEX][0];
+  CHECK(event_fd > 0 && kvm.irqfds.count(event_fd), "");
+  auto &irqfd = kvm.irqfds[event_fd];
+  CHECK(irqfd.gsi == 10, "gsi=%u", irqfd.gsi);
+  CHECK(irqfd.resample_fd > 0 && irqfd.resample_fd != event_fd, "");
+  CHECK(vfio.unmask_fd == irqfd.resample_fd, "KVM resample unmasks VFIO");
+  CHECK(CountMsiRoutes() == 0, "");
+
+  /* Moving the line reattaches the same eventfds */
+  bed.WriteConfig(PCI_INTERRUPT_LINE, 11, 1);
+  CHECK(kvm.irqfds.size() == 1 && kvm.irqfds[event_fd].gsi == 11, "");
+  CHECK(vfio.triggers[VFIO_PCI_INTX_IRQ_INDEX][0] == event_fd, "");
+  int resample_fd = kvm.irqfds[event_fd].resample_fd;
+  CHECK(vfio.unmask_fd == resample_fd, "");
+  bed.WriteConfig(PCI_INTERRUPT_LINE, 11, 1);
+  CHECK(kvm.irqfds.size() == 1, "unchanged");
+
+  /* MSI-X replaces INTx, VFIO rejects both at a time */
+  bed.WriteMsixControl(PCI_MSIX_FLAGS_ENABLE);
+  CHECK(!vfio.triggers.count(VFIO_PCI_INTX_IRQ_INDEX), "");
+  CHECK(vfio.unmask_fd == -1, "");
+  CHECK(!kvm.irqfds.count(event_fd), "");
+  CHECK(vfio.triggers[VFIO_PCI_MSIX_IRQ_INDEX].size() == MSIX_VECTORS, "");
+  bed.ProgramMsixVector(0, MsiAddress(0), 0x40, true);
+  CHECK(bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, 0) >= IOAPIC_NUM_PINS, "");
+
+  /* And INTx is back when MSI-X is disabled */
+  bed.WriteMsixControl(0);
+  CHECK(!vfio.triggers.count(VFIO_PCI_MSIX_IRQ_INDEX), "");
+  CHECK(CountMsiRoutes() == 0, "");
+  CHECK(vfio.triggers[VFIO_PCI_INTX_IRQ_INDEX].size() == 1, "");
+  CHECK(bed.AttachedGsi(VFIO_PCI_INTX_IRQ_INDEX, 0) == 11, "");
+  CHECK(vfio.unmask_fd == resample_fd, "");
+}
+
+/* Without the in-kernel IOAPIC there is no resample fd, the device is MSI only */
+static void TestSplitIrqchip() {
+  ResetKvm();
+  fake_split_irqchip = true;
+  TestBed bed;
+  fake_split_irqchip = false;
+
+  CHECK(bed.ReadConfig(PCI_INTERRUPT_PIN, 1) == 0, "");
+  bed.WriteConfig(PCI_INTERRUPT_LINE, 10, 1);
+  CHECK(vfio.triggers.empty(), "");
+  CHECK(kvm.irqfds.empty(), "");
+
+  bed.WriteMsixControl(PCI_MSIX_FLAGS_ENABLE);
+  bed.ProgramMsixVector(0, MsiAddress(0), 0x40, true);
+  CHECK(bed.AttachedGsi(VFIO_PCI_MSIX_IRQ_INDEX, 0) == IOAPIC_NUM_PINS, "");
+  bed.WriteMsixControl(0);
+  CHECK(vfio.triggers.empty(), "");
+}
+
+int main() {
+  TestConnect();
+  TestMsix();
+  TestIntx();
+  TestSplitIrqchip();
+
+  if (failures) {
+    fprintf(stderr, "vfio_pci_test: %d checks failed\n", failures);
+    return 1;
+  }
+  printf("vfio_pci_test: passed\n");
+  return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Drives the EVENT_IDX interrupt and kick decisions of virtio_ring.h against
+ * simulated guest rings. The expected decisions are computed from absolute
+ * counters, which never wrap.
+ */
+#include <cstdio>
+#include <vector>
+#include "virtio_ring.h"
+
+static int failures = 0;
+
+#define CHECK(cond, fmt, ...) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: CHECK(%s) failed: " fmt "\n", __FILE__, __LINE__, #cond, ##__VA_ARGS__); \
+    ++failures; \
+  } \
+} while (0)
+
+/* Split ring memory laid out by the guest, the used event follows the avail ring and
+ * the avail event follows the used ring
+ */
+struct SplitRing {
+  std::vector<uint8_t> available;
+  std::vector<uint8_t> used;
+
+  SplitRing(VirtQueue& vq, int size) :
+      available(sizeof(VRingAvailable) + sizeof(uint16_t) * (size + 1)),
+      used(sizeof(VRingUsed) + sizeof(VRingUsedElement) * size + sizeof(uint16_t)) {
+    vq.size = size;
+    vq.packed = false;
+    vq.available_ring = (VRingAvailable*)available.data();
+    vq.used_ring = (VRingUsed*)used.data();
+    vq.last_available_index = 0;
+    vq.signalled_used_valid = false;
+    vq.notification_disabled = false;
+  }
+
+  uint16_t& used_event(VirtQueue& vq) { return *(uint16_t*)&vq.available_ring->items[vq.size]; }
+  uint16_t& available_event(VirtQueue& vq) { return *(uint16_t*)&vq.used_ring->items[vq.size]; }
+};
+
+static void TestNeedEvent() {
+  /* The event is in [old, new) */
+  CHECK(vring_need_event(5, 6, 5), "");
+  CHECK(!vring_need_event(6, 6, 5), "");
+  CHECK(!vring_need_event(4, 6, 5), "");
+  CHECK(!vring_need_event(5, 5, 5), "no new entries");
+
+  /* Across the 16 bit wrap around */
+  CHECK(vring_need_event(0xFFFF, 2, 0xFFFE), "");
+  CHECK(vring_need_event(0, 2, 0xFFFE), "");
+  CHECK(vring_need_event(1, 2, 0xFFFE), "");
+  CHECK(!vring_need_event(2, 2, 0xFFFE), "");
+  CHECK(!vring_need_event(0xFFFD, 2, 0xFFFE), "");
+
+  /* Compare with absolute counters */
+  for (uint32_t old_used = 0xFFF0; old_used < 0x10010; old_used++) {
+    for (uint32_t count = 0; count < 8; count++) {
+      uint32_t new_used = old_used + count;
+      for (uint32_t event = old_used - 8; event < new_used + 8; event++) {
+        bool expected = old_used <= event && event < new_used;
+        CHECK(vring_need_event(event, new_used, old_used) == expected,
+          "event=%x new=%x old=%x", event, new_used, old_used);
+      }
+    }
+  }
+}
+
+static void TestSplitNotify() {
+  VirtQueue vq;
+  SplitRing ring(vq, 8);
+
+  /* Without EVENT_IDX the flags decide */
+  CHECK(vring_split_needs_notify(vq, false), "");
+  vq.available_ring->flags = VRING_AVAIL_F_NO_INTERRUPT;
+  CHECK(!vring_split_needs_notify(vq, false), "");
+  vq.available_ring->flags = 0;
+
+  /* The first interrupt is always sent, then only when the used index passes the
+   * used event. The used index starts near the wrap around.
+   */
+  for (uint32_t event_ahead = 0; event_ahead < 4; event_ahead++) {
+    uint32_t used = 0xFFFA;
+    vq.used_ring->index = used;
+    vq.signalled_used_valid = false;
+    CHECK(vring_split_needs_notify(vq, true), "first interrupt");
+
+    uint32_t signalled = used;
+    uint32_t event = used + event_ahead;
+    ring.used_event(vq) = event;
+    for (int step = 0; step < 12; step++) {
+      uint32_t count = 1 + step % 3;
+      used += count;
+      vq.used_ring->index = used;
+      bool expected = signalled <= event && event < used;
+      CHECK(vring_split_needs_notify(vq, true) == expected, "used=%x event=%x", used, event);
+      signalled = used;
+      if (expected) {
+        /* The guest asks for the next interrupt after handling the used entries */
+        event = used + event_ahead;
+        ring.used_event(vq) = event;
+      }
+    }
+  }
+}
+
+/* The device moves the avail event after draining the ring, a guest adding buffers
+ * kicks only if the avail event is within the entries it added
+ */
+static void TestSplitKick() {
+  VirtQueue vq;
+  SplitRing ring(vq, 8);
+
+  CHECK(!vring_arm_available_event(vq, false), "no EVENT_IDX");
+  CHECK(ring.available_event(vq) == 0, "");
+
+  uint32_t available = 0xFFFC;
+  vq.available_ring->index = available;
+  vq.last_available_index = available;
+  CHECK(!vring_arm_available_event(vq, true), "empty ring");
+  CHECK(ring.available_event(vq) == (uint16_t)available, "");
+  CHECK(!vring_arm_available_event(vq, true), "armed already");
+
+  for (int step = 0; step < 10; step++) {
+    uint32_t count = 1 + step % 3;
+    uint16_t old_available = available;
+    available += count;
+    vq.available_ring->index = available;
+    bool kick = vring_need_event(ring.available_event(vq), available, old_available);
+    CHECK(kick, "available=%x event=%x", available, ring.available_event(vq));
+    CHECK(vring_is_available(vq), "");
+
+    /* Buffers added while the device is busy do not kick */
+    vq.last_available_index += 1;
+    uint16_t busy_available = available + 1;
+    CHECK(!vring_need_event(ring.available_event(vq), busy_available, available), "");
+    available = busy_available;
+    vq.available_ring->index = available;
+
+    /* Drain, arming finds nothing left */
+    vq.last_available_index = available;
+    CHECK(!vring_is_available(vq), "");
+    CHECK(!vring_arm_available_event(vq, true), "");
+    CHECK(ring.available_event(vq) == (uint16_t)available, "");
+  }
+
+  /* A buffer added before the event was visible is reported by arming */
+  vq.available_ring->index = available + 1;
+  CHECK(vring_arm_available_event(vq, true) == false, "event unchanged");
+  vq.last_available_index = available - 1;
+  CHECK(vring_arm_available_event(vq, true), "raced buffer");
+
+  /* The poller disables notifications, arming is skipped */
+  vq.notification_disabled = true;
+  vq.last_available_index = available + 1;
+  CHECK(!vring_arm_available_event(vq, true), "");
+  CHECK(ring.available_event(vq) == (uint16_t)(available - 1), "");
+}
+
+/* Packed ring positions are an offset and a wrap counter, which flips every lap and
+ * starts at 1
+ */
+static inline uint16_t packed_offset(uint32_t position, int size) {
+  return position % size;
+}
+
+static inline bool packed_wrap(uint32_t position, int size) {
+  return (position / size) % 2 == 0;
+}
+
+static void TestPackedNotify() {
+  for (int size : { 4, 8, 256 }) {
+    std::vector<VRingPackedDescriptor> descriptors(size);
+    VRingPackedEvent driver_event = { 0 }, device_event = { 0 };
+    VirtQueue vq;
+    vq.size = size;
+    vq.packed = true;
+    vq.packed_ring = descriptors.data();
+    vq.driver_event = &driver_event;
+    vq.device_event = &device_event;
+
+    /* Flags other than DESC ignore the offset */
+    vq.used_index = 0;
+    vq.used_wrap_counter = true;
+    vq.signalled_used_valid = true;
+    vq.signalled_used = 0;
+    driver_event.flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    CHECK(!vring_packed_needs_notify(vq), "");
+    driver_event.flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    CHECK(vring_packed_needs_notify(vq), "");
+    driver_event.flags = VRING_PACKED_EVENT_FLAG_DESC;
+    vq.signalled_used_valid = false;
+    CHECK(vring_packed_needs_notify(vq), "first interrupt");
+
+    /* Every used window of up to a lap, including the wrap of the used index, and
+     * every event from a lap behind to a lap ahead of the new used position
+     */
+    int step = size <= 8 ? 1 : 7;
+    for (uint32_t old_used = 0; old_used < 3u * size; old_used += step) {
+      for (uint32_t count = 1; count <= (uint32_t)size; count += step) {
+        uint32_t new_used = old_used + count;
+        for (uint32_t event = new_used > (uint32_t)size ? new_used - size + 1 : 0;
+            event < new_used + size; event++) {
+          vq.signalled_used = packed_offset(old_used, size);
+          vq.signalled_used_valid = true;
+          vq.used_index = packed_offset(new_used, size);
+          vq.used_wrap_counter = packed_wrap(new_used, size);
+          driver_event.offset_wrap = packed_offset(event, size) |
+            (packed_wrap(event, size) << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+          bool expected = old_used <= event && event < new_used;
+          CHECK(vring_packed_needs_notify(vq) == expected,
+            "size=%d old=%u new=%u event=%u", size, old_used, new_used, event);
+          CHECK(vq.signalled_used == packed_offset(new_used, size), "");
+        }
+      }
+    }
+  }
+}
+
+static void TestPackedKick() {
+  const int size = 4;
+  std::vector<VRingPackedDescriptor> descriptors(size);
+  VRingPackedEvent driver_event = { 0 }, device_event = { 0 };
+  VirtQueue vq;
+  vq.size = size;
+  vq.packed = true;
+  vq.packed_ring = descriptors.data();
+  vq.driver_event = &driver_event;
+  vq.device_event = &device_event;
+  vq.notification_disabled = false;
+  vq.last_available_index = 3;
+  vq.available_wrap_counter = false;
+
+  CHECK(!vring_is_available(vq), "");
+  CHECK(!vring_arm_available_event(vq, true), "");
+  CHECK(device_event.flags == VRING_PACKED_EVENT_FLAG_DESC, "");
+  CHECK(device_event.offset_wrap == 3, "offset_wrap=%x", device_event.offset_wrap);
+  CHECK(!vring_arm_available_event(vq, true), "armed already");
+
+  /* The driver makes slot 3 available in the lap with wrap counter 0 */
+  descriptors[3].flags = VRING_PACKED_DESC_F_USED;
+  CHECK(vring_is_available(vq), "");
+
+  /* Slot 0 of the next lap */
+  vq.last_available_index = 0;
+  vq.available_wrap_counter = true;
+  CHECK(!vring_is_available(vq), "");
+  CHECK(!vring_arm_available_event(vq, true), "");
+  CHECK(device_event.offset_wrap == (1 << VRING_PACKED_EVENT_F_WRAP_CTR), "");
+  descriptors[0].flags = VRING_PACKED_DESC_F_AVAIL;
+  CHECK(vring_is_available(vq), "");
+}
+
+int main() {
+  TestNeedEvent();
+  TestSplitNotify();
+  TestSplitKick();
+  TestPackedNotify();
+  TestPackedKick();
+
+  if (failures) {
+    fprintf(stderr, "vring_event_test: %d checks failed\n", failures);
+    return 1;
+  }
+  printf("vring_event_test: passed\n");
+  return 0;
+}
@@ -0,0 +1,547 @@
+/*
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* A minimal vhost-user-blk backend serving a raw image, to verify the
+ * vhost-user-block device locally. One queue, one client at a time, and requests
+ * are handled synchronously.
+ *
+ * Usage: vhost-user-blk <socket> <raw image>
+ * Then add to the mvisor config:
+ *   machine:
+ *     shared_memory: Yes
+ *   objects:
+ *     - class: vhost-user-block
+ *       parent: pci-host
+ *       socket: <socket>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/virtio_config.h>
+#include "linuz/virtio_blk.h"
+#include "vhost_user.h"
+
+#define SECTOR_SIZE 512
+
+#define LOG(fmt, ...) fprintf(stderr, "vhost-user-blk: " fmt "\n", ##__VA_ARGS__)
+#define PANIC(fmt, ...) do { LOG(fmt, ##__VA_ARGS__); exit(1); } while (0)
+
+#define OFFERED_FEATURES ((1ULL << VIRTIO_F_VERSION_1) | \
+  (1ULL << VIRTIO_RING_F_INDIRECT_DESC) | \
+  (1ULL << VIRTIO_BLK_F_BLK_SIZE) | \
+  (1ULL << VIRTIO_BLK_F_FLUSH) | \
+  (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+
+#define OFFERED_PROTOCOL_FEATURES ((1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+  (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+/* Split ring layout, the kernel header is not C++ friendly */
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+#define VRING_DESC_F_INDIRECT       4
+#define VRING_AVAIL_F_NO_INTERRUPT  1
+
+struct vring_desc {
+  uint64_t  addr;
+  uint32_t  len;
+  uint16_t  flags;
+  uint16_t  next;
+} __attribute__((packed));
+
+struct vring_avail {
+  uint16_t  flags;
+  uint16_t  idx;
+  uint16_t  ring[];
+} __attribute__((packed));
+
+struct vring_used_elem {
+  uint32_t  id;
+  uint32_t  len;
+} __attribute__((packed));
+
+struct vring_used {
+  uint16_t  flags;
+  uint16_t  idx;
+  vring_used_elem ring[];
+} __attribute__((packed));
+
+struct Region {
+  uint64_t  guest_address;
+  uint64_t  user_address;
+  uint64_t  size;
+  uint8_t*  host;
+  void*     map;
+  size_t    map_size;
+};
+
+struct Vring {
+  uint32_t      num;
+  vring_desc*   descriptors;
+  vring_avail*  available;
+  vring_used*   used;
+  uint16_t      last_available;
+  int           kick_fd;
+  int           call_fd;
+  bool          started;
+  bool          enabled;
+};
+
+class Backend {
+ public:
+  Backend(const char* image) {
+    image_fd_ = open(image, O_RDWR);
+    if (image_fd_ < 0) {
+      PANIC("failed to open %s", image);
+    }
+    struct stat st;
+    fstat(image_fd_, &st);
+    bzero(&config_, sizeof(config_));
+    config_.capacity = st.st_size / SECTOR_SIZE;
+    config_.blk_size = SECTOR_SIZE;
+  }
+
+  void Serve(const char* path) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0) {
+      PANIC("failed to listen on %s", path);
+    }
+    LOG("listening on %s, capacity=%llu sectors", path, config_.capacity);
+
+    while (true) {
+      client_fd_ = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client_fd_ < 0) {
+        continue;
+      }
+      LOG("client connected");
+      ResetState();
+      while (Poll()) {
+      }
+      LOG("client disconnected");
+      ResetState();
+      close(client_fd_);
+    }
+  }
+
+ private:
+  void ResetState() {
+    for (auto &region : regions_) {
+      munmap(region.map, region.map_size);
+    }
+    regions_.clear();
+    if (vring_.kick_fd >= 0) {
+      close(vring_.kick_fd);
+    }
+    if (vring_.call_fd >= 0) {
+      close(vring_.call_fd);
+    }
+    bzero(&vring_, sizeof(vring_));
+    vring_.kick_fd = vring_.call_fd = -1;
+    features_ = protocol_features_ = 0;
+  }
+
+  /* Returns false if the client is gone */
+  bool Poll() {
+    pollfd fds[2] = {
+      { .fd = client_fd_, .events = POLLIN },
+      { .fd = vring_.kick_fd, .events = POLLIN }
+    };
+    if (poll(fds, vring_.kick_fd >= 0 ? 2 : 1, -1) < 0) {
+      return errno == EINTR;
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t value;
+      read(vring_.kick_fd, &value, sizeof(value));
+      ProcessQueue();
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      return HandleMessage();
+    }
+    return true;
+  }
+
+  bool ReceiveMessage(VhostUserMessage& message, std::vector<int>& fds) {
+    uint8_t control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)];
+    iovec iov = { .iov_base = &message.header, .iov_len = sizeof(message.header) };
+    msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    if (recvmsg(client_fd_, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(message.header)) {
+      return false;
+    }
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* data = (int*)CMSG_DATA(cmsg);
+        fds.insert(fds.end(), data, data + count);
+      }
+    }
+    if (message.header.size > sizeof(message.payload)) {
+      return false;
+    }
+    if (message.header.size > 0 &&
+        recv(client_fd_, &message.payload, message.header.size, MSG_WAITALL) != message.header.size) {
+      return false;
+    }
+    return true;
+  }
+
+  void Reply(VhostUserMessage& message, uint32_t size) {
+    message.header.flags = VHOST_USER_VERSION | VHOST_USER_FLAG_REPLY;
+    message.header.size = size;
+    send(client_fd_, &message, sizeof(message.header) + size, MSG_NOSIGNAL);
+  }
+
+  void ReplyU64(VhostUserMessage& message, uint64_t value) {
+    message.payload.u64 = value;
+    Reply(message, sizeof(uint64_t));
+  }
+
+  bool HandleMessage() {
+    VhostUserMessage message;
+    std::vector<int> fds;
+    if (!ReceiveMessage(message, fds)) {
+      return false;
+    }
+
+    bool need_ack = message.header.flags & VHOST_USER_FLAG_NEED_REPLY;
+    bool ok = true;
+    switch (message.header.request) {
+    case kVhostUserGetFeatures:
+      ReplyU64(message, OFFERED_FEATURES);
+      return true;
+    case kVhostUserSetFeatures:
+      features_ = message.payload.u64;
+      break;
+    case kVhostUserGetProtocolFeatures:
+      ReplyU64(message, OFFERED_PROTOCOL_FEATURES);
+      return true;
+    case kVhostUserSetProtocolFeatures:
+      protocol_features_ = message.payload.u64;
+      break;
+    case kVhostUserGetQueueNum:
+      ReplyU64(message, 1);
+      return true;
+    case kVhostUserSetOwner:
+    case kVhostUserResetOwner:
+      break;
+    case kVhostUserSetMemTable:
+      ok = SetMemoryTable(message.payload.memory, fds);
+      break;
+    case kVhostUserSetVringNum:
+      vring_.num = message.payload.state.num;
+      break;
+    case kVhostUserSetVringBase:
+      vring_.last_available = message.payload.state.num;
+      break;
+    case kVhostUserSetVringAddr:
+      ok = SetVringAddress(message.payload.address);
+      break;
+    case kVhostUserGetVringBase:
+      /* Stops the ring */
+      vring_.started = false;
+      if (vring_.kick_fd >= 0) {
+        close(vring_.kick_fd);
+        vring_.kick_fd = -1;
+      }
+      message.payload.state.num = vring_.last_available;
+      Reply(message, sizeof(VhostUserVringState));
+      return true;
+    case kVhostUserSetVringKick:
+    case kVhostUserSetVringCall:
+    case kVhostUserSetVringErr: {
+      int fd = (message.payload.u64 & VHOST_USER_VRING_NOFD) || fds.empty() ? -1 : fds[0];
+      fds.clear();
+      if (message.header.request == kVhostUserSetVringKick) {
+        if (vring_.kick_fd >= 0) {
+          close(vring_.kick_fd);
+        }
+        vring_.kick_fd = fd;
+        vring_.started = true;
+        /* Rings are enabled by SET_VRING_ENABLE if protocol features are negotiated */
+        if (!(features_ & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+          vring_.enabled = true;
+        }
+        ProcessQueue();
+      } else if (message.header.request == kVhostUserSetVringCall) {
+        if (vring_.call_fd >= 0) {
+          close(vring_.call_fd);
+        }
+        vring_.call_fd = fd;
+      } else if (fd >= 0) {
+        close(fd);
+      }
+      break;
+    }
+    case kVhostUserSetVringEnable:
+      vring_.enabled = message.payload.state.num;
+      ProcessQueue();
+      break;
+    case kVhostUserGetConfig: {
+      auto &config = message.payload.config;
+      if (config.offset + config.size > sizeof(config_)) {
+        config.size = 0;
+      } else {
+        memcpy(config.region, (uint8_t*)&config_ + config.offset, config.size);
+      }
+      Reply(message, offsetof(VhostUserConfig, region) + config.size);
+      return true;
+    }
+    default:
+      LOG("unhandled request=%u", message.header.request);
+      ok = false;
+      break;
+    }
+
+    for (int fd : fds) {
+      close(fd);
+    }
+    if (need_ack) {
+      ReplyU64(message, ok ? 0 : 1);
+    }
+    return true;
+  }
+
+  /* Map the whole file up to the end of each region, the fds are not kept */
+  bool SetMemoryTable(VhostUserMemory& memory, std::vector<int>& fds) {
+    if (fds.size() != memory.count) {
+      return false;
+    }
+    for (auto &region : regions_) {
+      munmap(region.map, region.map_size);
+    }
+    regions_.clear();
+
+    for (uint32_t i = 0; i < memory.count; i++) {
+      auto &r = memory.regions[i];
+      size_t map_size = r.mmap_offset + r.size;
+      void* map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+      if (map == MAP_FAILED) {
+        PANIC("failed to map region gpa=0x%llx size=0x%llx", (unsigned long long)r.guest_address,
+          (unsigned long long)r.size);
+      }
+      regions_.push_back(Region {
+        .guest_address = r.guest_address,
+        .user_address = r.user_address,
+        .size = r.size,
+        .host = (uint8_t*)map + r.mmap_offset,
+        .map = map,
+        .map_size = map_size
+      });
+    }
+    return true;
+  }
+
+  void* GuestToHost(uint64_t gpa, uint64_t size) {
+    for (auto &region : regions_) {
+      if (gpa >= region.guest_address && gpa + size <= region.guest_address + region.size) {
+        return region.host + (gpa - region.guest_address);
+      }
+    }
+    return nullptr;
+  }
+
+  void* UserToHost(uint64_t address) {
+    for (auto &region : regions_) {
+      if (address >= region.user_address && address < region.user_address + region.size) {
+        return region.host + (address - region.user_address);
+      }
+    }
+    return nullptr;
+  }
+
+  bool SetVringAddress(VhostUserVringAddress& address) {
+    vring_.descriptors = (vring_desc*)UserToHost(address.descriptor);
+    vring_.available = (vring_avail*)UserToHost(address.available);
+    vring_.used = (vring_used*)UserToHost(address.used);
+    return vring_.descriptors && vring_.available && vring_.used;
+  }
+
+  /* Split the chain into the buffers read and written by the device */
+  bool ReadChain(uint16_t head, std::vector<iovec>& out, std::vector<iovec>& in) {
+    vring_desc* table = vring_.descriptors;
+    uint32_t table_size = vring_.num;
+    uint32_t index = head;
+    for (uint32_t count = 0; count < table_size; count++) {
+      vring_desc* descriptor = &table[index];
+      if (descriptor->flags & VRING_DESC_F_INDIRECT) {
+        table = (vring_desc*)GuestToHost(descriptor->addr, descriptor->len);
+        table_size = descriptor->len / sizeof(vring_desc);
+        index = 0;
+        count = 0;
+        if (!table) {
+          return false;
+        }
+        descriptor = &table[0];
+      }
+      void* host = GuestToHost(descriptor->addr, descriptor->len);
+      if (!host) {
+        return false;
+      }
+      auto &list = (descriptor->flags & VRING_DESC_F_WRITE) ? in : out;
+      list.push_back(iovec { .iov_base = host, .iov_len = descriptor->len });
+      if (!(descriptor->flags & VRING_DESC_F_NEXT)) {
+        return true;
+      }
+      index = descriptor->next;
+    }
+    return false;
+  }
+
+  /* Copy from the front of the buffers, and remove the bytes copied */
+  static bool PopBytes(std::vector<iovec>& iov, void* data, size_t size) {
+    uint8_t* dest = (uint8_t*)data;
+    while (size > 0 && !iov.empty()) {
+      size_t bytes = std::min(size, iov.front().iov_len);
+      memcpy(dest, iov.front().iov_base, bytes);
+      dest += bytes;
+      size -= bytes;
+      iov.front().iov_base = (uint8_t*)iov.front().iov_base + bytes;
+      iov.front().iov_len -= bytes;
+      if (iov.front().iov_len == 0) {
+        iov.erase(iov.begin());
+      }
+    }
+    return size == 0;
+  }
+
+  static size_t TotalSize(const std::vector<iovec>& iov) {
+    size_t size = 0;
+    for (auto &v : iov) {
+      size += v.iov_len;
+    }
+    return size;
+  }
+
+  /* Returns the bytes written to the guest */
+  uint32_t HandleRequest(uint16_t head) {
+    std::vector<iovec> out, in;
+    if (!ReadChain(head, out, in) || in.empty() || in.back().iov_len == 0) {
+      LOG("invalid descriptor chain head=%u", head);
+      return 0;
+    }
+    /* The status is the last byte written */
+    auto &last = in.back();
+    uint8_t* status = (uint8_t*)last.iov_base + last.iov_len - 1;
+    if (--last.iov_len == 0) {
+      in.pop_back();
+    }
+
+    virtio_blk_outhdr header;
+    if (!PopBytes(out, &header, sizeof(header))) {
+      *status = VIRTIO_BLK_S_IOERR;
+      return 1;
+    }
+
+    off_t position = header.sector * SECTOR_SIZE;
+    size_t length = 0;
+    *status = VIRTIO_BLK_S_OK;
+    switch (header.type) {
+    case VIRTIO_BLK_T_IN:
+      length = TotalSize(in);
+      if (preadv(image_fd_, in.data(), in.size(), position) != (ssize_t)length) {
+        *status = VIRTIO_BLK_S_IOERR;
+        length = 0;
+      }
+      break;
+    case VIRTIO_BLK_T_OUT:
+      if (pwritev(image_fd_, out.data(), out.size(), position) != (ssize_t)TotalSize(out)) {
+        *status = VIRTIO_BLK_S_IOERR;
+      }
+      break;
+    case VIRTIO_BLK_T_FLUSH:
+      if (fdatasync(image_fd_) < 0) {
+        *status = VIRTIO_BLK_S_IOERR;
+      }
+      break;
+    case VIRTIO_BLK_T_GET_ID: {
+      char id[VIRTIO_BLK_ID_BYTES] = "mvisor-vhost-blk";
+      size_t size = std::min(sizeof(id), TotalSize(in));
+      uint8_t* source = (uint8_t*)id;
+      for (auto &v : in) {
+        size_t bytes = std::min(size - length, v.iov_len);
+        memcpy(v.iov_base, source + length, bytes);
+        length += bytes;
+      }
+      break;
+    }
+    default:
+      *status = VIRTIO_BLK_S_UNSUPP;
+      break;
+    }
+    return length + 1;
+  }
+
+  void ProcessQueue() {
+    if (!vring_.started || !vring_.enabled || !vring_.available) {
+      return;
+    }
+
+    bool pushed = false;
+    while (vring_.last_available != *(volatile uint16_t*)&vring_.available->idx) {
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      uint16_t head = vring_.available->ring[vring_.last_available++ % vring_.num];
+      uint32_t length = HandleRequest(head);
+
+      auto &item = vring_.used->ring[vring_.used->idx % vring_.num];
+      item.id = head;
+      item.len = length;
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      vring_.used->idx++;
+      pushed = true;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (pushed && vring_.call_fd >= 0 && !(vring_.available->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+      uint64_t value = 1;
+      write(vring_.call_fd, &value, sizeof(value));
+    }
+  }
+
+  int                 image_fd_ = -1;
+  int                 client_fd_ = -1;
+  virtio_blk_config   config_;
+  uint64_t            features_ = 0;
+  uint64_t            protocol_features_ = 0;
+  std::vector<Region> regions_;
+  Vring               vring_ = { .kick_fd = -1, .call_fd = -1 };
+};
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <socket> <raw image>\n", argv[0]);
+    return 1;
+  }
+  Backend backend(argv[2]);
+  backend.Serve(argv[1]);
+  return 0;
+}
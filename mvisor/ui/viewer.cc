@@ -19,9 +19,11 @@
 #include "viewer.h"
 #include <unistd.h>
 #include <chrono>
+#include <algorithm>
 #include "logger.h"
 #include "keymap.h"
 #include "spice/enums.h"
+#include "spice/vd_agent.h"
 
 Viewer::Viewer(Machine* machine) : machine_(machine) {
   device_manager_ = machine_->device_manager();
@@ -266,17 +268,47 @@ PointerInputInterface* Viewer::GetActivePointer() {
   return nullptr;
 }
 
+KeyboardInputInterface* Viewer::GetActiveKeyboard() {
+  for (auto keyboard : keyboards_) {
+    if (keyboard->InputAcceptable()) {
+      return keyboard;
+    }
+  }
+  /* PS/2 keyboard is always available for BIOS */
+  return keyboards_.back();
+}
+
 void Viewer::LookupDevices() {
-  keyboard_ = dynamic_cast<KeyboardInputInterface*>(machine_->LookupObjectByClass("Ps2Keyboard"));
+  /* Prefer virtio input devices once the guest driver is loaded */
+  auto virtio_keyboard = dynamic_cast<KeyboardInputInterface*>(machine_->LookupObjectByClass("VirtioKeyboard"));
+  if (virtio_keyboard) {
+    keyboards_.push_back(virtio_keyboard);
+  }
+  auto ps2_keyboard = dynamic_cast<KeyboardInputInterface*>(machine_->LookupObjectByClass("Ps2Keyboard"));
+  if (ps2_keyboard) {
+    keyboards_.push_back(ps2_keyboard);
+  }
   spice_agent_ = dynamic_cast<SpiceAgentInterface*>(machine_->LookupObjectByClass("SpiceAgent"));
+  if (spice_agent_) {
+    spice_agent_->RegisterClipboardListener([this](const ClipboardEvent& event) {
+      HandleClipboardEvent(event);
+    });
+  }
   display_ = dynamic_cast<DisplayInterface*>(machine_->LookupObjectByClass("Qxl"));
   if (display_ == nullptr) {
     display_ = dynamic_cast<DisplayInterface*>(machine_->LookupObjectByClass("Vga"));
   }
+  auto virtio_tablet = dynamic_cast<PointerInputInterface*>(machine_->LookupObjectByClass("VirtioTablet"));
+  if (virtio_tablet) {
+    pointers_.push_back(virtio_tablet);
+  }
   for (auto o : machine_->LookupObjects([](auto o) { return dynamic_cast<PointerInputInterface*>(o); })) {
-    pointers_.push_back(dynamic_cast<PointerInputInterface*>(o));
+    auto pointer = dynamic_cast<PointerInputInterface*>(o);
+    if (pointer != virtio_tablet) {
+      pointers_.push_back(pointer);
+    }
   }
-  MV_ASSERT(keyboard_ && display_);
+  MV_ASSERT(!keyboards_.empty() && display_);
 
   display_->RegisterDisplayChangeListener([this]() {
     requested_update_window_ = true;
@@ -314,6 +346,8 @@ int Viewer::MainLoop() {
       spice_agent_->Resize(pending_resize_.width, pending_resize_.height);
     }
 
+    UpdateClipboard();
+
     /* Keep display FPS */
     auto frame_cost_us = std::chrono::steady_clock::now() - frame_start_time;
     if (frame_cost_us < frame_interval_us) {
@@ -342,7 +376,7 @@ void Viewer::HandleEvent(const SDL_Event& event) {
       break;
     }
     if (TranslateScancode(event.key.keysym.scancode, event.type == SDL_KEYDOWN, transcoded)) {
-      keyboard_->QueueKeyboardEvent(transcoded);
+      GetActiveKeyboard()->QueueKeyboardEvent(transcoded);
     }
     break;
   case SDL_MOUSEWHEEL: {
@@ -393,8 +427,86 @@ void Viewer::HandleEvent(const SDL_Event& event) {
       break;
     }
     break;
+  case SDL_CLIPBOARDUPDATE:
+    if (ignore_clipboard_update_) {
+      ignore_clipboard_update_ = false;
+    } else if (spice_agent_ && SDL_HasClipboardText()) {
+      char* text = SDL_GetClipboardText();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        host_clipboard_ = std::make_shared<std::string>(text);
+      }
+      SDL_free(text);
+      spice_agent_->GrabClipboard({ VD_AGENT_CLIPBOARD_UTF8_TEXT });
+    }
+    break;
+  case SDL_DROPFILE:
+    if (spice_agent_) {
+      spice_agent_->SendFile(event.drop.file);
+    }
+    SDL_free(event.drop.file);
+    break;
   case SDL_QUIT:
     machine_->Quit();
     break;
   }
 }
+
+/* Called on the IO thread, the agent is never called with the lock held */
+void Viewer::HandleClipboardEvent(const ClipboardEvent& event) {
+  switch (event.event)
+  {
+  case kClipboardGrab:
+    for (size_t i = 0; i < event.ntypes; i++) {
+      if (event.types[i] == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
+        spice_agent_->RequestClipboard(VD_AGENT_CLIPBOARD_UTF8_TEXT);
+        break;
+      }
+    }
+    break;
+  case kClipboardData: {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (event.type == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
+      guest_clipboard_.append((const char*)event.data, event.size);
+      guest_clipboard_ready_ = event.last;
+    }
+    break;
+  }
+  case kClipboardRequest: {
+    std::shared_ptr<std::string> text;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      text = host_clipboard_;
+    }
+    if (event.type != VD_AGENT_CLIPBOARD_UTF8_TEXT || !text) {
+      spice_agent_->SendClipboard(VD_AGENT_CLIPBOARD_NONE, 0, nullptr);
+      break;
+    }
+    size_t offset = 0;
+    spice_agent_->SendClipboard(event.type, text->size(), [text, offset](uint8_t* buffer, size_t size) mutable {
+      size = std::min(size, text->size() - offset);
+      memcpy(buffer, text->data() + offset, size);
+      offset += size;
+      return size;
+    });
+    break;
+  }
+  case kClipboardRelease:
+    break;
+  }
+}
+
+void Viewer::UpdateClipboard() {
+  std::string text;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!guest_clipboard_ready_) {
+      return;
+    }
+    text.swap(guest_clipboard_);
+    guest_clipboard_ready_ = false;
+  }
+  /* Do not grab back what the guest just copied */
+  ignore_clipboard_update_ = true;
+  SDL_SetClipboardText(text.c_str());
+}
@@ -0,0 +1,67 @@
+/* 
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "utilities.h"
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+#include <sched.h>
+#include "logger.h"
+
+std::vector<int> parse_cpu_list(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream stream(list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    auto dash = range.find('-');
+    int first = atoi(range.c_str());
+    int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+    /* The CPUs are set in a cpu_set_t */
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      MV_PANIC("invalid cpu list %s", list.c_str());
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+std::string format_cpu_list(const std::vector<int>& cpus) {
+  std::string result;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+      j++;
+    }
+    if (!result.empty()) {
+      result += ",";
+    }
+    result += std::to_string(cpus[i]);
+    if (j > i) {
+      result += "-" + std::to_string(cpus[j]);
+    }
+    i = j;
+  }
+  return result;
+}